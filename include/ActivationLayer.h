@@ -8,15 +8,27 @@
 
 
 #include "Layer.h"
+#include "CalcFunctions.h"
 
 namespace MiniCNN
 {
+    // 融合了activation的层按融合前的层保存，activation写成单独一行的激活层。
+    // 在ActivationType与SigmoidLayer、ReluLayer的layerType之间转换，NONE对应空字符串，不认识的layerType为NONE
+    std::string activation_layer_type(const ActivationType activation);
+    ActivationType activation_from_layer_type(const std::string& layerType);
+
     class ActivationLayer : public Layer
-    {};
+    {
+    protected:
+        virtual bool supportInPlace() const override { return true; }
+        virtual bool needOutputInBackward() const override { return true; }
+    };
 
     class SigmoidLayer : public ActivationLayer
     {
         FRIEND_WITH_NETWORK
+        friend std::string activation_layer_type(const ActivationType activation);
+        friend ActivationType activation_from_layer_type(const std::string& layerType);
     public:
         SigmoidLayer();
         virtual ~SigmoidLayer();
@@ -32,6 +44,8 @@ namespace MiniCNN
     class ReluLayer : public ActivationLayer
     {
         FRIEND_WITH_NETWORK
+        friend std::string activation_layer_type(const ActivationType activation);
+        friend ActivationType activation_from_layer_type(const std::string& layerType);
     public:
         ReluLayer();
         virtual ~ReluLayer();
@@ -0,0 +1,57 @@
+//
+// Created by yang chen on 2018/4/2.
+//
+
+#ifndef MINICNN_ASYNCTRAINER_H
+#define MINICNN_ASYNCTRAINER_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "Network.h"
+#include "Optimizer.h"
+
+namespace MiniCNN
+{
+    // Hogwild式的异步SGD：每个worker线程拥有独立的网络副本（activation/gradient私有），
+    // 各自取mini-batch做forward/backward，然后不加锁直接更新共享的weights
+    class AsyncTrainer
+    {
+    public:
+        // 填充第batchIdx个mini-batch，返回false表示没有数据
+        using BatchFetcher = std::function<bool(const unsigned int batchIdx, std::shared_ptr<Tensor>& inputTensor,
+                                                std::shared_ptr<Tensor>& labelTensor)>;
+
+        AsyncTrainer(Network& network, const unsigned int workers, const float lr);
+        virtual ~AsyncTrainer();
+
+    public:
+        void setLearningRate(const float lr);
+        // 当某层在该worker读取参数之后已被其他worker更新超过maxStaleness次时，丢弃这次更新；0表示不限制
+        void setMaxStaleness(const unsigned int maxStaleness);
+        // 所有worker共同处理batchIdx在[0, batches)的mini-batch，返回平均loss
+        float trainBatches(BatchFetcher fetcher, const unsigned int batches);
+        inline unsigned int getWorkers() const { return (unsigned int)m_replicas.size(); }
+        inline unsigned long getSkippedUpdates() const { return m_skippedUpdates.load(); }
+
+    private:
+        void workerLoop(const unsigned int workerIdx, BatchFetcher& fetcher, const unsigned int batches);
+
+    private:
+        Network& m_network;
+        std::vector<std::shared_ptr<Network>> m_replicas;
+        std::vector<std::shared_ptr<SGD>> m_optimizers;
+        std::vector<std::shared_ptr<Tensor>> m_inputTensors;
+        std::vector<std::shared_ptr<Tensor>> m_labelTensors;
+        std::vector<float> m_workerLoss;
+        std::vector<unsigned int> m_workerBatches;
+
+        std::unique_ptr<std::atomic<unsigned long>[]> m_layerVersions;
+        std::atomic<unsigned int> m_nextBatch;
+        std::atomic<unsigned long> m_skippedUpdates;
+        unsigned int m_maxStaleness = 0;
+    };
+}
+
+#endif //MINICNN_ASYNCTRAINER_H
@@ -0,0 +1,147 @@
+//
+// Created by yang chen on 2018/4/26.
+//
+
+#ifndef MINICNN_AUGMENTATION_H
+#define MINICNN_AUGMENTATION_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include "Dataset.h"
+#include "Sampler.h"
+
+namespace MiniCNN
+{
+    struct AugmentationConfig
+    {
+        // 随机裁剪：四周补cropPadding个0后裁剪回原大小，即整数像素的平移
+        unsigned int cropPadding = 0;
+        // 随机平移（亚像素），x、y各在[-maxTranslate, maxTranslate]内
+        float maxTranslate = 0.0f;
+        // 绕图片中心随机旋转，角度在[-maxRotation, maxRotation]度内
+        float maxRotation = 0.0f;
+        // 弹性形变（Simard 2003）：每个像素的随机位移经标准差为elasticSigma的高斯平滑后乘以elasticAlpha，alpha为0时不使用
+        float elasticAlpha = 0.0f;
+        float elasticSigma = 4.0f;
+        // 加性高斯噪声的标准差（像素值0~255）
+        float noiseStddev = 0.0f;
+    };
+
+    // 对uint8图片（channels个width×height的平面）做随机增强：裁剪、平移、旋转和弹性形变合并为一次双线性重采样，
+    // 图片外的部分为0，噪声在同一遍中加上。坐标按行计算（可向量化），临时内存在构造时分配
+    class ImageAugmenter
+    {
+    public:
+        ImageAugmenter(const AugmentationConfig& config, const Shape& sampleShape);
+
+    public:
+        void augment(const uint8_t* src, uint8_t* dst, std::mt19937& engine);
+
+    private:
+        // 随机位移场，结果为平滑并乘以alpha后的m_dx、m_dy
+        void elasticField(std::mt19937& engine);
+        void gaussianBlur(float* field);
+
+    private:
+        AugmentationConfig m_config;
+        unsigned int m_channels;
+        unsigned int m_width;
+        unsigned int m_height;
+        std::vector<float> m_kernel;
+        std::vector<float> m_dx;
+        std::vector<float> m_dy;
+        std::vector<float> m_blurBuffer;
+        // 四周各补一个0的float平面，插值时不用判断边界
+        std::vector<float> m_padded;
+        std::vector<float> m_srcX;
+        std::vector<float> m_srcY;
+        // 当前样本的噪声（近似标准正态分布），每个样本由计数器重新生成
+        std::vector<float> m_noise;
+    };
+
+    struct AugmentationStats
+    {
+        unsigned int workers = 0;
+        unsigned long samples = 0;
+        // 所有worker增强和归一化的时间之和
+        double augmentSeconds = 0.0;
+        // 训练线程在nextBatch中等待的时间，不为0说明增强跟不上训练
+        double waitSeconds = 0.0;
+        // 单个worker和全部worker的增强吞吐
+        inline double workerSamplesPerSecond() const { return augmentSeconds > 0.0 ? samples / augmentSeconds : 0.0; }
+        inline double samplesPerSecond() const { return workerSamplesPerSecond() * workers; }
+    };
+
+    // 数据加载的增强阶段：后台线程按sampler的顺序取出uint8样本，增强后归一化为float并写入预先分配的batch，
+    // 训练线程用nextBatch依次取走。第epoch个epoch中下标为idx的样本使用create_random_engine(stream, epoch * size + idx)
+    // 的独立引擎，设置全局种子后增强的结果是确定的，与worker的数量、batch的大小和样本在batch中的位置无关
+    class AugmentedLoader
+    {
+    public:
+        // dataset需要有uint8样本（不是从预处理缓存加载的），否则isValid()为false，不会产生任何batch；
+        // prefetch为预先准备的batch数，0表示2倍的workers
+        AugmentedLoader(const Dataset& dataset, Sampler& sampler, const unsigned int batch, const AugmentationConfig& config,
+                        const unsigned int stream, const unsigned int workers = 1, const unsigned int prefetch = 0);
+        virtual ~AugmentedLoader();
+
+    public:
+        inline bool isValid() const { return m_valid; }
+        // 开始新的epoch：等待正在处理的batch完成后调用sampler.nextEpoch()，后台线程开始准备这个epoch的batch
+        void startEpoch();
+        // 从checkpoint继续：sampler已经恢复为第epoch个epoch的下标（不再调用nextEpoch），从第firstBatch个batch开始
+        void resumeEpoch(const unsigned int epoch, const unsigned int firstBatch);
+        // 当前是第几个epoch（第一次startEpoch之后为1），保存在checkpoint中
+        unsigned int getEpoch();
+        // 这个epoch的下一个batch，返回样本数，0表示这个epoch已经结束。tensor在下次调用nextBatch或startEpoch前有效
+        unsigned int nextBatch(std::shared_ptr<Tensor>& inputTensor, std::shared_ptr<Tensor>& labelTensor);
+        AugmentationStats getStats();
+        void resetStats();
+
+    private:
+        struct Slot
+        {
+            std::shared_ptr<Tensor> inputTensor;
+            std::shared_ptr<Tensor> labelTensor;
+            unsigned int batchIdx = 0;
+            unsigned int count = 0;
+            bool ready = false;
+        };
+
+        void beginEpoch(const bool advanceSampler, const unsigned int epoch, const unsigned int firstBatch);
+        void workerLoop();
+        void prepareBatch(ImageAugmenter& augmenter, std::vector<uint8_t>& buffer, Slot& slot,
+                          const unsigned int batchIdx, const unsigned int epoch);
+
+    private:
+        const Dataset& m_dataset;
+        Sampler& m_sampler;
+        unsigned int m_batch;
+        AugmentationConfig m_config;
+        unsigned int m_stream;
+        bool m_valid = false;
+        std::vector<Slot> m_slots;
+        std::vector<std::thread> m_threads;
+
+        std::mutex m_mutex;
+        std::condition_variable m_workerCondition;
+        std::condition_variable m_readyCondition;
+        bool m_stop = false;
+        unsigned int m_epoch = 0;
+        // 这个epoch的batch数，startEpoch之前为0
+        unsigned int m_batches = 0;
+        // 下一个由worker领取的batch、下一个交给训练线程的batch
+        unsigned int m_nextBatch = 0;
+        unsigned int m_consumeBatch = 0;
+        // 小于m_released的batch已经交还，它们的slot可以重新使用
+        unsigned int m_released = 0;
+        unsigned int m_inFlight = 0;
+        AugmentationStats m_stats;
+    };
+}
+
+#endif //MINICNN_AUGMENTATION_H
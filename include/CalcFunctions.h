@@ -5,16 +5,47 @@
 #ifndef MINICNN_CALCFUNCTIONS_H
 #define MINICNN_CALCFUNCTIONS_H
 
-
+#include <cstdint>
+#include <functional>
+#include <random>
+#include "Tensor.h"
 
 namespace MiniCNN
 {
-    void normal_distribution_init(float* data, const unsigned int size, const float meanValue, const float standardDeviation);
-    void uniform_distribution_init(float* data, const unsigned int size, const float lowValue, const float highValue);
+    enum class ActivationType { NONE, RELU, SIGMOID };
+
+    // 全局随机数种子，0表示每次使用std::random_device（默认）。设置后同一个stream的随机数序列是确定的
+    void set_random_seed(const unsigned int seed);
+    unsigned int get_random_seed();
+    // 环境变量MINICNN_SEED，否则为0
+    unsigned int get_default_random_seed();
+    // 第stream个随机数流的引擎，种子由全局种子和stream共同决定，不同的stream（如不同的层、数据shuffle）互不影响
+    std::mt19937 create_random_engine(const unsigned int stream);
+    // 第stream个流中第block块（如第几个样本）的引擎，各块的随机数互不相关，与处理的顺序和线程无关
+    std::mt19937 create_random_engine(const unsigned int stream, const unsigned int block);
+
+    // 参数按固定大小的块初始化，每块的随机数由(种子, stream, 块下标)决定，与线程数无关
+    void normal_distribution_init(float* data, const unsigned int size, const float meanValue, const float standardDeviation,
+                                  const unsigned int stream = 0);
+    void uniform_distribution_init(float* data, const unsigned int size, const float lowValue, const float highValue,
+                                   const unsigned int stream = 0);
     void constant_distribution_init(float* data, const unsigned int size, const float constantValue);
-    void xavier_init(float* data, const unsigned int size, const unsigned int inNum, const unsigned int outNum);
+    void xavier_init(float* data, const unsigned int size, const unsigned int inNum, const unsigned int outNum,
+                     const unsigned int stream = 0);
 
-    float moving_average(float avg, const int acc_number, float value);
+    // 成对求和：每256个元素内8路累加，更长时对半递归，舍入误差随长度按O(log n)增长
+    float pairwise_sum(const float* x, const unsigned int len);
+    // 把[0, len)按块分给worker并行归约，blockSum(start, end)返回[start, end)的和（块内可用pairwise_sum），
+    // 各块的部分和再成对合并。确定性模式（set_deterministic）下块的划分只由len决定，结果与线程数无关
+    float parallel_reduce(const unsigned int len, const std::function<float(const unsigned int, const unsigned int)>& blockSum);
+    float parallel_sum(const float* x, const unsigned int len);
+    // 交叉熵：返回sum(-label*log(output))，gradient不为空时在同一遍中写入gradient = -label/output*gradientScale。
+    // label为0的项loss和gradient都是0，不计算log
+    float cross_entropy_loss_gradient(const float* label, const float* output, float* gradient, const unsigned int len,
+                                      const float gradientScale);
+    // 平方误差：返回sum((label-output)^2)，gradient不为空时在同一遍中写入gradient = 2*(output-label)*gradientScale
+    float squared_error_loss_gradient(const float* label, const float* output, float* gradient, const unsigned int len,
+                                      const float gradientScale);
 
     // c = a*b
     void mul(const float* a, const float* b, float* c, const unsigned int len);
@@ -32,6 +63,62 @@ namespace MiniCNN
     // 待更新，参数重命名
     void fullyConnect(const float* input, const float* weight, const float* bias,float* output,
                      const unsigned int n, const unsigned int inBatchSize, const unsigned int outBatchSize);
+    // 在fullyConnect的累加结束后直接计算activation，输出不需要再读写一遍
+    void fullyConnectActivation(const float* input, const float* weight, const float* bias, float* output,
+                                const unsigned int n, const unsigned int inBatchSize, const unsigned int outBatchSize,
+                                const ActivationType activation);
+    // 输入、输出长度为常见大小（10、32、64、128、256、512、784、1024）时按编译期形状特化的全连接kernel，
+    // 计算与fullyConnectActivation相同。输入长度不是这些大小时返回nullptr，由调用者使用通用实现
+    typedef void (*FullyConnectKernel)(const float* input, const float* weight, const float* bias, float* output,
+                                       const unsigned int n, const unsigned int outBatchSize,
+                                       const ActivationType activation);
+    FullyConnectKernel get_fully_connect_kernel(const unsigned int inBatchSize, const unsigned int outBatchSize);
+    // 对n组长度为len的数据分别计算softmax，len为常见大小时返回特化的实例，否则返回通用实现
+    typedef void (*SoftmaxKernel)(const float* x, float* y, const unsigned int n, const unsigned int len);
+    SoftmaxKernel get_softmax_kernel(const unsigned int len);
+    // softmax的反向：delta = y * (grad - dot(y, grad))，每组O(len)；delta可以与grad是同一块内存
+    void softmax_backward(const float* y, const float* grad, float* delta, const unsigned int n, const unsigned int len);
+    // delta = f'(y) * grad，y为activation的输出
+    void activation_delta(const float* y, const float* grad, float* delta, const unsigned int len,
+                          const ActivationType activation);
+
+    // 对n组长度为len的数据分别求最大值的下标（有多个最大值时取第一个），多组同时比较
+    void argmax(const float* x, const unsigned int n, const unsigned int len, unsigned int* indices);
+    // 对n组长度为len的数据分别求最大的k个值的下标，按值从大到小写入indices[i*k, (i+1)*k)，k不能超过len
+    void top_k(const float* x, const unsigned int n, const unsigned int len, const unsigned int k, unsigned int* indices);
+
+    // y = x * scale
+    void uint8_to_float(const uint8_t* x, float* y, const unsigned int len, const float scale);
+    // int8量化推理：q = clamp(round(x / scale) + zeroPoint, 0, 255)
+    void quantize_u8(const float* x, uint8_t* q, const unsigned int len, const float scale, const int zeroPoint);
+    // output = (input·weight - zeroPoint * weightSum) * inputScale * weightScale + bias，再计算activation
+    // weight按输出通道逐行存放，每行长度为inStride（补0对齐到64），input每行同样长度
+    void fullyConnectInt8(const uint8_t* input, const int8_t* weight, const int32_t* weightSum, const float* weightScale,
+                          const float* bias, float* output, const unsigned int n, const unsigned int inStride,
+                          const unsigned int outBatchSize, const float inputScale, const int inputZeroPoint,
+                          const ActivationType activation);
+
+    // 稀疏weights的全连接：每blockRows个输出为一组，每组按CSR记录非零块所在的输入下标blockCol，
+    // 每个块包含blockRows个连续输出的weights（blockRows为1时即为CSR）。输入转置后每8个样本一组，每个块的weights
+    // 一次应用到一组样本，x86上支持AVX2时使用AVX2的kernel
+    void fullyConnectSparse(const float* input, const unsigned int* blockRowPtr, const unsigned int* blockCol,
+                            const float* values, const unsigned int blockRows, const float* bias, float* output,
+                            const unsigned int n, const unsigned int inBatchSize, const unsigned int outBatchSize,
+                            const ActivationType activation);
+
+    // 对称矩阵的特征分解（Householder三对角化 + QL迭代），matrix为n×n；
+    // eigenValues按从大到小排列，eigenVectors的第k列是第k个特征值对应的特征向量
+    void symmetric_eigen(double* matrix, double* eigenVectors, double* eigenValues, const unsigned int n);
+
+    // float与fp16/bf16之间的转换，均为round to nearest even
+    void float_to_narrow(const float* x, uint16_t* y, const unsigned int len, const DataType dataType);
+    void narrow_to_float(const uint16_t* x, float* y, const unsigned int len, const DataType dataType);
+    // x *= scale，同时检查结果中是否有inf/nan，全部有限时返回true
+    bool scale_and_check_finite(float* x, const unsigned int len, const float scale);
+    // weight以fp16/bf16存放，读取后转换为float，累加和输出都是float
+    void fullyConnectNarrow(const float* input, const uint16_t* weight, const float* bias, float* output,
+                            const unsigned int n, const unsigned int inBatchSize, const unsigned int outBatchSize,
+                            const DataType weightType, const ActivationType activation);
 
     // mode: 0-valid,1-same
     // 待更新，参数太多了
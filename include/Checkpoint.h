@@ -0,0 +1,130 @@
+//
+// Created by yang chen on 2018/5/1.
+//
+
+#ifndef MINICNN_CHECKPOINT_H
+#define MINICNN_CHECKPOINT_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Network.h"
+
+namespace MiniCNN
+{
+    // checkpoint中网络参数之外的训练状态，由训练循环填写和恢复
+    struct TrainingState
+    {
+        // 当前的epoch，以及这个epoch中下一个要训练的batch
+        unsigned int epoch = 0;
+        unsigned int batch = 0;
+        // 已经训练的batch总数
+        uint64_t step = 0;
+        float learningRate = 0.0f;
+        // 全局随机种子和Sampler::saveState()的结果
+        unsigned int seed = 0;
+        std::string samplerState;
+        // AugmentedLoader::getEpoch()，不使用时为0
+        unsigned int loaderEpoch = 0;
+    };
+
+    struct CheckpointWriterStats
+    {
+        unsigned long checkpoints = 0;
+        unsigned long failures = 0;
+        // 训练线程花在save（包括等待上一个checkpoint）和写时复制上的时间
+        double saveSeconds = 0.0;
+        double copyOnWriteSeconds = 0.0;
+        uint64_t copyOnWriteBytes = 0;
+        // 后台线程的写入时间和写入的字节数
+        double writeSeconds = 0.0;
+        uint64_t bytes = 0;
+    };
+
+    // 网络参数和optimizer状态的写时复制快照：创建时只记录tensor，不复制数据。训练线程更新某一层的参数之前，
+    // 或者后台线程写到这一层时，才把这一层复制出来，之后这一层在快照中不再变化
+    class ParamSnapshot
+    {
+    public:
+        struct Param
+        {
+            std::shared_ptr<Tensor> param;
+            std::shared_ptr<Tensor> state;
+            std::vector<float> paramData;
+            std::vector<float> stateData;
+        };
+        struct LayerParams
+        {
+            std::string layerType;
+            std::vector<Param> params;
+            bool copied = false;
+        };
+
+        explicit ParamSnapshot(const Network& network);
+
+    public:
+        // 训练线程在修改第layerIdx层的参数之前调用
+        void copyBeforeWrite(const unsigned int layerIdx);
+        // 后台线程取得第layerIdx层复制好的数据
+        const LayerParams& acquire(const unsigned int layerIdx);
+        // 后台线程写完第layerIdx层后释放复制的数据
+        void release(const unsigned int layerIdx);
+        inline bool isComplete() const { return m_copiedLayers == m_layers.size(); }
+        inline unsigned int getLayerCount() const { return (unsigned int)m_layers.size(); }
+        inline float getLossScale() const { return m_lossScale; }
+        inline unsigned int getGoodSteps() const { return m_goodSteps; }
+        inline double getCopyOnWriteSeconds() const { return m_copyOnWriteSeconds; }
+        inline uint64_t getCopyOnWriteBytes() const { return m_copyOnWriteBytes; }
+
+    private:
+        // 返回复制的字节数，已经复制过时为0
+        uint64_t copyLayer(const unsigned int layerIdx);
+
+    private:
+        std::vector<LayerParams> m_layers;
+        float m_lossScale = 1.0f;
+        unsigned int m_goodSteps = 0;
+        std::mutex m_mutex;
+        std::atomic<unsigned int> m_copiedLayers;
+        // 只由训练线程修改
+        double m_copyOnWriteSeconds = 0.0;
+        uint64_t m_copyOnWriteBytes = 0;
+    };
+
+    // 异步写checkpoint：save在两个batch之间由训练线程调用，只创建快照就返回，由后台线程写入临时文件、
+    // fsync后rename为目标文件，中途被中断时原来的checkpoint仍然完整。同一时间只写一个checkpoint，
+    // 上一个还没写完时save先等待它完成。不能用于AsyncTrainer的Hogwild训练
+    class CheckpointWriter
+    {
+    public:
+        CheckpointWriter();
+        virtual ~CheckpointWriter();
+
+    public:
+        void save(Network& network, const TrainingState& state, const std::string& path);
+        // 等待正在写的checkpoint完成，返回最近一个checkpoint是否写入成功
+        bool wait();
+        CheckpointWriterStats getStats();
+
+    private:
+        bool write(ParamSnapshot& snapshot, const TrainingState& state, const std::string& path);
+
+    private:
+        std::thread m_thread;
+        std::mutex m_mutex;
+        bool m_lastResult = true;
+        // 最近一次save的快照，写完后在训练线程中把它的写时复制统计计入m_stats
+        std::shared_ptr<ParamSnapshot> m_pendingSnapshot;
+        CheckpointWriterStats m_stats;
+    };
+
+    // 把checkpoint恢复到结构相同的网络（层的类型、参数的形状一致），包括optimizer的状态和动态loss scale；
+    // 学习率等训练状态写入state，由调用者恢复。文件不存在、损坏或者网络结构不同时返回false，网络不变
+    bool load_checkpoint(const std::string& path, Network& network, TrainingState& state);
+}
+
+#endif //MINICNN_CHECKPOINT_H
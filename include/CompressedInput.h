@@ -0,0 +1,87 @@
+//
+// Created by yang chen on 2018/4/29.
+//
+
+#ifndef MINICNN_COMPRESSEDINPUT_H
+#define MINICNN_COMPRESSEDINPUT_H
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace MiniCNN
+{
+    // 顺序读取可能被gzip压缩的文件，按文件开头的magic判断，未压缩的文件直接读取。
+    // 分块gzip（每个gzip member在头部的extra字段"BC"中记录自身的长度，与BGZF相同，gunzip也可以解压）
+    // 不用解压就能定位各个块，每次读入一组块由线程池并行解压；普通的gzip只能单线程流式解压。
+    // 两种情况都只缓存一段数据，内存与文件大小无关。POSIX上未压缩的文件直接用fd读取，打开时提示内核顺序读取
+    // （Linux上为POSIX_FADV_SEQUENTIAL），调用者可以再用adviseReadahead提示预读下一段
+    class CompressedInput
+    {
+    public:
+        enum class Format { RAW, GZIP, BLOCKED_GZIP };
+
+        CompressedInput();
+        virtual ~CompressedInput();
+
+    public:
+        bool open(const std::string& path);
+        // 读取解压后的len个字节，数据不足或压缩数据损坏（包括CRC不符）时返回false
+        bool read(void* data, const size_t len);
+        // 读取最多len个字节，返回实际读取的数量，0表示文件已经结束或出错
+        size_t readSome(void* data, const size_t len);
+        // 未压缩的文件：丢弃上次调用之后已经读过的页（POSIX_FADV_DONTNEED，page cache不随文件增长），
+        // 并提示内核预读接下来的nextLen个字节（POSIX_FADV_WILLNEED）。压缩的文件和不支持的平台上不做任何事
+        void adviseReadahead(const size_t nextLen);
+        // 压缩数据损坏或被截断，或读取出错
+        inline bool isFailed() const { return m_failed; }
+        inline Format getFormat() const { return m_format; }
+
+    private:
+        struct Stream;
+        struct Block
+        {
+            size_t compressedOffset = 0;
+            size_t compressedSize = 0;
+            size_t outputOffset = 0;
+            uint32_t outputSize = 0;
+            uint32_t crc = 0;
+        };
+
+        // 解压下一段数据到m_buffer，没有数据时返回false
+        bool fillBuffer();
+        bool inflateStream();
+        bool inflateBlocks();
+        // 读取下一个分块gzip member的头部、压缩数据和尾部，追加到m_compressed
+        bool readBlock(Block& block, bool& end);
+
+        void closeFile();
+
+    private:
+        std::ifstream m_ifs;
+        // 未压缩的文件在POSIX上的fd，已读到的位置和已经丢弃的页的位置
+        int m_fd = -1;
+        uint64_t m_offset = 0;
+        uint64_t m_releasedOffset = 0;
+        Format m_format = Format::RAW;
+        bool m_failed = false;
+        std::unique_ptr<Stream> m_stream;
+        std::vector<uint8_t> m_compressed;
+        std::vector<Block> m_blocks;
+        std::vector<uint8_t> m_buffer;
+        size_t m_bufferSize = 0;
+        size_t m_bufferPos = 0;
+    };
+
+    // 分块gzip每块未压缩的最大长度，与BGZF相同，保证压缩后的块长度可以用16位记录
+    const unsigned int BLOCKED_GZIP_BLOCK_SIZE = 0xff00;
+
+    // 把文件压缩为分块gzip，每组块由线程池并行压缩；level为zlib的压缩级别
+    bool compress_file_blocked(const std::string& srcPath, const std::string& dstPath, const int level = 6);
+    // path不存在而path.gz存在时返回path.gz，否则返回path
+    std::string resolve_compressed_path(const std::string& path);
+}
+
+#endif //MINICNN_COMPRESSEDINPUT_H
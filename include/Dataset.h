@@ -0,0 +1,84 @@
+//
+// Created by yang chen on 2018/4/24.
+//
+
+#ifndef MINICNN_DATASET_H
+#define MINICNN_DATASET_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Tensor.h"
+
+namespace MiniCNN
+{
+    // 不可变的数据集：所有样本按顺序连续存放，每个样本getSampleSize()个uint8，label为类别下标。
+    // 创建之后样本不再移动，shuffle、划分等都通过Sampler给出的下标完成。
+    // 也可以从预处理缓存加载：样本已缩放为float、label已展开为one-hot，按tensor的布局存放在映射的文件中。
+    // 下标连续的batch（如顺序的评估、测试）可以用viewBatch直接得到映射中的view，不拷贝；
+    // 其他batch仍由fillBatch拷贝，只是下标连续的一段合并为一次memcpy
+    class Dataset
+    {
+    public:
+        Dataset();
+        virtual ~Dataset();
+
+    public:
+        // sampleShape的Batch忽略；samples的长度必须是样本大小的整数倍，labels与样本一一对应且都小于classes
+        bool create(const Shape& sampleShape, const unsigned int classes,
+                    std::vector<uint8_t>&& samples, std::vector<uint8_t>&& labels);
+        // 把预处理后的数据写入path（先写临时文件再rename，多个进程同时写时不会读到不完整的文件）
+        bool saveCache(const std::string& path, const uint64_t key) const;
+        // 映射path，文件不存在、格式不对或key不一致时返回false，当前数据不变
+        bool loadCache(const std::string& path, const uint64_t key);
+        inline bool isCached() const { return m_floatSamples != nullptr; }
+
+        inline unsigned int size() const { return (unsigned int)m_labels.size(); }
+        inline bool empty() const { return m_labels.empty(); }
+        inline unsigned int getClasses() const { return m_classes; }
+        // Batch为1
+        inline Shape getSampleShape() const { return m_sampleShape; }
+        inline unsigned int getSampleSize() const { return m_sampleShape.oneBatchSize(); }
+        // 原始的uint8样本，从缓存加载时为nullptr
+        inline const uint8_t* getSample(const unsigned int idx) const
+        {
+            return m_samples.empty() ? nullptr : &m_samples[(size_t)idx * getSampleSize()];
+        }
+        inline uint8_t getLabel(const unsigned int idx) const { return m_labels[idx]; }
+        // uint8样本缩放到0~1的系数
+        static inline float getSampleScale() { return 1.0f / 255.0f; }
+        // 每个类别的样本数
+        std::vector<unsigned int> getClassCounts() const;
+        // 把indices[0, count)对应的样本缩放到0~1写入inputTensor，label按one-hot写入labelTensor（可以为空），
+        // 都写在tensor的前面几个样本，返回写入的数量（不超过tensor的batch）
+        unsigned int fillBatch(const unsigned int* indices, const unsigned int count,
+                               Tensor& inputTensor, Tensor* labelTensor) const;
+        // 使用缓存且indices[0, count)是连续的下标时，把inputTensor、labelTensor设为映射中这些样本的view（one-hot label），
+        // 不拷贝数据，返回true；否则返回false，两个tensor不变。view是只读的，持有映射，Dataset销毁后仍然有效
+        bool viewBatch(const unsigned int* indices, const unsigned int count,
+                       std::shared_ptr<Tensor>& inputTensor, std::shared_ptr<Tensor>& labelTensor) const;
+
+    private:
+        Shape m_sampleShape;
+        unsigned int m_classes = 0;
+        std::vector<uint8_t> m_samples;
+        std::vector<uint8_t> m_labels;
+        // 缓存映射的内存，m_floatSamples、m_floatLabels指向其中
+        std::shared_ptr<void> m_mapping;
+        const float* m_floatSamples = nullptr;
+        const float* m_floatLabels = nullptr;
+    };
+
+    // 预处理缓存的key：源文件的大小、修改时间和开头的4KB，settings（数据集相关的设置）和Dataset的预处理方式
+    // （缩放、label编码、布局）共同的64位hash，任何一项变化都会使用新的缓存。源文件不能读取时返回0
+    uint64_t dataset_cache_key(const std::vector<std::string>& sourceFiles, const std::string& settings);
+    // cacheDir为空时直接调用decode读取源文件；否则先查找缓存"<cacheDir>/<name>_<key>.cache"，找到则直接映射，
+    // 否则decode后生成缓存并重新映射，生成失败（如目录不存在）时仍返回decode的数据
+    bool load_dataset_with_cache(const std::vector<std::string>& sourceFiles, const std::string& settings,
+                                 const std::string& name, const std::string& cacheDir,
+                                 const std::function<bool(Dataset&)>& decode, Dataset& dataset);
+}
+
+#endif //MINICNN_DATASET_H
@@ -0,0 +1,87 @@
+//
+// Created by yang chen on 2018/4/20.
+//
+
+#ifndef MINICNN_EVALUATOR_H
+#define MINICNN_EVALUATOR_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "Network.h"
+
+namespace MiniCNN
+{
+    struct EvaluationResult
+    {
+        unsigned int samples = 0;
+        unsigned int classes = 0;
+        unsigned int topK = 1;
+        float accuracy = 0.0f;
+        // 真实类别在预测的前topK个类别中的比例
+        float topKAccuracy = 0.0f;
+        // 按样本数加权的平均loss，网络没有设置loss function时为0
+        float loss = 0.0f;
+        // confusion[label * classes + predicted]
+        std::vector<unsigned int> confusion;
+        double seconds = 0.0;
+        double samplesPerSecond = 0.0;
+    };
+
+    // 把数据集按batch分给多路并发的推理上下文：第一路直接使用network，其余为共享参数的副本。
+    // 每路的输入、label和预测结果的缓存在构造时分配，evaluate过程中不再分配
+    class Evaluator
+    {
+    public:
+        // 把第batchIdx个batch写入inputTensor、labelTensor（one-hot）的前面几个样本，返回写入的数量，0表示没有数据。
+        // 也可以把两个tensor换成已有数据的连续tensor（如Dataset::viewBatch得到的view），此时它们的Batch就是返回的数量
+        using BatchFiller = std::function<unsigned int(const unsigned int batchIdx,
+                                                       std::shared_ptr<Tensor>& inputTensor,
+                                                       std::shared_ptr<Tensor>& labelTensor)>;
+
+        // contexts为1时在调用线程中执行，层内的计算仍使用线程池；否则每路一个线程，层内不再分发
+        Evaluator(Network& network, const unsigned int batch, const unsigned int contexts = 1);
+        virtual ~Evaluator();
+
+    public:
+        void setTopK(const unsigned int k);
+        // 所有上下文共同处理batchIdx在[0, batches)的batch
+        EvaluationResult evaluate(BatchFiller filler, const unsigned int batches);
+        inline unsigned int getBatch() const { return m_batch; }
+        inline unsigned int getContexts() const { return (unsigned int)m_contexts.size(); }
+
+    private:
+        struct Context
+        {
+            Network* network = nullptr;
+            std::shared_ptr<Network> replica;
+            std::shared_ptr<Tensor> inputTensor;
+            std::shared_ptr<Tensor> labelTensor;
+            std::vector<unsigned int> labels;
+            std::vector<unsigned int> predictions;
+            std::vector<unsigned int> confusion;
+            unsigned int samples = 0;
+            unsigned int correct = 0;
+            unsigned int topKCorrect = 0;
+            double lossSum = 0.0;
+        };
+
+        // 网络结构变化（如fuseLayers、quantize）后重新创建副本，否则重新共享参数，使副本中fp16 weights等缓存失效
+        void syncReplicas();
+        void contextLoop(const unsigned int contextIdx, BatchFiller& filler, const unsigned int batches);
+
+    private:
+        Network& m_network;
+        unsigned int m_batch;
+        unsigned int m_classes;
+        unsigned int m_topK = 1;
+        std::vector<Context> m_contexts;
+        // 确定性模式下按batch记录loss，最后按batch的顺序相加，与各个batch由哪一路处理无关
+        std::vector<double> m_batchLoss;
+        bool m_deterministic = false;
+        std::atomic<unsigned int> m_nextBatch;
+    };
+}
+
+#endif //MINICNN_EVALUATOR_H
@@ -0,0 +1,40 @@
+//
+// Created by yang chen on 2018/4/3.
+//
+
+#ifndef MINICNN_FULLYCONNECTEDACTIVATIONLAYER_H
+#define MINICNN_FULLYCONNECTEDACTIVATIONLAYER_H
+
+#include "FullyConnectedLayer.h"
+#include "CalcFunctions.h"
+
+namespace MiniCNN
+{
+    // FullyConnectedLayer + ReluLayer/SigmoidLayer融合后的层，由Network::fuseLayers生成。
+    // 保存的格式与融合前的两层完全一致。activation只能是RELU或SIGMOID
+    class FullyConnectedActivationLayer : public FullyConnectedLayer
+    {
+        FRIEND_WITH_NETWORK
+
+    public:
+        FullyConnectedActivationLayer();
+        FullyConnectedActivationLayer(const FullyConnectedLayer& fullyConnectedLayer, const ActivationType activation);
+        virtual ~FullyConnectedActivationLayer();
+
+    protected:
+        DECLARE_LAYER_TYPE;
+        virtual void forward(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next) override;
+        virtual void backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
+                              std::shared_ptr<Tensor>& prevGrad, const std::shared_ptr<Tensor>& nextGrad) override;
+        virtual std::string getLayerType() const override;
+        virtual std::string save() const override;
+        virtual bool load(const std::string content) override;
+        virtual bool needOutputInBackward() const override { return true; }
+
+    private:
+        ActivationType m_activation = ActivationType::RELU;
+        std::shared_ptr<Tensor> m_delta;
+    };
+}
+
+#endif //MINICNN_FULLYCONNECTEDACTIVATIONLAYER_H
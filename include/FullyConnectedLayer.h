@@ -8,6 +8,7 @@
 
 
 #include "Layer.h"
+#include "CalcFunctions.h"
 
 namespace MiniCNN
 {
@@ -21,6 +22,8 @@ namespace MiniCNN
 
     public:
         void setParameters(const Shape paramShape, const bool enableBias);
+        // forward时weights使用的存储类型，FP16/BF16时m_weight仍作为fp32的master weights参与backward和更新
+        void setWeightDataType(const DataType dataType);
 
     protected:
         DECLARE_LAYER_TYPE;
@@ -28,17 +31,28 @@ namespace MiniCNN
         virtual void backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
                               std::shared_ptr<Tensor>& prevGrad, const std::shared_ptr<Tensor>& nextGrad) override;
         virtual void solveInnerParams() override;
+        virtual void shareParams(const std::vector<std::shared_ptr<Tensor>>& params) override;
         virtual std::string getLayerType() const override;
         virtual std::string save() const override;
-        virtual void load(const std::string content) override;
+        virtual bool load(const std::string content) override;
+        // 已知当前层输出的梯度delta时，计算输入的梯度以及weights、bias的梯度
+        void backwardWithDelta(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor>& prevGrad,
+                               const std::shared_ptr<Tensor>& delta);
+        // 按m_weightDataType计算forward，activation在累加结束后直接计算
+        void forwardWithActivation(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next,
+                                   const ActivationType activation);
 
-    private:
+    protected:
         Shape m_paramShape;
         std::shared_ptr<Tensor> m_weight;
         std::shared_ptr<Tensor> m_weightGradient;
         bool m_enableBias = false;
         std::shared_ptr<Tensor> m_bias;
         std::shared_ptr<Tensor> m_biasGradient;
+        DataType m_weightDataType = DataType::FP32;
+        // 由master weights转换得到的fp16/bf16 weights，训练时每次forward重新转换
+        std::shared_ptr<Tensor> m_narrowWeight;
+        bool m_narrowWeightDirty = true;
     };
 }
 
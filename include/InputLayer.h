@@ -29,7 +29,7 @@ namespace MiniCNN
 
         virtual std::string save() const override;
 
-        virtual void load(const std::string content) override;
+        virtual bool load(const std::string content) override;
     };
 }
 
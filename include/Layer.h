@@ -33,27 +33,39 @@ namespace MiniCNN
         inline void setInputShape(const Shape shape) { m_inputShape = shape; }
         inline void setOutputShape(const Shape shape) { m_outputShape = shape; }
 
+        // 参数随机初始化使用的随机数流，由Network按层的下标设置
+        inline unsigned int getRandomStream() const { return m_randomStream; }
+        inline void setRandomStream(const unsigned int stream) { m_randomStream = stream; }
+
         inline float getLearningRate() const { return m_learningRate; }
         inline void setLearningRate(float lr) { m_learningRate = lr; }
 
         inline std::vector<std::shared_ptr<Tensor>> getGradData() const { return m_gradients; }
         inline std::vector<std::shared_ptr<Tensor>> getParams() const { return m_params; }
+        // 让当前层直接使用另一层的参数tensor（例如多个网络副本共享同一份weights）
+        virtual void shareParams(const std::vector<std::shared_ptr<Tensor>>& params) {}
 
         virtual void forward(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next) = 0;
         virtual void backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
                             std::shared_ptr<Tensor>& prevGrad, const std::shared_ptr<Tensor>& nextGrad) = 0;
 
         virtual void solveInnerParams() { m_outputShape = m_inputShape; }
+        // 可以直接在输入tensor上计算输出（in-place），backward也直接写回传入的梯度tensor
+        virtual bool supportInPlace() const { return false; }
+        // backward时是否需要读取本层的输出，需要的话后面的层不能in-place覆盖它
+        virtual bool needOutputInBackward() const { return false; }
 
         virtual std::string getLayerType() const = 0;
         virtual std::string save() const { return getLayerType(); }
-        virtual void load(const std::string content) {}
+        // 模型文件中的参数不合法时返回false
+        virtual bool load(const std::string content) { return true; }
 
     protected:
         State m_state = State::TRAIN;
         Shape m_inputShape;
         Shape m_outputShape;
         float m_learningRate = 0.1f;
+        unsigned int m_randomStream = 0;
         std::vector<std::shared_ptr<Tensor>> m_gradients;
         std::vector<std::shared_ptr<Tensor>> m_params;
 
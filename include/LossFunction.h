@@ -17,6 +17,9 @@ namespace MiniCNN
         virtual float getLoss(const std::shared_ptr<Tensor> labelTensor, const std::shared_ptr<Tensor> outputTensor) = 0;
         virtual void getGradient(const std::shared_ptr<Tensor> labelTensor, const std::shared_ptr<Tensor> outputTensor,
                             std::shared_ptr<Tensor>& gradient) = 0;
+        // 返回loss，同时写入乘以gradientScale的梯度；默认分别调用getLoss、getGradient
+        virtual float getLossAndGradient(const std::shared_ptr<Tensor> labelTensor, const std::shared_ptr<Tensor> outputTensor,
+                                         std::shared_ptr<Tensor>& gradient, const float gradientScale);
     };
 
     class CrossEntropyFunction : public LossFunction
@@ -25,6 +28,8 @@ namespace MiniCNN
         virtual float getLoss(const std::shared_ptr<Tensor> labelTensor, const std::shared_ptr<Tensor> outputTensor) override;
         virtual void getGradient(const std::shared_ptr<Tensor> labelTensor, const std::shared_ptr<Tensor> outputTensor,
                                  std::shared_ptr<Tensor>& gradient) override;
+        virtual float getLossAndGradient(const std::shared_ptr<Tensor> labelTensor, const std::shared_ptr<Tensor> outputTensor,
+                                         std::shared_ptr<Tensor>& gradient, const float gradientScale) override;
     };
 
     class MSEFunction : public LossFunction
@@ -33,6 +38,8 @@ namespace MiniCNN
         virtual float getLoss(const std::shared_ptr<Tensor> labelTensor, const std::shared_ptr<Tensor> outputTensor) override;
         virtual void getGradient(const std::shared_ptr<Tensor> labelTensor, const std::shared_ptr<Tensor> outputTensor,
                                  std::shared_ptr<Tensor>& gradient) override;
+        virtual float getLossAndGradient(const std::shared_ptr<Tensor> labelTensor, const std::shared_ptr<Tensor> outputTensor,
+                                         std::shared_ptr<Tensor>& gradient, const float gradientScale) override;
     };
 }
 
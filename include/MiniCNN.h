@@ -12,6 +12,9 @@
 
 #include "Layer.h"
 #include "FullyConnectedLayer.h"
+#include "FullyConnectedActivationLayer.h"
+#include "QuantizedFullyConnectedLayer.h"
+#include "SparseFullyConnectedLayer.h"
 #include "ActivationLayer.h"
 #include "InputLayer.h"
 #include "SoftmaxLayer.h"
@@ -22,5 +25,13 @@
 //#include "BatchNormalizationLayer.h"
 
 #include "Network.h"
+#include "AsyncTrainer.h"
+#include "Evaluator.h"
+#include "Dataset.h"
+#include "Sampler.h"
+#include "Augmentation.h"
+#include "ShardedReader.h"
+#include "CompressedInput.h"
+#include "Checkpoint.h"
 
 #endif //MINICNN_MINICNN_H
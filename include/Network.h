@@ -6,6 +6,7 @@
 #define MINICNN_NETWORK_H
 
 #include <memory>
+#include <string>
 #include <vector>
 #include "Layer.h"
 #include "LossFunction.h"
@@ -13,8 +14,28 @@
 
 namespace MiniCNN
 {
+    struct CheckpointStats
+    {
+        unsigned int keptTensors = 0;
+        unsigned int recomputedTensors = 0;
+        // 相比保存全部activation节省的字节数
+        size_t savedBytes = 0;
+        unsigned long recomputedLayers = 0;
+        double forwardSeconds = 0.0;
+        double recomputeSeconds = 0.0;
+    };
+
+    class ParamSnapshot;
+    struct TrainingState;
+
     class Network
     {
+        friend class AsyncTrainer;
+        friend class Evaluator;
+        friend class ParamSnapshot;
+        friend class CheckpointWriter;
+        friend bool load_checkpoint(const std::string& path, Network& network, TrainingState& state);
+
     public:
         Network();
         virtual ~Network();
@@ -25,11 +46,51 @@ namespace MiniCNN
         void setLossFunction(std::shared_ptr<LossFunction> lossFunction);
         void setOptimizer(std::shared_ptr<Optimizer> optimizer);
         void setLearningRate(const float lr);
+        // 是否允许activation等层in-place执行，需要在addLayer之前设置
+        void setInPlace(const bool enable);
+        // 全连接层forward时weights的存储类型，参数本身始终以fp32保存和更新
+        void setWeightDataType(const DataType dataType);
+        // backward前把loss的梯度乘以scale，更新参数前再除回去，避免低精度下小梯度下溢
+        void setLossScale(const float lossScale);
+        // 按绝对值裁剪全连接层的weights，blockRows为4或8时按blockRows个输出×1个输入的块裁剪（块内绝对值的平均）。
+        // global为true时所有全连接层使用同一个阈值，否则每层裁剪相同的比例，返回裁剪后所有全连接层weights中0的比例
+        float prune(const float sparsity, const bool global, const unsigned int blockRows = 1);
+        // 把weights中0的比例不低于minSparsity的全连接层替换为稀疏格式的层（blockRows为1时为CSR），返回替换的数量
+        unsigned int sparsify(const unsigned int blockRows, const float minSparsity = 0.0f);
+        // 对rank*(in+out) < in*out的全连接层做截断SVD，W ≈ U·V，替换为in→rank、rank→out两个全连接层，返回替换的数量。
+        // 替换后的两层就是普通的全连接层，保存的模型可以直接加载
+        unsigned int factorize(const unsigned int rank);
+        // 生成不依赖MiniCNN的C++源文件：每层是固定形状的模板实例，weights为对齐的静态数组，
+        // 接口为modelName::forward(input, output)。网络中有无法生成的层（如int8量化层）时返回false
+        bool generateSource(const std::string& sourceFile, const std::string& modelName = "model") const;
+        // 混合精度训练：backward需要的activation以bf16保存，计算在两块fp32的缓存中轮流进行，
+        // 全连接层使用bf16 weights，参数和optimizer仍为fp32，并开启动态loss scale。开启后忽略checkpoint的设置
+        void setMixedPrecision(const bool enable);
+        // 动态loss scale：梯度出现inf/nan时跳过这一步并把scale减半，连续growthInterval步正常后scale加倍
+        void setDynamicLossScale(const bool enable, const unsigned int growthInterval = 2000);
+        inline float getLossScale() const { return m_lossScale; }
+        inline unsigned long getSkippedSteps() const { return m_skippedSteps; }
+        // 所有activation和gradient tensor占用的字节数
+        size_t getActivationMemorySize() const;
+        // 每interval层保留一个输出，其余activation在backward时从最近的checkpoint重新计算，0表示关闭
+        void setCheckpointInterval(const unsigned int interval);
+        // 始终保留第layerIdx层的输出，layerIdx超出层数时返回false
+        bool markCheckpoint(const unsigned int layerIdx);
+        CheckpointStats getCheckpointStats() const;
+        void resetCheckpointStats();
         float getLoss(const std::shared_ptr<Tensor> labelTensor, const std::shared_ptr<Tensor> outputTensor);
         float trainBatch(const std::shared_ptr<Tensor> inputTensor, const std::shared_ptr<Tensor> labelTensor);
         std::shared_ptr<Tensor> testBatch(const std::shared_ptr<Tensor> inputTensor);
         bool saveModel(const std::string& modelFile);
         bool loadModel(const std::string& modelFile);
+        // 创建一个与当前网络共享参数、但拥有独立activation/gradient缓存的网络副本
+        std::shared_ptr<Network> createReplica() const;
+        // 把FullyConnectedLayer + ReluLayer/SigmoidLayer融合为一个层，返回融合的数量
+        unsigned int fuseLayers();
+        // 用一批样本做前向计算，记录每个全连接层输入的取值范围，可以多次调用累计
+        void calibrate(const std::shared_ptr<Tensor> inputTensor);
+        // 按校准得到的范围把全连接层替换为int8量化的层，返回替换的数量
+        unsigned int quantize();
 
     private:
         State getState() const;
@@ -38,16 +99,71 @@ namespace MiniCNN
     private:
         std::shared_ptr<Tensor> forward(const std::shared_ptr<Tensor> inputTensor);
         float backward(const std::shared_ptr<Tensor> labelTensor);
-        std::shared_ptr<Layer> createLayerByType(const std::string layerType);
+        void update();
+        void updateWithDynamicLossScale();
+        bool hasParams(const unsigned int layerIdx) const;
+        // 供checkpoint读写各层的参数
+        std::string getLayerType(const unsigned int layerIdx) const;
+        std::vector<std::shared_ptr<Tensor>> getLayerParams(const unsigned int layerIdx) const;
+        // 参数被直接改写后，使由参数转换得到的缓存（如低精度的weights）失效
+        void invalidateParamCaches(const unsigned int layerIdx);
+        void updateLayer(const unsigned int layerIdx, Optimizer& optimizer);
+        // optimizer修改第layerIdx层的参数之前调用，正在写的checkpoint还没有复制这一层时先复制
+        void beforeParamsUpdate(const unsigned int layerIdx);
+        // 把参数重新共享给createReplica创建的副本，使副本中由参数转换得到的缓存失效；层的结构不同时返回false
+        bool shareParamsWith(Network& replica) const;
+        void reallocateTensors(std::vector<std::shared_ptr<Tensor>>& tensors, const unsigned int batch,
+                               const bool force = false);
+        // 在已分配的容量内改变所有activation、gradient的Batch
+        void setBatch(const unsigned int batch);
+        void planActivationMemory(const unsigned int batch);
+        void planMixedPrecisionMemory(const unsigned int batch);
+        void prepareInput(const std::shared_ptr<Tensor> inputTensor);
+        void forwardLayers(const unsigned int begin, const unsigned int end);
+        // 混合精度时，把backward第layerIdx层需要的输入、输出从bf16恢复到fp32的缓存
+        void restoreActivations(const unsigned int layerIdx);
+        void factorizeLayer(const unsigned int layerIdx, const unsigned int rank);
+        static void setLayerWeightDataType(std::shared_ptr<Layer> layer, const DataType dataType);
+        static std::shared_ptr<Layer> createLayerByType(const std::string layerType);
         std::string getLayerTypeFromLine(const std::string line);
 
     private:
         State m_state = State::TRAIN;
         std::vector<std::shared_ptr<Layer>> m_layers;
+        // m_inPlace[i]为true时，m_data[i + 1]与m_data[i]（以及对应的gradient）是同一个tensor
+        std::vector<bool> m_inPlace;
+        bool m_enableInPlace = true;
+        DataType m_weightDataType = DataType::FP32;
+        float m_lossScale = 1.0f;
+        bool m_dynamicLossScale = false;
+        unsigned int m_lossScaleGrowthInterval = 2000;
+        unsigned int m_goodSteps = 0;
+        unsigned long m_skippedSteps = 0;
+
+        // 混合精度：m_stash[i]是m_data[i]的bf16副本，m_data（除最终输出）与m_gradients只使用两块fp32存储
+        bool m_mixedPrecision = false;
+        std::vector<std::shared_ptr<Tensor>> m_stash;
         std::vector<std::shared_ptr<Tensor>> m_data;
         std::vector<std::shared_ptr<Tensor>> m_gradients;
+        // m_data[0]是调用者传入的输入tensor的view
+        bool m_inputView = false;
+        // 各个tensor按这个batch分配存储，更小的batch只改变shape
+        unsigned int m_batchCapacity = 0;
+
+        // checkpoint：被丢弃的activation按在segment中的位置共用存储，backward到该segment时重新计算
+        unsigned int m_checkpointInterval = 0;
+        std::vector<bool> m_checkpointMarks;
+        bool m_planDirty = false;
+        // m_recomputeBegin[i] < m_recomputeEnd[i]时，backward到第i层之前先重新计算这些层
+        std::vector<unsigned int> m_recomputeBegin;
+        std::vector<unsigned int> m_recomputeEnd;
+        CheckpointStats m_checkpointStats;
+        // 校准得到的每层输入的最小、最大值
+        std::vector<std::pair<float, float>> m_inputRanges;
         std::shared_ptr<LossFunction> m_lossFunction;
         std::shared_ptr<Optimizer> m_optimizer;
+        // 后台正在写的checkpoint的写时复制快照，全部复制完之后释放
+        std::shared_ptr<ParamSnapshot> m_snapshot;
     };
 }
 
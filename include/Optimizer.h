@@ -5,6 +5,8 @@
 #ifndef MINICNN_OPTIMIZER_H
 #define MINICNN_OPTIMIZER_H
 
+#include <map>
+#include <memory>
 #include <vector>
 #include "Tensor.h"
 
@@ -16,8 +18,12 @@ namespace MiniCNN
         Optimizer() = default;
         Optimizer(const float lr):m_lr(lr){}
         inline void setLearningRate(const float lr) { m_lr = lr; }
+        inline float getLearningRate() const { return m_lr; }
         virtual void update(std::vector<std::shared_ptr<Tensor>> params,
                             const std::vector<std::shared_ptr<Tensor>> gradient) = 0;
+        // 参数param对应的状态（如动量），没有时为nullptr；checkpoint通过它们保存和恢复optimizer
+        virtual std::shared_ptr<Tensor> getParamState(const std::shared_ptr<Tensor>& param) const { return nullptr; }
+        virtual void setParamState(const std::shared_ptr<Tensor>& param, std::shared_ptr<Tensor> state) {}
 
     protected:
         float m_lr = 0.0f;
@@ -37,10 +43,23 @@ namespace MiniCNN
         SGDWithMomentum(float lr, float momentum) : Optimizer(lr), m_momentum(momentum){}
         virtual void update(std::vector<std::shared_ptr<Tensor>> params,
                             const std::vector<std::shared_ptr<Tensor>> gradient) override;
+        virtual std::shared_ptr<Tensor> getParamState(const std::shared_ptr<Tensor>& param) const override;
+        virtual void setParamState(const std::shared_ptr<Tensor>& param, std::shared_ptr<Tensor> state) override;
+
+    private:
+        struct History
+        {
+            // 参数tensor被释放后地址可能被新的tensor重用，用weak_ptr确认还是同一个tensor
+            std::weak_ptr<Tensor> param;
+            std::shared_ptr<Tensor> data;
+        };
+        // 参数tensor的动量，没有时为nullptr
+        std::shared_ptr<Tensor> findHistory(const std::shared_ptr<Tensor>& param) const;
 
     private:
         float m_momentum = 0.0f;
-        std::vector<std::shared_ptr<Tensor>> m_historyData;
+        // update按层调用，动量按参数tensor分别保存
+        std::map<const Tensor*, History> m_historyData;
     };
 }
 
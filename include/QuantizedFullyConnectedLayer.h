@@ -0,0 +1,60 @@
+//
+// Created by yang chen on 2018/4/5.
+//
+
+#ifndef MINICNN_QUANTIZEDFULLYCONNECTEDLAYER_H
+#define MINICNN_QUANTIZEDFULLYCONNECTEDLAYER_H
+
+#include <cstdint>
+#include "Layer.h"
+#include "CalcFunctions.h"
+
+namespace MiniCNN
+{
+    // int8量化后的全连接层，只用于推理，由Network::quantize生成。
+    // weights按输出通道对称量化为int8（每个输出通道一个scale），输入按校准得到的范围非对称量化为uint8，
+    // 计算时int8*uint8累加到int32，最后统一还原为float并加上bias和activation
+    class QuantizedFullyConnectedLayer : public Layer
+    {
+        FRIEND_WITH_NETWORK
+
+    public:
+        QuantizedFullyConnectedLayer();
+        virtual ~QuantizedFullyConnectedLayer();
+
+    public:
+        // weight、bias与FullyConnectedLayer的格式一致，[inputMin, inputMax]为校准得到的输入范围
+        void setParameters(const Shape paramShape, const bool enableBias, const ActivationType activation,
+                           const Tensor& weight, const std::shared_ptr<Tensor> bias,
+                           const float inputMin, const float inputMax);
+
+    protected:
+        DECLARE_LAYER_TYPE;
+        virtual void forward(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next) override;
+        virtual void backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
+                              std::shared_ptr<Tensor>& prevGrad, const std::shared_ptr<Tensor>& nextGrad) override;
+        virtual void solveInnerParams() override;
+        virtual std::string getLayerType() const override;
+        virtual std::string save() const override;
+        virtual bool load(const std::string content) override;
+
+    private:
+        void allocateWeights();
+        void updateWeightSum();
+
+    private:
+        Shape m_paramShape;
+        bool m_enableBias = false;
+        ActivationType m_activation = ActivationType::NONE;
+        // 每行的长度补齐到64的倍数，补齐部分的weight为0
+        unsigned int m_inStride = 0;
+        std::vector<int8_t> m_weight;
+        std::vector<int32_t> m_weightSum;
+        std::vector<float> m_weightScale;
+        std::vector<float> m_bias;
+        float m_inputScale = 1.0f;
+        int m_inputZeroPoint = 0;
+    };
+}
+
+#endif //MINICNN_QUANTIZEDFULLYCONNECTEDLAYER_H
@@ -0,0 +1,112 @@
+//
+// Created by yang chen on 2018/4/24.
+//
+
+#ifndef MINICNN_SAMPLER_H
+#define MINICNN_SAMPLER_H
+
+#include <iosfwd>
+#include <random>
+#include <string>
+#include <vector>
+#include "Dataset.h"
+
+namespace MiniCNN
+{
+    // 数据集上的下标序列：每个epoch开始时调用nextEpoch()重新生成下标，按batch取出下标后由Dataset::fillBatch读取样本，
+    // 样本本身不复制也不移动。随机数来自create_random_engine(stream)，设置全局种子后序列是确定的
+    class Sampler
+    {
+    public:
+        virtual ~Sampler();
+
+    public:
+        virtual void nextEpoch() = 0;
+        inline const std::vector<unsigned int>& getIndices() const { return m_indices; }
+        inline unsigned int size() const { return (unsigned int)m_indices.size(); }
+        // 每batch个下标一组，最后一组可以不足
+        inline unsigned int getBatches(const unsigned int batch) const { return (size() + batch - 1) / batch; }
+        // 第batchIdx组的下标，返回数量，0表示没有数据
+        unsigned int getBatch(const unsigned int batchIdx, const unsigned int batch, const unsigned int*& indices) const;
+        // 当前的下标序列和随机数引擎的状态（文本），用于从checkpoint继续训练。恢复时下标的数量必须相同，失败时状态不变
+        std::string saveState() const;
+        bool loadState(const std::string& state);
+
+    protected:
+        virtual void saveEngine(std::ostream& os) const {}
+        virtual bool loadEngine(std::istream& is) { return true; }
+
+    protected:
+        std::vector<unsigned int> m_indices;
+    };
+
+    // 按给定的顺序，不指定时为0, 1, ..., count-1
+    class SequentialSampler : public Sampler
+    {
+    public:
+        explicit SequentialSampler(const unsigned int count);
+        explicit SequentialSampler(std::vector<unsigned int> indices);
+
+    public:
+        virtual void nextEpoch() override {}
+    };
+
+    // 每个epoch对下标做一次均匀的随机排列（无放回）
+    class RandomSampler : public Sampler
+    {
+    public:
+        RandomSampler(const unsigned int count, const unsigned int stream);
+        RandomSampler(std::vector<unsigned int> indices, const unsigned int stream);
+
+    public:
+        virtual void nextEpoch() override;
+
+    protected:
+        virtual void saveEngine(std::ostream& os) const override;
+        virtual bool loadEngine(std::istream& is) override;
+
+    private:
+        std::mt19937 m_engine;
+    };
+
+    // 每个epoch按权重有放回地抽取samples个下标，weights与population一一对应且不能全为0
+    class WeightedSampler : public Sampler
+    {
+    public:
+        // weights与population的数量不同、有负数或非有限值、或全为0时isValid()为false，不产生任何下标
+        WeightedSampler(std::vector<unsigned int> population, const std::vector<double>& weights,
+                        const unsigned int samples, const unsigned int stream);
+
+    public:
+        virtual void nextEpoch() override;
+        inline bool isValid() const { return m_valid; }
+
+    protected:
+        virtual void saveEngine(std::ostream& os) const override;
+        virtual bool loadEngine(std::istream& is) override;
+
+    private:
+        std::vector<unsigned int> m_population;
+        std::discrete_distribution<unsigned int> m_distribution;
+        std::mt19937 m_engine;
+        bool m_valid = false;
+    };
+
+    // 类别均衡：每个样本的权重为其类别样本数的倒数，各个（非空的）类别被抽到的概率相同
+    class ClassBalancedSampler : public WeightedSampler
+    {
+    public:
+        ClassBalancedSampler(const Dataset& dataset, std::vector<unsigned int> population,
+                             const unsigned int samples, const unsigned int stream);
+
+    private:
+        static std::vector<double> classBalancedWeights(const Dataset& dataset, const std::vector<unsigned int>& population);
+    };
+
+    // 分层划分：每个类别各自随机取round(count * validateRatio)个样本作为验证集，其余为训练集，
+    // 两边的类别比例与整个数据集一致。结果为升序的下标
+    void stratified_split(const Dataset& dataset, const float validateRatio, const unsigned int stream,
+                          std::vector<unsigned int>& trainIndices, std::vector<unsigned int>& validateIndices);
+}
+
+#endif //MINICNN_SAMPLER_H
@@ -0,0 +1,95 @@
+//
+// Created by yang chen on 2018/4/28.
+//
+
+#ifndef MINICNN_SHARDEDREADER_H
+#define MINICNN_SHARDEDREADER_H
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "Tensor.h"
+
+namespace MiniCNN
+{
+    class CompressedInput;
+
+    // 流式读取分成多个分片的IDX数据集（每个分片一对images/labels文件，可以是gzip压缩的），数据集可以比内存大：
+    // 每个epoch按随机的顺序依次读取各个分片，每次经CompressedInput读chunkSamples个样本，
+    // 样本先进入容量固定的shuffle buffer，再从中随机取出。每个样本每个epoch恰好出现一次，
+    // 占用的内存只由chunkSamples、bufferSamples和解压缓冲决定，与数据集的大小无关。
+    // 未压缩的分片在Linux上给内核预读提示：打开分片时POSIX_FADV_SEQUENTIAL；每读完一块，
+    // 对下一块的范围POSIX_FADV_WILLNEED，对已经读过的范围POSIX_FADV_DONTNEED，page cache也不随数据集增长
+    class ShardedReader
+    {
+    public:
+        ShardedReader();
+        virtual ~ShardedReader();
+
+    public:
+        // path为manifest文件（每行"<images文件> <labels文件>"，相对manifest所在的目录，#开头为注释），
+        // 或目录（按文件名排序，xxx-images-idx3-ubyte与xxx-labels-idx1-ubyte配对）。只读取各分片的文件头，
+        // 文件头不合法、images与labels的数量不同、样本的形状不一致时返回false
+        bool open(const std::string& path, const unsigned int classes, const unsigned int chunkSamples = 4096,
+                  const unsigned int bufferSamples = 16384, const unsigned int stream = 0);
+        // 开始新的epoch：重新打乱分片的顺序，清空buffer
+        void startEpoch();
+        // 把下一批样本缩放到0~1写入inputTensor，label按one-hot写入labelTensor（可以为空），
+        // 返回写入的数量（不超过tensor的batch），0表示这个epoch已经结束
+        unsigned int nextBatch(Tensor& inputTensor, Tensor* labelTensor);
+        // 分片在打开之后无法读取、被截断或label超出classes时，不再读取后面的分片，这个epoch提前结束，直到下一次startEpoch
+        inline bool isFailed() const { return m_failed; }
+
+        inline uint64_t size() const { return m_size; }
+        inline unsigned int getShards() const { return (unsigned int)m_shards.size(); }
+        inline unsigned int getClasses() const { return m_classes; }
+        // Batch为1
+        inline Shape getSampleShape() const { return m_sampleShape; }
+        // chunk和shuffle buffer占用的内存，不包括CompressedInput的解压缓冲
+        size_t getMemoryBytes() const;
+
+    private:
+        struct Shard
+        {
+            std::string imagesPath;
+            std::string labelsPath;
+            uint64_t count = 0;
+        };
+
+        bool addShard(const std::string& imagesPath, const std::string& labelsPath);
+        // 读取下一块，当前分片读完时打开下一个分片，这个epoch的数据都读完或者读取失败时返回false
+        bool readChunk();
+        // 从chunk中取出下一个样本，没有数据时返回nullptr
+        const uint8_t* pullSample(uint8_t& label);
+
+    private:
+        std::vector<Shard> m_shards;
+        Shape m_sampleShape;
+        unsigned int m_classes = 0;
+        uint64_t m_size = 0;
+        unsigned int m_chunkSamples = 0;
+        unsigned int m_bufferSamples = 0;
+        unsigned int m_stream = 0;
+
+        unsigned int m_epoch = 0;
+        std::mt19937 m_engine;
+        std::vector<unsigned int> m_shardOrder;
+        unsigned int m_nextShard = 0;
+        std::unique_ptr<CompressedInput> m_imagesInput;
+        std::unique_ptr<CompressedInput> m_labelsInput;
+        uint64_t m_shardRemaining = 0;
+        bool m_failed = false;
+
+        std::vector<uint8_t> m_chunkImages;
+        std::vector<uint8_t> m_chunkLabels;
+        unsigned int m_chunkCount = 0;
+        unsigned int m_chunkPos = 0;
+        std::vector<uint8_t> m_bufferImages;
+        std::vector<uint8_t> m_bufferLabels;
+        unsigned int m_bufferCount = 0;
+    };
+}
+
+#endif //MINICNN_SHARDEDREADER_H
@@ -20,6 +20,7 @@ namespace MiniCNN
     protected:
         DECLARE_LAYER_TYPE;
         virtual std::string getLayerType() const override;
+        virtual bool needOutputInBackward() const override { return true; }
         virtual void forward(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next) override;
         virtual void backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
                               std::shared_ptr<Tensor>& prevGrad, const std::shared_ptr<Tensor>& nextGrad) override;
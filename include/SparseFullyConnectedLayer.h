@@ -0,0 +1,52 @@
+//
+// Created by yang chen on 2018/4/8.
+//
+
+#ifndef MINICNN_SPARSEFULLYCONNECTEDLAYER_H
+#define MINICNN_SPARSEFULLYCONNECTEDLAYER_H
+
+#include "Layer.h"
+#include "CalcFunctions.h"
+
+namespace MiniCNN
+{
+    // 裁剪后的全连接层，只保存非零的weights，只用于推理，由Network::sparsify生成。
+    // 每m_blockRows个输出为一组，组内按输入下标记录非零的m_blockRows×1块（m_blockRows为1时就是CSR）
+    class SparseFullyConnectedLayer : public Layer
+    {
+        FRIEND_WITH_NETWORK
+
+    public:
+        SparseFullyConnectedLayer();
+        virtual ~SparseFullyConnectedLayer();
+
+    public:
+        // weight、bias与FullyConnectedLayer的格式一致，全为0的块不保存
+        void setParameters(const Shape paramShape, const bool enableBias, const ActivationType activation,
+                           const Tensor& weight, const std::shared_ptr<Tensor> bias, const unsigned int blockRows);
+        // 非零块中的weights占全部weights的比例
+        float getDensity() const;
+
+    protected:
+        DECLARE_LAYER_TYPE;
+        virtual void forward(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next) override;
+        virtual void backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
+                              std::shared_ptr<Tensor>& prevGrad, const std::shared_ptr<Tensor>& nextGrad) override;
+        virtual void solveInnerParams() override;
+        virtual std::string getLayerType() const override;
+        virtual std::string save() const override;
+        virtual bool load(const std::string content) override;
+
+    private:
+        Shape m_paramShape;
+        bool m_enableBias = false;
+        ActivationType m_activation = ActivationType::NONE;
+        unsigned int m_blockRows = 1;
+        std::vector<unsigned int> m_blockRowPtr;
+        std::vector<unsigned int> m_blockCol;
+        std::vector<float> m_values;
+        std::vector<float> m_bias;
+    };
+}
+
+#endif //MINICNN_SPARSEFULLYCONNECTEDLAYER_H
@@ -5,10 +5,15 @@
 #ifndef MINICNN_TENSOR_H
 #define MINICNN_TENSOR_H
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 
 namespace MiniCNN
 {
+    // tensor的存储类型，FP16/BF16每个元素占2个字节
+    enum class DataType { FP32, FP16, BF16 };
+
     class Shape
     {
     public:
@@ -48,20 +53,83 @@ namespace MiniCNN
         unsigned int Height = 0;
     };
 
+    // 各维相邻两个元素在存储中的间隔（元素个数），Row为相邻两行、Col为一行中相邻两个元素
+    class Strides
+    {
+    public:
+        Strides() = default;
+        Strides(unsigned int batch, unsigned int channels, unsigned int row, unsigned int col)
+                :Batch(batch), Channels(channels), Row(row), Col(col){}
+        // 按Batch、Channels、Height、Width的顺序紧密排列时的间隔
+        explicit Strides(const Shape& shape)
+                :Batch(shape.oneBatchSize()), Channels(shape.oneChannelSize()), Row(shape.Width), Col(1){}
+
+        inline size_t getOffset(const unsigned int inBatch, const unsigned int inChannels,
+                                const unsigned int inRow, const unsigned int inCol) const
+        {
+            return (size_t)inBatch * Batch + (size_t)inChannels * Channels + (size_t)inRow * Row + (size_t)inCol * Col;
+        }
+
+        unsigned int Batch = 0;
+        unsigned int Channels = 0;
+        unsigned int Row = 0;
+        unsigned int Col = 0;
+    };
+
+    // view与原tensor共用存储：getData()指向view的第一个元素，各维按getStrides()访问。
+    // 连续的view（isContiguous()）可以像普通tensor一样按getData()线性访问，各层的计算只接受连续的tensor
     class Tensor
     {
     public:
         Tensor(const Shape shape);
+        // 使用外部的存储（至少shape.totalSize()个float），多个tensor可以共用同一块内存
+        Tensor(const Shape shape, std::shared_ptr<float> storage);
+        // dataType为FP16/BF16时数据存放在getHalfData()中，getData()为空
+        Tensor(const Shape shape, const DataType dataType);
         virtual ~Tensor();
 
         inline Shape getShape() const { return m_shape; }
         inline std::shared_ptr<float> getData() const {return m_data; }
+        inline DataType getDataType() const { return m_dataType; }
+        inline std::shared_ptr<uint16_t> getHalfData() const { return m_halfData; }
+        inline size_t getElementSize() const { return m_dataType == DataType::FP32 ? sizeof(float) : sizeof(uint16_t); }
+        inline Strides getStrides() const { return m_strides; }
+        // 存储能容纳的元素个数，Batch变小时不释放
+        inline size_t getCapacity() const { return m_capacity; }
+        bool isContiguous() const;
         void setData(const float item);
-        void clone(Tensor& target);
+        // 改变Batch的大小，不超过容量时只修改shape，超过时重新分配存储（原有数据不保留）。只适用于连续的tensor
+        void resizeBatch(const unsigned int batch);
+        // 把数据按连续的排列拷贝到target，target的shape变为当前tensor的shape
+        void clone(Tensor& target) const;
+        // 从元素个数相同、类型任意的tensor转换数据，当前tensor需要是连续的
+        void convertFrom(const Tensor& source);
+
+        // 以下操作都返回共用存储的view，不拷贝数据；参数不合法时返回nullptr
+        // 第[batchBegin, batchEnd)个样本，连续的tensor得到的view仍然连续
+        std::shared_ptr<Tensor> slice(const unsigned int batchBegin, const unsigned int batchEnd) const;
+        // 第[channelBegin, channelEnd)个通道，不是全部通道且Batch > 1时得到的view不连续
+        std::shared_ptr<Tensor> sliceChannels(const unsigned int channelBegin, const unsigned int channelEnd) const;
+        // 元素总数不变时改变shape，只适用于连续的tensor
+        std::shared_ptr<Tensor> reshape(const Shape shape) const;
+        // 变为(Batch, Channels * Width * Height, 1, 1)
+        std::shared_ptr<Tensor> flatten() const;
+        // 连续时返回共用存储的view，否则拷贝为一个连续的新tensor
+        std::shared_ptr<Tensor> contiguous() const;
+
+    private:
+        Tensor(const Shape shape, const Strides strides, const DataType dataType,
+               std::shared_ptr<float> data, std::shared_ptr<uint16_t> halfData);
+        // 偏移offset个元素、使用新的shape和strides的view
+        std::shared_ptr<Tensor> createView(const size_t offset, const Shape shape, const Strides strides) const;
 
     private:
         Shape m_shape;
+        Strides m_strides;
+        size_t m_capacity = 0;
+        DataType m_dataType = DataType::FP32;
         std::shared_ptr<float> m_data;
+        std::shared_ptr<uint16_t> m_halfData;
     };
 }
 
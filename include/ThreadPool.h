@@ -19,28 +19,62 @@
 
 namespace MiniCNN
 {
+    // COMPACT: 依次占满一个NUMA node的cpu再使用下一个node
+    // SCATTER: worker轮流分布到各个node
+    // EXPLICIT: 使用指定的cpu列表
+    enum class AffinityPolicy { NONE, COMPACT, SCATTER, EXPLICIT };
+
+    // 每个NUMA node包含的cpu编号
+    struct CpuTopology
+    {
+        std::vector<std::vector<unsigned int>> nodeCpus;
+
+        inline unsigned int nodeCount() const { return (unsigned int)nodeCpus.size(); }
+        unsigned int cpuCount() const;
+        unsigned int nodeOfCpu(const unsigned int cpu) const;
+    };
+
     class ThreadPool
     {
     public:
         static ThreadPool& instance();
         unsigned int size() const;
         void resize(const unsigned int size);
+        void setAffinity(const AffinityPolicy policy, const std::vector<unsigned int>& cpus);
+        // 返回worker被绑定的NUMA node，未绑定时按worker编号均分到各node
+        unsigned int workerNode(const unsigned int workerIdx) const;
         template<class F, class... Args>
         auto enqueue(F&& f, Args&&... args)
         ->std::future<typename std::result_of<F(Args...)>::type>;
+        // 把任务交给指定的worker执行，保证同一块数据总是由同一个线程（同一个node）处理
+        template<class F, class... Args>
+        auto enqueueTo(const unsigned int workerIdx, F&& f, Args&&... args)
+        ->std::future<typename std::result_of<F(Args...)>::type>;
 
     private:
         ThreadPool(const unsigned int threads);
         virtual ~ThreadPool();
         void shutdown();
         void startup(const unsigned int threads);
+        void applyAffinity();
+        // 以下两个需要持有m_queueMutex：把一个空闲的worker（或指定的worker）移出空闲列表，
+        // 返回它的condition，由调用者在解锁后notify；没有空闲的worker（或指定的worker不在等待）时返回nullptr
+        std::condition_variable* takeIdleWorker();
+        std::condition_variable* takeWorker(const unsigned int workerIdx);
 
     private:
         std::vector<std::thread> m_workers;
         std::queue<std::function<void()>> m_tasks;
+        std::vector<std::queue<std::function<void()>>> m_workerTasks;
+        AffinityPolicy m_affinityPolicy = AffinityPolicy::NONE;
+        std::vector<unsigned int> m_affinityCpus;
+        std::vector<int> m_workerCpus;
 
         std::mutex m_queueMutex;
-        std::condition_variable m_condition;
+        // 每个worker等待自己的condition，enqueueTo只唤醒目标worker，enqueue只唤醒一个空闲的worker
+        std::vector<std::unique_ptr<std::condition_variable>> m_workerConditions;
+        // 正在等待的worker，后进先出，优先唤醒刚空闲、cache还热的worker
+        std::vector<unsigned int> m_idleWorkers;
         bool m_stop = true;
     };
 
@@ -52,6 +86,7 @@ namespace MiniCNN
                 (std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 
         std::future<return_tyep> res = task->get_future();
+        std::condition_variable* condition = nullptr;
         {
             std::unique_lock<std::mutex> lock(m_queueMutex);
 
@@ -59,15 +94,57 @@ namespace MiniCNN
                 throw std::runtime_error("enqueue on stopped ThreadPool");
 
             m_tasks.emplace([task](){(*task)();});
+            condition = takeIdleWorker();
+        }
+
+        // 没有空闲的worker时不需要唤醒，忙碌的worker在等待之前会先检查队列
+        if (condition)
+            condition->notify_one();
+        return res;
+    }
+
+    template<class F, class...Args>
+    auto ThreadPool::enqueueTo(const unsigned int workerIdx, F &&f, Args &&... args)->std::future<typename std::result_of<F(Args...)>::type>
+    {
+        using return_tyep = typename std::result_of<F(Args...)>::type;
+        auto task = std::make_shared<std::packaged_task<return_tyep()>>
+                (std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+
+        std::future<return_tyep> res = task->get_future();
+        std::condition_variable* condition = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(m_queueMutex);
+
+            if (m_stop)
+                throw std::runtime_error("enqueue on stopped ThreadPool");
+
+            const unsigned int target = workerIdx % (unsigned int)m_workerTasks.size();
+            m_workerTasks[target].emplace([task](){(*task)();});
+            condition = takeWorker(target);
         }
 
-        m_condition.notify_one();
+        // 只唤醒目标worker，其他worker不受影响
+        if (condition)
+            condition->notify_one();
         return res;
     }
 
 
     unsigned int get_thread_num();
     unsigned int set_thread_num(const unsigned int num);
+    // 环境变量MINICNN_NUM_THREADS，否则为硬件线程数
+    unsigned int get_default_thread_num();
+    // 环境变量MINICNN_AFFINITY（compact/scatter/none或者cpu列表如"0-3,8"）优先于此处的设置
+    void set_thread_affinity(const AffinityPolicy policy, const std::vector<unsigned int>& cpus = std::vector<unsigned int>());
+    const CpuTopology& get_cpu_topology();
+    unsigned int get_worker_node(const unsigned int workerIdx);
+    // serial = true时，当前线程调用dispatch_worker不再分发到线程池，用于自身已经是并行worker的线程
+    void set_serial_dispatch(const bool serial);
+    bool is_serial_dispatch();
+    // 确定性模式：所有并行归约使用只由数据长度决定的分块和合并顺序，结果与线程数无关，多次运行逐位相同。
+    // Hogwild式的AsyncTrainer本身依赖无锁竞争，不受此设置影响
+    void set_deterministic(const bool deterministic);
+    bool is_deterministic();
     void dispatch_worker(std::function<void(const unsigned int, const unsigned int)> func, const unsigned int number);
 }
 
@@ -7,6 +7,11 @@
 
 #include <vector>
 #include <cstdint>
+#include <string>
+#include "CompressedInput.h"
+#include "Dataset.h"
+
+// 以下读取函数都可以直接读取gzip压缩的文件（按文件内容判断），文件不存在时尝试同名的.gz文件
 
 struct image_t
 {
@@ -21,5 +26,16 @@ struct label_t
 };
 bool load_mnist_labels(const std::string& file_path, std::vector<label_t>& labels);
 
+// 读取IDX文件头：magic number和dims_count个维度的大小（大端），magic number不符或文件太短时返回false。
+// 图片为0x00000803（count、rows、cols），label为0x00000801（count）
+bool read_idx_header(MiniCNN::CompressedInput& input, const uint32_t expected_magic_number, uint32_t* dims,
+                     const int dims_count);
+
+// 图片和label直接读入连续的Dataset（10个类别），每个样本不再单独分配。
+// cache_dir不为空时先按源文件的hash查找预处理缓存，找到则直接映射；否则读取源文件并生成缓存，
+// 生成失败（如目录不存在）时仍返回读取的数据
+bool load_mnist_dataset(const std::string& images_file_path, const std::string& labels_file_path,
+                        MiniCNN::Dataset& dataset, const std::string& cache_dir = "");
+
 
 #endif //MINICNN_MNIST_DATA_LOADER_H
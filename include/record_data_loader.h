@@ -0,0 +1,43 @@
+//
+// Created by yang chen on 2018/4/30.
+//
+
+#ifndef MINICNN_RECORD_DATA_LOADER_H
+#define MINICNN_RECORD_DATA_LOADER_H
+
+#include <string>
+#include <vector>
+#include "Dataset.h"
+
+// 定长记录的格式：文件开头header_bytes个字节跳过，之后每条记录为label_bytes个字节的label，
+// 然后是channels×height×width（CHW，每个平面按行存放）的uint8样本。使用第label_index个label字节作为类别
+struct record_format_t
+{
+    unsigned int header_bytes = 0;
+    unsigned int label_bytes = 1;
+    unsigned int label_index = 0;
+    unsigned int channels = 0;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int classes = 0;
+};
+
+// 解析"header=0,labels=2,label_index=1,shape=3x32x32,classes=100"形式的格式说明，shape为CxHxW，
+// 未给出的项使用record_format_t的默认值，shape和classes必须给出
+bool parse_record_format(const std::string& spec, record_format_t& format);
+std::string record_format_to_string(const record_format_t& format);
+
+// 按顺序读取多个定长记录文件到一个连续的Dataset（可以是gzip压缩的，文件不存在时尝试同名的.gz文件），
+// 文件长度不是整数条记录或label超出classes时返回false。cache_dir的用法与load_mnist_dataset相同
+bool load_record_dataset(const std::vector<std::string>& file_paths, const record_format_t& format,
+                         MiniCNN::Dataset& dataset, const std::string& cache_dir = "");
+
+// CIFAR-10二进制格式（data_batch_1.bin等）：每条记录1个label字节和3×32×32的样本
+bool load_cifar10_dataset(const std::vector<std::string>& file_paths, MiniCNN::Dataset& dataset,
+                          const std::string& cache_dir = "");
+// CIFAR-100二进制格式（train.bin、test.bin）：每条记录依次为粗类、细类两个label字节，
+// fine_labels为true时使用100个细类，否则使用20个粗类
+bool load_cifar100_dataset(const std::vector<std::string>& file_paths, const bool fine_labels,
+                           MiniCNN::Dataset& dataset, const std::string& cache_dir = "");
+
+#endif //MINICNN_RECORD_DATA_LOADER_H
@@ -1,10 +1,65 @@
 #include <iostream>
+#include <string>
 extern int mnist_main();
+extern int mnist_hogwild_main();
+extern int mnist_quantize_main();
+extern int mnist_prune_main();
+extern int mnist_factorize_main();
+extern int mnist_codegen_main();
+extern int mnist_deterministic_main();
+extern int mnist_stream_main();
+extern int mnist_compress_main();
+extern int mnist_checkpoint_main();
+extern int cifar_main();
 
-int main() {
+int main(int argc, char* argv[]) {
     std::cout << "start!" << std::endl;
 
-    mnist_main();
+    const std::string mode = argc > 1 ? argv[1] : "train";
+    if (mode == "hogwild")
+    {
+        mnist_hogwild_main();
+    }
+    else if (mode == "quantize")
+    {
+        mnist_quantize_main();
+    }
+    else if (mode == "prune")
+    {
+        mnist_prune_main();
+    }
+    else if (mode == "factorize")
+    {
+        mnist_factorize_main();
+    }
+    else if (mode == "codegen")
+    {
+        mnist_codegen_main();
+    }
+    else if (mode == "deterministic")
+    {
+        mnist_deterministic_main();
+    }
+    else if (mode == "stream")
+    {
+        mnist_stream_main();
+    }
+    else if (mode == "compress")
+    {
+        mnist_compress_main();
+    }
+    else if (mode == "checkpoint")
+    {
+        mnist_checkpoint_main();
+    }
+    else if (mode == "cifar")
+    {
+        cifar_main();
+    }
+    else
+    {
+        mnist_main();
+    }
 
     std::cout << "finish!" << std::endl;
     return 0;
@@ -8,6 +8,32 @@
 
 namespace MiniCNN
 {
+    std::string activation_layer_type(const ActivationType activation)
+    {
+        switch (activation)
+        {
+            case ActivationType::RELU:
+                return ReluLayer::layerType;
+            case ActivationType::SIGMOID:
+                return SigmoidLayer::layerType;
+            default:
+                return "";
+        }
+    }
+
+    ActivationType activation_from_layer_type(const std::string& layerType)
+    {
+        if (layerType == ReluLayer::layerType)
+        {
+            return ActivationType::RELU;
+        }
+        if (layerType == SigmoidLayer::layerType)
+        {
+            return ActivationType::SIGMOID;
+        }
+        return ActivationType::NONE;
+    }
+
     SigmoidLayer::SigmoidLayer() {}
     SigmoidLayer::~SigmoidLayer() {}
 
@@ -36,26 +62,20 @@ namespace MiniCNN
     void SigmoidLayer::backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
                                 std::shared_ptr<Tensor> &prevGrad, const std::shared_ptr<Tensor> &nextGrad)
     {
-        const Shape prevLayerShape = prev->getShape();
         const Shape nextLayerShape = next->getShape();
-        const float* prevData = prev->getData().get();
-        float* nextData = next->getData().get();
-
-        const Shape prevGradShape = prevGrad->getShape();
-        const Shape nextGradShape = nextGrad->getShape();
+        const float* nextData = next->getData().get();
         float* prevGradData = prevGrad->getData().get();
         const float* nextGradData = nextGrad->getData().get();
 
-        prevGrad->setData(0.0f);
+        // prevGrad与nextGrad可以是同一个tensor（in-place）
         auto worker = [&](const unsigned int start, const unsigned int end)
         {
-            const unsigned int offset = start * prevLayerShape.oneBatchSize();
-            const unsigned int totalSize = (end - start) * prevLayerShape.oneBatchSize();
-
-            df_sigmoid(nextData + offset, prevGradData + offset, totalSize);
-            mul_inplace(prevGradData + offset, nextGradData + offset, totalSize);
+            const unsigned int offset = start * nextLayerShape.oneBatchSize();
+            const unsigned int totalSize = (end - start) * nextLayerShape.oneBatchSize();
+            activation_delta(nextData + offset, nextGradData + offset, prevGradData + offset, totalSize,
+                             ActivationType::SIGMOID);
         };
-        dispatch_worker(worker, prevLayerShape.Batch);
+        dispatch_worker(worker, nextLayerShape.Batch);
     }
 
     ReluLayer::ReluLayer() {}
@@ -86,25 +106,19 @@ namespace MiniCNN
     void ReluLayer::backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
                                 std::shared_ptr<Tensor> &prevGrad, const std::shared_ptr<Tensor> &nextGrad)
     {
-        const Shape prevLayerShape = prev->getShape();
         const Shape nextLayerShape = next->getShape();
-        const float* prevData = prev->getData().get();
-        float* nextData = next->getData().get();
-
-        const Shape prevGradShape = prevGrad->getShape();
-        const Shape nextGradShape = nextGrad->getShape();
+        const float* nextData = next->getData().get();
         float* prevGradData = prevGrad->getData().get();
         const float* nextGradData = nextGrad->getData().get();
 
-        prevGrad->setData(0.0f);
+        // prevGrad与nextGrad可以是同一个tensor（in-place）
         auto worker = [&](const unsigned int start, const unsigned int end)
         {
-            const unsigned int offset = start * prevLayerShape.oneBatchSize();
-            const unsigned int totalSize = (end - start) * prevLayerShape.oneBatchSize();
-
-            df_relu(nextData + offset, prevGradData + offset, totalSize);
-            mul_inplace(prevGradData + offset, nextGradData + offset, totalSize);
+            const unsigned int offset = start * nextLayerShape.oneBatchSize();
+            const unsigned int totalSize = (end - start) * nextLayerShape.oneBatchSize();
+            activation_delta(nextData + offset, nextGradData + offset, prevGradData + offset, totalSize,
+                             ActivationType::RELU);
         };
-        dispatch_worker(worker, prevLayerShape.Batch);
+        dispatch_worker(worker, nextLayerShape.Batch);
     }
 }
\ No newline at end of file
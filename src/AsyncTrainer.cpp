@@ -0,0 +1,130 @@
+//
+// Created by yang chen on 2018/4/2.
+//
+
+#include <algorithm>
+#include <thread>
+#include "../include/AsyncTrainer.h"
+#include "../include/ThreadPool.h"
+
+namespace MiniCNN
+{
+    AsyncTrainer::AsyncTrainer(Network& network, const unsigned int workers, const float lr)
+            : m_network(network), m_nextBatch(0), m_skippedUpdates(0)
+    {
+        const unsigned int workerNum = std::max(workers, 1u);
+        const Shape inputShape = m_network.m_data[0]->getShape();
+        const Shape labelShape = m_network.m_data[m_network.m_data.size() - 1]->getShape();
+
+        for (unsigned int i = 0; i < workerNum; i++)
+        {
+            m_replicas.push_back(m_network.createReplica());
+            m_optimizers.push_back(std::make_shared<SGD>(lr));
+            m_inputTensors.push_back(std::make_shared<Tensor>(inputShape));
+            m_labelTensors.push_back(std::make_shared<Tensor>(labelShape));
+        }
+        m_workerLoss.resize(workerNum, 0.0f);
+        m_workerBatches.resize(workerNum, 0);
+
+        m_layerVersions.reset(new std::atomic<unsigned long>[m_network.m_layers.size()]);
+        for (unsigned int i = 0; i < m_network.m_layers.size(); i++)
+        {
+            m_layerVersions[i].store(0);
+        }
+    }
+
+    AsyncTrainer::~AsyncTrainer() {}
+
+    void AsyncTrainer::setLearningRate(const float lr)
+    {
+        for (auto& optimizer : m_optimizers)
+        {
+            optimizer->setLearningRate(lr);
+        }
+    }
+
+    void AsyncTrainer::setMaxStaleness(const unsigned int maxStaleness)
+    {
+        m_maxStaleness = maxStaleness;
+    }
+
+    float AsyncTrainer::trainBatches(BatchFetcher fetcher, const unsigned int batches)
+    {
+        m_nextBatch.store(0);
+        std::fill(m_workerLoss.begin(), m_workerLoss.end(), 0.0f);
+        std::fill(m_workerBatches.begin(), m_workerBatches.end(), 0);
+
+        std::vector<std::thread> threads;
+        for (unsigned int i = 0; i < m_replicas.size(); i++)
+        {
+            threads.emplace_back(&AsyncTrainer::workerLoop, this, i, std::ref(fetcher), batches);
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        float loss = 0.0f;
+        unsigned int trainedBatches = 0;
+        for (unsigned int i = 0; i < m_replicas.size(); i++)
+        {
+            loss += m_workerLoss[i];
+            trainedBatches += m_workerBatches[i];
+        }
+        return trainedBatches > 0 ? loss / trainedBatches : 0.0f;
+    }
+
+    void AsyncTrainer::workerLoop(const unsigned int workerIdx, BatchFetcher& fetcher, const unsigned int batches)
+    {
+        // 每个worker本身就是一路并行，层内的计算不再分发到线程池
+        set_serial_dispatch(true);
+
+        Network& replica = *m_replicas[workerIdx];
+        SGD& optimizer = *m_optimizers[workerIdx];
+        const unsigned int layerNum = (unsigned int)replica.m_layers.size();
+        std::vector<unsigned long> readVersions(layerNum, 0);
+
+        while (true)
+        {
+            const unsigned int batchIdx = m_nextBatch.fetch_add(1);
+            if (batchIdx >= batches)
+            {
+                break;
+            }
+            if (!fetcher(batchIdx, m_inputTensors[workerIdx], m_labelTensors[workerIdx]))
+            {
+                continue;
+            }
+
+            // 记录forward开始时每层参数的版本号
+            for (unsigned int i = 0; i < layerNum; i++)
+            {
+                readVersions[i] = m_layerVersions[i].load(std::memory_order_relaxed);
+            }
+
+            replica.setState(State::TRAIN);
+            replica.forward(m_inputTensors[workerIdx]);
+            m_workerLoss[workerIdx] += replica.backward(m_labelTensors[workerIdx]);
+            m_workerBatches[workerIdx]++;
+
+            // 不加锁直接更新共享参数
+            for (unsigned int i = 0; i < layerNum; i++)
+            {
+                if (!replica.hasParams(i))
+                {
+                    continue;
+                }
+                if (m_maxStaleness > 0 &&
+                    m_layerVersions[i].load(std::memory_order_relaxed) - readVersions[i] > m_maxStaleness)
+                {
+                    m_skippedUpdates.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                replica.updateLayer(i, optimizer);
+                m_layerVersions[i].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        set_serial_dispatch(false);
+    }
+}
@@ -0,0 +1,432 @@
+//
+// Created by yang chen on 2018/4/26.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include "../include/Augmentation.h"
+#include "../include/CalcFunctions.h"
+
+namespace MiniCNN
+{
+    // 32位整数的混合函数（lowbias32），相邻的计数器得到不相关的结果
+    static inline uint32_t hash32(uint32_t x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    // 由计数器生成的近似标准正态噪声：第i个值为(key, i)散列出的4个16位均匀数之和（Irwin-Hall，范围约±3.46），
+    // 减去均值后按标准差归一化。每个值只依赖key和i，循环可以向量化
+    static void counter_normal_noise(const uint32_t key, float* noise, const unsigned int n)
+    {
+        const uint32_t base = hash32(key);
+        const float scale = std::sqrt(3.0f) / 65536.0f;
+        for (unsigned int i = 0; i < n; i++)
+        {
+            const uint32_t h1 = hash32(base + 2 * i);
+            const uint32_t h2 = hash32(base + 2 * i + 1);
+            const uint32_t sum = (h1 & 0xffff) + (h1 >> 16) + (h2 & 0xffff) + (h2 >> 16);
+            noise[i] = ((float)sum - 131070.0f) * scale;
+        }
+    }
+
+    ImageAugmenter::ImageAugmenter(const AugmentationConfig& config, const Shape& sampleShape)
+            : m_config(config), m_channels(sampleShape.Channels), m_width(sampleShape.Width), m_height(sampleShape.Height)
+    {
+        const unsigned int planeSize = m_width * m_height;
+        m_padded.resize((m_width + 2) * (m_height + 2), 0.0f);
+        m_srcX.resize(m_width);
+        m_srcY.resize(m_width);
+
+        if (m_config.elasticAlpha > 0.0f && m_config.elasticSigma > 0.0f)
+        {
+            const int radius = std::min((int)std::ceil(m_config.elasticSigma * 3.0f), (int)std::max(m_width, m_height));
+            m_kernel.resize(2 * radius + 1);
+            float sum = 0.0f;
+            for (int i = -radius; i <= radius; i++)
+            {
+                m_kernel[i + radius] = std::exp(-0.5f * i * i / (m_config.elasticSigma * m_config.elasticSigma));
+                sum += m_kernel[i + radius];
+            }
+            for (auto& weight : m_kernel)
+            {
+                weight /= sum;
+            }
+            m_dx.resize(planeSize);
+            m_dy.resize(planeSize);
+            m_blurBuffer.resize(planeSize);
+        }
+
+        if (m_config.noiseStddev > 0.0f)
+        {
+            m_noise.resize(planeSize * m_channels);
+        }
+    }
+
+    void ImageAugmenter::gaussianBlur(float* field)
+    {
+        // 可分离的高斯核，图片外按0处理；两个方向都是整行的乘加
+        const int radius = (int)m_kernel.size() / 2;
+        const int width = (int)m_width;
+        const int height = (int)m_height;
+        float* tmp = &m_blurBuffer[0];
+        std::fill(m_blurBuffer.begin(), m_blurBuffer.end(), 0.0f);
+        for (int y = 0; y < height; y++)
+        {
+            const float* in = field + y * width;
+            float* out = tmp + y * width;
+            for (int j = -radius; j <= radius; j++)
+            {
+                const float weight = m_kernel[j + radius];
+                const int begin = std::max(0, -j);
+                const int end = std::min(width, width - j);
+                for (int x = begin; x < end; x++)
+                {
+                    out[x] += weight * in[x + j];
+                }
+            }
+        }
+        std::fill(field, field + width * height, 0.0f);
+        for (int y = 0; y < height; y++)
+        {
+            float* out = field + y * width;
+            const int begin = std::max(-radius, -y);
+            const int end = std::min(radius, height - 1 - y);
+            for (int j = begin; j <= end; j++)
+            {
+                const float weight = m_kernel[j + radius];
+                const float* in = tmp + (y + j) * width;
+                for (int x = 0; x < width; x++)
+                {
+                    out[x] += weight * in[x];
+                }
+            }
+        }
+    }
+
+    void ImageAugmenter::elasticField(std::mt19937& engine)
+    {
+        std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+        for (auto& d : m_dx)
+        {
+            d = dist(engine);
+        }
+        for (auto& d : m_dy)
+        {
+            d = dist(engine);
+        }
+        gaussianBlur(&m_dx[0]);
+        gaussianBlur(&m_dy[0]);
+        const float alpha = m_config.elasticAlpha;
+        for (size_t i = 0; i < m_dx.size(); i++)
+        {
+            m_dx[i] *= alpha;
+            m_dy[i] *= alpha;
+        }
+    }
+
+    void ImageAugmenter::augment(const uint8_t* src, uint8_t* dst, std::mt19937& engine)
+    {
+        // 随机数按固定的顺序抽取，同一个引擎得到同样的结果
+        float shiftX = 0.0f, shiftY = 0.0f, angle = 0.0f;
+        if (m_config.cropPadding > 0)
+        {
+            std::uniform_int_distribution<int> dist(-(int)m_config.cropPadding, (int)m_config.cropPadding);
+            shiftX += (float)dist(engine);
+            shiftY += (float)dist(engine);
+        }
+        if (m_config.maxTranslate > 0.0f)
+        {
+            std::uniform_real_distribution<float> dist(-m_config.maxTranslate, m_config.maxTranslate);
+            shiftX += dist(engine);
+            shiftY += dist(engine);
+        }
+        if (m_config.maxRotation > 0.0f)
+        {
+            std::uniform_real_distribution<float> dist(-m_config.maxRotation, m_config.maxRotation);
+            angle = dist(engine) * 3.14159265358979f / 180.0f;
+        }
+        const bool elastic = !m_dx.empty();
+        if (elastic)
+        {
+            elasticField(engine);
+        }
+        const float* noise = nullptr;
+        const float noiseScale = m_config.noiseStddev;
+        const unsigned int planeSize = m_width * m_height;
+        if (!m_noise.empty())
+        {
+            // 每个样本的噪声都是新生成的，由引擎给出计数器的key
+            counter_normal_noise((uint32_t)engine(), &m_noise[0], (unsigned int)m_noise.size());
+            noise = &m_noise[0];
+        }
+
+        // 输出(x, y)对应的原图坐标：绕中心反向旋转再减去平移，然后加上弹性位移
+        const float cosAngle = std::cos(angle);
+        const float sinAngle = std::sin(angle);
+        const float centerX = (m_width - 1) * 0.5f;
+        const float centerY = (m_height - 1) * 0.5f;
+        const bool geometric = shiftX != 0.0f || shiftY != 0.0f || angle != 0.0f || elastic;
+        const unsigned int paddedWidth = m_width + 2;
+
+        for (unsigned int c = 0; c < m_channels; c++)
+        {
+            const uint8_t* srcPlane = src + c * planeSize;
+            uint8_t* dstPlane = dst + c * planeSize;
+            const float* planeNoise = noise != nullptr ? noise + c * planeSize : nullptr;
+            if (!geometric)
+            {
+                for (unsigned int i = 0; i < planeSize; i++)
+                {
+                    const float value = (float)srcPlane[i] + (planeNoise != nullptr ? planeNoise[i] * noiseScale : 0.0f);
+                    dstPlane[i] = (uint8_t)std::min(std::max(value + 0.5f, 0.0f), 255.0f);
+                }
+                continue;
+            }
+
+            for (unsigned int y = 0; y < m_height; y++)
+            {
+                float* paddedRow = &m_padded[(y + 1) * paddedWidth + 1];
+                const uint8_t* srcRow = srcPlane + y * m_width;
+                for (unsigned int x = 0; x < m_width; x++)
+                {
+                    paddedRow[x] = (float)srcRow[x];
+                }
+            }
+
+            for (unsigned int y = 0; y < m_height; y++)
+            {
+                float* srcX = &m_srcX[0];
+                float* srcY = &m_srcY[0];
+                const float v = (float)y - centerY;
+                const float baseX = sinAngle * v + centerX - shiftX - cosAngle * centerX;
+                const float baseY = cosAngle * v + centerY - shiftY + sinAngle * centerX;
+                for (unsigned int x = 0; x < m_width; x++)
+                {
+                    srcX[x] = cosAngle * (float)x + baseX;
+                    srcY[x] = -sinAngle * (float)x + baseY;
+                }
+                if (elastic)
+                {
+                    const float* dx = &m_dx[y * m_width];
+                    const float* dy = &m_dy[y * m_width];
+                    for (unsigned int x = 0; x < m_width; x++)
+                    {
+                        srcX[x] += dx[x];
+                        srcY[x] += dy[x];
+                    }
+                }
+
+                uint8_t* dstRow = dstPlane + y * m_width;
+                const float* rowNoise = planeNoise != nullptr ? planeNoise + y * m_width : nullptr;
+                for (unsigned int x = 0; x < m_width; x++)
+                {
+                    const float sx = srcX[x];
+                    const float sy = srcY[x];
+                    float value = 0.0f;
+                    // 补边之后[-1, width)内的坐标四个相邻像素都在padded中
+                    if (sx > -1.0f && sy > -1.0f && sx < (float)m_width && sy < (float)m_height)
+                    {
+                        const float fx0 = std::floor(sx);
+                        const float fy0 = std::floor(sy);
+                        const float fx = sx - fx0;
+                        const float fy = sy - fy0;
+                        const float* p = &m_padded[((int)fy0 + 1) * paddedWidth + (int)fx0 + 1];
+                        const float top = p[0] + (p[1] - p[0]) * fx;
+                        const float bottom = p[paddedWidth] + (p[paddedWidth + 1] - p[paddedWidth]) * fx;
+                        value = top + (bottom - top) * fy;
+                    }
+                    if (rowNoise != nullptr)
+                    {
+                        value += rowNoise[x] * noiseScale;
+                    }
+                    dstRow[x] = (uint8_t)std::min(std::max(value + 0.5f, 0.0f), 255.0f);
+                }
+            }
+        }
+    }
+
+    AugmentedLoader::AugmentedLoader(const Dataset& dataset, Sampler& sampler, const unsigned int batch,
+                                     const AugmentationConfig& config, const unsigned int stream,
+                                     const unsigned int workers, const unsigned int prefetch)
+            : m_dataset(dataset), m_sampler(sampler), m_batch(std::max(batch, 1u)), m_config(config), m_stream(stream)
+    {
+        // 从预处理缓存加载的Dataset只有float样本，不能增强
+        m_valid = dataset.size() > 0 && dataset.getSample(0) != nullptr;
+        if (!m_valid)
+        {
+            return;
+        }
+        const unsigned int workerCount = std::max(workers, 1u);
+        Shape inputShape = m_dataset.getSampleShape();
+        inputShape.Batch = m_batch;
+        m_slots.resize(prefetch > 0 ? prefetch : 2 * workerCount);
+        for (auto& slot : m_slots)
+        {
+            slot.inputTensor = std::make_shared<Tensor>(inputShape);
+            slot.labelTensor = std::make_shared<Tensor>(Shape(m_batch, m_dataset.getClasses(), 1, 1));
+        }
+        m_stats.workers = workerCount;
+        for (unsigned int i = 0; i < workerCount; i++)
+        {
+            m_threads.emplace_back(&AugmentedLoader::workerLoop, this);
+        }
+    }
+
+    AugmentedLoader::~AugmentedLoader()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_workerCondition.notify_all();
+        for (auto& thread : m_threads)
+        {
+            thread.join();
+        }
+    }
+
+    void AugmentedLoader::startEpoch()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        const unsigned int epoch = m_epoch + 1;
+        lock.unlock();
+        beginEpoch(true, epoch, 0);
+    }
+
+    void AugmentedLoader::resumeEpoch(const unsigned int epoch, const unsigned int firstBatch)
+    {
+        beginEpoch(false, epoch, firstBatch);
+    }
+
+    unsigned int AugmentedLoader::getEpoch()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_epoch;
+    }
+
+    void AugmentedLoader::beginEpoch(const bool advanceSampler, const unsigned int epoch, const unsigned int firstBatch)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // 停止领取，等正在处理的batch完成后才能修改sampler
+        m_batches = 0;
+        m_readyCondition.wait(lock, [this]() { return m_inFlight == 0; });
+        if (advanceSampler)
+        {
+            m_sampler.nextEpoch();
+        }
+        for (auto& slot : m_slots)
+        {
+            slot.ready = false;
+        }
+        m_epoch = epoch;
+        m_nextBatch = firstBatch;
+        m_consumeBatch = firstBatch;
+        m_released = firstBatch;
+        m_batches = m_valid ? m_sampler.getBatches(m_batch) : 0;
+        lock.unlock();
+        m_workerCondition.notify_all();
+    }
+
+    unsigned int AugmentedLoader::nextBatch(std::shared_ptr<Tensor>& inputTensor, std::shared_ptr<Tensor>& labelTensor)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_consumeBatch >= m_batches)
+        {
+            return 0;
+        }
+        // 交还上一个batch，它的slot可以被重新使用
+        m_released = m_consumeBatch;
+        m_workerCondition.notify_all();
+
+        Slot& slot = m_slots[m_consumeBatch % m_slots.size()];
+        const auto begin = std::chrono::steady_clock::now();
+        m_readyCondition.wait(lock, [&]() { return slot.ready && slot.batchIdx == m_consumeBatch; });
+        m_stats.waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        slot.ready = false;
+        m_consumeBatch++;
+
+        const unsigned int count = slot.count;
+        inputTensor = count == m_batch ? slot.inputTensor : slot.inputTensor->slice(0, count);
+        labelTensor = count == m_batch ? slot.labelTensor : slot.labelTensor->slice(0, count);
+        return count;
+    }
+
+    AugmentationStats AugmentedLoader::getStats()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+    void AugmentedLoader::resetStats()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        const unsigned int workers = m_stats.workers;
+        m_stats = AugmentationStats();
+        m_stats.workers = workers;
+    }
+
+    void AugmentedLoader::workerLoop()
+    {
+        ImageAugmenter augmenter(m_config, m_dataset.getSampleShape());
+        std::vector<uint8_t> buffer(m_dataset.getSampleSize());
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true)
+        {
+            // 第b个batch使用第b % slots个slot，上一次使用它的是第b - slots个batch，需要已经交还
+            m_workerCondition.wait(lock, [this]()
+            {
+                return m_stop || (m_nextBatch < m_batches && m_nextBatch < m_released + (unsigned int)m_slots.size());
+            });
+            if (m_stop)
+            {
+                break;
+            }
+            const unsigned int batchIdx = m_nextBatch++;
+            const unsigned int epoch = m_epoch;
+            Slot& slot = m_slots[batchIdx % m_slots.size()];
+            m_inFlight++;
+            lock.unlock();
+
+            const auto begin = std::chrono::steady_clock::now();
+            prepareBatch(augmenter, buffer, slot, batchIdx, epoch);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+            lock.lock();
+            slot.batchIdx = batchIdx;
+            slot.ready = true;
+            m_inFlight--;
+            m_stats.samples += slot.count;
+            m_stats.augmentSeconds += seconds;
+            m_readyCondition.notify_all();
+        }
+    }
+
+    void AugmentedLoader::prepareBatch(ImageAugmenter& augmenter, std::vector<uint8_t>& buffer, Slot& slot,
+                                       const unsigned int batchIdx, const unsigned int epoch)
+    {
+        const unsigned int* indices = nullptr;
+        const unsigned int count = m_sampler.getBatch(batchIdx, m_batch, indices);
+        const unsigned int sampleSize = m_dataset.getSampleSize();
+        const unsigned int classes = m_dataset.getClasses();
+        float* inputData = slot.inputTensor->getData().get();
+        float* labelData = slot.labelTensor->getData().get();
+        std::fill(labelData, labelData + (size_t)count * classes, 0.0f);
+        for (unsigned int i = 0; i < count; i++)
+        {
+            // 每个样本的引擎只由(种子, stream, epoch, 样本下标)决定，与它在batch中的位置和batch的大小无关
+            std::mt19937 engine = create_random_engine(m_stream, epoch * m_dataset.size() + indices[i]);
+            augmenter.augment(m_dataset.getSample(indices[i]), &buffer[0], engine);
+            uint8_to_float(&buffer[0], inputData + (size_t)i * sampleSize, sampleSize, Dataset::getSampleScale());
+            labelData[(size_t)i * classes + m_dataset.getLabel(indices[i])] = 1.0f;
+        }
+        slot.count = count;
+    }
+}
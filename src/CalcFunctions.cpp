@@ -1,56 +1,300 @@
 //
 // Created by yang chen on 2018/3/7.
 //
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <random>
+#include <vector>
 #include "../include/CalcFunctions.h"
 #include "../include/Tensor.h"
+#include "../include/ThreadPool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MINICNN_X86_SIMD
+#include <immintrin.h>
+#endif
 
 namespace MiniCNN
 {
-    void normal_distribution_init(float* data, const unsigned int size, const float meanValue, const float standardDeviation)
+    static std::atomic<unsigned int> g_randomSeed(0);
+
+    void set_random_seed(const unsigned int seed)
+    {
+        g_randomSeed.store(seed);
+    }
+
+    unsigned int get_random_seed()
+    {
+        return g_randomSeed.load();
+    }
+
+    unsigned int get_default_random_seed()
     {
-        std::random_device rd;
-        std::mt19937 engine(rd());
-        std::normal_distribution<float> dist(meanValue, standardDeviation);
-        for (unsigned int i = 0; i < size; i++)
+        const char* env = std::getenv("MINICNN_SEED");
+        return env != nullptr ? (unsigned int)std::strtoul(env, nullptr, 10) : 0;
+    }
+
+    std::mt19937 create_random_engine(const unsigned int stream, const unsigned int block)
+    {
+        const unsigned int seed = get_random_seed();
+        if (seed == 0)
         {
-            data[i] = dist(engine);
+            std::random_device rd;
+            std::seed_seq seq{rd(), rd(), stream, block};
+            return std::mt19937(seq);
         }
+        std::seed_seq seq{seed, stream, block};
+        return std::mt19937(seq);
+    }
+
+    std::mt19937 create_random_engine(const unsigned int stream)
+    {
+        return create_random_engine(stream, 0);
     }
 
-    void uniform_distribution_init(float* data, const unsigned int size, const float lowValue, const float highValue)
+    // 参数按固定大小分块并行初始化：每块由负责它的worker第一次写入（first-touch），
+    // 使参数页面分布到各个NUMA node上；每块使用独立的随机数引擎
+    static const unsigned int INIT_BLOCK_SIZE = 4096;
+
+    template<typename Distribution>
+    static void parallel_random_init(float* data, const unsigned int size, Distribution dist, const unsigned int stream)
     {
-        std::random_device rd;
-        std::mt19937 engine(rd());
-        std::uniform_real_distribution<float> dist(lowValue, highValue);
-        for (unsigned int i = 0; i < size; i++)
+        const unsigned int blocks = (size + INIT_BLOCK_SIZE - 1) / INIT_BLOCK_SIZE;
+        auto worker = [&](const unsigned int start, const unsigned int end)
         {
-            data[i] = dist(engine);
-        }
+            for (unsigned int block = start; block < end; block++)
+            {
+                std::mt19937 engine = create_random_engine(stream, block);
+                Distribution blockDist(dist.param());
+                const unsigned int stop = std::min(size, (block + 1) * INIT_BLOCK_SIZE);
+                for (unsigned int i = block * INIT_BLOCK_SIZE; i < stop; i++)
+                {
+                    data[i] = blockDist(engine);
+                }
+            }
+        };
+        dispatch_worker(worker, blocks);
+    }
+
+    void normal_distribution_init(float* data, const unsigned int size, const float meanValue, const float standardDeviation,
+                                  const unsigned int stream)
+    {
+        parallel_random_init(data, size, std::normal_distribution<float>(meanValue, standardDeviation), stream);
+    }
+
+    void uniform_distribution_init(float* data, const unsigned int size, const float lowValue, const float highValue,
+                                   const unsigned int stream)
+    {
+        parallel_random_init(data, size, std::uniform_real_distribution<float>(lowValue, highValue), stream);
     }
 
     void constant_distribution_init(float* data, const unsigned int size, const float constantValue)
     {
-        for (unsigned int i = 0; i < size; i++)
+        const unsigned int blocks = (size + INIT_BLOCK_SIZE - 1) / INIT_BLOCK_SIZE;
+        auto worker = [&](const unsigned int start, const unsigned int end)
         {
-            data[i] = constantValue;
-        }
+            const unsigned int stop = std::min(size, end * INIT_BLOCK_SIZE);
+            for (unsigned int i = start * INIT_BLOCK_SIZE; i < stop; i++)
+            {
+                data[i] = constantValue;
+            }
+        };
+        dispatch_worker(worker, blocks);
     }
 
-    void xavier_init(float* data, const unsigned int size, const unsigned int inNum, const unsigned int outNum)
+    void xavier_init(float* data, const unsigned int size, const unsigned int inNum, const unsigned int outNum,
+                     const unsigned int stream)
     {
         const float bias = std::sqrt(6.0f / float(inNum + outNum));
-        uniform_distribution_init(data, size, -bias, bias);
+        uniform_distribution_init(data, size, -bias, bias, stream);
+    }
+
+
+    static const unsigned int PAIRWISE_LEAF_SIZE = 256;
+    static const unsigned int REDUCE_BLOCK_SIZE = 16384;
+    static const unsigned int MAX_REDUCE_BLOCKS = 64;
+
+    // 长度超过PAIRWISE_LEAF_SIZE时对半递归，否则leaf(start, len)返回[start, start + len)的和
+    template<typename Leaf>
+    static float pairwise_reduce(const unsigned int start, const unsigned int len, const Leaf& leaf)
+    {
+        if (len > PAIRWISE_LEAF_SIZE)
+        {
+            const unsigned int half = len / 2;
+            return pairwise_reduce(start, half, leaf) + pairwise_reduce(start + half, len - half, leaf);
+        }
+        return leaf(start, len);
+    }
+
+    static inline float sum_lanes(const float* acc)
+    {
+        return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+    }
+
+    // 以下leaf都按8路累加，输入输出不重叠，便于编译器向量化
+    static float sum_leaf(const float* __restrict x, const unsigned int len)
+    {
+        float acc[8] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        unsigned int i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            for (unsigned int lane = 0; lane < 8; lane++)
+            {
+                acc[lane] += x[i + lane];
+            }
+        }
+        for (; i < len; i++)
+        {
+            acc[i % 8] += x[i];
+        }
+        return sum_lanes(acc);
+    }
+
+    // log比较慢，label为0的项直接跳过；gradient在同一个循环中写出
+    static float cross_entropy_leaf(const float* __restrict label, const float* __restrict output,
+                                    float* __restrict gradient, const unsigned int len, const float gradientScale)
+    {
+        float acc[8] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        if (gradient == nullptr)
+        {
+            for (unsigned int i = 0; i < len; i++)
+            {
+                if (label[i] != 0.0f)
+                {
+                    acc[i % 8] -= label[i] * std::log(output[i]);
+                }
+            }
+            return sum_lanes(acc);
+        }
+        for (unsigned int i = 0; i < len; i++)
+        {
+            if (label[i] != 0.0f)
+            {
+                acc[i % 8] -= label[i] * std::log(output[i]);
+                gradient[i] = -label[i] / output[i] * gradientScale;
+            }
+            else
+            {
+                gradient[i] = 0.0f;
+            }
+        }
+        return sum_lanes(acc);
     }
 
+    static float squared_error_leaf(const float* __restrict label, const float* __restrict output,
+                                    float* __restrict gradient, const unsigned int len, const float gradientScale)
+    {
+        float acc[8] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        unsigned int i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            for (unsigned int lane = 0; lane < 8; lane++)
+            {
+                const float diff = output[i + lane] - label[i + lane];
+                acc[lane] += diff * diff;
+            }
+        }
+        for (; i < len; i++)
+        {
+            const float diff = output[i] - label[i];
+            acc[i % 8] += diff * diff;
+        }
+        if (gradient != nullptr)
+        {
+            const float scale = 2.0f * gradientScale;
+            for (i = 0; i < len; i++)
+            {
+                gradient[i] = (output[i] - label[i]) * scale;
+            }
+        }
+        return sum_lanes(acc);
+    }
+
+    float pairwise_sum(const float* x, const unsigned int len)
+    {
+        return pairwise_reduce(0, len, [x](const unsigned int start, const unsigned int n)
+        {
+            return sum_leaf(x + start, n);
+        });
+    }
+
+    float parallel_reduce(const unsigned int len, const std::function<float(const unsigned int, const unsigned int)>& blockSum)
+    {
+        if (len == 0)
+        {
+            return 0.0f;
+        }
+        // 块数不超过MAX_REDUCE_BLOCKS，部分和放在栈上。确定性模式下块的划分只由len决定，
+        // 否则每个线程一块，合并的顺序随线程数变化
+        unsigned int blockSize = std::max(REDUCE_BLOCK_SIZE, (len + MAX_REDUCE_BLOCKS - 1) / MAX_REDUCE_BLOCKS);
+        if (!is_deterministic())
+        {
+            const unsigned int threads = std::min(std::max(get_thread_num(), 1u), MAX_REDUCE_BLOCKS);
+            blockSize = std::max(blockSize, (len + threads - 1) / threads);
+        }
+        const unsigned int blocks = (len + blockSize - 1) / blockSize;
+        float partial[MAX_REDUCE_BLOCKS];
+        auto worker = [&](const unsigned int start, const unsigned int end)
+        {
+            for (unsigned int block = start; block < end; block++)
+            {
+                partial[block] = blockSum(block * blockSize, std::min(len, (block + 1) * blockSize));
+            }
+        };
+        dispatch_worker(worker, blocks);
+
+        unsigned int count = blocks;
+        while (count > 1)
+        {
+            for (unsigned int i = 0; i < count / 2; i++)
+            {
+                partial[i] = partial[2 * i] + partial[2 * i + 1];
+            }
+            if (count % 2 == 1)
+            {
+                partial[count / 2] = partial[count - 1];
+            }
+            count = (count + 1) / 2;
+        }
+        return partial[0];
+    }
+
+    float parallel_sum(const float* x, const unsigned int len)
+    {
+        return parallel_reduce(len, [x](const unsigned int start, const unsigned int end)
+        {
+            return pairwise_sum(x + start, end - start);
+        });
+    }
+
+    float cross_entropy_loss_gradient(const float* label, const float* output, float* gradient, const unsigned int len,
+                                      const float gradientScale)
+    {
+        return parallel_reduce(len, [=](const unsigned int start, const unsigned int end)
+        {
+            return pairwise_reduce(start, end - start, [=](const unsigned int leafStart, const unsigned int n)
+            {
+                return cross_entropy_leaf(label + leafStart, output + leafStart,
+                                          gradient != nullptr ? gradient + leafStart : nullptr, n, gradientScale);
+            });
+        });
+    }
 
-    float moving_average(float avg, const int acc_number, float value)
+    float squared_error_loss_gradient(const float* label, const float* output, float* gradient, const unsigned int len,
+                                      const float gradientScale)
     {
-        // avg = avg - avg/number + value/number
-        avg -= avg / acc_number;
-        avg += value / acc_number;
-        return avg;
+        return parallel_reduce(len, [=](const unsigned int start, const unsigned int end)
+        {
+            return pairwise_reduce(start, end - start, [=](const unsigned int leafStart, const unsigned int n)
+            {
+                return squared_error_leaf(label + leafStart, output + leafStart,
+                                          gradient != nullptr ? gradient + leafStart : nullptr, n, gradientScale);
+            });
+        });
     }
 
     void mul(const float* a, const float* b, float* c, const unsigned int len)
@@ -188,4 +432,1189 @@ namespace MiniCNN
     }
 
 
+    static inline float activate(const float x, const ActivationType activation)
+    {
+        switch (activation)
+        {
+            case ActivationType::RELU:
+                return relu(x);
+            case ActivationType::SIGMOID:
+                return sigmoid(x);
+            default:
+                return x;
+        }
+    }
+
+    void fullyConnectActivation(const float* input, const float* weight, const float* bias, float* output,
+                                const unsigned int n, const unsigned int inBatchSize, const unsigned int outBatchSize,
+                                const ActivationType activation)
+    {
+        for (unsigned int k = 0; k < n; k++)
+        {
+            const float* pInput = input + k * inBatchSize;
+            float* pOutput = output + k * outBatchSize;
+
+            for (unsigned int i = 0; i < outBatchSize; i++)
+            {
+                float sum = 0.0f;
+                for (unsigned int j = 0; j < inBatchSize; j++)
+                {
+                    sum += pInput[j] * weight[i * inBatchSize + j];
+                }
+                if (bias)
+                {
+                    sum += bias[i];
+                }
+                pOutput[i] = activate(sum, activation);
+            }
+        }
+    }
+
+    // 按形状特化的kernel：输入、输出长度为编译期常量时循环可以完全展开，内积用8路独立累加以便向量化
+#ifdef MINICNN_X86_SIMD
+#define MINICNN_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define MINICNN_ALWAYS_INLINE inline
+#endif
+
+    template <unsigned int Len>
+    static MINICNN_ALWAYS_INLINE float dot_fixed(const float* a, const float* b)
+    {
+        const unsigned int lanes = 8;
+        float sum[lanes] = {};
+        for (unsigned int j = 0; j + lanes <= Len; j += lanes)
+        {
+            for (unsigned int l = 0; l < lanes; l++)
+            {
+                sum[l] += a[j + l] * b[j + l];
+            }
+        }
+        float tail = 0.0f;
+        for (unsigned int j = Len / lanes * lanes; j < Len; j++)
+        {
+            tail += a[j] * b[j];
+        }
+        return ((sum[0] + sum[4]) + (sum[1] + sum[5])) + ((sum[2] + sum[6]) + (sum[3] + sum[7])) + tail;
+    }
+
+    template <unsigned int Len>
+    static MINICNN_ALWAYS_INLINE void activate_fixed(float* x, const unsigned int len, const ActivationType activation)
+    {
+        const unsigned int size = Len > 0 ? Len : len;
+        switch (activation)
+        {
+            case ActivationType::RELU:
+                for (unsigned int i = 0; i < size; i++)
+                {
+                    x[i] = relu(x[i]);
+                }
+                break;
+            case ActivationType::SIGMOID:
+                for (unsigned int i = 0; i < size; i++)
+                {
+                    x[i] = sigmoid(x[i]);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Out为0时输出长度在运行时给出
+    template <unsigned int In, unsigned int Out>
+    static MINICNN_ALWAYS_INLINE void fully_connect_fixed_body(const float* input, const float* weight, const float* bias,
+                                                              float* output, const unsigned int n,
+                                                              const unsigned int outBatchSize,
+                                                              const ActivationType activation)
+    {
+        const unsigned int outSize = Out > 0 ? Out : outBatchSize;
+        for (unsigned int k = 0; k < n; k++)
+        {
+            const float* pInput = input + k * In;
+            float* pOutput = output + k * outSize;
+            for (unsigned int i = 0; i < outSize; i++)
+            {
+                const float sum = dot_fixed<In>(pInput, weight + i * In);
+                pOutput[i] = bias ? sum + bias[i] : sum;
+            }
+            activate_fixed<Out>(pOutput, outSize, activation);
+        }
+    }
+
+    template <unsigned int In, unsigned int Out>
+    static void fully_connect_fixed(const float* input, const float* weight, const float* bias, float* output,
+                                    const unsigned int n, const unsigned int outBatchSize,
+                                    const ActivationType activation)
+    {
+        fully_connect_fixed_body<In, Out>(input, weight, bias, output, n, outBatchSize, activation);
+    }
+
+#ifdef MINICNN_X86_SIMD
+    template <unsigned int In, unsigned int Out>
+    __attribute__((target("avx2,fma")))
+    static void fully_connect_fixed_avx2(const float* input, const float* weight, const float* bias, float* output,
+                                         const unsigned int n, const unsigned int outBatchSize,
+                                         const ActivationType activation)
+    {
+        fully_connect_fixed_body<In, Out>(input, weight, bias, output, n, outBatchSize, activation);
+    }
+#endif
+
+    // 与参考值的差超过该值时才重新选取参考值，exp(64)乘以元素个数仍在float范围内
+    static const float SOFTMAX_RESCALE_THRESHOLD = 64.0f;
+
+    // 一遍同时求最大值和exp的和（online normalizer）：pY[i] = exp(pX[i] - ref)，ref是遇到的较大值，
+    // 只有新值比ref大超过阈值时才把已写出的结果和sum整体缩放，每个元素只计算一次exp；最后一遍乘以1/sum
+    template <unsigned int Len>
+    static void softmax_fixed(const float* x, float* y, const unsigned int n, const unsigned int len)
+    {
+        const unsigned int size = Len > 0 ? Len : len;
+        for (unsigned int k = 0; k < n; k++)
+        {
+            const float* pX = x + k * size;
+            float* pY = y + k * size;
+
+            // 从-FLT_MAX开始，第一个有限值就会成为参考值，-inf的exp为0
+            float ref = -std::numeric_limits<float>::max();
+            float sum = 0.0f;
+            for (unsigned int i = 0; i < size; i++)
+            {
+                if (pX[i] > ref + SOFTMAX_RESCALE_THRESHOLD)
+                {
+                    // 缩放系数分两次乘，避免exp(ref - pX[i])本身落入denormal而丢失精度
+                    const float halfScale = std::exp((ref - pX[i]) * 0.5f);
+                    for (unsigned int j = 0; j < i; j++)
+                    {
+                        pY[j] = pY[j] * halfScale * halfScale;
+                    }
+                    sum = sum * halfScale * halfScale;
+                    ref = pX[i];
+                }
+                pY[i] = std::exp(pX[i] - ref);
+                sum += pY[i];
+            }
+            const float invSum = 1.0f / sum;
+            for (unsigned int i = 0; i < size; i++)
+            {
+                pY[i] *= invSum;
+            }
+        }
+    }
+
+    // 特化的长度，顺序与下面各个kernel表一致
+    static const unsigned int FIXED_SIZES[] = { 10, 32, 64, 128, 256, 512, 784, 1024 };
+    static const unsigned int FIXED_SIZE_COUNT = sizeof(FIXED_SIZES) / sizeof(FIXED_SIZES[0]);
+
+    static int fixed_size_index(const unsigned int size)
+    {
+        for (unsigned int i = 0; i < FIXED_SIZE_COUNT; i++)
+        {
+            if (FIXED_SIZES[i] == size)
+            {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+    // 每行为一个输入长度，列依次为各个输出长度，最后一列是运行时的输出长度
+#define MINICNN_FC_ROW(kernel, In) \
+    { kernel<In, 10>, kernel<In, 32>, kernel<In, 64>, kernel<In, 128>, \
+      kernel<In, 256>, kernel<In, 512>, kernel<In, 784>, kernel<In, 1024>, kernel<In, 0> }
+#define MINICNN_FC_TABLE(kernel) \
+    { MINICNN_FC_ROW(kernel, 10), MINICNN_FC_ROW(kernel, 32), MINICNN_FC_ROW(kernel, 64), \
+      MINICNN_FC_ROW(kernel, 128), MINICNN_FC_ROW(kernel, 256), MINICNN_FC_ROW(kernel, 512), \
+      MINICNN_FC_ROW(kernel, 784), MINICNN_FC_ROW(kernel, 1024) }
+
+    typedef FullyConnectKernel FullyConnectTable[FIXED_SIZE_COUNT][FIXED_SIZE_COUNT + 1];
+
+    static const FullyConnectTable& select_fully_connect_table()
+    {
+        static const FullyConnectTable portableTable = MINICNN_FC_TABLE(fully_connect_fixed);
+#ifdef MINICNN_X86_SIMD
+        static const FullyConnectTable avx2Table = MINICNN_FC_TABLE(fully_connect_fixed_avx2);
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        {
+            return avx2Table;
+        }
+#endif
+        return portableTable;
+    }
+
+#undef MINICNN_FC_TABLE
+#undef MINICNN_FC_ROW
+
+    FullyConnectKernel get_fully_connect_kernel(const unsigned int inBatchSize, const unsigned int outBatchSize)
+    {
+        static const FullyConnectTable& table = select_fully_connect_table();
+        const int inIdx = fixed_size_index(inBatchSize);
+        if (inIdx < 0)
+        {
+            return nullptr;
+        }
+        const int outIdx = fixed_size_index(outBatchSize);
+        return table[inIdx][outIdx < 0 ? FIXED_SIZE_COUNT : outIdx];
+    }
+
+    SoftmaxKernel get_softmax_kernel(const unsigned int len)
+    {
+        static const SoftmaxKernel kernels[FIXED_SIZE_COUNT] = {
+            softmax_fixed<10>, softmax_fixed<32>, softmax_fixed<64>, softmax_fixed<128>,
+            softmax_fixed<256>, softmax_fixed<512>, softmax_fixed<784>, softmax_fixed<1024>
+        };
+        const int idx = fixed_size_index(len);
+        return idx < 0 ? softmax_fixed<0> : kernels[idx];
+    }
+
+    void softmax_backward(const float* y, const float* grad, float* delta, const unsigned int n, const unsigned int len)
+    {
+        for (unsigned int k = 0; k < n; k++)
+        {
+            const float* pY = y + k * len;
+            const float* pGrad = grad + k * len;
+            float* pDelta = delta + k * len;
+
+            float dot = 0.0f;
+            for (unsigned int i = 0; i < len; i++)
+            {
+                dot += pY[i] * pGrad[i];
+            }
+            for (unsigned int i = 0; i < len; i++)
+            {
+                pDelta[i] = pY[i] * (pGrad[i] - dot);
+            }
+        }
+    }
+
+    void activation_delta(const float* y, const float* grad, float* delta, const unsigned int len,
+                          const ActivationType activation)
+    {
+        switch (activation)
+        {
+            case ActivationType::RELU:
+                for (unsigned int i = 0; i < len; i++)
+                {
+                    delta[i] = df_relu(y[i]) * grad[i];
+                }
+                break;
+            case ActivationType::SIGMOID:
+                for (unsigned int i = 0; i < len; i++)
+                {
+                    delta[i] = df_sigmoid(y[i]) * grad[i];
+                }
+                break;
+            default:
+                std::copy(grad, grad + len, delta);
+                break;
+        }
+    }
+
+    // 每组按顺序把候选值插入有序的前k个：严格更大时才插入，相等时先出现的下标排在前面；
+    // 插入位置之后的元素依次后移，最后一个被挤出
+    static void top_k_rows(const float* x, const unsigned int n, const unsigned int len, const unsigned int k,
+                           unsigned int* indices)
+    {
+        for (unsigned int row = 0; row < n; row++)
+        {
+            const float* rowData = x + row * len;
+            unsigned int* rowIndices = indices + row * k;
+            for (unsigned int j = 0; j < len; j++)
+            {
+                unsigned int idx = j;
+                bool inserted = false;
+                const unsigned int filled = std::min(j, k);
+                for (unsigned int r = 0; r < filled; r++)
+                {
+                    if (inserted || rowData[idx] > rowData[rowIndices[r]])
+                    {
+                        std::swap(idx, rowIndices[r]);
+                        inserted = true;
+                    }
+                }
+                if (j < k)
+                {
+                    rowIndices[j] = idx;
+                }
+            }
+        }
+    }
+
+#ifdef MINICNN_X86_SIMD
+    static const unsigned int SIMD_TOP_K = 8;
+
+    // 8组同时处理：每个lane是一组，用gather取各组的第j个值，插入的顺序和结果与top_k_rows相同
+    __attribute__((target("avx2")))
+    static void top_k_avx2(const float* x, const unsigned int n, const unsigned int len, const unsigned int k,
+                           unsigned int* indices)
+    {
+        __m256 best[SIMD_TOP_K];
+        __m256i bestIdx[SIMD_TOP_K];
+        alignas(32) unsigned int laneIdx[8];
+        const __m256i rowOffsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                      _mm256_set1_epi32((int)len));
+        unsigned int row = 0;
+        for (; row + 8 <= n; row += 8)
+        {
+            const float* base = x + row * len;
+            for (unsigned int j = 0; j < len; j++)
+            {
+                __m256i idx = _mm256_set1_epi32((int)j);
+                __m256 value = _mm256_i32gather_ps(base, _mm256_add_epi32(rowOffsets, idx), 4);
+                __m256 inserted = _mm256_setzero_ps();
+                const unsigned int filled = std::min(j, k);
+                for (unsigned int r = 0; r < filled; r++)
+                {
+                    const __m256 greater = _mm256_or_ps(inserted, _mm256_cmp_ps(value, best[r], _CMP_GT_OQ));
+                    inserted = greater;
+                    const __m256 newBest = _mm256_blendv_ps(best[r], value, greater);
+                    const __m256i newBestIdx = _mm256_blendv_epi8(bestIdx[r], idx, _mm256_castps_si256(greater));
+                    value = _mm256_blendv_ps(value, best[r], greater);
+                    idx = _mm256_blendv_epi8(idx, bestIdx[r], _mm256_castps_si256(greater));
+                    best[r] = newBest;
+                    bestIdx[r] = newBestIdx;
+                }
+                if (j < k)
+                {
+                    best[j] = value;
+                    bestIdx[j] = idx;
+                }
+            }
+            for (unsigned int r = 0; r < k; r++)
+            {
+                _mm256_store_si256((__m256i*)laneIdx, bestIdx[r]);
+                for (unsigned int lane = 0; lane < 8; lane++)
+                {
+                    indices[(row + lane) * k + r] = laneIdx[lane];
+                }
+            }
+        }
+        top_k_rows(x + row * len, n - row, len, k, indices + row * k);
+    }
+#endif
+
+    typedef void (*TopKFunc)(const float*, const unsigned int, const unsigned int, const unsigned int, unsigned int*);
+
+    static TopKFunc select_simd_top_k()
+    {
+#ifdef MINICNN_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return top_k_avx2;
+        }
+#endif
+        return nullptr;
+    }
+
+    void argmax(const float* x, const unsigned int n, const unsigned int len, unsigned int* indices)
+    {
+        top_k(x, n, len, 1, indices);
+    }
+
+    void top_k(const float* x, const unsigned int n, const unsigned int len, const unsigned int k, unsigned int* indices)
+    {
+        static const TopKFunc simdTopK = select_simd_top_k();
+#ifdef MINICNN_X86_SIMD
+        // gather的下标为int32
+        if (simdTopK != nullptr && k <= SIMD_TOP_K && (size_t)len * 8 < (size_t)INT32_MAX)
+        {
+            simdTopK(x, n, len, k, indices);
+            return;
+        }
+#endif
+        top_k_rows(x, n, len, k, indices);
+    }
+
+
+    void uint8_to_float(const uint8_t* __restrict x, float* __restrict y, const unsigned int len, const float scale)
+    {
+        for (unsigned int i = 0; i < len; i++)
+        {
+            y[i] = (float)x[i] * scale;
+        }
+    }
+
+    void quantize_u8(const float* x, uint8_t* q, const unsigned int len, const float scale, const int zeroPoint)
+    {
+        const float invScale = 1.0f / scale;
+        for (unsigned int i = 0; i < len; i++)
+        {
+            const int value = (int)std::lround(x[i] * invScale) + zeroPoint;
+            q[i] = (uint8_t)std::min(std::max(value, 0), 255);
+        }
+    }
+
+    static int32_t dot_u8s8(const uint8_t* a, const int8_t* b, const unsigned int len)
+    {
+        int32_t sum = 0;
+        for (unsigned int i = 0; i < len; i++)
+        {
+            sum += (int32_t)a[i] * (int32_t)b[i];
+        }
+        return sum;
+    }
+
+#ifdef MINICNN_X86_SIMD
+    // 没有VNNI时不使用maddubs（u8*s8两两相加会饱和到int16），先扩展为int16再用madd累加到int32，结果精确
+    __attribute__((target("avx2")))
+    static int32_t dot_u8s8_avx2(const uint8_t* a, const int8_t* b, const unsigned int len)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        for (unsigned int i = 0; i < len; i += 16)
+        {
+            const __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+            const __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+        }
+        const __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        const __m128i sum64 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(1, 0, 3, 2)));
+        const __m128i sum32 = _mm_add_epi32(sum64, _mm_shuffle_epi32(sum64, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(sum32);
+    }
+
+    // VNNI的dpbusd直接计算4个u8*s8之和并累加到int32，没有中间饱和
+    __attribute__((target("avx512f,avx512bw,avx512vnni")))
+    static int32_t dot_u8s8_vnni(const uint8_t* a, const int8_t* b, const unsigned int len)
+    {
+        __m512i acc = _mm512_setzero_si512();
+        for (unsigned int i = 0; i < len; i += 64)
+        {
+            acc = _mm512_dpbusd_epi32(acc, _mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        }
+        return _mm512_reduce_add_epi32(acc);
+    }
+#endif
+
+    typedef int32_t (*DotU8S8Func)(const uint8_t*, const int8_t*, const unsigned int);
+
+    // 运行时根据cpu选择实现，len需要是64的倍数
+    static DotU8S8Func select_dot_u8s8()
+    {
+#ifdef MINICNN_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw"))
+        {
+            return dot_u8s8_vnni;
+        }
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return dot_u8s8_avx2;
+        }
+#endif
+        return dot_u8s8;
+    }
+
+    void fullyConnectInt8(const uint8_t* input, const int8_t* weight, const int32_t* weightSum, const float* weightScale,
+                          const float* bias, float* output, const unsigned int n, const unsigned int inStride,
+                          const unsigned int outBatchSize, const float inputScale, const int inputZeroPoint,
+                          const ActivationType activation)
+    {
+        static const DotU8S8Func dot = select_dot_u8s8();
+        for (unsigned int k = 0; k < n; k++)
+        {
+            const uint8_t* pInput = input + k * inStride;
+            float* pOutput = output + k * outBatchSize;
+            for (unsigned int i = 0; i < outBatchSize; i++)
+            {
+                // 减去zero point的贡献后按两个scale还原为float
+                const int32_t acc = dot(pInput, weight + i * inStride, inStride) - inputZeroPoint * weightSum[i];
+                float sum = (float)acc * (inputScale * weightScale[i]);
+                if (bias)
+                {
+                    sum += bias[i];
+                }
+                pOutput[i] = activate(sum, activation);
+            }
+        }
+    }
+
+
+    // 稀疏全连接每次处理的样本数：输入按这个宽度转置，一个块的R个weights与这些样本的输入做外积，
+    // 累加结果R×SPARSE_SAMPLE_TILE正好放在寄存器中
+    static const unsigned int SPARSE_SAMPLE_TILE = 8;
+
+    // 第b个块行、从第k个样本开始的一组结果加上bias、经过激活写入output，超出n或outBatchSize的部分丢弃
+    template <unsigned int R>
+    static MINICNN_ALWAYS_INLINE void store_block_sparse(const float (&sum)[R][SPARSE_SAMPLE_TILE], const float* bias,
+                                                         float* output, const unsigned int b, const unsigned int k,
+                                                         const unsigned int n, const unsigned int outBatchSize,
+                                                         const ActivationType activation)
+    {
+        for (unsigned int t = 0; t < SPARSE_SAMPLE_TILE && k + t < n; t++)
+        {
+            float* pOutput = output + (size_t)(k + t) * outBatchSize;
+            for (unsigned int r = 0; r < R && b * R + r < outBatchSize; r++)
+            {
+                const unsigned int i = b * R + r;
+                pOutput[i] = activate(bias ? sum[r][t] + bias[i] : sum[r][t], activation);
+            }
+        }
+    }
+
+    typedef void (*BlockSparseKernel)(const float* tile, const unsigned int* blockRowPtr, const unsigned int* blockCol,
+                                      const float* values, const float* bias, float* output, const unsigned int n,
+                                      const unsigned int inBatchSize, const unsigned int outBatchSize,
+                                      const ActivationType activation);
+
+    // 块的行数R是编译期常量。外层按块行，每个块行的weights只从内存读一次（处理后面的样本时仍在L1中），
+    // 应用到所有样本；tile是转置后的输入，第t组样本的第c个输入位于tile[(t * inBatchSize + c) * SPARSE_SAMPLE_TILE]
+    template <unsigned int R>
+    static void block_sparse(const float* tile, const unsigned int* blockRowPtr, const unsigned int* blockCol,
+                             const float* values, const float* bias, float* output, const unsigned int n,
+                             const unsigned int inBatchSize, const unsigned int outBatchSize,
+                             const ActivationType activation)
+    {
+        const unsigned int T = SPARSE_SAMPLE_TILE;
+        const unsigned int blockRowCount = (outBatchSize + R - 1) / R;
+        for (unsigned int b = 0; b < blockRowCount; b++)
+        {
+            for (unsigned int k = 0; k < n; k += T)
+            {
+                const float* pTile = tile + (size_t)(k / T) * inBatchSize * T;
+                float sum[R][SPARSE_SAMPLE_TILE] = {};
+                for (unsigned int j = blockRowPtr[b]; j < blockRowPtr[b + 1]; j++)
+                {
+                    const float* x = pTile + (size_t)blockCol[j] * T;
+                    const float* pValues = values + (size_t)j * R;
+                    for (unsigned int r = 0; r < R; r++)
+                    {
+                        for (unsigned int t = 0; t < T; t++)
+                        {
+                            sum[r][t] += pValues[r] * x[t];
+                        }
+                    }
+                }
+                store_block_sparse<R>(sum, bias, output, b, k, n, outBatchSize, activation);
+            }
+        }
+    }
+
+#ifdef MINICNN_X86_SIMD
+    // 一组8个样本正好是一个ymm：每个块读一次输入，R个weights分别广播后乘加，R个累加器一直在寄存器中
+    template <unsigned int R>
+    __attribute__((target("avx2,fma")))
+    static void block_sparse_avx2(const float* tile, const unsigned int* blockRowPtr, const unsigned int* blockCol,
+                                  const float* values, const float* bias, float* output, const unsigned int n,
+                                  const unsigned int inBatchSize, const unsigned int outBatchSize,
+                                  const ActivationType activation)
+    {
+        static_assert(SPARSE_SAMPLE_TILE == 8, "one ymm per tile");
+        const unsigned int T = SPARSE_SAMPLE_TILE;
+        const unsigned int blockRowCount = (outBatchSize + R - 1) / R;
+        for (unsigned int b = 0; b < blockRowCount; b++)
+        {
+            for (unsigned int k = 0; k < n; k += T)
+            {
+                const float* pTile = tile + (size_t)(k / T) * inBatchSize * T;
+                __m256 acc[R];
+                for (unsigned int r = 0; r < R; r++)
+                {
+                    acc[r] = _mm256_setzero_ps();
+                }
+                for (unsigned int j = blockRowPtr[b]; j < blockRowPtr[b + 1]; j++)
+                {
+                    const __m256 x = _mm256_loadu_ps(pTile + (size_t)blockCol[j] * T);
+                    const float* pValues = values + (size_t)j * R;
+                    for (unsigned int r = 0; r < R; r++)
+                    {
+                        acc[r] = _mm256_fmadd_ps(_mm256_set1_ps(pValues[r]), x, acc[r]);
+                    }
+                }
+                float sum[R][SPARSE_SAMPLE_TILE];
+                for (unsigned int r = 0; r < R; r++)
+                {
+                    _mm256_storeu_ps(sum[r], acc[r]);
+                }
+                store_block_sparse<R>(sum, bias, output, b, k, n, outBatchSize, activation);
+            }
+        }
+    }
+#endif
+
+    // 依次为1、4、8行的块
+    typedef BlockSparseKernel BlockSparseTable[3];
+
+    static const BlockSparseTable& select_block_sparse_table()
+    {
+        static const BlockSparseTable portableTable = { block_sparse<1>, block_sparse<4>, block_sparse<8> };
+#ifdef MINICNN_X86_SIMD
+        static const BlockSparseTable avx2Table = { block_sparse_avx2<1>, block_sparse_avx2<4>, block_sparse_avx2<8> };
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        {
+            return avx2Table;
+        }
+#endif
+        return portableTable;
+    }
+
+    void fullyConnectSparse(const float* input, const unsigned int* blockRowPtr, const unsigned int* blockCol,
+                            const float* values, const unsigned int blockRows, const float* bias, float* output,
+                            const unsigned int n, const unsigned int inBatchSize, const unsigned int outBatchSize,
+                            const ActivationType activation)
+    {
+        static const BlockSparseTable& table = select_block_sparse_table();
+        const unsigned int T = SPARSE_SAMPLE_TILE;
+        const unsigned int tiles = (n + T - 1) / T;
+
+        // 转置为每SPARSE_SAMPLE_TILE个样本一组、同一输入的各个样本相邻，不足一组的部分补0
+        static thread_local std::vector<float> tile;
+        tile.assign((size_t)tiles * inBatchSize * T, 0.0f);
+        for (unsigned int k = 0; k < n; k++)
+        {
+            const float* pInput = input + (size_t)k * inBatchSize;
+            float* pTile = &tile[(size_t)(k / T) * inBatchSize * T + k % T];
+            for (unsigned int c = 0; c < inBatchSize; c++)
+            {
+                pTile[(size_t)c * T] = pInput[c];
+            }
+        }
+
+        const BlockSparseKernel kernel = table[blockRows == 8 ? 2 : (blockRows == 4 ? 1 : 0)];
+        kernel(tile.data(), blockRowPtr, blockCol, values, bias, output, n, inBatchSize, outBatchSize, activation);
+    }
+
+    void symmetric_eigen(double* matrix, double* eigenVectors, double* eigenValues, const unsigned int n)
+    {
+        // Householder变换化为三对角矩阵，再用隐式QL迭代求特征值，变换累积在eigenVectors中
+        double* V = eigenVectors;
+        double* d = eigenValues;
+        std::vector<double> e(n, 0.0);
+        std::copy(matrix, matrix + n * n, V);
+        if (n == 0)
+        {
+            return;
+        }
+
+        for (unsigned int j = 0; j < n; j++)
+        {
+            d[j] = V[(n - 1) * n + j];
+        }
+        for (unsigned int i = n - 1; i > 0; i--)
+        {
+            double scale = 0.0;
+            double h = 0.0;
+            for (unsigned int k = 0; k < i; k++)
+            {
+                scale += std::fabs(d[k]);
+            }
+            if (scale == 0.0)
+            {
+                e[i] = d[i - 1];
+                for (unsigned int j = 0; j < i; j++)
+                {
+                    d[j] = V[(i - 1) * n + j];
+                    V[i * n + j] = 0.0;
+                    V[j * n + i] = 0.0;
+                }
+            }
+            else
+            {
+                for (unsigned int k = 0; k < i; k++)
+                {
+                    d[k] /= scale;
+                    h += d[k] * d[k];
+                }
+                double f = d[i - 1];
+                double g = std::sqrt(h);
+                if (f > 0.0)
+                {
+                    g = -g;
+                }
+                e[i] = scale * g;
+                h -= f * g;
+                d[i - 1] = f - g;
+                for (unsigned int j = 0; j < i; j++)
+                {
+                    e[j] = 0.0;
+                }
+                for (unsigned int j = 0; j < i; j++)
+                {
+                    f = d[j];
+                    V[j * n + i] = f;
+                    g = e[j] + V[j * n + j] * f;
+                    for (unsigned int k = j + 1; k < i; k++)
+                    {
+                        g += V[k * n + j] * d[k];
+                        e[k] += V[k * n + j] * f;
+                    }
+                    e[j] = g;
+                }
+                f = 0.0;
+                for (unsigned int j = 0; j < i; j++)
+                {
+                    e[j] /= h;
+                    f += e[j] * d[j];
+                }
+                const double hh = f / (h + h);
+                for (unsigned int j = 0; j < i; j++)
+                {
+                    e[j] -= hh * d[j];
+                }
+                for (unsigned int j = 0; j < i; j++)
+                {
+                    f = d[j];
+                    g = e[j];
+                    for (unsigned int k = j; k < i; k++)
+                    {
+                        V[k * n + j] -= (f * e[k] + g * d[k]);
+                    }
+                    d[j] = V[(i - 1) * n + j];
+                    V[i * n + j] = 0.0;
+                }
+            }
+            d[i] = h;
+        }
+
+        // 累积Householder变换
+        for (unsigned int i = 0; i + 1 < n; i++)
+        {
+            V[(n - 1) * n + i] = V[i * n + i];
+            V[i * n + i] = 1.0;
+            const double h = d[i + 1];
+            if (h != 0.0)
+            {
+                for (unsigned int k = 0; k <= i; k++)
+                {
+                    d[k] = V[k * n + i + 1] / h;
+                }
+                for (unsigned int j = 0; j <= i; j++)
+                {
+                    double g = 0.0;
+                    for (unsigned int k = 0; k <= i; k++)
+                    {
+                        g += V[k * n + i + 1] * V[k * n + j];
+                    }
+                    for (unsigned int k = 0; k <= i; k++)
+                    {
+                        V[k * n + j] -= g * d[k];
+                    }
+                }
+            }
+            for (unsigned int k = 0; k <= i; k++)
+            {
+                V[k * n + i + 1] = 0.0;
+            }
+        }
+        for (unsigned int j = 0; j < n; j++)
+        {
+            d[j] = V[(n - 1) * n + j];
+            V[(n - 1) * n + j] = 0.0;
+        }
+        V[(n - 1) * n + n - 1] = 1.0;
+        e[0] = 0.0;
+
+        // 三对角矩阵的隐式QL迭代
+        for (unsigned int i = 1; i < n; i++)
+        {
+            e[i - 1] = e[i];
+        }
+        e[n - 1] = 0.0;
+
+        double f = 0.0;
+        double tst1 = 0.0;
+        const double eps = std::pow(2.0, -52.0);
+        for (int l = 0; l < (int)n; l++)
+        {
+            tst1 = std::max(tst1, std::fabs(d[l]) + std::fabs(e[l]));
+            int m = l;
+            while (m < (int)n - 1 && std::fabs(e[m]) > eps * tst1)
+            {
+                m++;
+            }
+            if (m > l)
+            {
+                do
+                {
+                    double g = d[l];
+                    double p = (d[l + 1] - g) / (2.0 * e[l]);
+                    double r = std::hypot(p, 1.0);
+                    if (p < 0.0)
+                    {
+                        r = -r;
+                    }
+                    d[l] = e[l] / (p + r);
+                    d[l + 1] = e[l] * (p + r);
+                    const double dl1 = d[l + 1];
+                    double h = g - d[l];
+                    for (int i = l + 2; i < (int)n; i++)
+                    {
+                        d[i] -= h;
+                    }
+                    f += h;
+
+                    p = d[m];
+                    double c = 1.0, c2 = 1.0, c3 = 1.0;
+                    const double el1 = e[l + 1];
+                    double s = 0.0, s2 = 0.0;
+                    for (int i = m - 1; i >= l; i--)
+                    {
+                        c3 = c2;
+                        c2 = c;
+                        s2 = s;
+                        g = c * e[i];
+                        h = c * p;
+                        r = std::hypot(p, e[i]);
+                        e[i + 1] = s * r;
+                        s = e[i] / r;
+                        c = p / r;
+                        p = c * d[i] - s * g;
+                        d[i + 1] = h + s * (c * g + s * d[i]);
+                        for (unsigned int k = 0; k < n; k++)
+                        {
+                            h = V[k * n + i + 1];
+                            V[k * n + i + 1] = s * V[k * n + i] + c * h;
+                            V[k * n + i] = c * V[k * n + i] - s * h;
+                        }
+                    }
+                    p = -s * s2 * c3 * el1 * e[l] / dl1;
+                    e[l] = s * p;
+                    d[l] = c * p;
+                } while (std::fabs(e[l]) > eps * tst1);
+            }
+            d[l] += f;
+            e[l] = 0.0;
+        }
+
+        // 按特征值从大到小排列特征向量
+        std::vector<unsigned int> order(n);
+        for (unsigned int i = 0; i < n; i++)
+        {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](const unsigned int a, const unsigned int b)
+        {
+            return d[a] > d[b];
+        });
+        std::vector<double> sortedVectors(n * n);
+        std::vector<double> sortedValues(n);
+        for (unsigned int k = 0; k < n; k++)
+        {
+            sortedValues[k] = d[order[k]];
+            for (unsigned int i = 0; i < n; i++)
+            {
+                sortedVectors[i * n + k] = V[i * n + order[k]];
+            }
+        }
+        std::copy(sortedValues.begin(), sortedValues.end(), d);
+        std::copy(sortedVectors.begin(), sortedVectors.end(), V);
+    }
+
+    static inline uint16_t float_to_half(const float value)
+    {
+        uint32_t bits = 0;
+        memcpy(&bits, &value, sizeof(bits));
+        const uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+        uint32_t absBits = bits & 0x7FFFFFFF;
+
+        if (absBits >= 0x7F800000)
+        {
+            // inf、nan
+            return sign | 0x7C00 | (absBits > 0x7F800000 ? 0x200 : 0);
+        }
+        if (absBits >= 0x47800000)
+        {
+            // 超出fp16的范围
+            return sign | 0x7C00;
+        }
+        if (absBits < 0x38800000)
+        {
+            // fp16的subnormal，借助float加法完成舍入
+            float absValue = 0.0f;
+            memcpy(&absValue, &absBits, sizeof(absValue));
+            absValue += 0.5f;
+            memcpy(&absBits, &absValue, sizeof(absBits));
+            return sign | (uint16_t)(absBits - 0x3F000000);
+        }
+        // 调整指数的偏移量，并按最低保留位做round to nearest even
+        const uint32_t mantissaOdd = (absBits >> 13) & 1;
+        absBits += 0xC8000FFF + mantissaOdd;
+        return sign | (uint16_t)(absBits >> 13);
+    }
+
+    static inline float half_to_float(const uint16_t value)
+    {
+        const uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+        const uint32_t exponent = (value >> 10) & 0x1F;
+        const uint32_t mantissa = value & 0x3FF;
+        uint32_t bits = 0;
+        if (exponent == 0)
+        {
+            // 0或subnormal：mantissa * 2^-24
+            const float absValue = (float)mantissa * (1.0f / 16777216.0f);
+            memcpy(&bits, &absValue, sizeof(bits));
+            bits |= sign;
+        }
+        else if (exponent == 31)
+        {
+            bits = sign | 0x7F800000 | (mantissa << 13);
+        }
+        else
+        {
+            bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        }
+        float result = 0.0f;
+        memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+
+    static inline uint16_t float_to_bfloat16(const float value)
+    {
+        uint32_t bits = 0;
+        memcpy(&bits, &value, sizeof(bits));
+        if ((bits & 0x7FFFFFFF) > 0x7F800000)
+        {
+            // 保证nan截断后仍然是nan
+            return (uint16_t)((bits >> 16) | 0x40);
+        }
+        bits += 0x7FFF + ((bits >> 16) & 1);
+        return (uint16_t)(bits >> 16);
+    }
+
+    static inline float bfloat16_to_float(const uint16_t value)
+    {
+        const uint32_t bits = (uint32_t)value << 16;
+        float result = 0.0f;
+        memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+
+    static void float_to_half_array(const float* x, uint16_t* y, const unsigned int len)
+    {
+        for (unsigned int i = 0; i < len; i++)
+        {
+            y[i] = float_to_half(x[i]);
+        }
+    }
+
+    static void half_to_float_array(const uint16_t* x, float* y, const unsigned int len)
+    {
+        for (unsigned int i = 0; i < len; i++)
+        {
+            y[i] = half_to_float(x[i]);
+        }
+    }
+
+    static void float_to_bfloat16_array(const float* x, uint16_t* y, const unsigned int len)
+    {
+        for (unsigned int i = 0; i < len; i++)
+        {
+            y[i] = float_to_bfloat16(x[i]);
+        }
+    }
+
+    static void bfloat16_to_float_array(const uint16_t* x, float* y, const unsigned int len)
+    {
+        for (unsigned int i = 0; i < len; i++)
+        {
+            y[i] = bfloat16_to_float(x[i]);
+        }
+    }
+
+    static float dot_half(const float* a, const uint16_t* b, const unsigned int len)
+    {
+        float sum = 0.0f;
+        for (unsigned int i = 0; i < len; i++)
+        {
+            sum += a[i] * half_to_float(b[i]);
+        }
+        return sum;
+    }
+
+    static float dot_bfloat16(const float* a, const uint16_t* b, const unsigned int len)
+    {
+        float sum = 0.0f;
+        for (unsigned int i = 0; i < len; i++)
+        {
+            sum += a[i] * bfloat16_to_float(b[i]);
+        }
+        return sum;
+    }
+
+#ifdef MINICNN_X86_SIMD
+    __attribute__((target("avx,f16c")))
+    static void float_to_half_f16c(const float* x, uint16_t* y, const unsigned int len)
+    {
+        unsigned int i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            _mm_storeu_si128((__m128i*)(y + i), _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT));
+        }
+        float_to_half_array(x + i, y + i, len - i);
+    }
+
+    __attribute__((target("avx,f16c")))
+    static void half_to_float_f16c(const uint16_t* x, float* y, const unsigned int len)
+    {
+        unsigned int i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            _mm256_storeu_ps(y + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x + i))));
+        }
+        half_to_float_array(x + i, y + i, len - i);
+    }
+
+    // vcvtneps2bf16同样是round to nearest even，但subnormal会被当作0处理
+    __attribute__((target("avx512f,avx512bf16")))
+    static void float_to_bfloat16_avx512(const float* x, uint16_t* y, const unsigned int len)
+    {
+        unsigned int i = 0;
+        for (; i + 16 <= len; i += 16)
+        {
+            const __m256bh result = _mm512_cvtneps_pbh(_mm512_loadu_ps(x + i));
+            _mm256_storeu_si256((__m256i*)(y + i), (__m256i)result);
+        }
+        float_to_bfloat16_array(x + i, y + i, len - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void bfloat16_to_float_avx2(const uint16_t* x, float* y, const unsigned int len)
+    {
+        unsigned int i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            const __m256i bits = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(x + i)));
+            _mm256_storeu_ps(y + i, _mm256_castsi256_ps(_mm256_slli_epi32(bits, 16)));
+        }
+        bfloat16_to_float_array(x + i, y + i, len - i);
+    }
+
+    __attribute__((target("avx,f16c,fma")))
+    static float dot_half_f16c(const float* a, const uint16_t* b, const unsigned int len)
+    {
+        __m256 acc = _mm256_setzero_ps();
+        unsigned int i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i))), acc);
+        }
+        const __m128 sum128 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        const __m128 sum64 = _mm_add_ps(sum128, _mm_movehl_ps(sum128, sum128));
+        const __m128 sum32 = _mm_add_ss(sum64, _mm_shuffle_ps(sum64, sum64, 1));
+        return _mm_cvtss_f32(sum32) + dot_half(a + i, b + i, len - i);
+    }
+
+    __attribute__((target("avx2,fma")))
+    static float dot_bfloat16_avx2(const float* a, const uint16_t* b, const unsigned int len)
+    {
+        __m256 acc = _mm256_setzero_ps();
+        unsigned int i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            const __m256i bits = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(b + i)));
+            acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_castsi256_ps(_mm256_slli_epi32(bits, 16)), acc);
+        }
+        const __m128 sum128 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        const __m128 sum64 = _mm_add_ps(sum128, _mm_movehl_ps(sum128, sum128));
+        const __m128 sum32 = _mm_add_ss(sum64, _mm_shuffle_ps(sum64, sum64, 1));
+        return _mm_cvtss_f32(sum32) + dot_bfloat16(a + i, b + i, len - i);
+    }
+#endif
+
+    typedef void (*ToNarrowFunc)(const float*, uint16_t*, const unsigned int);
+    typedef void (*FromNarrowFunc)(const uint16_t*, float*, const unsigned int);
+    typedef float (*DotNarrowFunc)(const float*, const uint16_t*, const unsigned int);
+
+    struct NarrowKernels
+    {
+        ToNarrowFunc toNarrow;
+        FromNarrowFunc fromNarrow;
+        DotNarrowFunc dot;
+    };
+
+    static NarrowKernels select_narrow_kernels(const DataType dataType)
+    {
+        NarrowKernels kernels;
+        if (dataType == DataType::FP16)
+        {
+            kernels = { float_to_half_array, half_to_float_array, dot_half };
+        }
+        else
+        {
+            kernels = { float_to_bfloat16_array, bfloat16_to_float_array, dot_bfloat16 };
+        }
+#ifdef MINICNN_X86_SIMD
+        __builtin_cpu_init();
+        if (dataType == DataType::FP16 && __builtin_cpu_supports("f16c"))
+        {
+            kernels.toNarrow = float_to_half_f16c;
+            kernels.fromNarrow = half_to_float_f16c;
+            if (__builtin_cpu_supports("fma"))
+            {
+                kernels.dot = dot_half_f16c;
+            }
+        }
+        if (dataType == DataType::BF16)
+        {
+            if (__builtin_cpu_supports("avx512bf16"))
+            {
+                kernels.toNarrow = float_to_bfloat16_avx512;
+            }
+            if (__builtin_cpu_supports("avx2"))
+            {
+                kernels.fromNarrow = bfloat16_to_float_avx2;
+                if (__builtin_cpu_supports("fma"))
+                {
+                    kernels.dot = dot_bfloat16_avx2;
+                }
+            }
+        }
+#endif
+        return kernels;
+    }
+
+    static const NarrowKernels& get_narrow_kernels(const DataType dataType)
+    {
+        static const NarrowKernels halfKernels = select_narrow_kernels(DataType::FP16);
+        static const NarrowKernels bfloat16Kernels = select_narrow_kernels(DataType::BF16);
+        return dataType == DataType::FP16 ? halfKernels : bfloat16Kernels;
+    }
+
+    void float_to_narrow(const float* x, uint16_t* y, const unsigned int len, const DataType dataType)
+    {
+        get_narrow_kernels(dataType).toNarrow(x, y, len);
+    }
+
+    void narrow_to_float(const uint16_t* x, float* y, const unsigned int len, const DataType dataType)
+    {
+        get_narrow_kernels(dataType).fromNarrow(x, y, len);
+    }
+
+    bool scale_and_check_finite(float* x, const unsigned int len, const float scale)
+    {
+        // 按指数位全为1判断inf/nan，没有分支，可以和乘法一起向量化
+        uint32_t nonFinite = 0;
+        for (unsigned int i = 0; i < len; i++)
+        {
+            x[i] *= scale;
+            uint32_t bits = 0;
+            memcpy(&bits, &x[i], sizeof(bits));
+            nonFinite |= (uint32_t)((bits & 0x7F800000) == 0x7F800000);
+        }
+        return nonFinite == 0;
+    }
+
+    void fullyConnectNarrow(const float* input, const uint16_t* weight, const float* bias, float* output,
+                            const unsigned int n, const unsigned int inBatchSize, const unsigned int outBatchSize,
+                            const DataType weightType, const ActivationType activation)
+    {
+        const DotNarrowFunc dot = get_narrow_kernels(weightType).dot;
+        for (unsigned int k = 0; k < n; k++)
+        {
+            const float* pInput = input + k * inBatchSize;
+            float* pOutput = output + k * outBatchSize;
+            for (unsigned int i = 0; i < outBatchSize; i++)
+            {
+                float sum = dot(pInput, weight + i * inBatchSize, inBatchSize);
+                if (bias)
+                {
+                    sum += bias[i];
+                }
+                pOutput[i] = activate(sum, activation);
+            }
+        }
+    }
+
+
 }//namespace
\ No newline at end of file
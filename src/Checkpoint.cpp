@@ -0,0 +1,456 @@
+//
+// Created by yang chen on 2018/5/1.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <zlib.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "../include/Checkpoint.h"
+
+namespace MiniCNN
+{
+    const char CHECKPOINT_MAGIC[8] = { 'M', 'C', 'N', 'N', 'C', 'K', 'P', 'T' };
+    const uint32_t CHECKPOINT_VERSION = 2;
+
+    // 内容的crc32，与分几次计算无关
+    static uint32_t update_checksum(uint32_t crc, const void* data, size_t len)
+    {
+        const Bytef* bytes = (const Bytef*)data;
+        while (len > 0)
+        {
+            const uInt count = (uInt)std::min<size_t>(len, 1u << 30);
+            crc = (uint32_t)crc32(crc, bytes, count);
+            bytes += count;
+            len -= count;
+        }
+        return crc;
+    }
+
+    // 先写临时文件，内容之后附加校验和，fsync后rename为目标文件
+    class AtomicFileWriter
+    {
+    public:
+        ~AtomicFileWriter()
+        {
+            if (m_file != nullptr)
+            {
+                fclose(m_file);
+                std::remove(m_tmpPath.c_str());
+            }
+        }
+
+        bool open(const std::string& path)
+        {
+            m_path = path;
+            std::random_device rd;
+            m_tmpPath = path + ".tmp" + std::to_string(rd());
+            m_file = fopen(m_tmpPath.c_str(), "wb");
+            return m_file != nullptr;
+        }
+
+        void write(const void* data, const size_t len)
+        {
+            m_checksum = update_checksum(m_checksum, data, len);
+            m_good = m_good && fwrite(data, 1, len, m_file) == len;
+            m_size += len;
+        }
+
+        template<typename T>
+        void writeValue(const T& value)
+        {
+            write(&value, sizeof(value));
+        }
+
+        void writeString(const std::string& value)
+        {
+            writeValue<uint64_t>(value.size());
+            write(value.data(), value.size());
+        }
+
+        bool commit()
+        {
+            const uint32_t checksum = m_checksum;
+            write(&checksum, sizeof(checksum));
+            m_good = m_good && fflush(m_file) == 0;
+#if defined(__unix__) || defined(__APPLE__)
+            m_good = m_good && fsync(fileno(m_file)) == 0;
+#endif
+            m_good = fclose(m_file) == 0 && m_good;
+            m_file = nullptr;
+#if !defined(__unix__) && !defined(__APPLE__)
+            // 目标文件存在时rename会失败，这里不是原子的
+            std::remove(m_path.c_str());
+#endif
+            if (!m_good || std::rename(m_tmpPath.c_str(), m_path.c_str()) != 0)
+            {
+                std::remove(m_tmpPath.c_str());
+                return false;
+            }
+#if defined(__unix__) || defined(__APPLE__)
+            // rename本身也要落盘，否则掉电后可能看不到新的文件
+            const size_t pos = m_path.find_last_of('/');
+            const std::string dir = pos == std::string::npos ? "." : m_path.substr(0, pos + 1);
+            const int dirFd = ::open(dir.c_str(), O_RDONLY);
+            if (dirFd >= 0)
+            {
+                fsync(dirFd);
+                close(dirFd);
+            }
+#endif
+            return true;
+        }
+
+        inline uint64_t size() const { return m_size; }
+
+    private:
+        std::string m_path;
+        std::string m_tmpPath;
+        FILE* m_file = nullptr;
+        uint32_t m_checksum = 0;
+        uint64_t m_size = 0;
+        bool m_good = true;
+    };
+
+    // 按顺序解析已经校验过的checkpoint，越界时返回false
+    class CheckpointReader
+    {
+    public:
+        CheckpointReader(const std::vector<char>& data, const size_t size) : m_data(data), m_size(size) {}
+
+        bool read(void* data, const size_t len)
+        {
+            if (len > m_size - m_pos)
+            {
+                return false;
+            }
+            std::memcpy(data, &m_data[m_pos], len);
+            m_pos += len;
+            return true;
+        }
+
+        template<typename T>
+        bool readValue(T& value)
+        {
+            return read(&value, sizeof(value));
+        }
+
+        bool readString(std::string& value)
+        {
+            uint64_t len = 0;
+            if (!readValue(len) || len > m_size - m_pos)
+            {
+                return false;
+            }
+            value.assign(&m_data[m_pos], (size_t)len);
+            m_pos += (size_t)len;
+            return true;
+        }
+
+        inline bool atEnd() const { return m_pos == m_size; }
+
+    private:
+        const std::vector<char>& m_data;
+        size_t m_size;
+        size_t m_pos = 0;
+    };
+
+    ParamSnapshot::ParamSnapshot(const Network& network)
+            : m_lossScale(network.m_lossScale), m_goodSteps(network.m_goodSteps), m_copiedLayers(0)
+    {
+        m_layers.resize(network.m_layers.size());
+        for (size_t i = 0; i < network.m_layers.size(); i++)
+        {
+            LayerParams& layer = m_layers[i];
+            layer.layerType = network.getLayerType(i);
+            for (const auto& param : network.getLayerParams(i))
+            {
+                Param entry;
+                entry.param = param;
+                entry.state = network.m_optimizer ? network.m_optimizer->getParamState(param) : nullptr;
+                layer.params.push_back(entry);
+            }
+            // 没有参数的层不需要复制
+            if (layer.params.empty())
+            {
+                layer.copied = true;
+                m_copiedLayers++;
+            }
+        }
+    }
+
+    uint64_t ParamSnapshot::copyLayer(const unsigned int layerIdx)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        LayerParams& layer = m_layers[layerIdx];
+        if (layer.copied)
+        {
+            return 0;
+        }
+        uint64_t bytes = 0;
+        for (auto& entry : layer.params)
+        {
+            const float* paramData = entry.param->getData().get();
+            entry.paramData.assign(paramData, paramData + entry.param->getShape().totalSize());
+            bytes += entry.paramData.size() * sizeof(float);
+            if (entry.state)
+            {
+                const float* stateData = entry.state->getData().get();
+                entry.stateData.assign(stateData, stateData + entry.state->getShape().totalSize());
+                bytes += entry.stateData.size() * sizeof(float);
+            }
+            // 之后只使用复制的数据
+            entry.param.reset();
+            entry.state.reset();
+        }
+        layer.copied = true;
+        m_copiedLayers++;
+        return bytes;
+    }
+
+    void ParamSnapshot::copyBeforeWrite(const unsigned int layerIdx)
+    {
+        if (layerIdx >= m_layers.size())
+        {
+            return;
+        }
+        const auto begin = std::chrono::steady_clock::now();
+        const uint64_t bytes = copyLayer(layerIdx);
+        if (bytes > 0)
+        {
+            m_copyOnWriteSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            m_copyOnWriteBytes += bytes;
+        }
+    }
+
+    const ParamSnapshot::LayerParams& ParamSnapshot::acquire(const unsigned int layerIdx)
+    {
+        copyLayer(layerIdx);
+        return m_layers[layerIdx];
+    }
+
+    void ParamSnapshot::release(const unsigned int layerIdx)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& entry : m_layers[layerIdx].params)
+        {
+            std::vector<float>().swap(entry.paramData);
+            std::vector<float>().swap(entry.stateData);
+        }
+    }
+
+    CheckpointWriter::CheckpointWriter() {}
+
+    CheckpointWriter::~CheckpointWriter()
+    {
+        wait();
+    }
+
+    void CheckpointWriter::save(Network& network, const TrainingState& state, const std::string& path)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+        wait();
+        std::shared_ptr<ParamSnapshot> snapshot = std::make_shared<ParamSnapshot>(network);
+        network.m_snapshot = snapshot;
+        m_pendingSnapshot = snapshot;
+        m_thread = std::thread([this, snapshot, state, path]()
+        {
+            write(*snapshot, state, path);
+        });
+        m_stats.saveSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    bool CheckpointWriter::wait()
+    {
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_pendingSnapshot)
+        {
+            m_stats.copyOnWriteSeconds += m_pendingSnapshot->getCopyOnWriteSeconds();
+            m_stats.copyOnWriteBytes += m_pendingSnapshot->getCopyOnWriteBytes();
+            m_pendingSnapshot.reset();
+        }
+        return m_lastResult;
+    }
+
+    CheckpointWriterStats CheckpointWriter::getStats()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+    bool CheckpointWriter::write(ParamSnapshot& snapshot, const TrainingState& state, const std::string& path)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+        AtomicFileWriter file;
+        bool success = file.open(path);
+        if (success)
+        {
+            file.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+            file.writeValue<uint32_t>(CHECKPOINT_VERSION);
+            file.writeValue<uint32_t>(state.epoch);
+            file.writeValue<uint32_t>(state.batch);
+            file.writeValue<uint64_t>(state.step);
+            file.writeValue<float>(state.learningRate);
+            file.writeValue<uint32_t>(state.seed);
+            file.writeValue<uint32_t>(state.loaderEpoch);
+            file.writeString(state.samplerState);
+            file.writeValue<float>(snapshot.getLossScale());
+            file.writeValue<uint32_t>(snapshot.getGoodSteps());
+
+            file.writeValue<uint32_t>(snapshot.getLayerCount());
+            for (unsigned int i = 0; i < snapshot.getLayerCount(); i++)
+            {
+                const ParamSnapshot::LayerParams& layer = snapshot.acquire(i);
+                file.writeString(layer.layerType);
+                file.writeValue<uint32_t>((uint32_t)layer.params.size());
+                for (const auto& entry : layer.params)
+                {
+                    file.writeValue<uint64_t>(entry.paramData.size());
+                    file.write(entry.paramData.data(), entry.paramData.size() * sizeof(float));
+                    file.writeValue<uint64_t>(entry.stateData.size());
+                    file.write(entry.stateData.data(), entry.stateData.size() * sizeof(float));
+                }
+                snapshot.release(i);
+            }
+            success = file.commit();
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_lastResult = success;
+        if (success)
+        {
+            m_stats.checkpoints++;
+            m_stats.bytes += file.size();
+        }
+        else
+        {
+            m_stats.failures++;
+        }
+        m_stats.writeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        return success;
+    }
+
+    bool load_checkpoint(const std::string& path, Network& network, TrainingState& state)
+    {
+        std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+        if (!ifs.is_open())
+        {
+            return false;
+        }
+        const std::streamoff fileSize = ifs.tellg();
+        if (fileSize < (std::streamoff)(sizeof(CHECKPOINT_MAGIC) + sizeof(uint32_t)))
+        {
+            return false;
+        }
+        std::vector<char> data((size_t)fileSize);
+        ifs.seekg(0);
+        if (!ifs.read(&data[0], fileSize))
+        {
+            return false;
+        }
+        const size_t contentSize = data.size() - sizeof(uint32_t);
+        uint32_t checksum = 0;
+        std::memcpy(&checksum, &data[contentSize], sizeof(checksum));
+        if (update_checksum(0, &data[0], contentSize) != checksum
+            || std::memcmp(&data[0], CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0)
+        {
+            return false;
+        }
+
+        CheckpointReader reader(data, contentSize);
+        char magic[sizeof(CHECKPOINT_MAGIC)];
+        uint32_t version = 0;
+        TrainingState loaded;
+        if (!reader.read(magic, sizeof(magic)) || !reader.readValue(version) || version != CHECKPOINT_VERSION
+            || !reader.readValue(loaded.epoch) || !reader.readValue(loaded.batch) || !reader.readValue(loaded.step)
+            || !reader.readValue(loaded.learningRate) || !reader.readValue(loaded.seed)
+            || !reader.readValue(loaded.loaderEpoch) || !reader.readString(loaded.samplerState))
+        {
+            return false;
+        }
+        float lossScale = 1.0f;
+        uint32_t goodSteps = 0;
+        uint32_t layerCount = 0;
+        if (!reader.readValue(lossScale) || !reader.readValue(goodSteps) || !reader.readValue(layerCount)
+            || layerCount != network.m_layers.size())
+        {
+            return false;
+        }
+
+        // 先全部解析并检查结构，再修改网络
+        std::vector<std::vector<std::vector<float>>> params(layerCount);
+        std::vector<std::vector<std::vector<float>>> states(layerCount);
+        for (uint32_t i = 0; i < layerCount; i++)
+        {
+            const std::vector<std::shared_ptr<Tensor>> layerParams = network.getLayerParams(i);
+            std::string layerType;
+            uint32_t paramCount = 0;
+            if (!reader.readString(layerType) || layerType != network.getLayerType(i)
+                || !reader.readValue(paramCount) || paramCount != layerParams.size())
+            {
+                return false;
+            }
+            params[i].resize(paramCount);
+            states[i].resize(paramCount);
+            for (uint32_t j = 0; j < paramCount; j++)
+            {
+                const size_t paramSize = layerParams[j]->getShape().totalSize();
+                uint64_t count = 0;
+                if (!reader.readValue(count) || count != paramSize)
+                {
+                    return false;
+                }
+                params[i][j].resize(paramSize);
+                if (!reader.read(params[i][j].data(), paramSize * sizeof(float))
+                    || !reader.readValue(count) || (count != 0 && count != paramSize))
+                {
+                    return false;
+                }
+                states[i][j].resize((size_t)count);
+                if (!reader.read(states[i][j].data(), (size_t)count * sizeof(float)))
+                {
+                    return false;
+                }
+            }
+        }
+        if (!reader.atEnd())
+        {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < layerCount; i++)
+        {
+            const std::vector<std::shared_ptr<Tensor>> layerParams = network.getLayerParams(i);
+            for (size_t j = 0; j < layerParams.size(); j++)
+            {
+                std::memcpy(layerParams[j]->getData().get(), params[i][j].data(), params[i][j].size() * sizeof(float));
+                if (network.m_optimizer)
+                {
+                    std::shared_ptr<Tensor> paramState;
+                    if (!states[i][j].empty())
+                    {
+                        paramState = std::make_shared<Tensor>(layerParams[j]->getShape());
+                        std::memcpy(paramState->getData().get(), states[i][j].data(), states[i][j].size() * sizeof(float));
+                    }
+                    network.m_optimizer->setParamState(layerParams[j], paramState);
+                }
+            }
+            network.invalidateParamCaches(i);
+        }
+        network.m_lossScale = lossScale;
+        network.m_goodSteps = goodSteps;
+        state = loaded;
+        return true;
+    }
+}
@@ -0,0 +1,483 @@
+//
+// Created by yang chen on 2018/4/29.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <zlib.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "../include/CompressedInput.h"
+#include "../include/ThreadPool.h"
+
+namespace MiniCNN
+{
+    // gzip头部固定的前12个字节，FLG只有FEXTRA时后面紧跟XLEN个字节的extra字段
+    const unsigned int GZIP_HEADER_SIZE = 12;
+    const unsigned int GZIP_TRAILER_SIZE = 8;
+    const uint8_t GZIP_FLAG_EXTRA = 0x04;
+    // 普通gzip流式解压时每次读入和输出的长度
+    const size_t STREAM_CHUNK_SIZE = 1 << 20;
+
+    struct CompressedInput::Stream
+    {
+        z_stream zs;
+        std::vector<uint8_t> input;
+        bool finished = false;
+
+        Stream() : input(STREAM_CHUNK_SIZE)
+        {
+            std::memset(&zs, 0, sizeof(zs));
+        }
+        ~Stream()
+        {
+            inflateEnd(&zs);
+        }
+    };
+
+    static uint32_t read_le32(const uint8_t* p)
+    {
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    static void write_le32(uint8_t* p, const uint32_t value)
+    {
+        p[0] = (uint8_t)value;
+        p[1] = (uint8_t)(value >> 8);
+        p[2] = (uint8_t)(value >> 16);
+        p[3] = (uint8_t)(value >> 24);
+    }
+
+    // 解析分块gzip member的头部，返回整个member的长度，不是分块gzip时返回0
+    static size_t read_block_header(std::ifstream& ifs, unsigned int& headerSize)
+    {
+        uint8_t header[GZIP_HEADER_SIZE];
+        if (!ifs.read((char*)header, sizeof(header)) || header[0] != 0x1f || header[1] != 0x8b || header[2] != 8
+            || header[3] != GZIP_FLAG_EXTRA)
+        {
+            return 0;
+        }
+        const unsigned int extraSize = header[10] | (header[11] << 8);
+        std::vector<uint8_t> extra(extraSize);
+        if (extraSize == 0 || !ifs.read((char*)&extra[0], extraSize))
+        {
+            return 0;
+        }
+        headerSize = GZIP_HEADER_SIZE + extraSize;
+        // 依次查找各个子字段，BC的内容为整个member的长度减1
+        for (unsigned int pos = 0; pos + 4 <= extraSize;)
+        {
+            const unsigned int fieldSize = extra[pos + 2] | (extra[pos + 3] << 8);
+            if (extra[pos] == 'B' && extra[pos + 1] == 'C' && fieldSize == 2 && pos + 6 <= extraSize)
+            {
+                const size_t blockSize = (size_t)(extra[pos + 4] | (extra[pos + 5] << 8)) + 1;
+                return blockSize >= headerSize + GZIP_TRAILER_SIZE ? blockSize : 0;
+            }
+            pos += 4 + fieldSize;
+        }
+        return 0;
+    }
+
+    CompressedInput::CompressedInput() {}
+
+    CompressedInput::~CompressedInput()
+    {
+        closeFile();
+    }
+
+    void CompressedInput::closeFile()
+    {
+        m_ifs.close();
+        m_ifs.clear();
+#if defined(__unix__) || defined(__APPLE__)
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+#endif
+        m_fd = -1;
+        m_offset = m_releasedOffset = 0;
+    }
+
+    bool CompressedInput::open(const std::string& path)
+    {
+        closeFile();
+        m_format = Format::RAW;
+        m_failed = false;
+        m_stream.reset();
+        m_bufferSize = m_bufferPos = 0;
+        m_ifs.open(path, std::ios::binary);
+        if (!m_ifs.is_open())
+        {
+            return false;
+        }
+
+        uint8_t magic[2] = { 0, 0 };
+        m_ifs.read((char*)magic, sizeof(magic));
+        const bool compressed = m_ifs.gcount() == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+        m_ifs.clear();
+        m_ifs.seekg(0);
+        if (!compressed)
+        {
+#if defined(__unix__) || defined(__APPLE__)
+            // 未压缩的文件直接用fd读取，可以提示内核预读
+            m_ifs.close();
+            m_fd = ::open(path.c_str(), O_RDONLY);
+            if (m_fd < 0)
+            {
+                return false;
+            }
+#ifdef __linux__
+            posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+            return true;
+        }
+
+        // 第一个member是分块gzip时认为整个文件都是
+        unsigned int headerSize = 0;
+        m_format = read_block_header(m_ifs, headerSize) > 0 ? Format::BLOCKED_GZIP : Format::GZIP;
+        m_ifs.clear();
+        m_ifs.seekg(0);
+        if (m_format == Format::GZIP)
+        {
+            m_stream.reset(new Stream());
+            // 15 + 16：只接受gzip格式
+            if (inflateInit2(&m_stream->zs, 15 + 16) != Z_OK)
+            {
+                m_stream.reset();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool CompressedInput::read(void* data, const size_t len)
+    {
+        uint8_t* dst = (uint8_t*)data;
+        size_t done = 0;
+        while (done < len)
+        {
+            const size_t count = readSome(dst + done, len - done);
+            if (count == 0)
+            {
+                return false;
+            }
+            done += count;
+        }
+        return true;
+    }
+
+    size_t CompressedInput::readSome(void* data, const size_t len)
+    {
+        if (m_format == Format::RAW)
+        {
+#if defined(__unix__) || defined(__APPLE__)
+            ssize_t count = 0;
+            do
+            {
+                count = ::read(m_fd, data, len);
+            } while (count < 0 && errno == EINTR);
+            if (count < 0)
+            {
+                m_failed = true;
+                return 0;
+            }
+            m_offset += (uint64_t)count;
+            return (size_t)count;
+#else
+            m_ifs.read((char*)data, (std::streamsize)len);
+            return (size_t)m_ifs.gcount();
+#endif
+        }
+        if (m_bufferPos >= m_bufferSize && !fillBuffer())
+        {
+            return 0;
+        }
+        const size_t count = std::min(len, m_bufferSize - m_bufferPos);
+        std::memcpy(data, &m_buffer[m_bufferPos], count);
+        m_bufferPos += count;
+        return count;
+    }
+
+    void CompressedInput::adviseReadahead(const size_t nextLen)
+    {
+#ifdef __linux__
+        if (m_fd < 0)
+        {
+            return;
+        }
+        if (m_offset > m_releasedOffset)
+        {
+            posix_fadvise(m_fd, (off_t)m_releasedOffset, (off_t)(m_offset - m_releasedOffset), POSIX_FADV_DONTNEED);
+            m_releasedOffset = m_offset;
+        }
+        if (nextLen > 0)
+        {
+            posix_fadvise(m_fd, (off_t)m_offset, (off_t)nextLen, POSIX_FADV_WILLNEED);
+        }
+#else
+        (void)nextLen;
+#endif
+    }
+
+    bool CompressedInput::fillBuffer()
+    {
+        m_bufferSize = m_bufferPos = 0;
+        // 空的块（如BGZF的EOF标记）不产生数据，继续读下一段
+        while (!m_failed && m_bufferSize == 0)
+        {
+            if (!(m_format == Format::GZIP ? inflateStream() : inflateBlocks()))
+            {
+                return false;
+            }
+        }
+        return !m_failed;
+    }
+
+    bool CompressedInput::inflateStream()
+    {
+        Stream& stream = *m_stream;
+        if (stream.finished)
+        {
+            return false;
+        }
+        if (m_buffer.size() < STREAM_CHUNK_SIZE)
+        {
+            m_buffer.resize(STREAM_CHUNK_SIZE);
+        }
+        z_stream& zs = stream.zs;
+        zs.next_out = &m_buffer[0];
+        zs.avail_out = (uInt)STREAM_CHUNK_SIZE;
+        while (zs.avail_out > 0)
+        {
+            if (zs.avail_in == 0)
+            {
+                m_ifs.read((char*)&stream.input[0], stream.input.size());
+                zs.next_in = &stream.input[0];
+                zs.avail_in = (uInt)m_ifs.gcount();
+                if (zs.avail_in == 0)
+                {
+                    // 文件在gzip流的中间结束
+                    m_failed = true;
+                    return false;
+                }
+            }
+            const int ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END)
+            {
+                // 多个member拼接的文件继续解压下一个member
+                if (zs.avail_in == 0 && m_ifs.peek() == std::char_traits<char>::eof())
+                {
+                    stream.finished = true;
+                    break;
+                }
+                inflateReset(&zs);
+            }
+            else if (ret != Z_OK)
+            {
+                m_failed = true;
+                return false;
+            }
+        }
+        m_bufferSize = STREAM_CHUNK_SIZE - zs.avail_out;
+        return true;
+    }
+
+    bool CompressedInput::readBlock(Block& block, bool& end)
+    {
+        end = false;
+        if (m_ifs.peek() == std::char_traits<char>::eof())
+        {
+            end = true;
+            return true;
+        }
+        unsigned int headerSize = 0;
+        const size_t blockSize = read_block_header(m_ifs, headerSize);
+        if (blockSize == 0)
+        {
+            // 分块gzip之后出现了普通的member
+            return false;
+        }
+        block.compressedOffset = m_compressed.size();
+        block.compressedSize = blockSize - headerSize - GZIP_TRAILER_SIZE;
+        m_compressed.resize(block.compressedOffset + block.compressedSize);
+        uint8_t trailer[GZIP_TRAILER_SIZE];
+        if (!m_ifs.read((char*)&m_compressed[block.compressedOffset], block.compressedSize)
+            || !m_ifs.read((char*)trailer, sizeof(trailer)))
+        {
+            return false;
+        }
+        block.crc = read_le32(trailer);
+        block.outputSize = read_le32(trailer + 4);
+        return block.outputSize <= BLOCKED_GZIP_BLOCK_SIZE;
+    }
+
+    bool CompressedInput::inflateBlocks()
+    {
+        // 每个线程分到几个块，块之间的负载差异可以相互抵消
+        const unsigned int group = std::max(get_thread_num(), 1u) * 4;
+        m_compressed.clear();
+        m_blocks.clear();
+        size_t outputSize = 0;
+        bool end = false;
+        for (unsigned int i = 0; i < group; i++)
+        {
+            Block block;
+            if (!readBlock(block, end))
+            {
+                m_failed = true;
+                return false;
+            }
+            if (end)
+            {
+                break;
+            }
+            if (block.outputSize == 0)
+            {
+                // 空块（如结束标记）没有数据
+                continue;
+            }
+            block.outputOffset = outputSize;
+            outputSize += block.outputSize;
+            m_blocks.push_back(block);
+        }
+        if (m_blocks.empty())
+        {
+            // 这一组都是空块时由fillBuffer继续读下一组
+            return !end;
+        }
+        if (m_buffer.size() < outputSize)
+        {
+            m_buffer.resize(outputSize);
+        }
+
+        std::atomic<bool> failed(false);
+        auto worker = [&](const unsigned int start, const unsigned int stop)
+        {
+            z_stream zs;
+            std::memset(&zs, 0, sizeof(zs));
+            if (inflateInit2(&zs, -15) != Z_OK)
+            {
+                failed = true;
+                return;
+            }
+            for (unsigned int i = start; i < stop && !failed; i++)
+            {
+                const Block& block = m_blocks[i];
+                uint8_t* output = m_buffer.data() + block.outputOffset;
+                inflateReset(&zs);
+                zs.next_in = &m_compressed[block.compressedOffset];
+                zs.avail_in = (uInt)block.compressedSize;
+                zs.next_out = output;
+                zs.avail_out = block.outputSize;
+                if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != block.outputSize
+                    || crc32(0, output, block.outputSize) != block.crc)
+                {
+                    failed = true;
+                }
+            }
+            inflateEnd(&zs);
+        };
+        dispatch_worker(worker, (unsigned int)m_blocks.size());
+        if (failed)
+        {
+            m_failed = true;
+            return false;
+        }
+        m_bufferSize = outputSize;
+        return true;
+    }
+
+    // 把一块数据压缩为一个完整的分块gzip member
+    static bool compress_block(const uint8_t* data, const unsigned int len, const int level, std::vector<uint8_t>& member)
+    {
+        const unsigned int headerSize = GZIP_HEADER_SIZE + 6;
+        member.resize(headerSize + compressBound(len) + GZIP_TRAILER_SIZE);
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            return false;
+        }
+        zs.next_in = (Bytef*)data;
+        zs.avail_in = len;
+        zs.next_out = &member[headerSize];
+        zs.avail_out = (uInt)(member.size() - headerSize - GZIP_TRAILER_SIZE);
+        const int ret = deflate(&zs, Z_FINISH);
+        const size_t compressedSize = zs.total_out;
+        deflateEnd(&zs);
+        const size_t blockSize = headerSize + compressedSize + GZIP_TRAILER_SIZE;
+        if (ret != Z_STREAM_END || blockSize > 0x10000)
+        {
+            // 无法压缩的数据按原样存储（level 0），长度一定不超过16位
+            return level != 0 && compress_block(data, len, 0, member);
+        }
+        const uint8_t header[headerSize] = { 0x1f, 0x8b, 8, GZIP_FLAG_EXTRA, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+                                             (uint8_t)(blockSize - 1), (uint8_t)((blockSize - 1) >> 8) };
+        std::memcpy(&member[0], header, headerSize);
+        write_le32(&member[headerSize + compressedSize], (uint32_t)crc32(0, data, len));
+        write_le32(&member[headerSize + compressedSize + 4], len);
+        member.resize(blockSize);
+        return true;
+    }
+
+    bool compress_file_blocked(const std::string& srcPath, const std::string& dstPath, const int level)
+    {
+        std::ifstream ifs(srcPath, std::ios::binary);
+        std::ofstream ofs(dstPath, std::ios::binary);
+        if (!ifs.is_open() || !ofs.is_open())
+        {
+            return false;
+        }
+        const unsigned int group = std::max(get_thread_num(), 1u) * 4;
+        std::vector<uint8_t> input((size_t)group * BLOCKED_GZIP_BLOCK_SIZE);
+        std::vector<std::vector<uint8_t>> members(group);
+        while (ifs)
+        {
+            ifs.read((char*)&input[0], input.size());
+            const size_t len = (size_t)ifs.gcount();
+            const unsigned int blocks = (unsigned int)((len + BLOCKED_GZIP_BLOCK_SIZE - 1) / BLOCKED_GZIP_BLOCK_SIZE);
+            std::atomic<bool> failed(false);
+            dispatch_worker([&](const unsigned int start, const unsigned int stop)
+            {
+                for (unsigned int i = start; i < stop; i++)
+                {
+                    const size_t offset = (size_t)i * BLOCKED_GZIP_BLOCK_SIZE;
+                    const unsigned int blockLen = (unsigned int)std::min<size_t>(len - offset, BLOCKED_GZIP_BLOCK_SIZE);
+                    if (!compress_block(&input[offset], blockLen, level, members[i]))
+                    {
+                        failed = true;
+                    }
+                }
+            }, blocks);
+            if (failed)
+            {
+                return false;
+            }
+            for (unsigned int i = 0; i < blocks; i++)
+            {
+                ofs.write((const char*)&members[i][0], members[i].size());
+            }
+        }
+        // 与BGZF相同的空块作为结束标记
+        static const uint8_t eofBlock[28] = { 0x1f, 0x8b, 8, GZIP_FLAG_EXTRA, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+                                              0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+        ofs.write((const char*)eofBlock, sizeof(eofBlock));
+        return ifs.eof() && ofs.good();
+    }
+
+    std::string resolve_compressed_path(const std::string& path)
+    {
+        if (std::ifstream(path).is_open())
+        {
+            return path;
+        }
+        const std::string compressedPath = path + ".gz";
+        return std::ifstream(compressedPath).is_open() ? compressedPath : path;
+    }
+}
@@ -0,0 +1,418 @@
+//
+// Created by yang chen on 2018/4/24.
+//
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "../include/Dataset.h"
+#include "../include/CalcFunctions.h"
+
+namespace MiniCNN
+{
+    // 缓存文件：header，然后是float样本、float one-hot label、uint8 label三段，每段的起始位置按4096对齐
+    static const char CACHE_MAGIC[8] = { 'M', 'C', 'N', 'N', 'D', 'S', 'E', 'T' };
+    static const uint32_t CACHE_VERSION = 1;
+    static const size_t CACHE_ALIGNMENT = 4096;
+    // 写入key的预处理方式，修改fillBatch的预处理时需要同时修改
+    static const char* const PREPROCESS_SETTINGS = "fp32 NCWH scale=1/255 label=one-hot";
+
+    struct CacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t classes;
+        uint64_t key;
+        uint32_t count;
+        uint32_t channels;
+        uint32_t width;
+        uint32_t height;
+        uint64_t samplesOffset;
+        uint64_t oneHotOffset;
+        uint64_t labelsOffset;
+        uint64_t fileSize;
+    };
+
+    static inline uint64_t align_offset(const uint64_t offset)
+    {
+        return (offset + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+    }
+
+    // 各段的位置只由样本数、样本大小和类别数决定
+    static CacheHeader make_cache_header(const uint64_t key, const unsigned int count, const Shape& sampleShape,
+                                         const unsigned int classes)
+    {
+        CacheHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        header.version = CACHE_VERSION;
+        header.classes = classes;
+        header.key = key;
+        header.count = count;
+        header.channels = sampleShape.Channels;
+        header.width = sampleShape.Width;
+        header.height = sampleShape.Height;
+        header.samplesOffset = align_offset(sizeof(CacheHeader));
+        header.oneHotOffset = align_offset(header.samplesOffset + (uint64_t)count * sampleShape.oneBatchSize() * sizeof(float));
+        header.labelsOffset = align_offset(header.oneHotOffset + (uint64_t)count * classes * sizeof(float));
+        header.fileSize = header.labelsOffset + count;
+        return header;
+    }
+
+    // 只读映射整个文件，不支持mmap的平台读入内存
+    static std::shared_ptr<void> map_file(const std::string& path, size_t& size)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        struct stat fileStat;
+        void* addr = MAP_FAILED;
+        if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0)
+        {
+            size = (size_t)fileStat.st_size;
+            addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (addr == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        const size_t mappedSize = size;
+        return std::shared_ptr<void>(addr, [mappedSize](void* p) { munmap(p, mappedSize); });
+#else
+        std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+        if (!ifs.is_open())
+        {
+            return nullptr;
+        }
+        size = (size_t)ifs.tellg();
+        std::shared_ptr<char> buffer(new char[size], std::default_delete<char[]>());
+        ifs.seekg(0);
+        ifs.read(buffer.get(), size);
+        return ifs ? std::static_pointer_cast<void>(buffer) : nullptr;
+#endif
+    }
+
+    Dataset::Dataset() {}
+
+    Dataset::~Dataset() {}
+
+    bool Dataset::create(const Shape& sampleShape, const unsigned int classes,
+                         std::vector<uint8_t>&& samples, std::vector<uint8_t>&& labels)
+    {
+        const size_t sampleSize = sampleShape.oneBatchSize();
+        if (sampleSize == 0 || classes == 0 || classes > 256 || samples.size() != labels.size() * sampleSize)
+        {
+            return false;
+        }
+        for (const uint8_t label : labels)
+        {
+            if (label >= classes)
+            {
+                return false;
+            }
+        }
+        m_sampleShape = Shape(1, sampleShape.Channels, sampleShape.Width, sampleShape.Height);
+        m_classes = classes;
+        m_samples = std::move(samples);
+        m_labels = std::move(labels);
+        m_mapping.reset();
+        m_floatSamples = nullptr;
+        m_floatLabels = nullptr;
+        return true;
+    }
+
+    bool Dataset::saveCache(const std::string& path, const uint64_t key) const
+    {
+        if (empty())
+        {
+            return false;
+        }
+        const CacheHeader header = make_cache_header(key, size(), m_sampleShape, m_classes);
+        // 临时文件名带随机后缀，同时生成同一个缓存的进程互不干扰，rename之后其他进程才能看到
+        std::random_device rd;
+        const std::string tmpPath = path + ".tmp" + std::to_string(rd());
+        std::ofstream ofs(tmpPath, std::ios::binary);
+        if (!ofs.is_open())
+        {
+            return false;
+        }
+
+        const unsigned int sampleSize = getSampleSize();
+        const std::vector<char> padding(CACHE_ALIGNMENT, 0);
+        const auto pad_to = [&](const uint64_t offset)
+        {
+            ofs.write(&padding[0], (std::streamsize)(offset - (uint64_t)ofs.tellp()));
+        };
+        ofs.write((const char*)&header, sizeof(header));
+        pad_to(header.samplesOffset);
+        std::vector<float> row(std::max(sampleSize, m_classes));
+        for (unsigned int i = 0; i < size(); i++)
+        {
+            const float* sampleData = m_floatSamples + (size_t)i * sampleSize;
+            if (!isCached())
+            {
+                Tensor rowTensor(Shape(1, m_sampleShape.Channels, m_sampleShape.Width, m_sampleShape.Height),
+                                 std::shared_ptr<float>(row.data(), [](float*) {}));
+                fillBatch(&i, 1, rowTensor, nullptr);
+                sampleData = row.data();
+            }
+            ofs.write((const char*)sampleData, sampleSize * sizeof(float));
+        }
+        pad_to(header.oneHotOffset);
+        for (unsigned int i = 0; i < size(); i++)
+        {
+            std::fill(row.begin(), row.begin() + m_classes, 0.0f);
+            row[m_labels[i]] = 1.0f;
+            ofs.write((const char*)row.data(), m_classes * sizeof(float));
+        }
+        pad_to(header.labelsOffset);
+        ofs.write((const char*)m_labels.data(), m_labels.size());
+        ofs.close();
+
+        if (!ofs || std::rename(tmpPath.c_str(), path.c_str()) != 0)
+        {
+            std::remove(tmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool Dataset::loadCache(const std::string& path, const uint64_t key)
+    {
+        size_t fileSize = 0;
+        std::shared_ptr<void> mapping = map_file(path, fileSize);
+        if (mapping == nullptr || fileSize < sizeof(CacheHeader))
+        {
+            return false;
+        }
+        CacheHeader header;
+        std::memcpy(&header, mapping.get(), sizeof(header));
+        const Shape sampleShape(1, header.channels, header.width, header.height);
+        const CacheHeader expected = make_cache_header(key, header.count, sampleShape, header.classes);
+        if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION
+            || header.key != key || header.count == 0 || sampleShape.oneBatchSize() == 0
+            || header.classes == 0 || header.classes > 256 || std::memcmp(&header, &expected, sizeof(header)) != 0
+            || header.fileSize != fileSize)
+        {
+            return false;
+        }
+
+        const char* base = (const char*)mapping.get();
+        const uint8_t* labels = (const uint8_t*)(base + header.labelsOffset);
+        if (std::any_of(labels, labels + header.count, [&](const uint8_t label) { return label >= header.classes; }))
+        {
+            return false;
+        }
+
+        m_sampleShape = sampleShape;
+        m_classes = header.classes;
+        m_samples.clear();
+        m_samples.shrink_to_fit();
+        m_labels.assign(labels, labels + header.count);
+        m_floatSamples = (const float*)(base + header.samplesOffset);
+        m_floatLabels = (const float*)(base + header.oneHotOffset);
+        m_mapping = mapping;
+        return true;
+    }
+
+    std::vector<unsigned int> Dataset::getClassCounts() const
+    {
+        std::vector<unsigned int> counts(m_classes, 0);
+        for (const uint8_t label : m_labels)
+        {
+            counts[label]++;
+        }
+        return counts;
+    }
+
+    unsigned int Dataset::fillBatch(const unsigned int* indices, const unsigned int count,
+                                    Tensor& inputTensor, Tensor* labelTensor) const
+    {
+        assert(inputTensor.isContiguous() && inputTensor.getShape().oneBatchSize() == getSampleSize());
+        const unsigned int n = std::min(count, inputTensor.getShape().Batch);
+        const unsigned int sampleSize = getSampleSize();
+        const unsigned int sizePerLabel = labelTensor != nullptr ? labelTensor->getShape().oneBatchSize() : 0;
+        assert(labelTensor == nullptr || (labelTensor->isContiguous() && labelTensor->getShape().Batch >= n));
+        float* inputData = inputTensor.getData().get();
+        float* labelData = labelTensor != nullptr ? labelTensor->getData().get() : nullptr;
+
+        if (isCached())
+        {
+            // 下标连续的一段样本在缓存中也是连续的，整段拷贝
+            unsigned int i = 0;
+            while (i < n)
+            {
+                unsigned int run = 1;
+                while (i + run < n && indices[i + run] == indices[i] + run)
+                {
+                    run++;
+                }
+                assert(indices[i] + run <= size());
+                std::memcpy(inputData + (size_t)i * sampleSize, m_floatSamples + (size_t)indices[i] * sampleSize,
+                            (size_t)run * sampleSize * sizeof(float));
+                if (labelData != nullptr && sizePerLabel == m_classes)
+                {
+                    std::memcpy(labelData + (size_t)i * sizePerLabel, m_floatLabels + (size_t)indices[i] * m_classes,
+                                (size_t)run * m_classes * sizeof(float));
+                }
+                i += run;
+            }
+            if (labelData == nullptr || sizePerLabel == m_classes)
+            {
+                return n;
+            }
+        }
+        else
+        {
+            //scale to 0.0f~1.0f
+            const float scaleRate = getSampleScale();
+            for (unsigned int i = 0; i < n; i++)
+            {
+                assert(indices[i] < size());
+                uint8_to_float(getSample(indices[i]), inputData + (size_t)i * sampleSize, sampleSize, scaleRate);
+            }
+        }
+
+        if (labelData != nullptr)
+        {
+            std::fill(labelData, labelData + (size_t)n * sizePerLabel, 0.0f);
+            for (unsigned int i = 0; i < n; i++)
+            {
+                assert(getLabel(indices[i]) < sizePerLabel);
+                labelData[(size_t)i * sizePerLabel + getLabel(indices[i])] = 1.0f;
+            }
+        }
+        return n;
+    }
+
+    bool Dataset::viewBatch(const unsigned int* indices, const unsigned int count,
+                            std::shared_ptr<Tensor>& inputTensor, std::shared_ptr<Tensor>& labelTensor) const
+    {
+        if (!isCached() || count == 0 || indices[0] >= size() || count > size() - indices[0])
+        {
+            return false;
+        }
+        for (unsigned int i = 1; i < count; i++)
+        {
+            if (indices[i] != indices[0] + i)
+            {
+                return false;
+            }
+        }
+
+        // 与映射共用引用计数，只是指向其中的样本；映射是只读的，调用者不能写入
+        const size_t first = indices[0];
+        Shape sampleShape = m_sampleShape;
+        sampleShape.Batch = count;
+        inputTensor = std::make_shared<Tensor>(sampleShape, std::shared_ptr<float>(
+                m_mapping, const_cast<float*>(m_floatSamples + first * getSampleSize())));
+        labelTensor = std::make_shared<Tensor>(Shape(count, m_classes, 1, 1), std::shared_ptr<float>(
+                m_mapping, const_cast<float*>(m_floatLabels + first * m_classes)));
+        return true;
+    }
+
+    // FNV-1a的变体：每次合并8个字节，结尾不足8个字节的部分逐字节合并
+    static void fnv1a_update(uint64_t& hash, const void* data, const size_t len)
+    {
+        const unsigned char* bytes = (const unsigned char*)data;
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, sizeof(word));
+            hash = (hash ^ word) * 0x100000001b3ULL;
+        }
+        for (; i < len; i++)
+        {
+            hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+        }
+    }
+
+    uint64_t dataset_cache_key(const std::vector<std::string>& sourceFiles, const std::string& settings)
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        const uint32_t version = CACHE_VERSION;
+        fnv1a_update(hash, &version, sizeof(version));
+        fnv1a_update(hash, PREPROCESS_SETTINGS, std::strlen(PREPROCESS_SETTINGS) + 1);
+        fnv1a_update(hash, settings.c_str(), settings.size() + 1);
+        // 不读取整个源文件（命中缓存时就不需要源文件的I/O了），只使用文件的大小、修改时间和开头的4KB（包括文件头）
+        std::vector<char> head(4096);
+        for (const auto& file : sourceFiles)
+        {
+            std::ifstream ifs(file, std::ios::binary | std::ios::ate);
+            if (!ifs.is_open())
+            {
+                return 0;
+            }
+            const uint64_t fileSize = (uint64_t)ifs.tellg();
+            ifs.seekg(0);
+            ifs.read(&head[0], (std::streamsize)std::min<uint64_t>(fileSize, head.size()));
+            fnv1a_update(hash, &head[0], (size_t)ifs.gcount());
+            uint64_t modifiedTime[2] = { 0, 0 };
+#if defined(__unix__) || defined(__APPLE__)
+            struct stat fileStat;
+            if (stat(file.c_str(), &fileStat) != 0)
+            {
+                return 0;
+            }
+#if defined(__APPLE__)
+            modifiedTime[0] = (uint64_t)fileStat.st_mtimespec.tv_sec;
+            modifiedTime[1] = (uint64_t)fileStat.st_mtimespec.tv_nsec;
+#else
+            modifiedTime[0] = (uint64_t)fileStat.st_mtim.tv_sec;
+            modifiedTime[1] = (uint64_t)fileStat.st_mtim.tv_nsec;
+#endif
+#endif
+            fnv1a_update(hash, modifiedTime, sizeof(modifiedTime));
+            // 文件之间的边界也参与hash
+            fnv1a_update(hash, &fileSize, sizeof(fileSize));
+        }
+        // 0表示无效的key
+        return hash != 0 ? hash : 1;
+    }
+
+    bool load_dataset_with_cache(const std::vector<std::string>& sourceFiles, const std::string& settings,
+                                 const std::string& name, const std::string& cacheDir,
+                                 const std::function<bool(Dataset&)>& decode, Dataset& dataset)
+    {
+        if (cacheDir.empty())
+        {
+            return decode(dataset);
+        }
+        const uint64_t key = dataset_cache_key(sourceFiles, settings);
+        if (key == 0)
+        {
+            return false;
+        }
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%016llx.cache", (unsigned long long)key);
+        const std::string cachePath = cacheDir + "/" + name + suffix;
+        if (dataset.loadCache(cachePath, key))
+        {
+            return true;
+        }
+        if (!decode(dataset))
+        {
+            return false;
+        }
+        // 生成后重新映射，本次运行也直接使用缓存
+        if (dataset.saveCache(cachePath, key))
+        {
+            dataset.loadCache(cachePath, key);
+        }
+        return true;
+    }
+}
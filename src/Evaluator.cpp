@@ -0,0 +1,200 @@
+//
+// Created by yang chen on 2018/4/20.
+//
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <thread>
+#include "../include/Evaluator.h"
+#include "../include/CalcFunctions.h"
+#include "../include/ThreadPool.h"
+
+namespace MiniCNN
+{
+    Evaluator::Evaluator(Network& network, const unsigned int batch, const unsigned int contexts)
+            : m_network(network), m_batch(std::max(batch, 1u)), m_nextBatch(0)
+    {
+        Shape inputShape = m_network.m_data[0]->getShape();
+        inputShape.Batch = m_batch;
+        m_classes = m_network.m_data[m_network.m_data.size() - 1]->getShape().oneBatchSize();
+
+        m_contexts.resize(std::max(contexts, 1u));
+        for (unsigned int i = 0; i < m_contexts.size(); i++)
+        {
+            Context& context = m_contexts[i];
+            if (i > 0)
+            {
+                context.replica = m_network.createReplica();
+            }
+            context.network = i > 0 ? context.replica.get() : &m_network;
+            context.inputTensor = std::make_shared<Tensor>(inputShape);
+            context.labelTensor = std::make_shared<Tensor>(Shape(m_batch, m_classes, 1, 1));
+            context.labels.resize(m_batch);
+            context.confusion.resize(m_classes * m_classes);
+        }
+        setTopK(1);
+    }
+
+    Evaluator::~Evaluator() {}
+
+    void Evaluator::setTopK(const unsigned int k)
+    {
+        m_topK = std::min(std::max(k, 1u), m_classes);
+        for (auto& context : m_contexts)
+        {
+            context.predictions.resize(m_batch * m_topK);
+        }
+    }
+
+    void Evaluator::syncReplicas()
+    {
+        for (unsigned int i = 1; i < m_contexts.size(); i++)
+        {
+            Context& context = m_contexts[i];
+            if (!m_network.shareParamsWith(*context.replica))
+            {
+                context.replica = m_network.createReplica();
+                context.network = context.replica.get();
+            }
+        }
+    }
+
+    EvaluationResult Evaluator::evaluate(BatchFiller filler, const unsigned int batches)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+
+        syncReplicas();
+        m_nextBatch.store(0);
+        m_deterministic = is_deterministic();
+        if (m_deterministic)
+        {
+            m_batchLoss.assign(batches, 0.0);
+        }
+        for (auto& context : m_contexts)
+        {
+            std::fill(context.confusion.begin(), context.confusion.end(), 0);
+            context.samples = 0;
+            context.correct = 0;
+            context.topKCorrect = 0;
+            context.lossSum = 0.0;
+        }
+
+        if (m_contexts.size() == 1)
+        {
+            contextLoop(0, filler, batches);
+        }
+        else
+        {
+            std::vector<std::thread> threads;
+            for (unsigned int i = 1; i < m_contexts.size(); i++)
+            {
+                threads.emplace_back(&Evaluator::contextLoop, this, i, std::ref(filler), batches);
+            }
+            contextLoop(0, filler, batches);
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+        }
+
+        EvaluationResult result;
+        result.classes = m_classes;
+        result.topK = m_topK;
+        result.confusion.resize(m_classes * m_classes, 0);
+        unsigned int correct = 0;
+        unsigned int topKCorrect = 0;
+        double lossSum = 0.0;
+        for (const auto& context : m_contexts)
+        {
+            result.samples += context.samples;
+            correct += context.correct;
+            topKCorrect += context.topKCorrect;
+            lossSum += m_deterministic ? 0.0 : context.lossSum;
+            for (unsigned int i = 0; i < result.confusion.size(); i++)
+            {
+                result.confusion[i] += context.confusion[i];
+            }
+        }
+
+        for (unsigned int i = 0; m_deterministic && i < batches; i++)
+        {
+            lossSum += m_batchLoss[i];
+        }
+
+        const auto end = std::chrono::steady_clock::now();
+        result.seconds = std::chrono::duration<double>(end - begin).count();
+        if (result.samples > 0)
+        {
+            result.accuracy = (float)correct / (float)result.samples;
+            result.topKAccuracy = (float)topKCorrect / (float)result.samples;
+            result.loss = (float)(lossSum / result.samples);
+        }
+        result.samplesPerSecond = result.seconds > 0.0 ? result.samples / result.seconds : 0.0;
+        return result;
+    }
+
+    void Evaluator::contextLoop(const unsigned int contextIdx, BatchFiller& filler, const unsigned int batches)
+    {
+        // 多路并发时每路本身就是一路并行，层内的计算不再分发到线程池；结束时恢复调用者原来的设置
+        const bool serial = m_contexts.size() > 1;
+        const bool prevSerial = is_serial_dispatch();
+        if (serial)
+        {
+            set_serial_dispatch(true);
+        }
+
+        Context& context = m_contexts[contextIdx];
+        Network& network = *context.network;
+        while (true)
+        {
+            const unsigned int batchIdx = m_nextBatch.fetch_add(1);
+            if (batchIdx >= batches)
+            {
+                break;
+            }
+
+            // 上一个batch不足时缩小过batch，容量不变，这里只恢复形状
+            context.inputTensor->resizeBatch(m_batch);
+            context.labelTensor->resizeBatch(m_batch);
+            std::shared_ptr<Tensor> inputTensor = context.inputTensor;
+            std::shared_ptr<Tensor> labelTensor = context.labelTensor;
+            const unsigned int count = std::min(filler(batchIdx, inputTensor, labelTensor), m_batch);
+            if (count == 0)
+            {
+                continue;
+            }
+            assert(inputTensor->getShape().Batch >= count && labelTensor->getShape().Batch >= count);
+            inputTensor->resizeBatch(count);
+            labelTensor->resizeBatch(count);
+
+            const std::shared_ptr<Tensor> probTensor = network.testBatch(inputTensor);
+            const double batchLoss = (double)network.getLoss(labelTensor, probTensor) * count;
+            if (m_deterministic)
+            {
+                m_batchLoss[batchIdx] = batchLoss;
+            }
+            else
+            {
+                context.lossSum += batchLoss;
+            }
+
+            const float* probData = probTensor->getData().get();
+            unsigned int* predictions = &context.predictions[0];
+            argmax(labelTensor->getData().get(), count, m_classes, &context.labels[0]);
+            top_k(probData, count, m_classes, m_topK, predictions);
+            for (unsigned int i = 0; i < count; i++)
+            {
+                const unsigned int label = context.labels[i];
+                const unsigned int* samplePredictions = predictions + i * m_topK;
+                context.confusion[label * m_classes + samplePredictions[0]]++;
+                context.correct += samplePredictions[0] == label ? 1 : 0;
+                context.topKCorrect += std::find(samplePredictions, samplePredictions + m_topK, label)
+                                       != samplePredictions + m_topK ? 1 : 0;
+            }
+            context.samples += count;
+        }
+
+        set_serial_dispatch(prevSerial);
+    }
+}
@@ -0,0 +1,91 @@
+//
+// Created by yang chen on 2018/4/3.
+//
+#include <cassert>
+#include <sstream>
+#include "../include/FullyConnectedActivationLayer.h"
+#include "../include/ActivationLayer.h"
+#include "../include/ThreadPool.h"
+
+namespace MiniCNN
+{
+
+    FullyConnectedActivationLayer::FullyConnectedActivationLayer() {}
+
+    FullyConnectedActivationLayer::FullyConnectedActivationLayer(const FullyConnectedLayer& fullyConnectedLayer,
+                                                                 const ActivationType activation)
+            : FullyConnectedLayer(fullyConnectedLayer), m_activation(activation)
+    {
+        // 只由fuseLayers从ReluLayer、SigmoidLayer融合得到，没有activation时应直接使用FullyConnectedLayer
+        assert(activation != ActivationType::NONE);
+    }
+
+    FullyConnectedActivationLayer::~FullyConnectedActivationLayer() {}
+
+    DEFINE_LAYER_TYPE(FullyConnectedActivationLayer, "FullyConnectedActivationLayer");
+    std::string FullyConnectedActivationLayer::getLayerType() const
+    {
+        return layerType;
+    }
+
+    std::string FullyConnectedActivationLayer::save() const
+    {
+        // 按融合前的两层保存，模型文件与未融合的网络通用
+        return FullyConnectedLayer::save() + "\n" + activation_layer_type(m_activation);
+    }
+
+    bool FullyConnectedActivationLayer::load(const std::string content)
+    {
+        const size_t lineEnd = content.find('\n');
+        if (!FullyConnectedLayer::load(content.substr(0, lineEnd)))
+        {
+            return false;
+        }
+
+        std::string activationType;
+        if (lineEnd != std::string::npos)
+        {
+            std::stringstream ss(content.substr(lineEnd + 1));
+            ss >> activationType;
+        }
+        // 缺少激活层或者不认识的激活层都不能加载，不替换为其他的activation
+        const ActivationType activation = activation_from_layer_type(activationType);
+        if (activation == ActivationType::NONE)
+        {
+            return false;
+        }
+        m_activation = activation;
+        return true;
+    }
+
+    void FullyConnectedActivationLayer::forward(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next)
+    {
+        forwardWithActivation(prev, next, m_activation);
+    }
+
+    void FullyConnectedActivationLayer::backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
+                                                 std::shared_ptr<Tensor>& prevGrad, const std::shared_ptr<Tensor>& nextGrad)
+    {
+        const Shape nextLayerShape = next->getShape();
+        // batch变化时只在容量不够的时候重新分配
+        if (!m_delta || m_delta->getShape().oneBatchSize() != nextLayerShape.oneBatchSize())
+        {
+            m_delta.reset(new Tensor(nextLayerShape));
+        }
+        m_delta->resizeBatch(nextLayerShape.Batch);
+
+        // 先求activation之前的梯度，再按全连接层反向传播
+        const float* nextData = next->getData().get();
+        const float* nextGradData = nextGrad->getData().get();
+        float* deltaData = m_delta->getData().get();
+        auto worker = [&](const unsigned int start, const unsigned int end)
+        {
+            const unsigned int offset = start * nextLayerShape.oneBatchSize();
+            const unsigned int totalSize = (end - start) * nextLayerShape.oneBatchSize();
+            activation_delta(nextData + offset, nextGradData + offset, deltaData + offset, totalSize, m_activation);
+        };
+        dispatch_worker(worker, nextLayerShape.Batch);
+
+        backwardWithDelta(prev, prevGrad, m_delta);
+    }
+}
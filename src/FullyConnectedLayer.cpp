@@ -19,6 +19,13 @@ namespace MiniCNN
         setOutputShape(paramShape);
     }
 
+    void FullyConnectedLayer::setWeightDataType(const DataType dataType)
+    {
+        m_weightDataType = dataType;
+        m_narrowWeight.reset();
+        m_narrowWeightDirty = true;
+    }
+
     DEFINE_LAYER_TYPE(FullyConnectedLayer, "FullyConnectedLayer");
     std::string FullyConnectedLayer::getLayerType() const
     {
@@ -30,7 +37,7 @@ namespace MiniCNN
         const std::string spliter = " ";
         std::stringstream ss;
 
-        ss << getLayerType() << spliter << m_paramShape.Batch << spliter << m_paramShape.Channels << spliter
+        ss << layerType << spliter << m_paramShape.Batch << spliter << m_paramShape.Channels << spliter
            << m_paramShape.Width << spliter << m_paramShape.Height << spliter << m_enableBias << spliter;
 
         const auto weightData = m_weight->getData().get();
@@ -55,15 +62,16 @@ namespace MiniCNN
         return ss.str();
     }
 
-    void FullyConnectedLayer::load(const std::string content)
+    bool FullyConnectedLayer::load(const std::string content)
     {
-        std::stringstream ss;
+        std::stringstream ss(content);
         std::string _layerType;
         ss >> _layerType >> m_paramShape.Batch >> m_paramShape.Channels >> m_paramShape.Width
            >> m_paramShape.Height >> m_enableBias;
 
         setOutputShape(m_paramShape);
         solveInnerParams();
+        m_narrowWeightDirty = true;
         const auto weightData = m_weight->getData().get();
         const auto weightShape = m_weight->getShape();
         unsigned int totalSize = weightShape.totalSize();
@@ -82,6 +90,7 @@ namespace MiniCNN
                 ss >> biasData[i];
             }
         }
+        return true;
     }
 
     void FullyConnectedLayer::solveInnerParams()
@@ -98,7 +107,8 @@ namespace MiniCNN
             m_weight.reset(new Tensor(Shape(1, weightNum, 1, 1)));
 
             // 默认使用高斯分布初始化
-            normal_distribution_init(m_weight->getData().get(), m_weight->getShape().totalSize(), 0.0f, 0.1f);
+            normal_distribution_init(m_weight->getData().get(), m_weight->getShape().totalSize(), 0.0f, 0.1f,
+                                     getRandomStream());
         }
 
         if (m_weightGradient.get() == nullptr)
@@ -133,9 +143,82 @@ namespace MiniCNN
 
     }
 
+    void FullyConnectedLayer::shareParams(const std::vector<std::shared_ptr<Tensor>>& params)
+    {
+        m_weight = params[0];
+        m_bias = params[1];
+        m_narrowWeightDirty = true;
+
+        m_params.clear();
+        m_params.push_back(m_weight);
+        m_params.push_back(m_bias);
+    }
+
+    void FullyConnectedLayer::forwardWithActivation(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next,
+                                                    const ActivationType activation)
+    {
+        const Shape prevLayerShape = prev->getShape();
+        const Shape nextLayerShape = next->getShape();
+
+        const float* prevLayerData = prev->getData().get();
+        float* nextLayerData = next->getData().get();
+        const float* pBiasData = m_enableBias ? m_bias->getData().get() : nullptr;
+
+        if (m_weightDataType == DataType::FP32)
+        {
+            const float* pWeightData = m_weight->getData().get();
+            // 输入、输出为常见大小时使用按形状特化的kernel
+            const FullyConnectKernel kernel =
+                    get_fully_connect_kernel(prevLayerShape.oneBatchSize(), nextLayerShape.oneBatchSize());
+            auto worker = [&](const unsigned int start, const unsigned int end)
+            {
+                if (kernel)
+                {
+                    kernel(prevLayerData + start * prevLayerShape.oneBatchSize(), pWeightData, pBiasData,
+                           nextLayerData + start * nextLayerShape.oneBatchSize(), end - start,
+                           nextLayerShape.oneBatchSize(), activation);
+                    return;
+                }
+                fullyConnectActivation(prevLayerData + start * prevLayerShape.oneBatchSize(), pWeightData, pBiasData,
+                                       nextLayerData + start * nextLayerShape.oneBatchSize(), end - start,
+                                       prevLayerShape.oneBatchSize(), nextLayerShape.oneBatchSize(), activation);
+            };
+            dispatch_worker(worker, prevLayerShape.Batch);
+            return;
+        }
+
+        // 训练时master weights每个batch都会更新，推理时只在更新后转换一次
+        if (!m_narrowWeight)
+        {
+            m_narrowWeight.reset(new Tensor(m_weight->getShape(), m_weightDataType));
+            m_narrowWeightDirty = true;
+        }
+        if (m_narrowWeightDirty || getState() == State::TRAIN)
+        {
+            m_narrowWeight->convertFrom(*m_weight);
+        }
+        m_narrowWeightDirty = getState() == State::TRAIN;
+
+        const uint16_t* pWeightData = m_narrowWeight->getHalfData().get();
+        auto worker = [&](const unsigned int start, const unsigned int end)
+        {
+            fullyConnectNarrow(prevLayerData + start * prevLayerShape.oneBatchSize(), pWeightData, pBiasData,
+                               nextLayerData + start * nextLayerShape.oneBatchSize(), end - start,
+                               prevLayerShape.oneBatchSize(), nextLayerShape.oneBatchSize(), m_weightDataType, activation);
+        };
+        dispatch_worker(worker, prevLayerShape.Batch);
+    }
+
     void FullyConnectedLayer::forward(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next)
     {
         // forward过程中，prevLayer相当于上一层，nextLayer相当于当前层
+        // 低精度weights或者有按形状特化的kernel时，由forwardWithActivation处理
+        if (m_weightDataType != DataType::FP32 ||
+            get_fully_connect_kernel(prev->getShape().oneBatchSize(), next->getShape().oneBatchSize()))
+        {
+            forwardWithActivation(prev, next, ActivationType::NONE);
+            return;
+        }
 
         const Shape prevLayerShape = prev->getShape();
         const Shape nextLayerShape = next->getShape();
@@ -161,20 +244,22 @@ namespace MiniCNN
                                        std::shared_ptr<Tensor> &prevGrad, const std::shared_ptr<Tensor> &nextGrad)
     {
         // backward过程中，prevLayer相当于当前层，而nextLayer相当于后面传递回来的层
+        backwardWithDelta(prev, prevGrad, nextGrad);
+    }
 
+    void FullyConnectedLayer::backwardWithDelta(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor>& prevGrad,
+                                                const std::shared_ptr<Tensor>& delta)
+    {
         const Shape prevLayerShape = prev->getShape();
-        const Shape nextLayerShape = next->getShape();
         const Shape prevGradShape = prevGrad->getShape();
-        const Shape nextGradShape = nextGrad->getShape();
+        const Shape deltaShape = delta->getShape();
         const Shape weightShape = m_weight->getShape();
         const Shape biasShape = m_enableBias? m_bias->getShape() : Shape();
 
         const float* prevLayerData = prev->getData().get();
-        const float* nextLayerData = next->getData().get();
         float* prevGradData = prevGrad->getData().get();
-        const float* nextGradData = nextGrad->getData().get();
+        const float* deltaData = delta->getData().get();
         const float* weightData = m_weight->getData().get();
-        const float* biasData = m_enableBias? m_bias->getData().get(): nullptr;
 
         // 根据链式法则，计算当前层的gradient
         prevGrad->setData(0.0f);
@@ -185,14 +270,14 @@ namespace MiniCNN
                 for (unsigned int pidx = 0; pidx < prevGradShape.oneBatchSize(); pidx++)
                 {
                     const unsigned int prevGradIdx = pn * prevGradShape.oneBatchSize() + pidx;
-                    for (unsigned int nc = 0; nc < nextGradShape.Channels; nc++)
+                    for (unsigned int nc = 0; nc < deltaShape.Channels; nc++)
                     {
                         // 例如3X2的全连接，则weight = （1，6，1，1），channels = （11，21，31，12，22，32）
                         // 求当前层第1个节点的loss = w11*loss1 + w12*loss2
                         const unsigned int weightIdx = nc * prevLayerShape.oneBatchSize() + pidx;
-                        const unsigned int nextGradIdx = pn * nextGradShape.oneBatchSize() + nc;
+                        const unsigned int deltaIdx = pn * deltaShape.oneBatchSize() + nc;
 
-                        prevGradData[prevGradIdx] += weightData[weightIdx] * nextGradData[nextGradIdx];
+                        prevGradData[prevGradIdx] += weightData[weightIdx] * deltaData[deltaIdx];
                     }
                 }
             }
@@ -202,36 +287,36 @@ namespace MiniCNN
         // 更新当前层的weights
         m_weightGradient->setData(0.0f);
         float* weightGradData = m_weightGradient->getData().get();
-        for (unsigned int pn = 0; pn < nextLayerShape.Batch; pn++)
+        for (unsigned int pn = 0; pn < deltaShape.Batch; pn++)
         {
-            for (unsigned int nc = 0; nc < nextLayerShape.Channels; nc++)
+            for (unsigned int nc = 0; nc < deltaShape.Channels; nc++)
             {
-                const unsigned int nextGradIdx = pn * nextGradShape.oneBatchSize() + nc;
+                const unsigned int deltaIdx = pn * deltaShape.oneBatchSize() + nc;
                 for (unsigned int pidx = 0; pidx < prevGradShape.oneBatchSize(); pidx++)
                 {
                     const unsigned int weightGradIdx = nc * prevGradShape.oneBatchSize() + pidx;
                     const unsigned int prevDataIdx = pn * prevLayerShape.oneBatchSize() + pidx;
 
-                    weightGradData[weightGradIdx] += prevLayerData[prevDataIdx] * nextGradData[nextGradIdx];
+                    weightGradData[weightGradIdx] += prevLayerData[prevDataIdx] * deltaData[deltaIdx];
                 }
             }
         }
-        div_inplace(weightGradData, (float)nextLayerShape.Batch, weightShape.totalSize());
+        div_inplace(weightGradData, (float)deltaShape.Batch, weightShape.totalSize());
 
-        // 更新bias
+        // 更新bias，bias的梯度就是输出的梯度
         if (m_enableBias)
         {
             m_biasGradient->setData(0.0f);
             float* biasGradientData = m_biasGradient->getData().get();
-            for (unsigned int nn = 0; nn < nextLayerShape.Batch; nn++)
+            for (unsigned int nn = 0; nn < deltaShape.Batch; nn++)
             {
                 for (unsigned int biasGradIdx = 0; biasGradIdx < biasShape.oneBatchSize(); biasGradIdx++)
                 {
-                    biasGradientData[biasGradIdx] += 1.0f * nextLayerData[nn * biasShape.oneBatchSize() + biasGradIdx];
+                    biasGradientData[biasGradIdx] += deltaData[nn * biasShape.oneBatchSize() + biasGradIdx];
                 }
             }
             //div by batch size
-            div_inplace(biasGradientData, (float)nextLayerShape.Batch, biasShape.totalSize());
+            div_inplace(biasGradientData, (float)deltaShape.Batch, biasShape.totalSize());
         }
 
     }
@@ -26,7 +26,7 @@ namespace MiniCNN
         return ss.str();
     }
 
-    void InputLayer::load(const std::string content)
+    bool InputLayer::load(const std::string content)
     {
         std::string _layerType;
         unsigned int channels = 0;
@@ -43,6 +43,7 @@ namespace MiniCNN
         setInputShape(shape);
         setOutputShape(shape);
         solveInnerParams();
+        return true;
     }
 
     void InputLayer::forward(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next)
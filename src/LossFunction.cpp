@@ -1,88 +1,77 @@
 //
 // Created by yang chen on 2018/3/8.
 //
-#include <cmath>
 #include "../include/LossFunction.h"
 #include "../include/CalcFunctions.h"
 
 namespace MiniCNN
 {
+    float LossFunction::getLossAndGradient(const std::shared_ptr<Tensor> labelTensor,
+                                           const std::shared_ptr<Tensor> outputTensor,
+                                           std::shared_ptr<Tensor>& gradient, const float gradientScale)
+    {
+        const float loss = getLoss(labelTensor, outputTensor);
+        getGradient(labelTensor, outputTensor, gradient);
+        if (gradientScale != 1.0f)
+        {
+            float* gradientData = gradient->getData().get();
+            for (unsigned int i = 0; i < gradient->getShape().totalSize(); i++)
+            {
+                gradientData[i] *= gradientScale;
+            }
+        }
+        return loss;
+    }
+
+    // loss为所有元素的和除以Batch，即每个样本的平均loss
     float CrossEntropyFunction::getLoss(const std::shared_ptr<Tensor> labelTensor,
                                         const std::shared_ptr<Tensor> outputTensor)
     {
         const Shape outputShape = outputTensor->getShape();
-        const float* labelData = labelTensor->getData().get();
-        const float* outputData = outputTensor->getData().get();
-        float loss = 0.0f;
-
-        for (unsigned int i = 0; i < outputShape.totalSize(); i++)
-        {
-            const float oneLoss = -labelData[i] * std::log(outputData[i]);
-            // 这里使用的是统计学中的简单移动平均值法，目的是为了防止数值溢出，其值是近似准确值
-            // 该方法在BatchNormalization 的论文中有用到
-            loss = moving_average(loss, i+1, oneLoss);
-        }
-        return loss * outputShape.oneBatchSize();
+        const float loss = cross_entropy_loss_gradient(labelTensor->getData().get(), outputTensor->getData().get(),
+                                                       nullptr, outputShape.totalSize(), 1.0f);
+        return loss / outputShape.Batch;
     }
 
     void CrossEntropyFunction::getGradient(const std::shared_ptr<Tensor> labelTensor,
                                             const std::shared_ptr<Tensor> outputTensor,
                                             std::shared_ptr<Tensor> &gradient)
     {
-        const Shape labelShape = labelTensor->getShape();
-        const Shape outputShape = outputTensor->getShape();
-        const Shape gradientShape = gradient->getShape();
-
-        gradient->setData(0.0f);
-        for (unsigned int batchIdx = 0; batchIdx < outputShape.Batch; batchIdx++)
-        {
-            const float* labelData = labelTensor->getData().get() + batchIdx * labelShape.oneBatchSize();
-            const float* outputData = outputTensor->getData().get() + batchIdx * outputShape.oneBatchSize();
-            float* gradientData = gradient->getData().get() + batchIdx * gradientShape.oneBatchSize();
-
-            for (unsigned int gradIdx = 0; gradIdx < gradientShape.oneBatchSize(); gradIdx++)
-            {
-                gradientData[gradIdx] -= labelData[gradIdx] / outputData[gradIdx];
-            }
-        }
-
+        getLossAndGradient(labelTensor, outputTensor, gradient, 1.0f);
     }
 
+    float CrossEntropyFunction::getLossAndGradient(const std::shared_ptr<Tensor> labelTensor,
+                                                   const std::shared_ptr<Tensor> outputTensor,
+                                                   std::shared_ptr<Tensor>& gradient, const float gradientScale)
+    {
+        const Shape outputShape = outputTensor->getShape();
+        const float loss = cross_entropy_loss_gradient(labelTensor->getData().get(), outputTensor->getData().get(),
+                                                       gradient->getData().get(), outputShape.totalSize(), gradientScale);
+        return loss / outputShape.Batch;
+    }
 
     float MSEFunction::getLoss(const std::shared_ptr<Tensor> labelTensor, const std::shared_ptr<Tensor> outputTensor)
     {
         const Shape outputShape = outputTensor->getShape();
-        const float* labelData = labelTensor->getData().get();
-        const float* outputData = outputTensor->getData().get();
-        float loss = 0.0f;
-
-        for (unsigned int i = 0; i < outputShape.totalSize(); i++)
-        {
-            const float oneLoss = (labelData[i] - outputData[i]) * (labelData[i] - outputData[i]);
-            loss = moving_average(loss, i+1, oneLoss);
-        }
-        return loss * outputShape.oneBatchSize();
+        const float loss = squared_error_loss_gradient(labelTensor->getData().get(), outputTensor->getData().get(),
+                                                       nullptr, outputShape.totalSize(), 1.0f);
+        return loss / outputShape.Batch;
     }
 
     void MSEFunction::getGradient(const std::shared_ptr<Tensor> labelTensor,
                                   const std::shared_ptr<Tensor> outputTensor,
                                   std::shared_ptr<Tensor> &gradient)
     {
-        const Shape labelShape = labelTensor->getShape();
-        const Shape outputShape = outputTensor->getShape();
-        const Shape gradientShape = gradient->getShape();
-
-        gradient->setData(0.0f);
-        for (unsigned int batchIdx = 0; batchIdx < outputShape.Batch; batchIdx++)
-        {
-            const float* labelData = labelTensor->getData().get() + batchIdx * labelShape.oneBatchSize();
-            const float* outputData = outputTensor->getData().get() + batchIdx * outputShape.oneBatchSize();
-            float* gradientData = gradient->getData().get() + batchIdx * gradientShape.oneBatchSize();
+        getLossAndGradient(labelTensor, outputTensor, gradient, 1.0f);
+    }
 
-            for (unsigned int gradIdx = 0; gradIdx < gradientShape.oneBatchSize(); gradIdx++)
-            {
-                gradientData[gradIdx] += 2.0f * (outputData[gradIdx] - labelData[gradIdx]);
-            }
-        }
+    float MSEFunction::getLossAndGradient(const std::shared_ptr<Tensor> labelTensor,
+                                          const std::shared_ptr<Tensor> outputTensor,
+                                          std::shared_ptr<Tensor>& gradient, const float gradientScale)
+    {
+        const Shape outputShape = outputTensor->getShape();
+        const float loss = squared_error_loss_gradient(labelTensor->getData().get(), outputTensor->getData().get(),
+                                                       gradient->getData().get(), outputShape.totalSize(), gradientScale);
+        return loss / outputShape.Batch;
     }
-}
\ No newline at end of file
+}
@@ -2,13 +2,26 @@
 // Created by yang chen on 2018/3/9.
 //
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <fstream>
+#include <limits>
+#include <map>
 #include <sstream>
 
 #include "../include/Network.h"
+#include "../include/Checkpoint.h"
+#include "../include/CalcFunctions.h"
+#include "../include/ThreadPool.h"
 #include "../include/Layer.h"
 #include "../include/InputLayer.h"
 #include "../include/FullyConnectedLayer.h"
+#include "../include/FullyConnectedActivationLayer.h"
+#include "../include/QuantizedFullyConnectedLayer.h"
+#include "../include/SparseFullyConnectedLayer.h"
 #include "../include/ActivationLayer.h"
 #include "../include/SoftmaxLayer.h"
 
@@ -20,6 +33,11 @@ namespace MiniCNN
     void Network::addLayer(std::shared_ptr<Layer> layer)
     {
         m_layers.push_back(layer);
+        layer->setRandomStream((unsigned int)m_layers.size() - 1);
+        if (m_weightDataType != DataType::FP32)
+        {
+            setLayerWeightDataType(layer, m_weightDataType);
+        }
 
         const std::shared_ptr<Tensor> prev = m_data[m_data.size() - 1];
         const Shape inputShape = prev->getShape();
@@ -28,12 +46,167 @@ namespace MiniCNN
         layer->solveInnerParams();
 
         const Shape outputShape = layer->getOutputShape();
-        m_data.push_back(std::make_shared<Tensor>(outputShape));
-        m_gradients.push_back(std::make_shared<Tensor>(outputShape));
+
+        // in-place的层直接使用输入的tensor，前一层backward需要自己输出的时候不能覆盖
+        const bool prevNeedOutput = m_layers.size() > 1 && m_layers[m_layers.size() - 2]->needOutputInBackward();
+        const bool inPlace = m_enableInPlace && m_layers.size() > 1 && layer->supportInPlace()
+                             && !prevNeedOutput && outputShape == inputShape;
+        m_inPlace.push_back(inPlace);
+        m_checkpointMarks.push_back(false);
+        m_planDirty = true;
+        if (inPlace)
+        {
+            m_data.push_back(prev);
+            m_gradients.push_back(m_gradients[m_gradients.size() - 1]);
+        }
+        else
+        {
+            m_data.push_back(std::make_shared<Tensor>(outputShape));
+            m_gradients.push_back(std::make_shared<Tensor>(outputShape));
+        }
+    }
+
+    void Network::setInPlace(const bool enable)
+    {
+        m_enableInPlace = enable;
+    }
+
+    void Network::setLayerWeightDataType(std::shared_ptr<Layer> layer, const DataType dataType)
+    {
+        const std::string layerType = layer->getLayerType();
+        if (layerType == FullyConnectedLayer::layerType || layerType == FullyConnectedActivationLayer::layerType)
+        {
+            std::static_pointer_cast<FullyConnectedLayer>(layer)->setWeightDataType(dataType);
+        }
+    }
+
+    void Network::setWeightDataType(const DataType dataType)
+    {
+        m_weightDataType = dataType;
+        for (const auto& layer : m_layers)
+        {
+            setLayerWeightDataType(layer, dataType);
+        }
+    }
+
+    void Network::setLossScale(const float lossScale)
+    {
+        m_lossScale = lossScale;
+    }
+
+    void Network::setDynamicLossScale(const bool enable, const unsigned int growthInterval)
+    {
+        m_dynamicLossScale = enable;
+        m_lossScaleGrowthInterval = growthInterval;
+        m_goodSteps = 0;
+    }
+
+    void Network::setMixedPrecision(const bool enable)
+    {
+        m_mixedPrecision = enable;
+        m_planDirty = true;
+        setWeightDataType(enable ? DataType::BF16 : DataType::FP32);
+        setDynamicLossScale(enable);
+        setLossScale(enable ? 65536.0f : 1.0f);
+    }
+
+    size_t Network::getActivationMemorySize() const
+    {
+        // 按实际的存储统计，in-place的层以及共用存储的tensor不重复计算
+        std::map<const void*, size_t> storages;
+        for (const auto& tensors : { &m_data, &m_gradients, &m_stash })
+        {
+            for (const auto& tensor : *tensors)
+            {
+                // 输入是调用者的tensor时不计入
+                if (!tensor || (m_inputView && tensor == m_data[0]))
+                {
+                    continue;
+                }
+                const void* storage = tensor->getDataType() == DataType::FP32 ? (const void*)tensor->getData().get()
+                                                                              : (const void*)tensor->getHalfData().get();
+                size_t& bytes = storages[storage];
+                bytes = std::max(bytes, tensor->getCapacity() * tensor->getElementSize());
+            }
+        }
+
+        size_t totalBytes = 0;
+        for (const auto& storage : storages)
+        {
+            totalBytes += storage.second;
+        }
+        return totalBytes;
+    }
+
+    void Network::setCheckpointInterval(const unsigned int interval)
+    {
+        m_checkpointInterval = interval;
+        m_planDirty = true;
+    }
+
+    bool Network::markCheckpoint(const unsigned int layerIdx)
+    {
+        if (layerIdx >= m_layers.size())
+        {
+            return false;
+        }
+        m_checkpointMarks[layerIdx] = true;
+        m_planDirty = true;
+        return true;
+    }
+
+    CheckpointStats Network::getCheckpointStats() const
+    {
+        return m_checkpointStats;
+    }
+
+    void Network::resetCheckpointStats()
+    {
+        m_checkpointStats.recomputedLayers = 0;
+        m_checkpointStats.forwardSeconds = 0.0;
+        m_checkpointStats.recomputeSeconds = 0.0;
+    }
+
+    void Network::reallocateTensors(std::vector<std::shared_ptr<Tensor>>& tensors, const unsigned int batch, const bool force)
+    {
+        // 容量不够（或者force）时按m_batchCapacity分配，否则只改变Batch
+        const unsigned int capacityBatch = std::max(batch, m_batchCapacity);
+        for (unsigned int i = 0; i < tensors.size(); i++)
+        {
+            if (i > 0 && i - 1 < m_inPlace.size() && m_inPlace[i - 1])
+            {
+                tensors[i] = tensors[i - 1];
+                continue;
+            }
+
+            Shape newShape = tensors[i]->getShape();
+            newShape.Batch = batch;
+            if (force || tensors[i]->getCapacity() < newShape.totalSize())
+            {
+                newShape.Batch = capacityBatch;
+                tensors[i].reset(new Tensor(newShape));
+            }
+            tensors[i]->resizeBatch(batch);
+        }
+    }
+
+    void Network::setBatch(const unsigned int batch)
+    {
+        for (const auto& tensors : { &m_data, &m_gradients, &m_stash })
+        {
+            for (const auto& tensor : *tensors)
+            {
+                if (tensor && tensor->getShape().Batch != batch)
+                {
+                    tensor->resizeBatch(batch);
+                }
+            }
+        }
     }
 
     void Network::setInputSize(const Shape size)
     {
+        m_batchCapacity = std::max(m_batchCapacity, size.Batch);
         m_data.push_back(std::make_shared<Tensor>(size));
         m_gradients.push_back(std::make_shared<Tensor>(size));
     }
@@ -58,7 +231,9 @@ namespace MiniCNN
         if (!m_lossFunction)
             return 0.0f;
 
-        return m_lossFunction->getLoss(labelTensor, outputTensor);
+        // 损失函数按连续的排列读取label
+        return m_lossFunction->getLoss(labelTensor->isContiguous() ? labelTensor : labelTensor->contiguous(),
+                                       outputTensor);
     }
 
     float Network::trainBatch(const std::shared_ptr<Tensor> inputTensor, const std::shared_ptr<Tensor> labelTensor)
@@ -66,6 +241,7 @@ namespace MiniCNN
         setState(State::TRAIN);
         forward(inputTensor);
         const float loss = backward(labelTensor);
+        update();
         return loss;
     }
 
@@ -99,7 +275,8 @@ namespace MiniCNN
         // 加载inputlayer
         std::string layerType = getLayerTypeFromLine(line);
         std::shared_ptr<Layer> layer = createLayerByType(layerType);
-        layer->load(line);
+        if (!layer->load(line))
+            return false;
         setInputSize(layer->getInputShape());
         addLayer(layer);
 
@@ -114,7 +291,8 @@ namespace MiniCNN
             const std::shared_ptr<Tensor> prevData = m_data[m_data.size() - 1];
             const Shape inputShape = prevData->getShape();
             layer->setInputShape(inputShape);
-            layer->load(line);
+            if (!layer->load(line))
+                return false;
             addLayer(layer);
         }
 
@@ -122,6 +300,748 @@ namespace MiniCNN
         return true;
     }
 
+    std::shared_ptr<Network> Network::createReplica() const
+    {
+        std::shared_ptr<Network> replica = std::make_shared<Network>();
+        replica->setInPlace(m_enableInPlace);
+        replica->setWeightDataType(m_weightDataType);
+        replica->setLossScale(m_lossScale);
+        replica->setInputSize(m_data[0]->getShape());
+        replica->setLossFunction(m_lossFunction);
+        replica->setOptimizer(m_optimizer);
+        replica->setState(m_state);
+
+        for (const auto& layer : m_layers)
+        {
+            // 通过save/load复制层的结构，再把参数指向当前网络的tensor
+            std::shared_ptr<Layer> replicaLayer = createLayerByType(layer->getLayerType());
+            replicaLayer->setInputShape(replica->m_data[replica->m_data.size() - 1]->getShape());
+            replicaLayer->load(layer->save());
+            replicaLayer->shareParams(layer->getParams());
+            replica->addLayer(replicaLayer);
+        }
+
+        return replica;
+    }
+
+    bool Network::shareParamsWith(Network& replica) const
+    {
+        if (replica.m_layers.size() != m_layers.size())
+        {
+            return false;
+        }
+        for (unsigned int i = 0; i < m_layers.size(); i++)
+        {
+            if (replica.m_layers[i]->getLayerType() != m_layers[i]->getLayerType())
+            {
+                return false;
+            }
+        }
+        for (unsigned int i = 0; i < m_layers.size(); i++)
+        {
+            replica.m_layers[i]->shareParams(m_layers[i]->getParams());
+        }
+        return true;
+    }
+
+    unsigned int Network::fuseLayers()
+    {
+        unsigned int fusedCount = 0;
+        for (unsigned int i = 0; i + 1 < m_layers.size(); i++)
+        {
+            const std::string layerType = m_layers[i]->getLayerType();
+            if (layerType != FullyConnectedLayer::layerType && layerType != QuantizedFullyConnectedLayer::layerType
+                && layerType != SparseFullyConnectedLayer::layerType)
+            {
+                continue;
+            }
+
+            const std::string nextLayerType = m_layers[i + 1]->getLayerType();
+            ActivationType activation = ActivationType::NONE;
+            if (nextLayerType == ReluLayer::layerType)
+            {
+                activation = ActivationType::RELU;
+            }
+            else if (nextLayerType == SigmoidLayer::layerType)
+            {
+                activation = ActivationType::SIGMOID;
+            }
+            else
+            {
+                continue;
+            }
+
+            // 融合后的层直接使用原来的参数，全连接层的输出不再需要单独的tensor
+            if (layerType == QuantizedFullyConnectedLayer::layerType)
+            {
+                const auto quantizedLayer = std::static_pointer_cast<QuantizedFullyConnectedLayer>(m_layers[i]);
+                if (quantizedLayer->m_activation != ActivationType::NONE)
+                {
+                    continue;
+                }
+                quantizedLayer->m_activation = activation;
+            }
+            else if (layerType == SparseFullyConnectedLayer::layerType)
+            {
+                const auto sparseLayer = std::static_pointer_cast<SparseFullyConnectedLayer>(m_layers[i]);
+                if (sparseLayer->m_activation != ActivationType::NONE)
+                {
+                    continue;
+                }
+                sparseLayer->m_activation = activation;
+            }
+            else
+            {
+                const auto fullyConnectedLayer = std::static_pointer_cast<FullyConnectedLayer>(m_layers[i]);
+                m_layers[i] = std::make_shared<FullyConnectedActivationLayer>(*fullyConnectedLayer, activation);
+            }
+            m_layers.erase(m_layers.begin() + i + 1);
+            m_inPlace.erase(m_inPlace.begin() + i + 1);
+            m_checkpointMarks[i] = m_checkpointMarks[i] || m_checkpointMarks[i + 1];
+            m_checkpointMarks.erase(m_checkpointMarks.begin() + i + 1);
+            m_planDirty = true;
+            m_data.erase(m_data.begin() + i + 1);
+            m_gradients.erase(m_gradients.begin() + i + 1);
+            fusedCount++;
+        }
+        if (fusedCount > 0)
+        {
+            // 层的下标发生了变化，需要重新校准
+            m_inputRanges.clear();
+        }
+        return fusedCount;
+    }
+
+    void Network::calibrate(const std::shared_ptr<Tensor> inputTensor)
+    {
+        setState(State::TEST);
+        prepareInput(inputTensor);
+        if (m_inputRanges.size() != m_layers.size())
+        {
+            m_inputRanges.assign(m_layers.size(), std::make_pair(std::numeric_limits<float>::max(),
+                                                                 std::numeric_limits<float>::lowest()));
+        }
+
+        // 逐层计算，在输入被后面的层覆盖之前统计范围
+        for (unsigned int i = 0; i < m_layers.size(); i++)
+        {
+            const float* data = m_data[i]->getData().get();
+            const auto range = std::minmax_element(data, data + m_data[i]->getShape().totalSize());
+            m_inputRanges[i].first = std::min(m_inputRanges[i].first, *range.first);
+            m_inputRanges[i].second = std::max(m_inputRanges[i].second, *range.second);
+            forwardLayers(i, i + 1);
+        }
+    }
+
+    unsigned int Network::quantize()
+    {
+        if (m_inputRanges.size() != m_layers.size())
+        {
+            return 0;
+        }
+
+        unsigned int quantizedCount = 0;
+        for (unsigned int i = 0; i < m_layers.size(); i++)
+        {
+            const std::string layerType = m_layers[i]->getLayerType();
+            if (layerType != FullyConnectedLayer::layerType && layerType != FullyConnectedActivationLayer::layerType)
+            {
+                continue;
+            }
+
+            ActivationType activation = ActivationType::NONE;
+            if (layerType == FullyConnectedActivationLayer::layerType)
+            {
+                activation = std::static_pointer_cast<FullyConnectedActivationLayer>(m_layers[i])->m_activation;
+            }
+            const auto fullyConnectedLayer = std::static_pointer_cast<FullyConnectedLayer>(m_layers[i]);
+            const auto quantizedLayer = std::make_shared<QuantizedFullyConnectedLayer>();
+            quantizedLayer->setState(m_state);
+            quantizedLayer->setInputShape(fullyConnectedLayer->getInputShape());
+            quantizedLayer->setParameters(fullyConnectedLayer->m_paramShape, fullyConnectedLayer->m_enableBias,
+                                          activation, *fullyConnectedLayer->m_weight, fullyConnectedLayer->m_bias,
+                                          m_inputRanges[i].first, m_inputRanges[i].second);
+            m_layers[i] = quantizedLayer;
+            quantizedCount++;
+        }
+        return quantizedCount;
+    }
+
+    static unsigned int get_supported_block_rows(const unsigned int blockRows)
+    {
+        return blockRows == 4 || blockRows == 8 ? blockRows : 1;
+    }
+
+    float Network::prune(const float sparsity, const bool global, const unsigned int blockRows)
+    {
+        const unsigned int rows = get_supported_block_rows(blockRows);
+
+        // 每个块的分数为块内weights绝对值的平均，按(块所在的组, 输入下标)排列
+        std::vector<std::shared_ptr<FullyConnectedLayer>> layers;
+        std::vector<std::vector<float>> scores;
+        for (const auto& layer : m_layers)
+        {
+            const std::string layerType = layer->getLayerType();
+            if (layerType != FullyConnectedLayer::layerType && layerType != FullyConnectedActivationLayer::layerType)
+            {
+                continue;
+            }
+            const auto fullyConnectedLayer = std::static_pointer_cast<FullyConnectedLayer>(layer);
+            const unsigned int inSize = fullyConnectedLayer->getInputShape().oneBatchSize();
+            const unsigned int outSize = fullyConnectedLayer->m_paramShape.oneBatchSize();
+            const float* weightData = fullyConnectedLayer->m_weight->getData().get();
+
+            std::vector<float> layerScores;
+            for (unsigned int b = 0; b * rows < outSize; b++)
+            {
+                const unsigned int validRows = std::min(rows, outSize - b * rows);
+                for (unsigned int j = 0; j < inSize; j++)
+                {
+                    float sum = 0.0f;
+                    for (unsigned int r = 0; r < validRows; r++)
+                    {
+                        sum += std::fabs(weightData[(b * rows + r) * inSize + j]);
+                    }
+                    layerScores.push_back(sum / validRows);
+                }
+            }
+            layers.push_back(fullyConnectedLayer);
+            scores.push_back(layerScores);
+        }
+
+        // 分数不超过阈值的块被裁剪，阈值为按分数排序后第sparsity比例处的值
+        auto get_threshold = [sparsity](std::vector<float> values)
+        {
+            const size_t pruneCount = (size_t)(std::min(std::max(sparsity, 0.0f), 1.0f) * values.size());
+            if (pruneCount == 0)
+            {
+                return -1.0f;
+            }
+            std::nth_element(values.begin(), values.begin() + pruneCount - 1, values.end());
+            return values[pruneCount - 1];
+        };
+        float globalThreshold = -1.0f;
+        if (global)
+        {
+            std::vector<float> allScores;
+            for (const auto& layerScores : scores)
+            {
+                allScores.insert(allScores.end(), layerScores.begin(), layerScores.end());
+            }
+            globalThreshold = get_threshold(allScores);
+        }
+
+        size_t zeroCount = 0;
+        size_t totalCount = 0;
+        for (unsigned int k = 0; k < layers.size(); k++)
+        {
+            const float threshold = global ? globalThreshold : get_threshold(scores[k]);
+            const unsigned int inSize = layers[k]->getInputShape().oneBatchSize();
+            const unsigned int outSize = layers[k]->m_paramShape.oneBatchSize();
+            float* weightData = layers[k]->m_weight->getData().get();
+            for (unsigned int idx = 0; idx < scores[k].size(); idx++)
+            {
+                if (scores[k][idx] > threshold)
+                {
+                    continue;
+                }
+                const unsigned int b = idx / inSize;
+                const unsigned int j = idx % inSize;
+                for (unsigned int r = 0; r < rows && b * rows + r < outSize; r++)
+                {
+                    weightData[(b * rows + r) * inSize + j] = 0.0f;
+                }
+            }
+            layers[k]->m_narrowWeightDirty = true;
+
+            const unsigned int weightSize = layers[k]->m_weight->getShape().totalSize();
+            zeroCount += std::count(weightData, weightData + weightSize, 0.0f);
+            totalCount += weightSize;
+        }
+        return totalCount > 0 ? (float)zeroCount / totalCount : 0.0f;
+    }
+
+    unsigned int Network::sparsify(const unsigned int blockRows, const float minSparsity)
+    {
+        unsigned int sparseCount = 0;
+        for (unsigned int i = 0; i < m_layers.size(); i++)
+        {
+            const std::string layerType = m_layers[i]->getLayerType();
+            if (layerType != FullyConnectedLayer::layerType && layerType != FullyConnectedActivationLayer::layerType)
+            {
+                continue;
+            }
+
+            const auto fullyConnectedLayer = std::static_pointer_cast<FullyConnectedLayer>(m_layers[i]);
+            const float* weightData = fullyConnectedLayer->m_weight->getData().get();
+            const unsigned int weightSize = fullyConnectedLayer->m_weight->getShape().totalSize();
+            const float layerSparsity = (float)std::count(weightData, weightData + weightSize, 0.0f) / weightSize;
+            if (layerSparsity < minSparsity)
+            {
+                continue;
+            }
+
+            ActivationType activation = ActivationType::NONE;
+            if (layerType == FullyConnectedActivationLayer::layerType)
+            {
+                activation = std::static_pointer_cast<FullyConnectedActivationLayer>(m_layers[i])->m_activation;
+            }
+            const auto sparseLayer = std::make_shared<SparseFullyConnectedLayer>();
+            sparseLayer->setState(m_state);
+            sparseLayer->setInputShape(fullyConnectedLayer->getInputShape());
+            sparseLayer->setParameters(fullyConnectedLayer->m_paramShape, fullyConnectedLayer->m_enableBias, activation,
+                                       *fullyConnectedLayer->m_weight, fullyConnectedLayer->m_bias,
+                                       get_supported_block_rows(blockRows));
+            m_layers[i] = sparseLayer;
+            sparseCount++;
+        }
+        return sparseCount;
+    }
+
+    unsigned int Network::factorize(const unsigned int rank)
+    {
+        unsigned int factorizedCount = 0;
+        for (unsigned int i = 0; i < m_layers.size(); i++)
+        {
+            const std::string layerType = m_layers[i]->getLayerType();
+            if (layerType != FullyConnectedLayer::layerType && layerType != FullyConnectedActivationLayer::layerType)
+            {
+                continue;
+            }
+            const unsigned int inSize = m_layers[i]->getInputShape().oneBatchSize();
+            const unsigned int outSize = m_layers[i]->getOutputShape().oneBatchSize();
+            if (rank == 0 || (size_t)rank * (inSize + outSize) >= (size_t)inSize * outSize)
+            {
+                continue;
+            }
+
+            // 新插入的第二层不需要再处理
+            factorizeLayer(i, rank);
+            factorizedCount++;
+            i++;
+        }
+        if (factorizedCount > 0)
+        {
+            m_inputRanges.clear();
+        }
+        return factorizedCount;
+    }
+
+    void Network::factorizeLayer(const unsigned int layerIdx, const unsigned int rank)
+    {
+        const auto fullyConnectedLayer = std::static_pointer_cast<FullyConnectedLayer>(m_layers[layerIdx]);
+        const unsigned int inSize = fullyConnectedLayer->getInputShape().oneBatchSize();
+        const unsigned int outSize = fullyConnectedLayer->m_paramShape.oneBatchSize();
+        const float* weightData = fullyConnectedLayer->m_weight->getData().get();
+
+        // 对W·Wt和Wt·W中较小的一个做特征分解，得到W的前rank个左（或右）奇异向量
+        const bool useLeft = outSize <= inSize;
+        const unsigned int n = useLeft ? outSize : inSize;
+        std::vector<double> gram(n * n, 0.0);
+        auto gramWorker = [&](const unsigned int start, const unsigned int end)
+        {
+            for (unsigned int a = start; a < end; a++)
+            {
+                for (unsigned int b = 0; b < n; b++)
+                {
+                    double sum = 0.0;
+                    const unsigned int m = useLeft ? inSize : outSize;
+                    for (unsigned int k = 0; k < m; k++)
+                    {
+                        sum += useLeft ? (double)weightData[a * inSize + k] * weightData[b * inSize + k]
+                                       : (double)weightData[k * inSize + a] * weightData[k * inSize + b];
+                    }
+                    gram[a * n + b] = sum;
+                }
+            }
+        };
+        dispatch_worker(gramWorker, n);
+
+        std::vector<double> eigenVectors(n * n);
+        std::vector<double> eigenValues(n);
+        symmetric_eigen(gram.data(), eigenVectors.data(), eigenValues.data(), n);
+
+        // useLeft时 W ≈ Ur·(Urt·W)，否则 W ≈ (W·Vr)·Vrt
+        std::vector<float> firstWeight(rank * inSize);
+        std::vector<float> secondWeight(outSize * rank);
+        for (unsigned int r = 0; r < rank; r++)
+        {
+            if (useLeft)
+            {
+                for (unsigned int j = 0; j < inSize; j++)
+                {
+                    double sum = 0.0;
+                    for (unsigned int i = 0; i < outSize; i++)
+                    {
+                        sum += eigenVectors[i * n + r] * weightData[i * inSize + j];
+                    }
+                    firstWeight[r * inSize + j] = (float)sum;
+                }
+                for (unsigned int i = 0; i < outSize; i++)
+                {
+                    secondWeight[i * rank + r] = (float)eigenVectors[i * n + r];
+                }
+            }
+            else
+            {
+                for (unsigned int j = 0; j < inSize; j++)
+                {
+                    firstWeight[r * inSize + j] = (float)eigenVectors[j * n + r];
+                }
+                for (unsigned int i = 0; i < outSize; i++)
+                {
+                    double sum = 0.0;
+                    for (unsigned int j = 0; j < inSize; j++)
+                    {
+                        sum += weightData[i * inSize + j] * eigenVectors[j * n + r];
+                    }
+                    secondWeight[i * rank + r] = (float)sum;
+                }
+            }
+        }
+
+        // 第一层不需要bias，但为了能直接训练，仍然保留一个全0的bias
+        const auto firstLayer = std::make_shared<FullyConnectedLayer>();
+        firstLayer->setState(m_state);
+        firstLayer->setParameters(Shape(1, rank, 1, 1), true);
+        firstLayer->setInputShape(fullyConnectedLayer->getInputShape());
+        firstLayer->solveInnerParams();
+        std::copy(firstWeight.begin(), firstWeight.end(), firstLayer->m_weight->getData().get());
+        firstLayer->m_bias->setData(0.0f);
+
+        Shape middleShape = firstLayer->getOutputShape();
+        std::shared_ptr<FullyConnectedLayer> secondLayer = std::make_shared<FullyConnectedLayer>();
+        secondLayer->setState(m_state);
+        secondLayer->setParameters(fullyConnectedLayer->m_paramShape, fullyConnectedLayer->m_enableBias);
+        secondLayer->setInputShape(middleShape);
+        secondLayer->solveInnerParams();
+        std::copy(secondWeight.begin(), secondWeight.end(), secondLayer->m_weight->getData().get());
+        if (fullyConnectedLayer->m_enableBias)
+        {
+            fullyConnectedLayer->m_bias->clone(*secondLayer->m_bias);
+        }
+        if (fullyConnectedLayer->getLayerType() == FullyConnectedActivationLayer::layerType)
+        {
+            const ActivationType activation =
+                    std::static_pointer_cast<FullyConnectedActivationLayer>(fullyConnectedLayer)->m_activation;
+            secondLayer = std::make_shared<FullyConnectedActivationLayer>(*secondLayer, activation);
+        }
+        if (m_weightDataType != DataType::FP32)
+        {
+            setLayerWeightDataType(firstLayer, m_weightDataType);
+            setLayerWeightDataType(secondLayer, m_weightDataType);
+        }
+
+        // 原来的输出tensor留给第二层，中间插入rank宽的tensor
+        m_layers[layerIdx] = firstLayer;
+        m_layers.insert(m_layers.begin() + layerIdx + 1, secondLayer);
+        m_inPlace.insert(m_inPlace.begin() + layerIdx + 1, false);
+        m_checkpointMarks.insert(m_checkpointMarks.begin() + layerIdx, false);
+        middleShape.Batch = m_data[layerIdx]->getShape().Batch;
+        m_data.insert(m_data.begin() + layerIdx + 1, std::make_shared<Tensor>(middleShape));
+        m_gradients.insert(m_gradients.begin() + layerIdx + 1, std::make_shared<Tensor>(middleShape));
+        m_planDirty = true;
+    }
+
+    // 生成代码中float常量的写法，保证读回后与原值完全相同
+    static std::string float_literal(const float value)
+    {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+        std::string literal = buffer;
+        if (literal.find_first_of(".e") == std::string::npos)
+        {
+            literal += ".0";
+        }
+        return literal + "f";
+    }
+
+    static void write_float_array(std::ostream& os, const std::string& name, const std::vector<float>& values)
+    {
+        os << "    alignas(64) static const float " << name << "[" << values.size() << "] = {";
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            os << (i % 8 == 0 ? "\n        " : " ") << float_literal(values[i]) << ",";
+        }
+        os << "\n    };\n\n";
+    }
+
+    static bool is_identifier(const std::string& name)
+    {
+        if (name.empty() || std::isdigit((unsigned char)name[0]))
+        {
+            return false;
+        }
+        for (const char c : name)
+        {
+            if (!std::isalnum((unsigned char)c) && c != '_')
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Network::generateSource(const std::string& sourceFile, const std::string& modelName) const
+    {
+        if (!is_identifier(modelName) || m_layers.empty())
+        {
+            return false;
+        }
+
+        // 每一步计算：kind为dense/activation/softmax，weights以输入为行（In×Out）转置存储
+        struct Step
+        {
+            std::string kind;
+            unsigned int inSize;
+            unsigned int outSize;
+            bool enableBias;
+            ActivationType activation;
+            std::vector<float> weight;
+            std::vector<float> bias;
+        };
+        std::vector<Step> steps;
+        for (const auto& layer : m_layers)
+        {
+            const std::string layerType = layer->getLayerType();
+            Step step = {"", layer->getInputShape().oneBatchSize(), layer->getOutputShape().oneBatchSize(), false,
+                         ActivationType::NONE, {}, {}};
+            if (layerType == InputLayer::layerType)
+            {
+                continue;
+            }
+            else if (layerType == ReluLayer::layerType || layerType == SigmoidLayer::layerType)
+            {
+                step.kind = "activation";
+                step.activation = layerType == ReluLayer::layerType ? ActivationType::RELU : ActivationType::SIGMOID;
+            }
+            else if (layerType == SoftmaxLayer::layerType)
+            {
+                step.kind = "softmax";
+            }
+            else if (layerType == FullyConnectedLayer::layerType || layerType == FullyConnectedActivationLayer::layerType)
+            {
+                const auto fullyConnectedLayer = std::static_pointer_cast<FullyConnectedLayer>(layer);
+                const float* weightData = fullyConnectedLayer->m_weight->getData().get();
+                step.kind = "dense";
+                step.outSize = fullyConnectedLayer->m_paramShape.oneBatchSize();
+                step.enableBias = fullyConnectedLayer->m_enableBias;
+                if (layerType == FullyConnectedActivationLayer::layerType)
+                {
+                    step.activation = std::static_pointer_cast<FullyConnectedActivationLayer>(layer)->m_activation;
+                }
+                step.weight.resize((size_t)step.inSize * step.outSize);
+                for (unsigned int i = 0; i < step.outSize; i++)
+                {
+                    for (unsigned int j = 0; j < step.inSize; j++)
+                    {
+                        step.weight[(size_t)j * step.outSize + i] = weightData[(size_t)i * step.inSize + j];
+                    }
+                }
+                if (step.enableBias)
+                {
+                    const float* biasData = fullyConnectedLayer->m_bias->getData().get();
+                    step.bias.assign(biasData, biasData + step.outSize);
+                }
+            }
+            else if (layerType == SparseFullyConnectedLayer::layerType)
+            {
+                // 稀疏层展开为稠密的weights，由编译器处理固定形状的循环
+                const auto sparseLayer = std::static_pointer_cast<SparseFullyConnectedLayer>(layer);
+                const unsigned int rows = sparseLayer->m_blockRows;
+                step.kind = "dense";
+                step.outSize = sparseLayer->m_paramShape.oneBatchSize();
+                step.enableBias = sparseLayer->m_enableBias;
+                step.activation = sparseLayer->m_activation;
+                step.weight.assign((size_t)step.inSize * step.outSize, 0.0f);
+                for (unsigned int b = 0; b + 1 < sparseLayer->m_blockRowPtr.size(); b++)
+                {
+                    for (unsigned int k = sparseLayer->m_blockRowPtr[b]; k < sparseLayer->m_blockRowPtr[b + 1]; k++)
+                    {
+                        for (unsigned int r = 0; r < rows && b * rows + r < step.outSize; r++)
+                        {
+                            step.weight[(size_t)sparseLayer->m_blockCol[k] * step.outSize + b * rows + r] =
+                                    sparseLayer->m_values[(size_t)k * rows + r];
+                        }
+                    }
+                }
+                step.bias = sparseLayer->m_bias;
+            }
+            else
+            {
+                // int8量化层等没有对应的模板实现
+                return false;
+            }
+            steps.push_back(step);
+        }
+        if (steps.empty())
+        {
+            return false;
+        }
+
+        std::ofstream ofs(sourceFile);
+        if (!ofs.is_open())
+        {
+            return false;
+        }
+
+        const unsigned int inputSize = m_layers[0]->getOutputShape().oneBatchSize();
+        const unsigned int outputSize = steps.back().outSize;
+        unsigned int bufferSize = 0;
+        for (const auto& step : steps)
+        {
+            bufferSize = std::max(bufferSize, step.outSize);
+        }
+
+        ofs << "// Generated by MiniCNN from a trained model. Do not edit.\n"
+            << "// 所有形状都是编译期常量，weights为对齐的静态数组，推理过程不分配堆内存。建议以-O3编译：\n"
+            << "//   void " << modelName << "::forward(const float* input, float* output);\n"
+            << "//   void " << modelName << "::forward_batch(const float* input, float* output, unsigned int n);\n"
+            << "\n"
+            << "#include <cmath>\n"
+            << "\n"
+            << "namespace " << modelName << "\n"
+            << "{\n"
+            << "    constexpr unsigned int kInputSize = " << inputSize << ";\n"
+            << "    constexpr unsigned int kOutputSize = " << outputSize << ";\n"
+            << "\n"
+            << "    // 0: none, 1: relu, 2: sigmoid\n"
+            << "    template <int Act>\n"
+            << "    inline float activate(const float x)\n"
+            << "    {\n"
+            << "        return Act == 1 ? (x > 0.0f ? x : 0.0f) : Act == 2 ? 1.0f / (1.0f + std::exp(-x)) : x;\n"
+            << "    }\n"
+            << "\n"
+            << "    // weight按输入为行存储（In×Out），内层循环沿输出连续访问，不需要重排浮点加法就能向量化\n"
+            << "    template <unsigned int In, unsigned int Out, bool Bias, int Act>\n"
+            << "    inline void dense(const float* __restrict input, const float* __restrict weight,\n"
+            << "                      const float* __restrict bias, float* __restrict output)\n"
+            << "    {\n"
+            << "        for (unsigned int i = 0; i < Out; i++)\n"
+            << "        {\n"
+            << "            output[i] = Bias ? bias[i] : 0.0f;\n"
+            << "        }\n"
+            << "        for (unsigned int j = 0; j < In; j++)\n"
+            << "        {\n"
+            << "            const float x = input[j];\n"
+            << "            const float* w = weight + j * Out;\n"
+            << "            for (unsigned int i = 0; i < Out; i++)\n"
+            << "            {\n"
+            << "                output[i] += x * w[i];\n"
+            << "            }\n"
+            << "        }\n"
+            << "        if (Act != 0)\n"
+            << "        {\n"
+            << "            for (unsigned int i = 0; i < Out; i++)\n"
+            << "            {\n"
+            << "                output[i] = activate<Act>(output[i]);\n"
+            << "            }\n"
+            << "        }\n"
+            << "    }\n"
+            << "\n"
+            << "    // input与output可以是同一块内存\n"
+            << "    template <unsigned int N, int Act>\n"
+            << "    inline void activation(const float* input, float* output)\n"
+            << "    {\n"
+            << "        for (unsigned int i = 0; i < N; i++)\n"
+            << "        {\n"
+            << "            output[i] = activate<Act>(input[i]);\n"
+            << "        }\n"
+            << "    }\n"
+            << "\n"
+            << "    template <unsigned int N>\n"
+            << "    inline void softmax(const float* input, float* output)\n"
+            << "    {\n"
+            << "        float maxValue = input[0];\n"
+            << "        for (unsigned int i = 1; i < N; i++)\n"
+            << "        {\n"
+            << "            maxValue = input[i] > maxValue ? input[i] : maxValue;\n"
+            << "        }\n"
+            << "        float sum = 0.0f;\n"
+            << "        for (unsigned int i = 0; i < N; i++)\n"
+            << "        {\n"
+            << "            output[i] = std::exp(input[i] - maxValue);\n"
+            << "            sum += output[i];\n"
+            << "        }\n"
+            << "        for (unsigned int i = 0; i < N; i++)\n"
+            << "        {\n"
+            << "            output[i] /= sum;\n"
+            << "        }\n"
+            << "    }\n"
+            << "\n";
+
+        for (unsigned int i = 0; i < steps.size(); i++)
+        {
+            if (steps[i].kind != "dense")
+            {
+                continue;
+            }
+            write_float_array(ofs, "kWeight" + std::to_string(i), steps[i].weight);
+            if (steps[i].enableBias)
+            {
+                write_float_array(ofs, "kBias" + std::to_string(i), steps[i].bias);
+            }
+        }
+
+        // 中间结果在两块栈上的缓存之间交替，elementwise的层原地计算，最后一层直接写output
+        ofs << "    void forward(const float* input, float* output)\n"
+            << "    {\n";
+        if (steps.size() > 1)
+        {
+            ofs << "        alignas(64) float buffer0[" << bufferSize << "];\n"
+                << "        alignas(64) float buffer1[" << bufferSize << "];\n";
+        }
+        std::string current = "input";
+        for (unsigned int i = 0; i < steps.size(); i++)
+        {
+            const Step& step = steps[i];
+            const bool last = i + 1 == steps.size();
+            std::string target;
+            if (last)
+            {
+                target = "output";
+            }
+            else if (step.kind != "dense" && current != "input")
+            {
+                target = current;
+            }
+            else
+            {
+                target = current == "buffer0" ? "buffer1" : "buffer0";
+            }
+
+            const std::string index = std::to_string(i);
+            if (step.kind == "dense")
+            {
+                ofs << "        dense<" << step.inSize << ", " << step.outSize << ", "
+                    << (step.enableBias ? "true" : "false") << ", " << (int)step.activation << ">("
+                    << current << ", kWeight" << index << ", " << (step.enableBias ? "kBias" + index : "nullptr")
+                    << ", " << target << ");\n";
+            }
+            else if (step.kind == "activation")
+            {
+                ofs << "        activation<" << step.outSize << ", " << (int)step.activation << ">("
+                    << current << ", " << target << ");\n";
+            }
+            else
+            {
+                ofs << "        softmax<" << step.outSize << ">(" << current << ", " << target << ");\n";
+            }
+            current = target;
+        }
+        ofs << "    }\n"
+            << "\n"
+            << "    void forward_batch(const float* input, float* output, const unsigned int n)\n"
+            << "    {\n"
+            << "        for (unsigned int k = 0; k < n; k++)\n"
+            << "        {\n"
+            << "            forward(input + k * kInputSize, output + k * kOutputSize);\n"
+            << "        }\n"
+            << "    }\n"
+            << "}\n";
+        return ofs.good();
+    }
+
     State Network::getState() const
     {
         return m_state;
@@ -130,6 +1050,11 @@ namespace MiniCNN
     void Network::setState(State state)
     {
         m_state = state;
+        // 层根据状态决定是否缓存转换后的低精度weights
+        for (const auto& layer : m_layers)
+        {
+            layer->setState(state);
+        }
     }
 
     std::shared_ptr<Layer> Network::createLayerByType(const std::string layerType)
@@ -142,6 +1067,18 @@ namespace MiniCNN
         {
             return std::make_shared<FullyConnectedLayer>();
         }
+        else if (layerType == FullyConnectedActivationLayer::layerType)
+        {
+            return std::make_shared<FullyConnectedActivationLayer>();
+        }
+        else if (layerType == QuantizedFullyConnectedLayer::layerType)
+        {
+            return std::make_shared<QuantizedFullyConnectedLayer>();
+        }
+        else if (layerType == SparseFullyConnectedLayer::layerType)
+        {
+            return std::make_shared<SparseFullyConnectedLayer>();
+        }
         else if (layerType == SoftmaxLayer::layerType)
         {
             return std::make_shared<SoftmaxLayer>();
@@ -169,74 +1106,459 @@ namespace MiniCNN
         return layerType;
     }
 
-    std::shared_ptr<Tensor> Network::forward(const std::shared_ptr<Tensor> inputTensor)
+    void Network::planActivationMemory(const unsigned int batch)
     {
-        const auto oldBatch = m_data[0]->getShape().Batch;
-        const auto newBatch = inputTensor->getShape().Batch;
+        const unsigned int layerNum = (unsigned int)m_layers.size();
+        m_planDirty = false;
+        m_recomputeBegin.assign(layerNum, 0);
+        m_recomputeEnd.assign(layerNum, 0);
+
+        if (m_mixedPrecision)
+        {
+            planMixedPrecisionMemory(batch);
+            return;
+        }
+        if (!m_stash.empty())
+        {
+            // 混合精度时m_data、m_gradients共用存储，需要全部重新分配
+            m_stash.clear();
+            reallocateTensors(m_data, batch, true);
+            reallocateTensors(m_gradients, batch, true);
+            m_checkpointStats = CheckpointStats();
+            m_planDirty = true;
+        }
 
-        // 从inputTensor中拷贝数据，并且更新输入Batch的大小
-        if (oldBatch != newBatch)
+        const bool enableCheckpoint = m_checkpointInterval > 0 ||
+                                      std::find(m_checkpointMarks.begin(), m_checkpointMarks.end(), true) != m_checkpointMarks.end();
+        if (!enableCheckpoint)
         {
-            for (unsigned int i = 0; i < m_data.size(); i++)
+            // 之前按checkpoint分配过共用的存储时需要全部重新分配
+            reallocateTensors(m_data, batch, m_checkpointStats.recomputedTensors > 0);
+            m_checkpointStats = CheckpointStats();
+            return;
+        }
+
+        // 输入、最终输出以及checkpoint层的输出需要保留，in-place共用的tensor只要有一个保留就整体保留
+        std::vector<bool> kept(layerNum + 1, false);
+        kept[0] = true;
+        kept[layerNum] = true;
+        for (unsigned int j = 1; j <= layerNum; j++)
+        {
+            if ((m_checkpointInterval > 0 && j % m_checkpointInterval == 0) || m_checkpointMarks[j - 1])
             {
-                Shape newShape = m_data[i]->getShape();
-                newShape.Batch = newBatch;
-                m_data[i].reset(new Tensor(newShape));
+                kept[j] = true;
+            }
+        }
+        for (unsigned int j = layerNum; j > 0; j--)
+        {
+            if (m_inPlace[j - 1] && (kept[j] || kept[j - 1]))
+            {
+                kept[j] = kept[j - 1] = true;
+            }
+        }
+        for (unsigned int j = 1; j <= layerNum; j++)
+        {
+            if (m_inPlace[j - 1] && kept[j - 1])
+            {
+                kept[j] = true;
             }
         }
-        inputTensor->clone(*m_data[0]);
 
-        for (unsigned int i = 0; i < m_layers.size(); i++)
+        // 保留的tensor中in-place链的最后一个位置作为重新计算的起点，两个起点之间是一个segment
+        std::vector<unsigned int> restarts;
+        for (unsigned int j = 0; j <= layerNum; j++)
+        {
+            if (kept[j] && (j == layerNum || !m_inPlace[j]))
+            {
+                restarts.push_back(j);
+            }
+        }
+
+        // 被丢弃的tensor按在segment中的位置分配共用的存储
+        std::vector<int> slotOf(layerNum + 1, -1);
+        std::vector<unsigned int> slotCapacity;
+        for (unsigned int k = 0; k + 1 < restarts.size(); k++)
+        {
+            unsigned int position = 0;
+            unsigned int lastDropped = 0;
+            for (unsigned int j = restarts[k] + 1; j < restarts[k + 1]; j++)
+            {
+                if (kept[j])
+                {
+                    continue;
+                }
+                lastDropped = j;
+                if (m_inPlace[j - 1])
+                {
+                    slotOf[j] = slotOf[j - 1];
+                    continue;
+                }
+
+                Shape shape = m_data[j]->getShape();
+                shape.Batch = batch;
+                if (position >= slotCapacity.size())
+                {
+                    slotCapacity.push_back(0);
+                }
+                slotCapacity[position] = std::max(slotCapacity[position], shape.totalSize());
+                slotOf[j] = position++;
+            }
+
+            // 最后一个segment的activation在forward结束后仍然有效，不需要重新计算
+            if (lastDropped > 0 && k + 2 < restarts.size())
+            {
+                const unsigned int lastLayer = restarts[k + 1] - 1;
+                m_recomputeBegin[lastLayer] = restarts[k];
+                m_recomputeEnd[lastLayer] = lastDropped;
+            }
+        }
+
+        std::vector<std::shared_ptr<float>> slots;
+        for (const unsigned int capacity : slotCapacity)
+        {
+            slots.push_back(std::shared_ptr<float>(new float[capacity], std::default_delete<float[]>()));
+        }
+
+        m_checkpointStats.keptTensors = 0;
+        m_checkpointStats.recomputedTensors = 0;
+        m_checkpointStats.savedBytes = 0;
+        for (unsigned int j = 0; j <= layerNum; j++)
+        {
+            Shape shape = m_data[j]->getShape();
+            shape.Batch = batch;
+            if (j > 0 && m_inPlace[j - 1])
+            {
+                m_data[j] = m_data[j - 1];
+                continue;
+            }
+
+            if (kept[j])
+            {
+                m_data[j].reset(new Tensor(shape));
+                m_checkpointStats.keptTensors++;
+            }
+            else
+            {
+                m_data[j].reset(new Tensor(shape, slots[slotOf[j]]));
+                m_checkpointStats.recomputedTensors++;
+                m_checkpointStats.savedBytes += shape.totalSize() * sizeof(float);
+            }
+        }
+        for (const unsigned int capacity : slotCapacity)
         {
-            if (i + 1 < m_layers.size())
+            m_checkpointStats.savedBytes -= capacity * sizeof(float);
+        }
+    }
+
+    void Network::planMixedPrecisionMemory(const unsigned int batch)
+    {
+        // in-place的层与输入共用存储，其余每层的输出与输入交替使用两块存储，
+        // 最终输出（以及与它in-place共用的tensor）单独保存为fp32
+        const unsigned int layerNum = (unsigned int)m_layers.size();
+        std::vector<unsigned int> group(layerNum + 1, 0);
+        for (unsigned int j = 1; j <= layerNum; j++)
+        {
+            group[j] = group[j - 1] + (m_inPlace[j - 1] ? 0 : 1);
+        }
+
+        unsigned int slotCapacity[2] = { 0, 0 };
+        for (unsigned int j = 0; j <= layerNum; j++)
+        {
+            if (group[j] != group[layerNum])
+            {
+                Shape shape = m_data[j]->getShape();
+                shape.Batch = batch;
+                slotCapacity[group[j] % 2] = std::max(slotCapacity[group[j] % 2], shape.totalSize());
+            }
+        }
+
+        for (auto* tensors : { &m_data, &m_gradients })
+        {
+            std::shared_ptr<float> slots[2];
+            for (unsigned int k = 0; k < 2; k++)
+            {
+                slots[k].reset(new float[std::max(slotCapacity[k], 1u)], std::default_delete<float[]>());
+            }
+            for (unsigned int j = 0; j <= layerNum; j++)
+            {
+                Shape shape = (*tensors)[j]->getShape();
+                shape.Batch = batch;
+                if (j > 0 && m_inPlace[j - 1])
+                {
+                    (*tensors)[j] = (*tensors)[j - 1];
+                }
+                else if (group[j] == group[layerNum])
+                {
+                    (*tensors)[j].reset(new Tensor(shape));
+                }
+                else
+                {
+                    (*tensors)[j].reset(new Tensor(shape, slots[group[j] % 2]));
+                }
+            }
+        }
+
+        m_stash.resize(layerNum + 1);
+        for (unsigned int j = 0; j <= layerNum; j++)
+        {
+            if (j > 0 && m_inPlace[j - 1])
+            {
+                m_stash[j] = m_stash[j - 1];
+            }
+            else if (group[j] == group[layerNum])
+            {
+                // 最终输出本身就是fp32，不需要副本
+                m_stash[j].reset();
+            }
+            else
+            {
+                m_stash[j].reset(new Tensor(m_data[j]->getShape(), DataType::BF16));
+            }
+        }
+        m_checkpointStats = CheckpointStats();
+    }
+
+    void Network::forwardLayers(const unsigned int begin, const unsigned int end)
+    {
+        for (unsigned int i = begin; i < end; i++)
+        {
+            if (i + 1 < m_layers.size() && !m_inPlace[i])
             {
                 m_data[i + 1]->setData(0.0f);
             }
             m_layers[i]->forward(m_data[i], m_data[i + 1]);
+            // 输出所在的存储会被后面的层覆盖，backward需要的数据保存为bf16
+            if (m_mixedPrecision && m_stash[i + 1])
+            {
+                m_stash[i + 1]->convertFrom(*m_data[i + 1]);
+            }
+        }
+    }
+
+    void Network::restoreActivations(const unsigned int layerIdx)
+    {
+        if (m_stash[layerIdx])
+        {
+            m_data[layerIdx]->convertFrom(*m_stash[layerIdx]);
+        }
+        if (!m_inPlace[layerIdx] && m_stash[layerIdx + 1])
+        {
+            m_data[layerIdx + 1]->convertFrom(*m_stash[layerIdx + 1]);
+        }
+    }
+
+    void Network::prepareInput(const std::shared_ptr<Tensor> inputTensor)
+    {
+        const auto newBatch = inputTensor->getShape().Batch;
+
+        // 所有tensor按出现过的最大batch分配，之后batch变小、变大（不超过容量）都只改变shape，不重新分配
+        if (newBatch > m_batchCapacity)
+        {
+            m_batchCapacity = newBatch;
+            m_planDirty = true;
         }
+        if (m_planDirty)
+        {
+            planActivationMemory(m_batchCapacity);
+        }
+        setBatch(newBatch);
+
+        // 连续的fp32输入直接作为第一层的输入（只改变shape，不拷贝）；混合精度时m_data[0]会从bf16恢复，
+        // 不能写到调用者的tensor中，仍然拷贝
+        Shape inputShape = m_data[0]->getShape();
+        inputShape.Batch = newBatch;
+        if (!m_mixedPrecision && inputTensor->getDataType() == DataType::FP32 && inputTensor->isContiguous()
+            && inputTensor->getShape().totalSize() == inputShape.totalSize())
+        {
+            m_data[0] = inputTensor->reshape(inputShape);
+            m_inputView = true;
+            return;
+        }
+        if (m_inputView)
+        {
+            Shape bufferShape = inputShape;
+            bufferShape.Batch = m_batchCapacity;
+            m_data[0].reset(new Tensor(bufferShape));
+            m_inputView = false;
+        }
+        inputTensor->clone(*m_data[0]);
+        if (m_mixedPrecision && m_stash[0])
+        {
+            m_stash[0]->convertFrom(*m_data[0]);
+        }
+    }
+
+    std::shared_ptr<Tensor> Network::forward(const std::shared_ptr<Tensor> inputTensor)
+    {
+        prepareInput(inputTensor);
+
+        const auto begin = std::chrono::steady_clock::now();
+        forwardLayers(0, (unsigned int)m_layers.size());
+        const auto end = std::chrono::steady_clock::now();
+        m_checkpointStats.forwardSeconds += std::chrono::duration<double>(end - begin).count();
 
         return m_data[m_data.size() - 1];
     }
 
     float Network::backward(const std::shared_ptr<Tensor> labelTensor)
     {
+        // 损失函数按连续的排列读取label
+        const std::shared_ptr<Tensor> label = labelTensor->isContiguous() ? labelTensor : labelTensor->contiguous();
         const auto lastOutputData = m_data[m_data.size() - 1];
-        const float loss = getLoss(labelTensor, lastOutputData);
 
         // 处理数据对齐问题
         if (m_gradients.size() != m_layers.size() + 1)
         {
-            m_gradients.push_back(std::make_shared<Tensor>(labelTensor->getShape()));
+            m_gradients.push_back(std::make_shared<Tensor>(label->getShape()));
         }
 
-        for (unsigned int i = 0; i < m_data.size(); i++)
+        reallocateTensors(m_gradients, m_data[0]->getShape().Batch);
+
+        if (!(m_gradients[m_gradients.size() - 1]->getShape() == label->getShape()))
+        {
+            m_gradients[m_gradients.size() - 1].reset(new Tensor(label->getShape()));
+        }
+
+        // loss和乘以loss scale的梯度在同一遍中计算
+        const float loss = m_lossFunction->getLossAndGradient(label, lastOutputData, m_gradients[m_gradients.size() - 1],
+                                                              m_lossScale);
+
+        for (int i = m_layers.size() - 1; i >= 0; i--)
         {
-            if (!(m_gradients[i]->getShape() == m_data[i]->getShape()))
+            // 当前segment的activation被后面的segment覆盖过，先从checkpoint重新计算
+            if (m_recomputeBegin[i] < m_recomputeEnd[i])
+            {
+                const auto begin = std::chrono::steady_clock::now();
+                forwardLayers(m_recomputeBegin[i], m_recomputeEnd[i]);
+                const auto end = std::chrono::steady_clock::now();
+                m_checkpointStats.recomputeSeconds += std::chrono::duration<double>(end - begin).count();
+                m_checkpointStats.recomputedLayers += m_recomputeEnd[i] - m_recomputeBegin[i];
+            }
+
+            if (m_mixedPrecision)
+            {
+                restoreActivations(i);
+            }
+
+            if (!m_inPlace[i])
             {
-                m_gradients[i].reset(new Tensor(m_data[i]->getShape()));
+                m_gradients[i]->setData(0.0f);
             }
+            m_layers[i]->backward(m_data[i], m_data[i + 1], m_gradients[i], m_gradients[i + 1]);
         }
 
-        if (!(m_gradients[m_gradients.size() - 1]->getShape() == labelTensor->getShape()))
+        return loss;
+    }
+
+    void Network::update()
+    {
+        if (m_dynamicLossScale)
         {
-            m_gradients[m_gradients.size() - 1].reset(new Tensor(labelTensor->getShape()));
+            updateWithDynamicLossScale();
+            return;
         }
 
-        // 计算梯度
-        m_lossFunction->getGradient(labelTensor, lastOutputData, m_gradients[m_gradients.size() - 1]);
-
+        // 更新参数
         for (int i = m_layers.size() - 1; i >= 0; i--)
         {
-            m_gradients[i]->setData(0.0f);
-            m_layers[i]->backward(m_data[i], m_data[i + 1], m_gradients[i], m_gradients[i + 1]);
+            updateLayer(i, *m_optimizer);
+        }
+    }
+
+    void Network::updateWithDynamicLossScale()
+    {
+        // 在除以loss scale的同时检查溢出，所有梯度都有限时才更新参数
+        std::atomic<bool> finite(true);
+        const float invLossScale = 1.0f / m_lossScale;
+        for (const auto& layer : m_layers)
+        {
+            for (const auto& gradient : layer->getGradData())
+            {
+                if (!gradient)
+                {
+                    continue;
+                }
+                float* gradientData = gradient->getData().get();
+                auto worker = [&](const unsigned int start, const unsigned int end)
+                {
+                    if (!scale_and_check_finite(gradientData + start, end - start, invLossScale))
+                    {
+                        finite.store(false, std::memory_order_relaxed);
+                    }
+                };
+                dispatch_worker(worker, gradient->getShape().totalSize());
+            }
+        }
+
+        if (!finite.load())
+        {
+            m_lossScale = std::max(m_lossScale * 0.5f, 1.0f);
+            m_goodSteps = 0;
+            m_skippedSteps++;
+            return;
+        }
+        if (++m_goodSteps >= m_lossScaleGrowthInterval)
+        {
+            m_lossScale *= 2.0f;
+            m_goodSteps = 0;
         }
 
-        // 更新参数
         for (int i = m_layers.size() - 1; i >= 0; i--)
         {
+            beforeParamsUpdate(i);
             m_optimizer->update(m_layers[i]->getParams(), m_layers[i]->getGradData());
         }
+    }
 
-        return loss;
+    bool Network::hasParams(const unsigned int layerIdx) const
+    {
+        return !m_layers[layerIdx]->getParams().empty();
+    }
+
+    std::string Network::getLayerType(const unsigned int layerIdx) const
+    {
+        return m_layers[layerIdx]->getLayerType();
+    }
+
+    std::vector<std::shared_ptr<Tensor>> Network::getLayerParams(const unsigned int layerIdx) const
+    {
+        return m_layers[layerIdx]->getParams();
+    }
+
+    void Network::invalidateParamCaches(const unsigned int layerIdx)
+    {
+        const std::vector<std::shared_ptr<Tensor>> params = m_layers[layerIdx]->getParams();
+        if (!params.empty())
+        {
+            m_layers[layerIdx]->shareParams(params);
+        }
+    }
+
+    void Network::updateLayer(const unsigned int layerIdx, Optimizer& optimizer)
+    {
+        if (m_lossScale != 1.0f)
+        {
+            for (const auto& gradient : m_layers[layerIdx]->getGradData())
+            {
+                if (gradient)
+                {
+                    div_inplace(gradient->getData().get(), m_lossScale, gradient->getShape().totalSize());
+                }
+            }
+        }
+        beforeParamsUpdate(layerIdx);
+        optimizer.update(m_layers[layerIdx]->getParams(), m_layers[layerIdx]->getGradData());
+    }
+
+    void Network::beforeParamsUpdate(const unsigned int layerIdx)
+    {
+        if (m_snapshot)
+        {
+            m_snapshot->copyBeforeWrite(layerIdx);
+            if (m_snapshot->isComplete())
+            {
+                m_snapshot.reset();
+            }
+        }
     }
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 // Created by yang chen on 2018/3/9.
 //
 
+#include <iterator>
 #include "../include/Optimizer.h"
 
 namespace MiniCNN
@@ -24,22 +25,24 @@ namespace MiniCNN
     void SGDWithMomentum::update(std::vector<std::shared_ptr<Tensor>> params,
                                  const std::vector<std::shared_ptr<Tensor>> gradient)
     {
-        if (m_historyData.size() != params.size())
-        {
-            m_historyData.resize(params.size());
-        }
-
         for (unsigned int i = 0; i < params.size(); i++)
         {
-            if ((m_historyData[i].get() == nullptr) || !(m_historyData[i]->getShape() == params[i]->getShape()))
+            std::shared_ptr<Tensor> history = findHistory(params[i]);
+            if ((history.get() == nullptr) || !(history->getShape() == params[i]->getShape()))
             {
-                m_historyData[i].reset(new Tensor(params[i]->getShape()));
-                m_historyData[i]->setData(0.0f);
+                // 顺便删除已经释放的参数（如被替换的层）的动量
+                for (auto it = m_historyData.begin(); it != m_historyData.end();)
+                {
+                    it = it->second.param.expired() ? m_historyData.erase(it) : std::next(it);
+                }
+                history.reset(new Tensor(params[i]->getShape()));
+                history->setData(0.0f);
+                setParamState(params[i], history);
             }
 
             float* paramData = params[i]->getData().get();
             const float* gradientData = gradient[i]->getData().get();
-            float* historyData = m_historyData[i]->getData().get();
+            float* historyData = history->getData().get();
 
             for (unsigned int j = 0; j < params[i]->getShape().totalSize(); j++)
             {
@@ -49,4 +52,33 @@ namespace MiniCNN
 
         }
     }
+
+    std::shared_ptr<Tensor> SGDWithMomentum::findHistory(const std::shared_ptr<Tensor>& param) const
+    {
+        const auto it = m_historyData.find(param.get());
+        if (it == m_historyData.end() || it->second.param.lock() != param)
+        {
+            return nullptr;
+        }
+        return it->second.data;
+    }
+
+    std::shared_ptr<Tensor> SGDWithMomentum::getParamState(const std::shared_ptr<Tensor>& param) const
+    {
+        return findHistory(param);
+    }
+
+    void SGDWithMomentum::setParamState(const std::shared_ptr<Tensor>& param, std::shared_ptr<Tensor> state)
+    {
+        if (state)
+        {
+            History& history = m_historyData[param.get()];
+            history.param = param;
+            history.data = state;
+        }
+        else
+        {
+            m_historyData.erase(param.get());
+        }
+    }
 }
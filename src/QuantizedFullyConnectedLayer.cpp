@@ -0,0 +1,227 @@
+//
+// Created by yang chen on 2018/4/5.
+//
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include "../include/QuantizedFullyConnectedLayer.h"
+#include "../include/ActivationLayer.h"
+#include "../include/ThreadPool.h"
+
+namespace MiniCNN
+{
+    static const unsigned int INT8_ALIGN = 64;
+
+    QuantizedFullyConnectedLayer::QuantizedFullyConnectedLayer() {}
+    QuantizedFullyConnectedLayer::~QuantizedFullyConnectedLayer() {}
+
+    DEFINE_LAYER_TYPE(QuantizedFullyConnectedLayer, "QuantizedFullyConnectedLayer");
+    std::string QuantizedFullyConnectedLayer::getLayerType() const
+    {
+        return layerType;
+    }
+
+    void QuantizedFullyConnectedLayer::setParameters(const Shape paramShape, const bool enableBias,
+                                                     const ActivationType activation, const Tensor& weight,
+                                                     const std::shared_ptr<Tensor> bias,
+                                                     const float inputMin, const float inputMax)
+    {
+        m_paramShape = paramShape;
+        m_enableBias = enableBias;
+        m_activation = activation;
+        setOutputShape(paramShape);
+        solveInnerParams();
+
+        // 输入的范围必须包含0，保证0能被精确表示
+        const float minValue = std::min(inputMin, 0.0f);
+        const float maxValue = std::max(inputMax, 0.0f);
+        m_inputScale = maxValue > minValue ? (maxValue - minValue) / 255.0f : 1.0f;
+        m_inputZeroPoint = std::min(std::max((int)std::lround(-minValue / m_inputScale), 0), 255);
+
+        // 每个输出通道按绝对值最大值对称量化到[-127, 127]
+        const unsigned int inSize = getInputShape().oneBatchSize();
+        const unsigned int outSize = m_paramShape.oneBatchSize();
+        const float* weightData = weight.getData().get();
+        for (unsigned int i = 0; i < outSize; i++)
+        {
+            const float* row = weightData + i * inSize;
+            float absMax = 0.0f;
+            for (unsigned int j = 0; j < inSize; j++)
+            {
+                absMax = std::max(absMax, std::fabs(row[j]));
+            }
+            m_weightScale[i] = absMax > 0.0f ? absMax / 127.0f : 1.0f;
+            for (unsigned int j = 0; j < inSize; j++)
+            {
+                const int value = (int)std::lround(row[j] / m_weightScale[i]);
+                m_weight[i * m_inStride + j] = (int8_t)std::min(std::max(value, -127), 127);
+            }
+        }
+        updateWeightSum();
+
+        if (m_enableBias)
+        {
+            std::copy(bias->getData().get(), bias->getData().get() + outSize, m_bias.begin());
+        }
+    }
+
+    void QuantizedFullyConnectedLayer::solveInnerParams()
+    {
+        const Shape inputShape = getInputShape();
+        Shape outputShape = getOutputShape();
+        outputShape.Batch = inputShape.Batch;
+        setOutputShape(outputShape);
+        allocateWeights();
+    }
+
+    void QuantizedFullyConnectedLayer::allocateWeights()
+    {
+        const unsigned int inSize = getInputShape().oneBatchSize();
+        const unsigned int outSize = m_paramShape.oneBatchSize();
+        const unsigned int inStride = (inSize + INT8_ALIGN - 1) / INT8_ALIGN * INT8_ALIGN;
+        // addLayer时会再次调用solveInnerParams，已经加载的参数不能被覆盖
+        if (inStride == m_inStride && m_weight.size() == outSize * inStride)
+        {
+            return;
+        }
+        m_inStride = inStride;
+        m_weight.assign(outSize * m_inStride, 0);
+        m_weightSum.assign(outSize, 0);
+        m_weightScale.assign(outSize, 1.0f);
+        m_bias.assign(m_enableBias ? outSize : 0, 0.0f);
+    }
+
+    void QuantizedFullyConnectedLayer::updateWeightSum()
+    {
+        // 预先计算每行weight之和，用于扣除输入zero point的贡献
+        for (unsigned int i = 0; i < m_weightSum.size(); i++)
+        {
+            int32_t sum = 0;
+            for (unsigned int j = 0; j < m_inStride; j++)
+            {
+                sum += m_weight[i * m_inStride + j];
+            }
+            m_weightSum[i] = sum;
+        }
+    }
+
+    std::string QuantizedFullyConnectedLayer::save() const
+    {
+        const std::string spliter = " ";
+        std::stringstream ss;
+
+        ss << layerType << spliter << m_paramShape.Batch << spliter << m_paramShape.Channels << spliter
+           << m_paramShape.Width << spliter << m_paramShape.Height << spliter << m_enableBias << spliter
+           << m_inputScale << spliter << m_inputZeroPoint << spliter;
+
+        for (const float scale : m_weightScale)
+        {
+            ss << scale << spliter;
+        }
+        for (const float bias : m_bias)
+        {
+            ss << bias << spliter;
+        }
+
+        const unsigned int inSize = getInputShape().oneBatchSize();
+        for (unsigned int i = 0; i < m_weightScale.size(); i++)
+        {
+            for (unsigned int j = 0; j < inSize; j++)
+            {
+                ss << (int)m_weight[i * m_inStride + j] << spliter;
+            }
+        }
+
+        // 融合的activation按单独的层保存
+        if (m_activation != ActivationType::NONE)
+        {
+            ss << "\n" << activation_layer_type(m_activation);
+        }
+        return ss.str();
+    }
+
+    bool QuantizedFullyConnectedLayer::load(const std::string content)
+    {
+        const size_t lineEnd = content.find('\n');
+        std::stringstream ss(content.substr(0, lineEnd));
+        std::string _layerType;
+        ss >> _layerType >> m_paramShape.Batch >> m_paramShape.Channels >> m_paramShape.Width
+           >> m_paramShape.Height >> m_enableBias >> m_inputScale >> m_inputZeroPoint;
+
+        setOutputShape(m_paramShape);
+        solveInnerParams();
+        for (float& scale : m_weightScale)
+        {
+            ss >> scale;
+        }
+        for (float& bias : m_bias)
+        {
+            ss >> bias;
+        }
+
+        const unsigned int inSize = getInputShape().oneBatchSize();
+        for (unsigned int i = 0; i < m_weightScale.size(); i++)
+        {
+            for (unsigned int j = 0; j < inSize; j++)
+            {
+                int value = 0;
+                ss >> value;
+                m_weight[i * m_inStride + j] = (int8_t)value;
+            }
+        }
+        updateWeightSum();
+
+        std::string activationType;
+        if (lineEnd != std::string::npos)
+        {
+            std::stringstream activationSs(content.substr(lineEnd + 1));
+            activationSs >> activationType;
+        }
+        m_activation = activation_from_layer_type(activationType);
+        return true;
+    }
+
+    void QuantizedFullyConnectedLayer::forward(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next)
+    {
+        const Shape prevLayerShape = prev->getShape();
+        const Shape nextLayerShape = next->getShape();
+        const unsigned int inSize = prevLayerShape.oneBatchSize();
+
+        const float* prevLayerData = prev->getData().get();
+        float* nextLayerData = next->getData().get();
+        const float* pBiasData = m_enableBias ? m_bias.data() : nullptr;
+
+        auto worker = [&](const unsigned int start, const unsigned int end)
+        {
+            // 量化后的输入放在线程局部的临时内存中，同一个层可以被多个线程（多个Evaluator上下文）同时使用
+            static thread_local std::vector<uint8_t> quantizedInput;
+            if (quantizedInput.size() < (end - start) * m_inStride)
+            {
+                quantizedInput.resize((end - start) * m_inStride);
+            }
+            uint8_t* quantizedData = quantizedInput.data();
+            for (unsigned int k = start; k < end; k++)
+            {
+                uint8_t* row = quantizedData + (k - start) * m_inStride;
+                quantize_u8(prevLayerData + k * inSize, row, inSize, m_inputScale, m_inputZeroPoint);
+                // 临时内存可能被其他层用过，补齐部分需要重新清0
+                std::fill(row + inSize, row + m_inStride, (uint8_t)0);
+            }
+            fullyConnectInt8(quantizedData, m_weight.data(), m_weightSum.data(),
+                             m_weightScale.data(), pBiasData, nextLayerData + start * nextLayerShape.oneBatchSize(),
+                             end - start, m_inStride, nextLayerShape.oneBatchSize(), m_inputScale, m_inputZeroPoint,
+                             m_activation);
+        };
+        dispatch_worker(worker, prevLayerShape.Batch);
+    }
+
+    void QuantizedFullyConnectedLayer::backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
+                                                std::shared_ptr<Tensor>& prevGrad, const std::shared_ptr<Tensor>& nextGrad)
+    {
+        // 量化后的层只用于推理，不能产生全0的梯度让训练悄悄地继续
+        fprintf(stderr, "MiniCNN: %s does not support backward, it is only used for inference\n", layerType.c_str());
+        std::abort();
+    }
+}
@@ -0,0 +1,199 @@
+//
+// Created by yang chen on 2018/4/24.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <sstream>
+#include "../include/Sampler.h"
+#include "../include/CalcFunctions.h"
+
+namespace MiniCNN
+{
+    Sampler::~Sampler() {}
+
+    unsigned int Sampler::getBatch(const unsigned int batchIdx, const unsigned int batch, const unsigned int*& indices) const
+    {
+        const size_t offset = (size_t)batchIdx * batch;
+        if (offset >= m_indices.size())
+        {
+            indices = nullptr;
+            return 0;
+        }
+        indices = &m_indices[offset];
+        return (unsigned int)std::min<size_t>(batch, m_indices.size() - offset);
+    }
+
+    std::string Sampler::saveState() const
+    {
+        std::ostringstream oss;
+        oss << m_indices.size();
+        for (const unsigned int index : m_indices)
+        {
+            oss << ' ' << index;
+        }
+        oss << ' ';
+        saveEngine(oss);
+        return oss.str();
+    }
+
+    bool Sampler::loadState(const std::string& state)
+    {
+        std::istringstream iss(state);
+        size_t count = 0;
+        if (!(iss >> count) || count != m_indices.size())
+        {
+            return false;
+        }
+        std::vector<unsigned int> indices(count);
+        for (auto& index : indices)
+        {
+            if (!(iss >> index))
+            {
+                return false;
+            }
+        }
+        if (!loadEngine(iss))
+        {
+            return false;
+        }
+        m_indices = std::move(indices);
+        return true;
+    }
+
+    SequentialSampler::SequentialSampler(const unsigned int count)
+    {
+        m_indices.resize(count);
+        std::iota(m_indices.begin(), m_indices.end(), 0u);
+    }
+
+    SequentialSampler::SequentialSampler(std::vector<unsigned int> indices)
+    {
+        m_indices = std::move(indices);
+    }
+
+    RandomSampler::RandomSampler(const unsigned int count, const unsigned int stream)
+            : m_engine(create_random_engine(stream))
+    {
+        m_indices.resize(count);
+        std::iota(m_indices.begin(), m_indices.end(), 0u);
+    }
+
+    RandomSampler::RandomSampler(std::vector<unsigned int> indices, const unsigned int stream)
+            : m_engine(create_random_engine(stream))
+    {
+        m_indices = std::move(indices);
+    }
+
+    void RandomSampler::nextEpoch()
+    {
+        // 在上一个epoch的排列上继续打乱，结果仍是均匀的随机排列
+        std::shuffle(m_indices.begin(), m_indices.end(), m_engine);
+    }
+
+    void RandomSampler::saveEngine(std::ostream& os) const
+    {
+        os << m_engine;
+    }
+
+    bool RandomSampler::loadEngine(std::istream& is)
+    {
+        std::mt19937 engine;
+        if (!(is >> engine))
+        {
+            return false;
+        }
+        m_engine = engine;
+        return true;
+    }
+
+    WeightedSampler::WeightedSampler(std::vector<unsigned int> population, const std::vector<double>& weights,
+                                     const unsigned int samples, const unsigned int stream)
+            : m_population(std::move(population)), m_engine(create_random_engine(stream))
+    {
+        m_valid = weights.size() == m_population.size();
+        bool positive = false;
+        for (size_t i = 0; m_valid && i < weights.size(); i++)
+        {
+            m_valid = std::isfinite(weights[i]) && weights[i] >= 0.0;
+            positive = positive || weights[i] > 0.0;
+        }
+        m_valid = m_valid && positive;
+        if (!m_valid)
+        {
+            return;
+        }
+        m_distribution = std::discrete_distribution<unsigned int>(weights.begin(), weights.end());
+        m_indices.resize(samples);
+    }
+
+    void WeightedSampler::nextEpoch()
+    {
+        for (auto& index : m_indices)
+        {
+            index = m_population[m_distribution(m_engine)];
+        }
+    }
+
+    void WeightedSampler::saveEngine(std::ostream& os) const
+    {
+        os << m_engine;
+    }
+
+    bool WeightedSampler::loadEngine(std::istream& is)
+    {
+        std::mt19937 engine;
+        if (!(is >> engine))
+        {
+            return false;
+        }
+        m_engine = engine;
+        return true;
+    }
+
+    ClassBalancedSampler::ClassBalancedSampler(const Dataset& dataset, std::vector<unsigned int> population,
+                                               const unsigned int samples, const unsigned int stream)
+            : WeightedSampler(population, classBalancedWeights(dataset, population), samples, stream)
+    {
+    }
+
+    std::vector<double> ClassBalancedSampler::classBalancedWeights(const Dataset& dataset,
+                                                                   const std::vector<unsigned int>& population)
+    {
+        std::vector<unsigned int> counts(dataset.getClasses(), 0);
+        for (const unsigned int idx : population)
+        {
+            counts[dataset.getLabel(idx)]++;
+        }
+        std::vector<double> weights(population.size());
+        for (size_t i = 0; i < population.size(); i++)
+        {
+            weights[i] = 1.0 / counts[dataset.getLabel(population[i])];
+        }
+        return weights;
+    }
+
+    void stratified_split(const Dataset& dataset, const float validateRatio, const unsigned int stream,
+                          std::vector<unsigned int>& trainIndices, std::vector<unsigned int>& validateIndices)
+    {
+        std::vector<std::vector<unsigned int>> classIndices(dataset.getClasses());
+        for (unsigned int i = 0; i < dataset.size(); i++)
+        {
+            classIndices[dataset.getLabel(i)].push_back(i);
+        }
+
+        trainIndices.clear();
+        validateIndices.clear();
+        std::mt19937 engine = create_random_engine(stream);
+        for (auto& indices : classIndices)
+        {
+            std::shuffle(indices.begin(), indices.end(), engine);
+            const size_t validateCount = std::min(indices.size(), (size_t)std::lround(indices.size() * validateRatio));
+            validateIndices.insert(validateIndices.end(), indices.begin(), indices.begin() + validateCount);
+            trainIndices.insert(trainIndices.end(), indices.begin() + validateCount, indices.end());
+        }
+        std::sort(trainIndices.begin(), trainIndices.end());
+        std::sort(validateIndices.begin(), validateIndices.end());
+    }
+}
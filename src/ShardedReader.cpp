@@ -0,0 +1,337 @@
+//
+// Created by yang chen on 2018/4/28.
+//
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+#include "../include/ShardedReader.h"
+#include "../include/CalcFunctions.h"
+#include "../include/CompressedInput.h"
+#include "../include/Dataset.h"
+#include "../include/mnist_data_loader.h"
+
+namespace MiniCNN
+{
+    static std::string parent_dir(const std::string& path)
+    {
+        const size_t pos = path.find_last_of("/\\");
+        return pos == std::string::npos ? "." : path.substr(0, pos);
+    }
+
+    static bool ends_with(const std::string& s, const std::string& suffix)
+    {
+        return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    // 目录中的xxx-images-idx3-ubyte与xxx-labels-idx1-ubyte配对（都可以带.gz后缀），按文件名排序
+    static bool list_shard_dir(const std::string& dir, std::vector<std::pair<std::string, std::string>>& pairs)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        DIR* handle = opendir(dir.c_str());
+        if (handle == nullptr)
+        {
+            return false;
+        }
+        const std::string imagesSuffix = "-images-idx3-ubyte";
+        std::vector<std::string> names;
+        while (const dirent* entry = readdir(handle))
+        {
+            names.push_back(entry->d_name);
+        }
+        closedir(handle);
+        std::sort(names.begin(), names.end());
+        for (const auto& name : names)
+        {
+            const std::string base = ends_with(name, ".gz") ? name.substr(0, name.size() - 3) : name;
+            if (ends_with(base, imagesSuffix))
+            {
+                const std::string prefix = base.substr(0, base.size() - imagesSuffix.size());
+                const std::string labels = prefix + "-labels-idx1-ubyte";
+                if (std::binary_search(names.begin(), names.end(), labels))
+                {
+                    pairs.emplace_back(dir + "/" + name, dir + "/" + labels);
+                }
+                else if (std::binary_search(names.begin(), names.end(), labels + ".gz"))
+                {
+                    pairs.emplace_back(dir + "/" + name, dir + "/" + labels + ".gz");
+                }
+            }
+        }
+        return true;
+#else
+        (void)dir;
+        (void)pairs;
+        return false;
+#endif
+    }
+
+    static bool is_directory(const std::string& path)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        struct stat pathStat;
+        return stat(path.c_str(), &pathStat) == 0 && S_ISDIR(pathStat.st_mode);
+#else
+        (void)path;
+        return false;
+#endif
+    }
+
+    ShardedReader::ShardedReader() {}
+
+    ShardedReader::~ShardedReader() {}
+
+    bool ShardedReader::open(const std::string& path, const unsigned int classes, const unsigned int chunkSamples,
+                             const unsigned int bufferSamples, const unsigned int stream)
+    {
+        m_shards.clear();
+        m_size = 0;
+        m_sampleShape = Shape();
+        m_classes = classes;
+        if (classes == 0 || classes > 256)
+        {
+            return false;
+        }
+
+        std::vector<std::pair<std::string, std::string>> pairs;
+        if (is_directory(path))
+        {
+            if (!list_shard_dir(path, pairs))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            std::ifstream ifs(path);
+            if (!ifs.is_open())
+            {
+                return false;
+            }
+            const std::string dir = parent_dir(path);
+            std::string line;
+            while (std::getline(ifs, line))
+            {
+                std::istringstream iss(line);
+                std::string images, labels;
+                if (!(iss >> images) || images[0] == '#')
+                {
+                    continue;
+                }
+                if (!(iss >> labels))
+                {
+                    return false;
+                }
+                pairs.emplace_back(images[0] == '/' ? images : dir + "/" + images,
+                                   labels[0] == '/' ? labels : dir + "/" + labels);
+            }
+        }
+
+        for (const auto& pair : pairs)
+        {
+            if (!addShard(pair.first, pair.second))
+            {
+                m_shards.clear();
+                m_size = 0;
+                return false;
+            }
+        }
+        if (m_shards.empty())
+        {
+            return false;
+        }
+
+        m_chunkSamples = std::max(chunkSamples, 1u);
+        m_bufferSamples = std::max(bufferSamples, 1u);
+        m_stream = stream;
+        m_epoch = 0;
+        const unsigned int sampleSize = m_sampleShape.oneBatchSize();
+        m_chunkImages.assign((size_t)m_chunkSamples * sampleSize, 0);
+        m_chunkLabels.assign(m_chunkSamples, 0);
+        m_bufferImages.assign((size_t)m_bufferSamples * sampleSize, 0);
+        m_bufferLabels.assign(m_bufferSamples, 0);
+        m_shardOrder.resize(m_shards.size());
+        std::iota(m_shardOrder.begin(), m_shardOrder.end(), 0u);
+        m_nextShard = (unsigned int)m_shards.size();
+        m_shardRemaining = 0;
+        m_chunkCount = m_chunkPos = 0;
+        m_bufferCount = 0;
+        return true;
+    }
+
+    bool ShardedReader::addShard(const std::string& imagesPath, const std::string& labelsPath)
+    {
+        //count, rows, cols
+        uint32_t imageDims[3] = { 0, 0, 0 };
+        uint32_t labelCount = 0;
+        CompressedInput imagesInput;
+        CompressedInput labelsInput;
+        if (!imagesInput.open(imagesPath) || !labelsInput.open(labelsPath)
+            || !read_idx_header(imagesInput, 0x00000803, imageDims, 3)
+            || !read_idx_header(labelsInput, 0x00000801, &labelCount, 1)
+            || imageDims[0] != labelCount || imageDims[1] == 0 || imageDims[2] == 0)
+        {
+            return false;
+        }
+        const Shape sampleShape(1, 1, imageDims[2], imageDims[1]);
+        if (!m_shards.empty() && sampleShape != m_sampleShape)
+        {
+            return false;
+        }
+        m_sampleShape = sampleShape;
+
+        Shard shard;
+        shard.imagesPath = imagesPath;
+        shard.labelsPath = labelsPath;
+        shard.count = labelCount;
+        m_shards.push_back(shard);
+        m_size += labelCount;
+        return true;
+    }
+
+    size_t ShardedReader::getMemoryBytes() const
+    {
+        return m_chunkImages.size() + m_chunkLabels.size() + m_bufferImages.size() + m_bufferLabels.size();
+    }
+
+    void ShardedReader::startEpoch()
+    {
+        m_engine = create_random_engine(m_stream, m_epoch++);
+        std::shuffle(m_shardOrder.begin(), m_shardOrder.end(), m_engine);
+        m_nextShard = 0;
+        m_imagesInput.reset();
+        m_labelsInput.reset();
+        m_shardRemaining = 0;
+        m_failed = false;
+        m_chunkCount = m_chunkPos = 0;
+        m_bufferCount = 0;
+    }
+
+    bool ShardedReader::readChunk()
+    {
+        while (m_shardRemaining == 0)
+        {
+            if (m_failed || m_nextShard >= m_shardOrder.size())
+            {
+                return false;
+            }
+            const Shard& shard = m_shards[m_shardOrder[m_nextShard++]];
+            m_imagesInput.reset(new CompressedInput());
+            m_labelsInput.reset(new CompressedInput());
+            //count, rows, cols
+            uint32_t imageDims[3] = { 0, 0, 0 };
+            uint32_t labelCount = 0;
+            if (!m_imagesInput->open(shard.imagesPath) || !m_labelsInput->open(shard.labelsPath)
+                || !read_idx_header(*m_imagesInput, 0x00000803, imageDims, 3)
+                || !read_idx_header(*m_labelsInput, 0x00000801, &labelCount, 1)
+                || imageDims[0] != shard.count || labelCount != shard.count
+                || Shape(1, 1, imageDims[2], imageDims[1]) != m_sampleShape)
+            {
+                // 打开时检查过的分片无法再读取或已被修改
+                m_failed = true;
+                return false;
+            }
+            m_shardRemaining = shard.count;
+        }
+
+        const unsigned int sampleSize = m_sampleShape.oneBatchSize();
+        const unsigned int count = (unsigned int)std::min<uint64_t>(m_shardRemaining, m_chunkSamples);
+        if (!m_imagesInput->read(&m_chunkImages[0], (size_t)count * sampleSize)
+            || !m_labelsInput->read(&m_chunkLabels[0], count))
+        {
+            // 文件在打开之后被截断，或压缩数据损坏
+            m_failed = true;
+            m_shardRemaining = 0;
+            return false;
+        }
+        // label的范围在读取时检查，打开时只读取文件头
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if (m_chunkLabels[i] >= m_classes)
+            {
+                m_failed = true;
+                m_shardRemaining = 0;
+                return false;
+            }
+        }
+        m_shardRemaining -= count;
+        // 提示预读这个分片的下一块，已经读过的页不再需要
+        const unsigned int nextCount = (unsigned int)std::min<uint64_t>(m_shardRemaining, m_chunkSamples);
+        m_imagesInput->adviseReadahead((size_t)nextCount * sampleSize);
+        m_labelsInput->adviseReadahead(nextCount);
+        m_chunkCount = count;
+        m_chunkPos = 0;
+        return true;
+    }
+
+    const uint8_t* ShardedReader::pullSample(uint8_t& label)
+    {
+        if (m_chunkPos >= m_chunkCount && !readChunk())
+        {
+            return nullptr;
+        }
+        label = m_chunkLabels[m_chunkPos];
+        return &m_chunkImages[(size_t)(m_chunkPos++) * m_sampleShape.oneBatchSize()];
+    }
+
+    unsigned int ShardedReader::nextBatch(Tensor& inputTensor, Tensor* labelTensor)
+    {
+        assert(inputTensor.isContiguous() && inputTensor.getShape().oneBatchSize() == m_sampleShape.oneBatchSize());
+        assert(labelTensor == nullptr || labelTensor->isContiguous());
+        const unsigned int sampleSize = m_sampleShape.oneBatchSize();
+        const unsigned int batch = inputTensor.getShape().Batch;
+        const unsigned int sizePerLabel = labelTensor != nullptr ? labelTensor->getShape().oneBatchSize() : 0;
+        float* inputData = inputTensor.getData().get();
+        float* labelData = labelTensor != nullptr ? labelTensor->getData().get() : nullptr;
+
+        // buffer未满时先装满（每个epoch开始时）
+        uint8_t label = 0;
+        while (m_bufferCount < m_bufferSamples)
+        {
+            const uint8_t* sample = pullSample(label);
+            if (sample == nullptr)
+            {
+                break;
+            }
+            std::memcpy(&m_bufferImages[(size_t)m_bufferCount * sampleSize], sample, sampleSize);
+            m_bufferLabels[m_bufferCount++] = label;
+        }
+
+        unsigned int count = 0;
+        for (; count < batch && m_bufferCount > 0; count++)
+        {
+            // 随机取出一个样本，空出的位置由下一个读入的样本填上；数据读完后用buffer末尾的样本填上
+            const unsigned int pick = std::uniform_int_distribution<unsigned int>(0, m_bufferCount - 1)(m_engine);
+            uint8_t* slot = &m_bufferImages[(size_t)pick * sampleSize];
+            uint8_to_float(slot, inputData + (size_t)count * sampleSize, sampleSize, Dataset::getSampleScale());
+            if (labelData != nullptr)
+            {
+                float* oneHot = labelData + (size_t)count * sizePerLabel;
+                std::fill(oneHot, oneHot + sizePerLabel, 0.0f);
+                assert(m_bufferLabels[pick] < sizePerLabel);
+                oneHot[m_bufferLabels[pick]] = 1.0f;
+            }
+
+            const uint8_t* sample = pullSample(label);
+            if (sample != nullptr)
+            {
+                std::memcpy(slot, sample, sampleSize);
+                m_bufferLabels[pick] = label;
+            }
+            else
+            {
+                m_bufferCount--;
+                std::memcpy(slot, &m_bufferImages[(size_t)m_bufferCount * sampleSize], sampleSize);
+                m_bufferLabels[pick] = m_bufferLabels[m_bufferCount];
+            }
+        }
+        return count;
+    }
+}
@@ -1,8 +1,9 @@
 //
 // Created by yang chen on 2018/3/8.
 //
-#include <cmath>
 #include "../include/SoftmaxLayer.h"
+#include "../include/CalcFunctions.h"
+#include "../include/ThreadPool.h"
 
 namespace MiniCNN
 {
@@ -19,70 +20,34 @@ namespace MiniCNN
     {
         const Shape prevLayerShape = prev->getShape();
         const Shape nextLayerShape = next->getShape();
+        const float* prevData = prev->getData().get();
+        float* nextData = next->getData().get();
 
-        for (unsigned int batchIdx = 0; batchIdx < nextLayerShape.Batch; batchIdx++)
+        // 按样本分给各个worker；每个样本的长度为常见大小时使用按长度特化的kernel
+        const SoftmaxKernel kernel = get_softmax_kernel(prevLayerShape.oneBatchSize());
+        auto worker = [&](const unsigned int start, const unsigned int end)
         {
-            const float* prevData = prev->getData().get() + batchIdx * prevLayerShape.oneBatchSize();
-            float* nextData = next->getData().get() + batchIdx * nextLayerShape.oneBatchSize();
-
-            // 该方法仿照caffe实现，先减去最大值，再处理。实际效果与理论方法一致
-            // find max value
-            float maxValue = prevData[0];
-            for (unsigned int prevDataIdx = 0; prevDataIdx < prevLayerShape.oneBatchSize(); prevDataIdx++)
-            {
-                if (prevData[prevDataIdx] > maxValue)
-                    maxValue = prevData[prevDataIdx];
-            }
-
-            // sum
-            float sum = 0;
-            for (unsigned int prevDataIdx = 0; prevDataIdx < prevLayerShape.oneBatchSize(); prevDataIdx++)
-            {
-                nextData[prevDataIdx] = std::exp(prevData[prevDataIdx] - maxValue);
-                sum += nextData[prevDataIdx];
-            }
-
-            // div
-            for (unsigned int prevDataIdx = 0; prevDataIdx < prevLayerShape.oneBatchSize(); prevDataIdx++)
-            {
-                nextData[prevDataIdx] = nextData[prevDataIdx] / sum;
-            }
-        }
+            kernel(prevData + start * prevLayerShape.oneBatchSize(), nextData + start * nextLayerShape.oneBatchSize(),
+                   end - start, prevLayerShape.oneBatchSize());
+        };
+        dispatch_worker(worker, nextLayerShape.Batch);
     }
 
     void SoftmaxLayer::backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
                                 std::shared_ptr<Tensor> &prevGrad, const std::shared_ptr<Tensor> &nextGrad)
     {
-        const Shape prevLayerShape = prev->getShape();
         const Shape nextLayerShape = next->getShape();
-        const Shape prevGradShape = prevGrad->getShape();
-        const Shape nextGradShape = nextGrad->getShape();
+        const float* nextData = next->getData().get();
+        float* prevGradData = prevGrad->getData().get();
+        const float* nextGradData = nextGrad->getData().get();
 
-        for (unsigned int batchIdx = 0; batchIdx < prevLayerShape.oneBatchSize(); batchIdx++)
+        // dx_i = sum_j dy_j * y_j * (δij - y_i) = y_i * (dy_i - sum_j y_j * dy_j)
+        auto worker = [&](const unsigned int start, const unsigned int end)
         {
-            const float* prevData = prev->getData().get() + batchIdx * prevLayerShape.oneBatchSize();
-            const float* nextData = next->getData().get() + batchIdx * nextLayerShape.oneBatchSize();
-            float* prevGradData = prevGrad->getData().get() + batchIdx * prevGradShape.oneBatchSize();
-            const float* nextGradData = nextGrad->getData().get() + batchIdx * nextGradShape.oneBatchSize();
-
-            for (unsigned int prevGradIdx = 0; prevGradIdx < prevGradShape.oneBatchSize(); prevGradIdx++)
-            {
-                for (unsigned int nextGradIdx = 0; nextGradIdx < nextGradShape.oneBatchSize(); nextGradIdx++)
-                {
-                    if (nextGradIdx == prevGradIdx)
-                    {
-                        // 如果j == i，loss' = aj * (1 - aj) * loss
-                        prevGradData[prevGradIdx] += nextData[prevGradIdx] * (1.0f - nextData[prevGradIdx]) * nextGradData[nextGradIdx];
-                    }
-                    else
-                    {
-                        // 如果j != i, loss' = -aj * ai * loss
-                        prevGradData[prevGradIdx] -= nextData[nextGradIdx] * nextData[prevGradIdx] * nextGradData[nextGradIdx];
-                    }
-                }
-            }
-
-        }
+            const unsigned int offset = start * nextLayerShape.oneBatchSize();
+            softmax_backward(nextData + offset, nextGradData + offset, prevGradData + offset, end - start,
+                             nextLayerShape.oneBatchSize());
+        };
+        dispatch_worker(worker, nextLayerShape.Batch);
     }
-
-}
\ No newline at end of file
+}
@@ -0,0 +1,217 @@
+//
+// Created by yang chen on 2018/4/8.
+//
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include "../include/SparseFullyConnectedLayer.h"
+#include "../include/ActivationLayer.h"
+#include "../include/ThreadPool.h"
+
+namespace MiniCNN
+{
+
+    SparseFullyConnectedLayer::SparseFullyConnectedLayer() {}
+    SparseFullyConnectedLayer::~SparseFullyConnectedLayer() {}
+
+    DEFINE_LAYER_TYPE(SparseFullyConnectedLayer, "SparseFullyConnectedLayer");
+    std::string SparseFullyConnectedLayer::getLayerType() const
+    {
+        return layerType;
+    }
+
+    void SparseFullyConnectedLayer::setParameters(const Shape paramShape, const bool enableBias,
+                                                  const ActivationType activation, const Tensor& weight,
+                                                  const std::shared_ptr<Tensor> bias, const unsigned int blockRows)
+    {
+        m_paramShape = paramShape;
+        m_enableBias = enableBias;
+        m_activation = activation;
+        m_blockRows = blockRows;
+        setOutputShape(paramShape);
+        solveInnerParams();
+
+        const unsigned int inSize = getInputShape().oneBatchSize();
+        const unsigned int outSize = m_paramShape.oneBatchSize();
+        const unsigned int blockRowCount = (outSize + m_blockRows - 1) / m_blockRows;
+        const float* weightData = weight.getData().get();
+
+        m_blockRowPtr.assign(1, 0);
+        m_blockCol.clear();
+        m_values.clear();
+        for (unsigned int b = 0; b < blockRowCount; b++)
+        {
+            for (unsigned int j = 0; j < inSize; j++)
+            {
+                // 超出输出个数的行补0
+                float block[8] = {};
+                bool nonZero = false;
+                for (unsigned int r = 0; r < m_blockRows && b * m_blockRows + r < outSize; r++)
+                {
+                    block[r] = weightData[(b * m_blockRows + r) * inSize + j];
+                    nonZero = nonZero || block[r] != 0.0f;
+                }
+                if (nonZero)
+                {
+                    m_blockCol.push_back(j);
+                    m_values.insert(m_values.end(), block, block + m_blockRows);
+                }
+            }
+            m_blockRowPtr.push_back((unsigned int)m_blockCol.size());
+        }
+
+        if (m_enableBias)
+        {
+            m_bias.assign(bias->getData().get(), bias->getData().get() + outSize);
+        }
+    }
+
+    float SparseFullyConnectedLayer::getDensity() const
+    {
+        const float totalSize = (float)getInputShape().oneBatchSize() * m_paramShape.oneBatchSize();
+        return totalSize > 0.0f ? (float)m_values.size() / totalSize : 0.0f;
+    }
+
+    void SparseFullyConnectedLayer::solveInnerParams()
+    {
+        const Shape inputShape = getInputShape();
+        Shape outputShape = getOutputShape();
+        outputShape.Batch = inputShape.Batch;
+        setOutputShape(outputShape);
+    }
+
+    std::string SparseFullyConnectedLayer::save() const
+    {
+        const std::string spliter = " ";
+        std::stringstream ss;
+
+        ss << layerType << spliter << m_paramShape.Batch << spliter << m_paramShape.Channels << spliter
+           << m_paramShape.Width << spliter << m_paramShape.Height << spliter << m_enableBias << spliter
+           << m_blockRows << spliter << m_blockCol.size() << spliter;
+
+        for (const float bias : m_bias)
+        {
+            ss << bias << spliter;
+        }
+        for (const unsigned int ptr : m_blockRowPtr)
+        {
+            ss << ptr << spliter;
+        }
+        for (const unsigned int col : m_blockCol)
+        {
+            ss << col << spliter;
+        }
+        for (const float value : m_values)
+        {
+            ss << value << spliter;
+        }
+
+        // 融合的activation按单独的层保存
+        if (m_activation != ActivationType::NONE)
+        {
+            ss << "\n" << activation_layer_type(m_activation);
+        }
+        return ss.str();
+    }
+
+    bool SparseFullyConnectedLayer::load(const std::string content)
+    {
+        const size_t lineEnd = content.find('\n');
+        std::stringstream ss(content.substr(0, lineEnd));
+        std::string _layerType;
+        unsigned int blockCount = 0;
+        ss >> _layerType >> m_paramShape.Batch >> m_paramShape.Channels >> m_paramShape.Width
+           >> m_paramShape.Height >> m_enableBias >> m_blockRows >> blockCount;
+        // fullyConnectSparse只支持1、4、8行的块，非零块不会超过按形状划分的块数
+        if (!ss || (m_blockRows != 1 && m_blockRows != 4 && m_blockRows != 8))
+        {
+            return false;
+        }
+
+        setOutputShape(m_paramShape);
+        solveInnerParams();
+        const unsigned int inSize = getInputShape().oneBatchSize();
+        const unsigned int outSize = m_paramShape.oneBatchSize();
+        const unsigned int blockRowCount = (outSize + m_blockRows - 1) / m_blockRows;
+        if ((uint64_t)blockCount > (uint64_t)blockRowCount * inSize)
+        {
+            return false;
+        }
+
+        m_bias.assign(m_enableBias ? outSize : 0, 0.0f);
+        for (float& bias : m_bias)
+        {
+            ss >> bias;
+        }
+        m_blockRowPtr.assign(blockRowCount + 1, 0);
+        for (unsigned int& ptr : m_blockRowPtr)
+        {
+            ss >> ptr;
+        }
+        m_blockCol.assign(blockCount, 0);
+        for (unsigned int& col : m_blockCol)
+        {
+            ss >> col;
+        }
+        m_values.assign((size_t)blockCount * m_blockRows, 0.0f);
+        for (float& value : m_values)
+        {
+            ss >> value;
+        }
+        if (!ss || m_blockRowPtr.front() != 0 || m_blockRowPtr.back() != blockCount)
+        {
+            return false;
+        }
+        for (unsigned int b = 0; b < blockRowCount; b++)
+        {
+            if (m_blockRowPtr[b] > m_blockRowPtr[b + 1])
+            {
+                return false;
+            }
+        }
+        for (const unsigned int col : m_blockCol)
+        {
+            if (col >= inSize)
+            {
+                return false;
+            }
+        }
+
+        std::string activationType;
+        if (lineEnd != std::string::npos)
+        {
+            std::stringstream activationSs(content.substr(lineEnd + 1));
+            activationSs >> activationType;
+        }
+        m_activation = activation_from_layer_type(activationType);
+        return true;
+    }
+
+    void SparseFullyConnectedLayer::forward(const std::shared_ptr<Tensor> prev, std::shared_ptr<Tensor> next)
+    {
+        const Shape prevLayerShape = prev->getShape();
+        const Shape nextLayerShape = next->getShape();
+
+        const float* prevLayerData = prev->getData().get();
+        float* nextLayerData = next->getData().get();
+        const float* pBiasData = m_enableBias ? m_bias.data() : nullptr;
+
+        auto worker = [&](const unsigned int start, const unsigned int end)
+        {
+            fullyConnectSparse(prevLayerData + start * prevLayerShape.oneBatchSize(), m_blockRowPtr.data(),
+                               m_blockCol.data(), m_values.data(), m_blockRows, pBiasData,
+                               nextLayerData + start * nextLayerShape.oneBatchSize(), end - start,
+                               prevLayerShape.oneBatchSize(), nextLayerShape.oneBatchSize(), m_activation);
+        };
+        dispatch_worker(worker, prevLayerShape.Batch);
+    }
+
+    void SparseFullyConnectedLayer::backward(std::shared_ptr<Tensor> prev, const std::shared_ptr<Tensor> next,
+                                             std::shared_ptr<Tensor>& prevGrad, const std::shared_ptr<Tensor>& nextGrad)
+    {
+        // 稀疏的层只用于推理，不能产生全0的梯度让训练悄悄地继续
+        fprintf(stderr, "MiniCNN: %s does not support backward, it is only used for inference\n", layerType.c_str());
+        std::abort();
+    }
+}
@@ -3,24 +3,302 @@
 //
 
 #include <algorithm>
+#include <cstring>
 #include "../include/Tensor.h"
+#include "../include/CalcFunctions.h"
+#include "../include/ThreadPool.h"
 
 namespace MiniCNN
 {
-    Tensor::Tensor(const Shape shape):m_shape(shape), m_data(new float[shape.totalSize()]) {}
+    Tensor::Tensor(const Shape shape):m_shape(shape), m_strides(shape), m_capacity(shape.totalSize()),
+                                      m_data(new float[shape.totalSize()], std::default_delete<float[]>()) {}
+
+    Tensor::Tensor(const Shape shape, std::shared_ptr<float> storage)
+            :m_shape(shape), m_strides(shape), m_capacity(shape.totalSize()), m_data(storage) {}
+
+    Tensor::Tensor(const Shape shape, const DataType dataType)
+            :m_shape(shape), m_strides(shape), m_capacity(shape.totalSize()), m_dataType(dataType)
+    {
+        if (dataType == DataType::FP32)
+        {
+            m_data.reset(new float[shape.totalSize()], std::default_delete<float[]>());
+        }
+        else
+        {
+            m_halfData.reset(new uint16_t[shape.totalSize()], std::default_delete<uint16_t[]>());
+        }
+    }
+
+    Tensor::Tensor(const Shape shape, const Strides strides, const DataType dataType,
+                   std::shared_ptr<float> data, std::shared_ptr<uint16_t> halfData)
+            :m_shape(shape), m_strides(strides), m_capacity(shape.totalSize()), m_dataType(dataType),
+             m_data(data), m_halfData(halfData) {}
 
     Tensor::~Tensor() {}
 
+    // 按元素顺序把tensor划分为存储中连续的若干段，对每一段调用f(存储中的偏移, 元素序号, 长度)
+    template <typename F>
+    static void for_each_run(const Shape& shape, const Strides& strides, F f)
+    {
+        const Strides dense(shape);
+        const bool rowContiguous = strides.Col == 1 || shape.Width <= 1;
+        const bool channelContiguous = rowContiguous && (strides.Row == dense.Row || shape.Height <= 1);
+        const bool batchContiguous = channelContiguous && (strides.Channels == dense.Channels || shape.Channels <= 1);
+        size_t index = 0;
+        for (unsigned int b = 0; b < shape.Batch; b++)
+        {
+            if (batchContiguous)
+            {
+                f(strides.getOffset(b, 0, 0, 0), index, shape.oneBatchSize());
+                index += shape.oneBatchSize();
+                continue;
+            }
+            for (unsigned int c = 0; c < shape.Channels; c++)
+            {
+                if (channelContiguous)
+                {
+                    f(strides.getOffset(b, c, 0, 0), index, shape.oneChannelSize());
+                    index += shape.oneChannelSize();
+                    continue;
+                }
+                for (unsigned int r = 0; r < shape.Height; r++)
+                {
+                    if (rowContiguous)
+                    {
+                        f(strides.getOffset(b, c, r, 0), index, shape.Width);
+                        index += shape.Width;
+                        continue;
+                    }
+                    for (unsigned int col = 0; col < shape.Width; col++)
+                    {
+                        f(strides.getOffset(b, c, r, col), index++, 1u);
+                    }
+                }
+            }
+        }
+    }
+
+    bool Tensor::isContiguous() const
+    {
+        // 长度为1的维度不影响排列
+        const Strides dense(m_shape);
+        return (m_strides.Col == dense.Col || m_shape.Width <= 1)
+               && (m_strides.Row == dense.Row || m_shape.Height <= 1)
+               && (m_strides.Channels == dense.Channels || m_shape.Channels <= 1)
+               && (m_strides.Batch == dense.Batch || m_shape.Batch <= 1);
+    }
+
     void Tensor::setData(const float item)
     {
-        std::fill(m_data.get(), m_data.get() + getShape().totalSize(), item);
+        if (!isContiguous())
+        {
+            uint16_t halfItem = 0;
+            if (m_dataType != DataType::FP32)
+            {
+                float_to_narrow(&item, &halfItem, 1, m_dataType);
+            }
+            for_each_run(m_shape, m_strides, [&](const size_t offset, const size_t index, const unsigned int len)
+            {
+                if (m_dataType == DataType::FP32)
+                {
+                    std::fill(m_data.get() + offset, m_data.get() + offset + len, item);
+                }
+                else
+                {
+                    std::fill(m_halfData.get() + offset, m_halfData.get() + offset + len, halfItem);
+                }
+            });
+            return;
+        }
+
+        // 按batch划分，与各层forward/backward的划分方式一致，
+        // 新分配的activation由之后处理它的worker第一次写入（first-touch）
+        const unsigned int oneBatchSize = m_shape.oneBatchSize();
+        if (m_dataType != DataType::FP32)
+        {
+            uint16_t halfItem = 0;
+            float_to_narrow(&item, &halfItem, 1, m_dataType);
+            uint16_t* halfData = m_halfData.get();
+            auto worker = [&](const unsigned int start, const unsigned int end)
+            {
+                std::fill(halfData + start * oneBatchSize, halfData + end * oneBatchSize, halfItem);
+            };
+            dispatch_worker(worker, m_shape.Batch);
+            return;
+        }
+
+        float* data = m_data.get();
+        auto worker = [&](const unsigned int start, const unsigned int end)
+        {
+            std::fill(data + start * oneBatchSize, data + end * oneBatchSize, item);
+        };
+        dispatch_worker(worker, m_shape.Batch);
     }
 
-    void Tensor::clone(Tensor& target)
+    void Tensor::resizeBatch(const unsigned int batch)
     {
+        Shape shape = m_shape;
+        shape.Batch = batch;
+        if (shape.totalSize() > m_capacity)
+        {
+            if (m_dataType == DataType::FP32)
+            {
+                m_data.reset(new float[shape.totalSize()], std::default_delete<float[]>());
+            }
+            else
+            {
+                m_halfData.reset(new uint16_t[shape.totalSize()], std::default_delete<uint16_t[]>());
+            }
+            m_capacity = shape.totalSize();
+        }
+        m_shape = shape;
+        m_strides = Strides(shape);
+    }
+
+    void Tensor::clone(Tensor& target) const
+    {
+        // target的容量不够时扩大
+        if (target.m_capacity < m_shape.totalSize())
+        {
+            target.m_shape = m_shape;
+            target.resizeBatch(m_shape.Batch);
+        }
         target.m_shape = this->m_shape;
-        unsigned int length = sizeof(float) * this->m_shape.totalSize();
-        memcpy(target.m_data.get(), this->m_data.get(), length);
+        target.m_strides = Strides(this->m_shape);
+        if (!isContiguous())
+        {
+            // 不连续的view逐段拷贝，类型不同时先拷贝为连续的tensor再转换
+            if (target.m_dataType != m_dataType)
+            {
+                target.convertFrom(*contiguous());
+                return;
+            }
+            const size_t elementSize = getElementSize();
+            const char* source = m_dataType == DataType::FP32 ? (const char*)m_data.get() : (const char*)m_halfData.get();
+            char* destination = m_dataType == DataType::FP32 ? (char*)target.m_data.get() : (char*)target.m_halfData.get();
+            for_each_run(m_shape, m_strides, [&](const size_t offset, const size_t index, const unsigned int len)
+            {
+                memcpy(destination + index * elementSize, source + offset * elementSize, len * elementSize);
+            });
+            return;
+        }
+        if (target.m_dataType != m_dataType)
+        {
+            target.convertFrom(*this);
+            return;
+        }
+        const size_t length = getElementSize() * this->m_shape.totalSize();
+        if (m_dataType == DataType::FP32)
+        {
+            memcpy(target.m_data.get(), this->m_data.get(), length);
+        }
+        else
+        {
+            memcpy(target.m_halfData.get(), this->m_halfData.get(), length);
+        }
+    }
+
+    void Tensor::convertFrom(const Tensor& source)
+    {
+        if (!source.isContiguous())
+        {
+            convertFrom(*source.contiguous());
+            return;
+        }
+        const unsigned int totalSize = m_shape.totalSize();
+        const DataType sourceType = source.m_dataType;
+        auto worker = [&](const unsigned int start, const unsigned int end)
+        {
+            if (sourceType == m_dataType)
+            {
+                if (m_dataType == DataType::FP32)
+                {
+                    std::copy(source.m_data.get() + start, source.m_data.get() + end, m_data.get() + start);
+                }
+                else
+                {
+                    std::copy(source.m_halfData.get() + start, source.m_halfData.get() + end, m_halfData.get() + start);
+                }
+            }
+            else if (sourceType == DataType::FP32)
+            {
+                float_to_narrow(source.m_data.get() + start, m_halfData.get() + start, end - start, m_dataType);
+            }
+            else if (m_dataType == DataType::FP32)
+            {
+                narrow_to_float(source.m_halfData.get() + start, m_data.get() + start, end - start, sourceType);
+            }
+            else
+            {
+                // fp16与bf16之间经过float转换
+                std::unique_ptr<float[]> buffer(new float[end - start]);
+                narrow_to_float(source.m_halfData.get() + start, buffer.get(), end - start, sourceType);
+                float_to_narrow(buffer.get(), m_halfData.get() + start, end - start, m_dataType);
+            }
+        };
+        dispatch_worker(worker, totalSize);
+    }
+
+    std::shared_ptr<Tensor> Tensor::createView(const size_t offset, const Shape shape, const Strides strides) const
+    {
+        // 与原tensor共同持有存储，指针指向view的第一个元素
+        std::shared_ptr<float> data;
+        std::shared_ptr<uint16_t> halfData;
+        if (m_data)
+        {
+            data = std::shared_ptr<float>(m_data, m_data.get() + offset);
+        }
+        if (m_halfData)
+        {
+            halfData = std::shared_ptr<uint16_t>(m_halfData, m_halfData.get() + offset);
+        }
+        return std::shared_ptr<Tensor>(new Tensor(shape, strides, m_dataType, data, halfData));
+    }
+
+    std::shared_ptr<Tensor> Tensor::slice(const unsigned int batchBegin, const unsigned int batchEnd) const
+    {
+        if (batchBegin > batchEnd || batchEnd > m_shape.Batch)
+        {
+            return nullptr;
+        }
+        Shape shape = m_shape;
+        shape.Batch = batchEnd - batchBegin;
+        return createView((size_t)batchBegin * m_strides.Batch, shape, m_strides);
+    }
+
+    std::shared_ptr<Tensor> Tensor::sliceChannels(const unsigned int channelBegin, const unsigned int channelEnd) const
+    {
+        if (channelBegin > channelEnd || channelEnd > m_shape.Channels)
+        {
+            return nullptr;
+        }
+        Shape shape = m_shape;
+        shape.Channels = channelEnd - channelBegin;
+        return createView((size_t)channelBegin * m_strides.Channels, shape, m_strides);
     }
-}
 
+    std::shared_ptr<Tensor> Tensor::reshape(const Shape shape) const
+    {
+        if (!isContiguous() || shape.totalSize() != m_shape.totalSize())
+        {
+            return nullptr;
+        }
+        return createView(0, shape, Strides(shape));
+    }
+
+    std::shared_ptr<Tensor> Tensor::flatten() const
+    {
+        return reshape(Shape(m_shape.Batch, m_shape.oneBatchSize(), 1, 1));
+    }
+
+    std::shared_ptr<Tensor> Tensor::contiguous() const
+    {
+        if (isContiguous())
+        {
+            return createView(0, m_shape, m_strides);
+        }
+        std::shared_ptr<Tensor> result = std::make_shared<Tensor>(m_shape, m_dataType);
+        clone(*result);
+        return result;
+    }
+}
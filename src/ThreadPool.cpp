@@ -4,12 +4,26 @@
 
 #include "../include/ThreadPool.h"
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace MiniCNN
 {
+    // 在worker线程或者外部的并行线程中再次dispatch时直接在当前线程执行，避免嵌套等待造成死锁
+    static thread_local bool t_serialDispatch = false;
+
     ThreadPool& ThreadPool::instance()
     {
-        static ThreadPool inst(2);
+        static ThreadPool inst(get_default_thread_num());
         return inst;
     }
     // the constructor just launches some amount of workers
@@ -31,7 +45,10 @@ namespace MiniCNN
             m_stop = true;
         }
 
-        m_condition.notify_all();
+        for (auto& condition : m_workerConditions)
+        {
+            condition->notify_all();
+        }
         for (std::thread &worker : m_workers)
         {
             if (worker.joinable())
@@ -42,33 +59,246 @@ namespace MiniCNN
 
         m_workers.clear();
         m_tasks = decltype(m_tasks)();
+        m_workerTasks.clear();
+        m_workerConditions.clear();
+        m_idleWorkers.clear();
     }
 
     void ThreadPool::startup(const unsigned int threads)
     {
         m_stop = false;
+        m_workerTasks.resize(threads);
+        m_workerConditions.clear();
+        for (unsigned int i = 0; i < threads; ++i)
+            m_workerConditions.emplace_back(new std::condition_variable());
         for (unsigned int i = 0; i < threads; ++i)
             m_workers.emplace_back(
-                [this]
+                [this, i]
                 {
+                    t_serialDispatch = true;
+                    std::queue<std::function<void()>>& localTasks = this->m_workerTasks[i];
+                    std::condition_variable& condition = *this->m_workerConditions[i];
                     for (;;)
                     {
                         std::function<void()> task;
+                        std::condition_variable* next = nullptr;
 
                         {
                             std::unique_lock<std::mutex> lock(this->m_queueMutex);
-                            this->m_condition.wait(lock, [this]{ return this->m_stop || !this->m_tasks.empty(); });
-                            if (this->m_stop && this->m_tasks.empty())
+                            while (!this->m_stop && localTasks.empty() && this->m_tasks.empty())
+                            {
+                                // 登记为空闲后再等待，唤醒者会把它移出列表；虚假唤醒时自己移出
+                                this->m_idleWorkers.push_back(i);
+                                condition.wait(lock);
+                                this->takeWorker(i);
+                            }
+                            if (this->m_stop && localTasks.empty() && this->m_tasks.empty())
                                 break;
-                            task = std::move(this->m_tasks.front());
-                            this->m_tasks.pop();
+                            // 优先处理指定给自己的任务
+                            std::queue<std::function<void()>>& queue = localTasks.empty() ? this->m_tasks : localTasks;
+                            task = std::move(queue.front());
+                            queue.pop();
+                            // 被enqueue唤醒却先处理了自己的任务时，公共队列中的任务转交给另一个空闲的worker
+                            if (!this->m_tasks.empty())
+                                next = this->takeIdleWorker();
                         }
 
+                        if (next)
+                            next->notify_one();
                         task();
                     }
                 }
             );
+        applyAffinity();
+    }
+
+    std::condition_variable* ThreadPool::takeIdleWorker()
+    {
+        if (m_idleWorkers.empty())
+        {
+            return nullptr;
+        }
+        const unsigned int workerIdx = m_idleWorkers.back();
+        m_idleWorkers.pop_back();
+        return m_workerConditions[workerIdx].get();
+    }
+
+    std::condition_variable* ThreadPool::takeWorker(const unsigned int workerIdx)
+    {
+        const auto it = std::find(m_idleWorkers.begin(), m_idleWorkers.end(), workerIdx);
+        if (it == m_idleWorkers.end())
+        {
+            return nullptr;
+        }
+        m_idleWorkers.erase(it);
+        return m_workerConditions[workerIdx].get();
+    }
+
+#ifdef __linux__
+    static const unsigned long MAX_CPUS = CPU_SETSIZE;
+#else
+    static const unsigned long MAX_CPUS = 1024;
+#endif
+
+    // 解析cpu列表中的一个编号，允许前后的空白，编号不能超过MAX_CPUS
+    static bool parse_cpu_id(const std::string& text, unsigned int& cpu)
+    {
+        const char* begin = text.c_str();
+        while (std::isspace((unsigned char)*begin))
+        {
+            begin++;
+        }
+        if (!std::isdigit((unsigned char)*begin))
+        {
+            return false;
+        }
+        char* end = nullptr;
+        const unsigned long value = std::strtoul(begin, &end, 10);
+        while (std::isspace((unsigned char)*end))
+        {
+            end++;
+        }
+        if (*end != '\0' || value >= MAX_CPUS)
+        {
+            return false;
+        }
+        cpu = (unsigned int)value;
+        return true;
+    }
+
+    // 解析"0-3,8,10"形式的cpu列表，格式错误时返回false
+    static bool parse_cpu_list(const std::string& text, std::vector<unsigned int>& cpus)
+    {
+        cpus.clear();
+        std::stringstream ss(text);
+        std::string item;
+        while (std::getline(ss, item, ','))
+        {
+            const size_t dash = item.find('-');
+            unsigned int first = 0;
+            unsigned int last = 0;
+            if (!parse_cpu_id(item.substr(0, dash), first)
+                || !parse_cpu_id(dash == std::string::npos ? item : item.substr(dash + 1), last) || last < first)
+            {
+                cpus.clear();
+                return false;
+            }
+            for (unsigned int cpu = first; cpu <= last; cpu++)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        return true;
     }
+
+    static bool read_affinity_from_env(AffinityPolicy& policy, std::vector<unsigned int>& cpus)
+    {
+        const char* env = std::getenv("MINICNN_AFFINITY");
+        if (env == nullptr || env[0] == '\0')
+        {
+            return false;
+        }
+
+        const std::string value(env);
+        cpus.clear();
+        if (value == "none")
+        {
+            policy = AffinityPolicy::NONE;
+        }
+        else if (value == "compact")
+        {
+            policy = AffinityPolicy::COMPACT;
+        }
+        else if (value == "scatter")
+        {
+            policy = AffinityPolicy::SCATTER;
+        }
+        else if (parse_cpu_list(value, cpus) && !cpus.empty())
+        {
+            policy = AffinityPolicy::EXPLICIT;
+        }
+        else
+        {
+            fprintf(stderr, "MiniCNN: ignoring malformed MINICNN_AFFINITY=\"%s\"\n", env);
+            return false;
+        }
+        return true;
+    }
+
+    void ThreadPool::applyAffinity()
+    {
+        AffinityPolicy policy = m_affinityPolicy;
+        std::vector<unsigned int> cpus = m_affinityCpus;
+        read_affinity_from_env(policy, cpus);
+
+        const CpuTopology& topology = get_cpu_topology();
+        if (policy == AffinityPolicy::COMPACT)
+        {
+            cpus.clear();
+            for (const auto& nodeCpus : topology.nodeCpus)
+            {
+                cpus.insert(cpus.end(), nodeCpus.begin(), nodeCpus.end());
+            }
+        }
+        else if (policy == AffinityPolicy::SCATTER)
+        {
+            cpus.clear();
+            for (unsigned int idx = 0; cpus.size() < topology.cpuCount(); idx++)
+            {
+                for (const auto& nodeCpus : topology.nodeCpus)
+                {
+                    if (idx < nodeCpus.size())
+                    {
+                        cpus.push_back(nodeCpus[idx]);
+                    }
+                }
+            }
+        }
+        else if (policy == AffinityPolicy::NONE)
+        {
+            cpus.clear();
+        }
+
+        m_workerCpus.assign(m_workers.size(), -1);
+        for (unsigned int i = 0; i < m_workers.size(); i++)
+        {
+#ifdef __linux__
+            cpu_set_t cpuSet;
+            CPU_ZERO(&cpuSet);
+            if (cpus.empty())
+            {
+                for (unsigned int cpu = 0; cpu < (unsigned int)CPU_SETSIZE; cpu++)
+                {
+                    CPU_SET(cpu, &cpuSet);
+                }
+            }
+            else
+            {
+                m_workerCpus[i] = cpus[i % cpus.size()];
+                CPU_SET(m_workerCpus[i], &cpuSet);
+            }
+            pthread_setaffinity_np(m_workers[i].native_handle(), sizeof(cpuSet), &cpuSet);
+#endif
+        }
+    }
+
+    void ThreadPool::setAffinity(const AffinityPolicy policy, const std::vector<unsigned int>& cpus)
+    {
+        m_affinityPolicy = policy;
+        m_affinityCpus = cpus;
+        applyAffinity();
+    }
+
+    unsigned int ThreadPool::workerNode(const unsigned int workerIdx) const
+    {
+        const CpuTopology& topology = get_cpu_topology();
+        if (workerIdx < m_workerCpus.size() && m_workerCpus[workerIdx] >= 0)
+        {
+            return topology.nodeOfCpu((unsigned int)m_workerCpus[workerIdx]);
+        }
+        return m_workers.empty() ? 0 : workerIdx * topology.nodeCount() / (unsigned int)m_workers.size();
+    }
+
     inline unsigned int ThreadPool::size() const
     {
         return m_workers.size();
@@ -95,6 +325,109 @@ namespace MiniCNN
         return get_thread_num();
     }
 
+    unsigned int get_default_thread_num()
+    {
+        const char* env = std::getenv("MINICNN_NUM_THREADS");
+        if (env != nullptr && std::atoi(env) > 0)
+        {
+            return (unsigned int)std::atoi(env);
+        }
+        return std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    void set_thread_affinity(const AffinityPolicy policy, const std::vector<unsigned int>& cpus)
+    {
+        ThreadPool::instance().setAffinity(policy, cpus);
+    }
+
+    unsigned int CpuTopology::cpuCount() const
+    {
+        unsigned int count = 0;
+        for (const auto& cpus : nodeCpus)
+        {
+            count += (unsigned int)cpus.size();
+        }
+        return count;
+    }
+
+    unsigned int CpuTopology::nodeOfCpu(const unsigned int cpu) const
+    {
+        for (unsigned int node = 0; node < nodeCpus.size(); node++)
+        {
+            if (std::find(nodeCpus[node].begin(), nodeCpus[node].end(), cpu) != nodeCpus[node].end())
+            {
+                return node;
+            }
+        }
+        return 0;
+    }
+
+    static CpuTopology detect_cpu_topology()
+    {
+        CpuTopology topology;
+        // 从sysfs读取每个node的cpu列表
+        for (unsigned int node = 0; ; node++)
+        {
+            std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!ifs.is_open())
+            {
+                break;
+            }
+            std::string line;
+            std::getline(ifs, line);
+            std::vector<unsigned int> cpus;
+            if (parse_cpu_list(line, cpus) && !cpus.empty())
+            {
+                topology.nodeCpus.push_back(cpus);
+            }
+        }
+
+        // 非NUMA系统当作一个node处理
+        if (topology.nodeCpus.empty())
+        {
+            std::vector<unsigned int> cpus;
+            for (unsigned int cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); cpu++)
+            {
+                cpus.push_back(cpu);
+            }
+            topology.nodeCpus.push_back(cpus);
+        }
+        return topology;
+    }
+
+    const CpuTopology& get_cpu_topology()
+    {
+        static const CpuTopology topology = detect_cpu_topology();
+        return topology;
+    }
+
+    unsigned int get_worker_node(const unsigned int workerIdx)
+    {
+        return ThreadPool::instance().workerNode(workerIdx);
+    }
+
+    void set_serial_dispatch(const bool serial)
+    {
+        t_serialDispatch = serial;
+    }
+
+    bool is_serial_dispatch()
+    {
+        return t_serialDispatch;
+    }
+
+    static std::atomic<bool> g_deterministic(false);
+
+    void set_deterministic(const bool deterministic)
+    {
+        g_deterministic.store(deterministic);
+    }
+
+    bool is_deterministic()
+    {
+        return g_deterministic.load();
+    }
+
     void dispatch_worker(std::function<void(const unsigned int, const unsigned int)> func, const unsigned int number)
     {
         if (number <= 0)
@@ -104,7 +437,7 @@ namespace MiniCNN
 
         const unsigned int threads_of_pool = ThreadPool::instance().size();
 
-        if (threads_of_pool <= 1 || number <= 1)
+        if (threads_of_pool <= 1 || number <= 1 || t_serialDispatch)
         {
             func(0, number);
         }
@@ -124,7 +457,8 @@ namespace MiniCNN
                 {
                     stop = stop + 1;
                 }
-                futures.push_back(ThreadPool::instance().enqueue(func, start, stop));
+                // 第i块数据总是交给第i个worker，使first-touch分配的内存与之后的计算位于同一个node
+                futures.push_back(ThreadPool::instance().enqueueTo(i, func, start, stop));
                 start = stop;
                 if (stop >= number)
                 {
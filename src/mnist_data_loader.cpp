@@ -3,9 +3,11 @@
 //
 
 #include "../include/mnist_data_loader.h"
+#include "../include/CompressedInput.h"
 
+#include <algorithm>
 #include <fstream>
-#include <cassert>
+#include <cstdio>
 
 template<typename T>
 T reverse_endian(T p) {
@@ -18,42 +20,42 @@ inline bool is_little_endian() {
     return *(char*)&x != 0;
 }
 
-bool load_mnist_images(const std::string& file_path, std::vector<image_t>& images)
+bool read_idx_header(MiniCNN::CompressedInput& input, const uint32_t expected_magic_number, uint32_t* dims,
+                     const int dims_count)
 {
-    images.clear();
-    std::ifstream ifs(file_path,std::ios::binary);
-    if (!ifs.is_open())
+    uint32_t magic_number = 0;
+    if (!input.read(&magic_number, sizeof(magic_number)) || !input.read(dims, sizeof(uint32_t) * dims_count))
     {
         return false;
     }
-    //detect platform information
-    const bool is_little_endian_flag = is_little_endian();
-    //magic number
-    uint32_t magic_number;
-    ifs.read((char*)&magic_number, sizeof(magic_number));
-    if (is_little_endian_flag)
+    if (is_little_endian())
     {
         magic_number = reverse_endian<uint32_t>(magic_number);
+        for (int i = 0; i < dims_count; i++)
+        {
+            dims[i] = reverse_endian<uint32_t>(dims[i]);
+        }
     }
-    const bool magic_number_validate = (magic_number == 0x00000803);
-    assert(magic_number_validate);
-    if (!magic_number_validate)
+    return magic_number == expected_magic_number;
+}
+
+bool load_mnist_images(const std::string& file_path, std::vector<image_t>& images)
+{
+    images.clear();
+    MiniCNN::CompressedInput input;
+    if (!input.open(MiniCNN::resolve_compressed_path(file_path)))
     {
         return false;
     }
-    //count
-    uint32_t images_total_count = 0;
-    ifs.read((char*)&images_total_count, sizeof(images_total_count));
-    //image property
-    uint32_t width = 0, height = 0;
-    ifs.read((char*)&height, sizeof(height));
-    ifs.read((char*)&width, sizeof(width));
-    if (is_little_endian_flag)
+    //count, height, width
+    uint32_t image_dims[3] = { 0, 0, 0 };
+    if (!read_idx_header(input, 0x00000803, image_dims, 3))
     {
-        images_total_count = reverse_endian<uint32_t>(images_total_count);
-        width = reverse_endian<uint32_t>(width);
-        height = reverse_endian<uint32_t>(height);
+        return false;
     }
+    const uint32_t images_total_count = image_dims[0];
+    const uint32_t height = image_dims[1];
+    const uint32_t width = image_dims[2];
     //images
     for (uint32_t i = 0; i < images_total_count;i++)
     {
@@ -62,7 +64,7 @@ bool load_mnist_images(const std::string& file_path, std::vector<image_t>& image
         image.width = width;
         image.height = height;
         image.data.resize(width*height);
-        ifs.read((char*)&image.data[0], width*height);
+        input.read((char*)&image.data[0], width*height);
         images.push_back(image);
     }
     return true;
@@ -71,38 +73,60 @@ bool load_mnist_images(const std::string& file_path, std::vector<image_t>& image
 bool load_mnist_labels(const std::string& file_path, std::vector<label_t>& labels)
 {
     labels.clear();
-    std::ifstream ifs(file_path, std::ios::binary);
-    if (!ifs.is_open())
+    MiniCNN::CompressedInput input;
+    if (!input.open(MiniCNN::resolve_compressed_path(file_path)))
     {
         return false;
-    }//detect platform information
-    const bool is_little_endian_flag = is_little_endian();
-    //magic number
-    uint32_t magic_number;
-    ifs.read((char*)&magic_number, sizeof(magic_number));
-    if (is_little_endian_flag)
-    {
-        magic_number = reverse_endian<uint32_t>(magic_number);
     }
-    const bool magic_number_validate = (magic_number == 0x00000801);
-    assert(magic_number_validate);
-    if (!magic_number_validate)
-    {
-        return false;
-    }
-    //count
     uint32_t labels_total_count = 0;
-    ifs.read((char*)&labels_total_count, sizeof(labels_total_count));
-    if (is_little_endian_flag)
+    if (!read_idx_header(input, 0x00000801, &labels_total_count, 1))
     {
-        labels_total_count = reverse_endian<uint32_t>(labels_total_count);
+        return false;
     }
     //labels
     for (uint32_t i = 0; i < labels_total_count; i++)
     {
         label_t label;
-        ifs.read((char*)&label.data, sizeof(label.data));
+        input.read((char*)&label.data, sizeof(label.data));
         labels.push_back(label);
     }
     return true;
-}
\ No newline at end of file
+}
+
+static bool decode_mnist_dataset(const std::string& images_file_path, const std::string& labels_file_path,
+                                 MiniCNN::Dataset& dataset)
+{
+    MiniCNN::CompressedInput images_input;
+    MiniCNN::CompressedInput labels_input;
+    //count, height, width
+    uint32_t image_dims[3] = { 0, 0, 0 };
+    uint32_t labels_count = 0;
+    if (!images_input.open(images_file_path) || !labels_input.open(labels_file_path)
+        || !read_idx_header(images_input, 0x00000803, image_dims, 3)
+        || !read_idx_header(labels_input, 0x00000801, &labels_count, 1)
+        || image_dims[0] != labels_count)
+    {
+        return false;
+    }
+
+    const size_t image_size = (size_t)image_dims[1] * image_dims[2];
+    std::vector<uint8_t> samples(image_size * labels_count);
+    std::vector<uint8_t> labels(labels_count);
+    if (!images_input.read(samples.data(), samples.size()) || !labels_input.read(labels.data(), labels.size()))
+    {
+        return false;
+    }
+    return dataset.create(MiniCNN::Shape(1, 1, image_dims[2], image_dims[1]), 10, std::move(samples), std::move(labels));
+}
+
+bool load_mnist_dataset(const std::string& source_images_file_path, const std::string& source_labels_file_path,
+                        MiniCNN::Dataset& dataset, const std::string& cache_dir)
+{
+    const std::string images_file_path = MiniCNN::resolve_compressed_path(source_images_file_path);
+    const std::string labels_file_path = MiniCNN::resolve_compressed_path(source_labels_file_path);
+    return MiniCNN::load_dataset_with_cache({ images_file_path, labels_file_path }, "mnist classes=10", "mnist", cache_dir,
+                                            [&](MiniCNN::Dataset& decoded)
+    {
+        return decode_mnist_dataset(images_file_path, labels_file_path, decoded);
+    }, dataset);
+}
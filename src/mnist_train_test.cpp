@@ -2,189 +2,139 @@
 // Created by yang chen on 2018/3/13.
 //
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <numeric>
 #include <cassert>
 #include <random>
+#include <zlib.h>
 #include "../include/MiniCNN.h"
 #include "../include/mnist_data_loader.h"
+#include "../include/record_data_loader.h"
 
 
 const int CLASSES = 10;
+// 数据shuffle、训练/验证集划分、数据增强使用的随机数流，与各层的流（层的下标）不冲突
+const unsigned int SHUFFLE_STREAM = 0x10000;
+const unsigned int SPLIT_STREAM = 0x10001;
+const unsigned int AUGMENT_STREAM = 0x10002;
+const unsigned int READER_STREAM = 0x10003;
+
+// 环境变量MINICNN_DATASET_CACHE指定预处理缓存的目录，多次运行（如超参数搜索）共用同一份缓存；未设置时不使用缓存
+static std::string dataset_cache_dir()
+{
+    const char* env = std::getenv("MINICNN_DATASET_CACHE");
+    return env != nullptr ? env : "";
+}
 
-static bool fetch_data(const std::vector<image_t>& images,std::shared_ptr<MiniCNN::Tensor> inputTensor,
-                       const std::vector<label_t>& labels, std::shared_ptr<MiniCNN::Tensor> labelTensor,
-                       const size_t offset, const size_t length)
+// 环境变量MINICNN_AUGMENTATION不为0时，train()在后台线程中对训练数据做随机增强
+static bool augmentation_enabled()
 {
-    assert(images.size() == labels.size() && inputTensor->getShape().Batch == labelTensor->getShape().Batch);
-    if (offset >= images.size())
-    {
-        return false;
-    }
-    size_t actualEndPos = offset + length;
-    if (actualEndPos > images.size())
-    {
-        //image data
-        auto inputDataSize = inputTensor->getShape();
-        inputDataSize.Batch = images.size() - offset;
-        actualEndPos = offset + inputDataSize.Batch;
-        inputTensor.reset(new MiniCNN::Tensor(inputDataSize));
-        //label data
-        auto labelDataSize = labelTensor->getShape();
-        labelDataSize.Batch = inputDataSize.Batch;
-        labelTensor.reset(new MiniCNN::Tensor(inputDataSize));
-    }
-    //copy
-    const size_t sizePerImage = inputTensor->getShape().oneBatchSize();
-    const size_t sizePerLabel = labelTensor->getShape().oneBatchSize();
-    assert(sizePerImage == images[0].channels*images[0].width*images[0].height);
-    //scale to 0.0f~1.0f
-    const float scaleRate = 1.0f / 255.0f;
-    for (size_t i = offset; i < actualEndPos; i++)
-    {
-        //image data
-        float* inputData = inputTensor->getData().get() + (i - offset)*sizePerImage;
-        const uint8_t* imageData = &images[i].data[0];
-        for (size_t j = 0; j < sizePerImage;j++)
-        {
-            inputData[j] = (float)imageData[j] * scaleRate;
-        }
-        //label data
-        float* labelData = labelTensor->getData().get() + (i - offset)*sizePerLabel;
-        const uint8_t label = labels[i].data;
-        for (size_t j = 0; j < sizePerLabel; j++)
-        {
-            if (j == label)
-            {
-                labelData[j] = 1.0f;
-            }
-            else
-            {
-                labelData[j] = 0.0f;
-            }
-        }
-    }
-    return true;
+    const char* env = std::getenv("MINICNN_AUGMENTATION");
+    return env != nullptr && std::strtoul(env, nullptr, 10) != 0;
 }
-static std::shared_ptr<MiniCNN::Tensor> convertLabelToTensor(const std::vector<label_t>& test_labels, const size_t start, const size_t len)
+
+// 环境变量MINICNN_TRAINING_CHECKPOINT指定训练checkpoint的路径：文件存在时从中继续训练，之后定期在后台写入；
+// 未设置时不写checkpoint
+static std::string training_checkpoint_path()
 {
-    assert(test_labels.size() > 0);
-    const size_t number = len;
-    const size_t sizePerLabel = CLASSES;
-    std::shared_ptr<MiniCNN::Tensor> result(new MiniCNN::Tensor(MiniCNN::Shape(number, CLASSES, 1, 1)));
-    for (size_t i = start; i < start + len; i++)
-    {
-        //image data
-        float* labelData = result->getData().get() + (i - start)*sizePerLabel;
-        const uint8_t label = test_labels[i].data;
-        for (size_t j = 0; j < sizePerLabel; j++)
-        {
-            if (j == label)
-            {
-                labelData[j] = 1.0f;
-            }
-            else
-            {
-                labelData[j] = 0.0f;
-            }
-        }
-    }
-    return result;
+    const char* env = std::getenv("MINICNN_TRAINING_CHECKPOINT");
+    return env != nullptr ? env : "";
 }
 
-static std::shared_ptr<MiniCNN::Tensor> convertVectorToTensor(const std::vector<image_t>& test_images, const size_t start, const size_t len)
+// 环境变量MINICNN_SCRATCH_DIR指定工具生成的中间文件（如训练集的分片、压缩测试文件）的目录，未设置时使用TMPDIR或/tmp，
+// 不写入数据目录
+static std::string scratch_dir()
 {
-    assert(test_images.size() > 0);
-    const size_t number = len;
-    const size_t channel = test_images[0].channels;
-    const size_t width = test_images[0].width;
-    const size_t height = test_images[0].height;
-    const size_t sizePerImage = channel*width*height;
-    const float scaleRate = 1.0f / 255.0f;
-    std::shared_ptr<MiniCNN::Tensor> result(new MiniCNN::Tensor(MiniCNN::Shape(number, channel, width, height)));
-    for (size_t i = start; i < start + len; i++)
+    const char* env = std::getenv("MINICNN_SCRATCH_DIR");
+    if (env == nullptr || env[0] == '\0')
     {
-        //image data
-        float* inputData = result->getData().get() + (i-start)*sizePerImage;
-        const uint8_t* imageData = &test_images[i].data[0];
-        for (size_t j = 0; j < sizePerImage; j++)
-        {
-            inputData[j] = (float)imageData[j] * scaleRate;
-        }
+        env = std::getenv("TMPDIR");
     }
-    return result;
+    return env != nullptr && env[0] != '\0' ? env : "/tmp";
 }
 
-static uint8_t getMaxIdxInArray(const float* start, const float* stop)
+// 按sampler的第batchIdx组下标把样本写入inputTensor、labelTensor的前面几个样本，返回写入的数量，0表示没有数据。
+// 不足一个batch时由调用者用slice取前面的样本，不重新分配tensor
+static unsigned int fetch_batch(const MiniCNN::Dataset& dataset, const MiniCNN::Sampler& sampler, const unsigned int batchIdx,
+                                const std::shared_ptr<MiniCNN::Tensor>& inputTensor,
+                                const std::shared_ptr<MiniCNN::Tensor>& labelTensor)
 {
-    assert(start && stop && stop >= start);
-    ptrdiff_t result = 0;
-    const ptrdiff_t len = stop - start;
-    for (ptrdiff_t i = 0; i < len; i++)
+    assert(inputTensor->getShape().Batch == labelTensor->getShape().Batch);
+    const unsigned int* indices = nullptr;
+    const unsigned int count = sampler.getBatch(batchIdx, inputTensor->getShape().Batch, indices);
+    return count > 0 ? dataset.fillBatch(indices, count, *inputTensor, labelTensor.get()) : 0;
+}
+
+// 前count个样本的view，count等于batch时直接返回tensor本身
+static std::shared_ptr<MiniCNN::Tensor> head_view(const std::shared_ptr<MiniCNN::Tensor>& tensor, const size_t count)
+{
+    return count == tensor->getShape().Batch ? tensor : tensor->slice(0, (unsigned int)count);
+}
+
+// 用evaluator的各路上下文跑完sampler中的所有样本。数据集使用缓存且batch的下标连续（如SequentialSampler）时，
+// 直接使用缓存映射中的view，不拷贝
+static MiniCNN::EvaluationResult evaluate(MiniCNN::Evaluator& evaluator, const MiniCNN::Dataset& dataset,
+                                          const MiniCNN::Sampler& sampler)
+{
+    assert(sampler.size() > 0);
+    return evaluator.evaluate([&](const unsigned int batchIdx, std::shared_ptr<MiniCNN::Tensor>& inputTensor,
+                                  std::shared_ptr<MiniCNN::Tensor>& labelTensor)
     {
-        if (start[i] >= start[result])
+        const unsigned int* indices = nullptr;
+        const unsigned int count = sampler.getBatch(batchIdx, inputTensor->getShape().Batch, indices);
+        if (count > 0 && dataset.viewBatch(indices, count, inputTensor, labelTensor))
         {
-            result = i;
+            return count;
         }
-    }
-    return (uint8_t)result;
+        return fetch_batch(dataset, sampler, batchIdx, inputTensor, labelTensor);
+    }, sampler.getBatches(evaluator.getBatch()));
 }
 
-static std::pair<float,float> test(MiniCNN::Network& network, const size_t batch,const std::vector<image_t>& test_images,const std::vector<label_t>& test_labels)
+// 单路evaluator，不创建副本，层内的计算使用线程池
+static std::pair<float,float> test(MiniCNN::Network& network, const size_t batch, const MiniCNN::Dataset& test_dataset)
 {
-    assert(test_images.size() == test_labels.size() && test_images.size()>0);
-    int correctCount = 0;
-    float loss = 0.0f;
-    int batchs = 0;
-    for (size_t i = 0; i < test_labels.size(); i += batch, batchs++)
-    {
-        const size_t start = i;
-        const size_t len = std::min(test_labels.size() - start, batch);
-        const std::shared_ptr<MiniCNN::Tensor> inputTensor = convertVectorToTensor(test_images, start, len);
-        const std::shared_ptr<MiniCNN::Tensor> labelTensor = convertLabelToTensor(test_labels, start, len);
-        const std::shared_ptr<MiniCNN::Tensor> probTensor = network.testBatch(inputTensor);
-
-        //get loss
-        const float batch_loss = network.getLoss(labelTensor, probTensor);
-        loss = MiniCNN::moving_average(loss, batchs + 1, batch_loss);
+    MiniCNN::Evaluator evaluator(network, (unsigned int)batch);
+    const MiniCNN::EvaluationResult result = evaluate(evaluator, test_dataset, MiniCNN::SequentialSampler(test_dataset.size()));
+    return std::pair<float, float>(result.accuracy, result.loss);
+}
 
-        const size_t labelSize = probTensor->getShape().oneBatchSize();
-        const float* probData = probTensor->getData().get();
-        for (size_t j = 0; j < len; j++)
-        {
-            const uint8_t stdProb = test_labels[i+j].data;
-            const uint8_t testProb = getMaxIdxInArray(probData + j*labelSize, probData + (j + 1) * labelSize);
-            if (stdProb == testProb)
-            {
-                correctCount++;
-            }
-        }
+// 在测试集上推理repeats次，返回最短的用时；accuracy和loss（可以为空）为最后一次的结果
+static double timed_test(MiniCNN::Network& network, const size_t batch, const MiniCNN::Dataset& test_dataset,
+                         const unsigned int repeats, float& accuracy, float* loss = nullptr)
+{
+    double bestSeconds = std::numeric_limits<double>::max();
+    std::pair<float, float> result(0.0f, 0.0f);
+    for (unsigned int i = 0; i < repeats; i++)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+        result = test(network, batch, test_dataset);
+        const auto end = std::chrono::steady_clock::now();
+        bestSeconds = std::min(bestSeconds, std::chrono::duration<double>(end - begin).count());
+    }
+    accuracy = result.first;
+    if (loss != nullptr)
+    {
+        *loss = result.second;
     }
-    const float accuracy = (float)correctCount / (float)test_labels.size();
-    return std::pair<float, float>(accuracy,loss);
+    return bestSeconds;
 }
 
-static float getAccuracy(const std::shared_ptr<MiniCNN::Tensor> probTensor, const std::shared_ptr<MiniCNN::Tensor> labelTensor)
+// 加载已保存的模型并融合层，用于只做推理的工具
+static bool load_inference_model(const std::string& model_file, MiniCNN::Network& network)
 {
-    const auto probSize = probTensor->getShape();
-    const auto labelSize = labelTensor->getShape();
-    const auto itemSize = labelSize.oneBatchSize();
-    const float* probData = probTensor->getData().get();
-    const float* labelData = labelTensor->getData().get();
-    assert(probSize == labelSize);
-    int correctCount = 0;
-    int totalCount = 0;
-    for (size_t n = 0; n < probSize.Batch;n++)
+    if (!network.loadModel(model_file))
     {
-        const uint8_t stdProb = getMaxIdxInArray(labelData + n*itemSize, labelData + (n + 1) * itemSize);
-        const uint8_t testProb = getMaxIdxInArray(probData + n*itemSize, probData + (n + 1) * itemSize);
-        if (stdProb == testProb)
-        {
-            correctCount++;
-        }
-        totalCount++;
+        return false;
     }
-    const float result = (float)correctCount / (float)totalCount;
-    return result;
+    network.fuseLayers();
+    return true;
 }
 
 static void add_input_layer(MiniCNN::Network& network)
@@ -211,29 +161,6 @@ static void add_softmax_layer(MiniCNN::Network& network)
     network.addLayer(softmaxLayer);
 }
 
-static void shuffle_data(std::vector<image_t>& images, std::vector<label_t>& labels)
-{
-    assert(images.size() == labels.size());
-    std::vector<size_t> indexArray;
-    for (size_t i = 0; i < images.size();i++)
-    {
-        indexArray.push_back(i);
-    }
-    std::random_shuffle(indexArray.begin(), indexArray.end());
-
-    std::vector<image_t> tmpImages(images.size());
-    std::vector<label_t> tmpLabels(labels.size());
-    for (size_t i = 0; i < images.size(); i++)
-    {
-        const size_t srcIndex = i;
-        const size_t dstIndex = indexArray[i];
-        tmpImages[srcIndex] = images[dstIndex];
-        tmpLabels[srcIndex] = labels[dstIndex];
-    }
-    images = tmpImages;
-    labels = tmpLabels;
-}
-
 /***************************  not finished **************************************
 static void add_conv_layer(MiniCNN::Network& network,const int number,const int input_channel)
 {
@@ -317,44 +244,60 @@ static void train(const std::string& mnist_train_images_file,
 {
     bool success = false;
 
+    // 训练数据在后台线程中随机增强；增强在uint8上进行，开启时不使用预处理缓存
+    const bool augmentation = augmentation_enabled();
+    MiniCNN::AugmentationConfig augmentationConfig;
+    augmentationConfig.maxTranslate = 2.0f;
+    augmentationConfig.maxRotation = 10.0f;
+    augmentationConfig.elasticAlpha = 8.0f;
+    augmentationConfig.elasticSigma = 4.0f;
+    augmentationConfig.noiseStddev = 8.0f;
+    const unsigned int augmentationWorkers = 2;
+
     //load train images
     std::cout <<"loading training data..." << std::endl;
 
-    std::vector<image_t> images;
-    success = load_mnist_images(mnist_train_images_file, images);
-    assert(success && images.size() > 0);
-    //load train labels
-    std::vector<label_t> labels;
-    success = load_mnist_labels(mnist_train_labels_file, labels);
-    assert(success && labels.size() > 0);
-    assert(images.size() == labels.size());
-    shuffle_data(images, labels);
-
-    //train data & validate data
-    //train
-    std::vector<image_t> train_images(static_cast<size_t>(images.size()*0.9f));
-    std::vector<label_t> train_labels(static_cast<size_t>(labels.size()*0.9f));
-    std::copy(images.begin(), images.begin() + train_images.size(), train_images.begin());
-    std::copy(labels.begin(), labels.begin() + train_labels.size(), train_labels.begin());
-    //validate
-    std::vector<image_t> validate_images(images.size() - train_images.size());
-    std::vector<label_t> validate_labels(labels.size() - train_labels.size());
-    std::copy(images.begin() + train_images.size(), images.end(), validate_images.begin());
-    std::copy(labels.begin() + train_labels.size(), labels.end(), validate_labels.begin());
-
-    std::cout << "load training data done. train set's size is " << train_images.size()
-              << ", validate set's size is " << validate_images.size() << std::endl;
+    MiniCNN::Dataset dataset;
+    success = load_mnist_dataset(mnist_train_images_file, mnist_train_labels_file, dataset,
+                                 augmentation ? "" : dataset_cache_dir());
+    assert(success && dataset.size() > 0);
+
+    //train data & validate data，按类别分层划分，只记录下标
+    std::vector<unsigned int> train_indices, validate_indices;
+    MiniCNN::stratified_split(dataset, 0.1f, SPLIT_STREAM, train_indices, validate_indices);
+    MiniCNN::RandomSampler train_sampler(std::move(train_indices), SHUFFLE_STREAM);
+    const MiniCNN::SequentialSampler validate_sampler(std::move(validate_indices));
+
+    std::cout << "load training data done" << (dataset.isCached() ? " (cached)" : "") << ". train set's size is "
+              << train_sampler.size() << ", validate set's size is " << validate_sampler.size() << std::endl;
 
     float learningRate = 0.1f;
     const float decayRate = 0.8f;
     const float minLearningRate = 0.001f;
     const unsigned int testAfterBatches = 10;
     const unsigned int maxBatches = 10000;
+    // 每saveAfterBatches个batch以及每个epoch结束时写一次训练checkpoint
+    // 种子为0时每次运行的训练/验证集划分都不同，从checkpoint继续会把验证样本用于训练，这时不使用checkpoint
+    std::string trainingCheckpoint = training_checkpoint_path();
+    if (!trainingCheckpoint.empty() && MiniCNN::get_random_seed() == 0)
+    {
+        std::cout << "training checkpoint disabled: set MINICNN_SEED to a non-zero seed to use "
+                  << trainingCheckpoint << std::endl;
+        trainingCheckpoint.clear();
+    }
+    const unsigned int saveAfterBatches = 100;
+    // 每checkpointInterval层保留一次activation，0表示保留全部
+    const unsigned int checkpointInterval = 0;
+    // forward时weights的存储类型（FP32/FP16/BF16），低精度时配合lossScale使用
+    const MiniCNN::DataType weightDataType = MiniCNN::DataType::FP32;
+    const float lossScale = 1.0f;
+    // bf16 activation + fp32 master weights + 动态loss scale，开启时覆盖上面两项
+    const bool mixedPrecision = false;
     const unsigned int max_epoch = 5;
     const unsigned int batch = 128;
-    const unsigned int channels = images[0].channels;
-    const unsigned int width = images[0].width;
-    const unsigned int height = images[0].height;
+    const unsigned int channels = dataset.getSampleShape().Channels;
+    const unsigned int width = dataset.getSampleShape().Width;
+    const unsigned int height = dataset.getSampleShape().Height;
 
     printf("max_epoch:%d, testAfterBatches:%d \n", max_epoch, testAfterBatches);
     printf("learningRate:%f, decayRate:%f, minLearningRate:%f \n", learningRate, decayRate, minLearningRate);
@@ -366,40 +309,140 @@ static void train(const std::string& mnist_train_images_file,
     network.setLossFunction(std::make_shared<MiniCNN::CrossEntropyFunction>());
     network.setOptimizer(std::make_shared<MiniCNN::SGD>(learningRate));
     network.setLearningRate(learningRate);
+    network.fuseLayers();
+    network.setCheckpointInterval(checkpointInterval);
+    network.setWeightDataType(weightDataType);
+    network.setLossScale(lossScale);
+    if (mixedPrecision)
+    {
+        network.setMixedPrecision(true);
+    }
 
-    std::cout << "construct network done." << std::endl;
+    std::cout << "construct network done. activation memory: "
+              << network.getActivationMemorySize() / 1024.0f / 1024.0f << " MB" << std::endl;
+
+    // 从训练checkpoint继续：参数、optimizer状态、学习率、sampler的位置都恢复到写入时的状态
+    MiniCNN::TrainingState resumeState;
+    const bool resumed = !trainingCheckpoint.empty() && std::ifstream(trainingCheckpoint).good();
+    if (resumed)
+    {
+        if (!MiniCNN::load_checkpoint(trainingCheckpoint, network, resumeState)
+            || resumeState.seed != MiniCNN::get_random_seed() || !train_sampler.loadState(resumeState.samplerState))
+        {
+            // 随机种子不同时训练/验证集的划分也不同，不能继续
+            std::cout << "failed to resume from " << trainingCheckpoint << " (seed "
+                      << resumeState.seed << ")" << std::endl;
+            return;
+        }
+        learningRate = resumeState.learningRate;
+        network.setLearningRate(learningRate);
+        printf("resumed from %s: epoch %u, batch %u, learningRate:%f \n", trainingCheckpoint.c_str(),
+               resumeState.epoch, resumeState.batch, learningRate);
+    }
+    MiniCNN::CheckpointWriter checkpointWriter;
+    uint64_t step = resumed ? resumeState.step : 0;
+
+    // 验证集的各路推理上下文只创建一次，每次验证时共享当前的参数
+    MiniCNN::Evaluator validator(network, 128, MiniCNN::get_thread_num());
 
     float val_accuracy = 0.0f;
     float train_loss = 0.0f;
     int train_batches = 0;
     float val_loss = 0.0f;
+    // 只统计trainBatch的时间，确定性模式与普通模式的吞吐分开报告
+    double train_seconds = 0.0;
+    size_t train_samples = 0;
 
     //train
     std::cout << "begin training..." << std::endl;
     std::shared_ptr<MiniCNN::Tensor> inputTensor = std::make_shared<MiniCNN::Tensor>(MiniCNN::Shape(batch, channels, width, height));
     std::shared_ptr<MiniCNN::Tensor> labelTensor = std::make_shared<MiniCNN::Tensor>(MiniCNN::Shape(batch, CLASSES, 1, 1));
-    unsigned int epochIdx = 0;
+    std::unique_ptr<MiniCNN::AugmentedLoader> loader;
+    if (augmentation)
+    {
+        loader.reset(new MiniCNN::AugmentedLoader(dataset, train_sampler, batch, augmentationConfig, AUGMENT_STREAM,
+                                                  augmentationWorkers));
+        if (!loader->isValid())
+        {
+            std::cout << "augmentation needs uint8 samples, the dataset has none" << std::endl;
+            return;
+        }
+    }
+    auto save_training_checkpoint = [&](const unsigned int epoch, const unsigned int nextBatch)
+    {
+        MiniCNN::TrainingState state;
+        state.epoch = epoch;
+        state.batch = nextBatch;
+        state.step = step;
+        state.learningRate = learningRate;
+        state.seed = MiniCNN::get_random_seed();
+        state.samplerState = train_sampler.saveState();
+        state.loaderEpoch = loader ? loader->getEpoch() : 0;
+        checkpointWriter.save(network, state, trainingCheckpoint);
+    };
+    unsigned int epochIdx = resumed ? resumeState.epoch : 0;
+    // 在epoch中间写入的checkpoint，sampler已经是这个epoch的顺序，不再shuffle
+    unsigned int resumeBatch = resumed ? resumeState.batch : 0;
+    bool resuming = resumed;
     while (epochIdx < max_epoch)
     {
         //before epoch start, shuffle all train data first
-        shuffle_data(train_images, train_labels);
-        unsigned int batchIdx = 0;
+        if (resumeBatch == 0)
+        {
+            if (loader && !resuming)
+            {
+                loader->startEpoch();
+            }
+            else
+            {
+                train_sampler.nextEpoch();
+            }
+        }
+        if (loader && resuming)
+        {
+            loader->resumeEpoch(resumeBatch == 0 ? resumeState.loaderEpoch + 1 : resumeState.loaderEpoch, resumeBatch);
+        }
+        unsigned int batchIdx = resumeBatch;
+        resumeBatch = 0;
+        resuming = false;
         while (true)
         {
-            if (!fetch_data(train_images, inputTensor, train_labels, labelTensor, batchIdx*batch, batch))
+            std::shared_ptr<MiniCNN::Tensor> batchInput, batchLabel;
+            size_t len = 0;
+            if (loader)
+            {
+                len = loader->nextBatch(batchInput, batchLabel);
+            }
+            else
+            {
+                len = fetch_batch(dataset, train_sampler, batchIdx, inputTensor, labelTensor);
+                batchInput = head_view(inputTensor, len);
+                batchLabel = head_view(labelTensor, len);
+            }
+            if (len == 0)
             {
                 break;
             }
-            const float batch_loss = network.trainBatch(inputTensor,labelTensor);
-            train_loss = MiniCNN::moving_average(train_loss, train_batches + 1, batch_loss);
+            const auto trainBegin = std::chrono::steady_clock::now();
+            const float batch_loss = network.trainBatch(batchInput, batchLabel);
+            train_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - trainBegin).count();
+            train_samples += len;
+            train_loss += batch_loss;
             train_batches++;
+            step++;
+            if (!trainingCheckpoint.empty() && step % saveAfterBatches == 0)
+            {
+                save_training_checkpoint(epochIdx, batchIdx + 1);
+            }
 
             if (batchIdx > 0 && batchIdx % testAfterBatches == 0)
             {
-                std::tie(val_accuracy, val_loss) = test(network, 128, validate_images, validate_labels);
+                const MiniCNN::EvaluationResult result = evaluate(validator, dataset, validate_sampler);
+                val_accuracy = result.accuracy;
+                val_loss = result.loss;
 
-                printf("sample:%d/%lu, learningRate:%f, train_loss:%f, val_loss:%f, val_accuracy:%.4f%% \n",
-                                     batchIdx*batch, train_images.size(), learningRate, train_loss, val_loss, val_accuracy*100.0f);
+                printf("sample:%d/%u, learningRate:%f, train_loss:%f, val_loss:%f, val_accuracy:%.4f%% \n",
+                                     batchIdx*batch, train_sampler.size(), learningRate, train_loss / train_batches, val_loss, val_accuracy*100.0f);
 
                 train_loss = 0.0f;
                 train_batches = 0;
@@ -415,16 +458,60 @@ static void train(const std::string& mnist_train_images_file,
             break;
         }
 
-        std::tie(val_accuracy, val_loss) = test(network, 128, validate_images, validate_labels);
+        const MiniCNN::EvaluationResult result = evaluate(validator, dataset, validate_sampler);
+        val_accuracy = result.accuracy;
+        val_loss = result.loss;
 
         //update learning rate
         learningRate = std::max(learningRate*decayRate, minLearningRate);
         network.setLearningRate(learningRate);
 
-        printf("epoch[%d] val_loss : %f , val_accuracy : %.4f%%  \n", epochIdx++, val_loss, val_accuracy*100.0f);
+        printf("epoch[%d] val_loss : %f , val_accuracy : %.4f%%, val_throughput : %.0f samples/s, %s train_throughput : %.0f samples/s \n",
+               epochIdx++, val_loss, val_accuracy*100.0f, result.samplesPerSecond,
+               MiniCNN::is_deterministic() ? "deterministic" : "non-deterministic",
+               train_seconds > 0.0 ? train_samples / train_seconds : 0.0);
+        train_seconds = 0.0;
+        train_samples = 0;
+        if (loader)
+        {
+            // 增强的吞吐单独报告，训练线程的等待时间不为0说明增强成为了瓶颈
+            const MiniCNN::AugmentationStats stats = loader->getStats();
+            printf("augmentation : %.0f samples/s (%d workers, %.0f samples/s each), trainer waited %.3fs \n",
+                   stats.samplesPerSecond(), stats.workers, stats.workerSamplesPerSecond(), stats.waitSeconds);
+            loader->resetStats();
+        }
+
+        if (checkpointInterval > 0)
+        {
+            const MiniCNN::CheckpointStats stats = network.getCheckpointStats();
+            printf("checkpoint: kept %d tensors, recomputed %d tensors, saved %.2f MB, recompute overhead %.2f%% of forward time \n",
+                   stats.keptTensors, stats.recomputedTensors, stats.savedBytes / 1024.0f / 1024.0f,
+                   stats.forwardSeconds > 0.0 ? stats.recomputeSeconds / stats.forwardSeconds * 100.0 : 0.0);
+            network.resetCheckpointStats();
+        }
+        if (mixedPrecision)
+        {
+            printf("mixed precision: loss scale %g, skipped steps %lu \n", network.getLossScale(), network.getSkippedSteps());
+        }
+        if (!trainingCheckpoint.empty())
+        {
+            // 学习率已经衰减，恢复后从下一个epoch开始
+            save_training_checkpoint(epochIdx, 0);
+        }
+    }
+    if (!trainingCheckpoint.empty())
+    {
+        const bool saved = checkpointWriter.wait();
+        const MiniCNN::CheckpointWriterStats stats = checkpointWriter.getStats();
+        printf("training checkpoint: %s, %lu written, %lu failed, trainer spent %.3fs (copy-on-write %.2f MB in %.3fs), "
+               "background writing %.3fs \n", saved ? "saved" : "failed", stats.checkpoints, stats.failures,
+               stats.saveSeconds + stats.copyOnWriteSeconds, stats.copyOnWriteBytes / 1024.0f / 1024.0f,
+               stats.copyOnWriteSeconds, stats.writeSeconds);
     }
 
-    std::tie(val_accuracy, val_loss) = test(network, 128, validate_images, validate_labels);
+    const MiniCNN::EvaluationResult result = evaluate(validator, dataset, validate_sampler);
+    val_accuracy = result.accuracy;
+    val_loss = result.loss;
     printf("final val_loss : %f , final val_accuracy : %.4f%% \n", val_loss, val_accuracy*100.0f);
 
     success = network.saveModel(modelFilePath);
@@ -442,40 +529,933 @@ static void test(const std::string& mnist_test_images_file,
     //load train images
     printf("loading test data...\n");
 
-    std::vector<image_t> images;
-    success = load_mnist_images(mnist_test_images_file, images);
-    assert(success && images.size() > 0);
-
-    //load train labels
-    std::vector<label_t> labels;
-    success = load_mnist_labels(mnist_test_labels_file, labels);
-    assert(success && labels.size() > 0);
-    assert(images.size() == labels.size());
-    printf("load test data done. images' size is %lu,validate labels' size is %lu \n", images.size(), labels.size());
+    MiniCNN::Dataset dataset;
+    success = load_mnist_dataset(mnist_test_images_file, mnist_test_labels_file, dataset, dataset_cache_dir());
+    assert(success && dataset.size() > 0);
+    printf("load test data done. test set's size is %d \n", dataset.size());
 
     const unsigned int batch = 64;
-    const unsigned int channels = images[0].channels;
-    const unsigned int width = images[0].width;
-    const unsigned int height = images[0].height;
+    const unsigned int channels = dataset.getSampleShape().Channels;
+    const unsigned int width = dataset.getSampleShape().Width;
+    const unsigned int height = dataset.getSampleShape().Height;
     printf("channels:%d , width:%d , height:%d \n", channels, width, height);
 
     printf("construct network begin...\n");
     MiniCNN::Network network;
-    success = network.loadModel(modelFilePath);
+    success = load_inference_model(modelFilePath, network);
     assert(success);
     printf("construct network done.\n");
 
-    //train
+    //test
     printf("begin test...\n");
-    float accuracy = 0.0f, loss = std::numeric_limits<float>::max();
-    std::tie(accuracy,loss) = test(network,batch,images, labels);
-    printf("accuracy : %.4f%% \n", accuracy*100.0f);
+    MiniCNN::Evaluator evaluator(network, batch, MiniCNN::get_thread_num());
+    evaluator.setTopK(3);
+    const MiniCNN::EvaluationResult result = evaluate(evaluator, dataset, MiniCNN::SequentialSampler(dataset.size()));
+    printf("accuracy : %.4f%%, top-%d accuracy : %.4f%%, loss : %f \n",
+           result.accuracy*100.0f, result.topK, result.topKAccuracy*100.0f, result.loss);
+    printf("throughput : %.0f samples/s (%d contexts, %.3fs) \n",
+           result.samplesPerSecond, evaluator.getContexts(), result.seconds);
+    printf("confusion matrix (row: label, column: predicted): \n");
+    for (unsigned int i = 0; i < result.classes; i++)
+    {
+        for (unsigned int j = 0; j < result.classes; j++)
+        {
+            printf("%6d", result.confusion[i * result.classes + j]);
+        }
+        printf("\n");
+    }
     printf("finished test. \n");
 }
 
+// 每个epoch训练一次，累计训练时间（不含验证时间），返回达到targetAccuracy所用的秒数，未达到返回-1
+static double time_to_accuracy(const char* name, MiniCNN::Network& network, std::function<float()> trainEpoch,
+                               const unsigned int max_epoch, const float targetAccuracy,
+                               const MiniCNN::Dataset& dataset, const MiniCNN::Sampler& validate_sampler)
+{
+    MiniCNN::Evaluator validator(network, 128, MiniCNN::get_thread_num());
+    double trainSeconds = 0.0;
+    double reachedSeconds = -1.0;
+    for (unsigned int epochIdx = 0; epochIdx < max_epoch; epochIdx++)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+        const float train_loss = trainEpoch();
+        const auto end = std::chrono::steady_clock::now();
+        trainSeconds += std::chrono::duration<double>(end - begin).count();
+
+        const MiniCNN::EvaluationResult result = evaluate(validator, dataset, validate_sampler);
+        const float val_accuracy = result.accuracy;
+        printf("[%s] epoch[%d] train_time:%.2fs, train_loss:%f, val_loss:%f, val_accuracy:%.4f%% \n",
+               name, epochIdx, trainSeconds, train_loss, result.loss, val_accuracy*100.0f);
+
+        if (reachedSeconds < 0.0 && val_accuracy >= targetAccuracy)
+        {
+            reachedSeconds = trainSeconds;
+        }
+    }
+    return reachedSeconds;
+}
+
+// 比较同步Network::trainBatch与Hogwild异步训练达到同一验证精度所需的时间。异步训练依次使用不限制staleness（0）、
+// 最严格的限制（1）和worker数一半的限制，分别报告用时和被丢弃的过期更新数
+int mnist_hogwild_main()
+{
+    MiniCNN::set_thread_num(MiniCNN::get_default_thread_num());
+    MiniCNN::set_random_seed(MiniCNN::get_default_random_seed());
+
+    const std::string mnist_train_images_file = "../res/MNIST_data/train-images-idx3-ubyte";
+    const std::string mnist_train_labels_file = "../res/MNIST_data/train-labels-idx1-ubyte";
+
+    MiniCNN::Dataset dataset;
+    const bool success = load_mnist_dataset(mnist_train_images_file, mnist_train_labels_file, dataset, dataset_cache_dir());
+    assert(success && dataset.size() > 0);
+
+    std::vector<unsigned int> train_indices, validate_indices;
+    MiniCNN::stratified_split(dataset, 0.1f, SPLIT_STREAM, train_indices, validate_indices);
+    MiniCNN::RandomSampler train_sampler(std::move(train_indices), SHUFFLE_STREAM);
+    const MiniCNN::SequentialSampler validate_sampler(std::move(validate_indices));
+
+    const float learningRate = 0.1f;
+    const float targetAccuracy = 0.95f;
+    const unsigned int max_epoch = 5;
+    const unsigned int batch = 128;
+    const unsigned int channels = dataset.getSampleShape().Channels;
+    const unsigned int width = dataset.getSampleShape().Width;
+    const unsigned int height = dataset.getSampleShape().Height;
+    // 只使用完整的batch，两种方式处理的样本数一致
+    const unsigned int batches = train_sampler.size() / batch;
+    const unsigned int workers = MiniCNN::get_thread_num();
+
+    std::vector<unsigned int> stalenessBounds = {0, 1};
+    if (workers / 2 > 1)
+    {
+        stalenessBounds.push_back(workers / 2);
+    }
+
+    printf("max_epoch:%d, batch:%d, learningRate:%f, targetAccuracy:%.2f%%, workers:%d \n",
+           max_epoch, batch, learningRate, targetAccuracy*100.0f, workers);
+
+    //synchronous
+    MiniCNN::Network syncNetwork(buildMLPNet(batch, channels, width, height));
+    syncNetwork.setLossFunction(std::make_shared<MiniCNN::CrossEntropyFunction>());
+    syncNetwork.setOptimizer(std::make_shared<MiniCNN::SGD>(learningRate));
+    syncNetwork.fuseLayers();
+    std::shared_ptr<MiniCNN::Tensor> inputTensor = std::make_shared<MiniCNN::Tensor>(MiniCNN::Shape(batch, channels, width, height));
+    std::shared_ptr<MiniCNN::Tensor> labelTensor = std::make_shared<MiniCNN::Tensor>(MiniCNN::Shape(batch, CLASSES, 1, 1));
+    const double syncSeconds = time_to_accuracy("sync", syncNetwork, [&]()
+    {
+        train_sampler.nextEpoch();
+        float train_loss = 0.0f;
+        for (unsigned int batchIdx = 0; batchIdx < batches; batchIdx++)
+        {
+            fetch_batch(dataset, train_sampler, batchIdx, inputTensor, labelTensor);
+            train_loss += syncNetwork.trainBatch(inputTensor, labelTensor);
+        }
+        return train_loss / batches;
+    }, max_epoch, targetAccuracy, dataset, validate_sampler);
+
+    //hogwild
+    std::vector<double> asyncSeconds;
+    std::vector<unsigned long> skippedUpdates;
+    for (const unsigned int maxStaleness : stalenessBounds)
+    {
+        MiniCNN::Network asyncNetwork(buildMLPNet(batch, channels, width, height));
+        asyncNetwork.setLossFunction(std::make_shared<MiniCNN::CrossEntropyFunction>());
+        asyncNetwork.setOptimizer(std::make_shared<MiniCNN::SGD>(learningRate));
+        asyncNetwork.fuseLayers();
+        MiniCNN::AsyncTrainer trainer(asyncNetwork, workers, learningRate);
+        trainer.setMaxStaleness(maxStaleness);
+        const std::string name = "hogwild(maxStaleness " + std::to_string(maxStaleness) + ")";
+        asyncSeconds.push_back(time_to_accuracy(name.c_str(), asyncNetwork, [&]()
+        {
+            train_sampler.nextEpoch();
+            return trainer.trainBatches([&](const unsigned int batchIdx, std::shared_ptr<MiniCNN::Tensor>& input,
+                                            std::shared_ptr<MiniCNN::Tensor>& label)
+            {
+                return fetch_batch(dataset, train_sampler, batchIdx, input, label) == batch;
+            }, batches);
+        }, max_epoch, targetAccuracy, dataset, validate_sampler));
+        skippedUpdates.push_back(trainer.getSkippedUpdates());
+    }
+
+    // time_to_accuracy返回-1表示max_epoch内没有达到targetAccuracy
+    const auto format_seconds = [](const double seconds)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), seconds < 0.0 ? "not reached" : "%.2fs", seconds);
+        return std::string(text);
+    };
+    printf("time to %.2f%% accuracy: sync %s \n", targetAccuracy*100.0f, format_seconds(syncSeconds).c_str());
+    for (unsigned int i = 0; i < stalenessBounds.size(); i++)
+    {
+        printf("hogwild maxStaleness %u%s: %s, skipped stale updates: %lu \n", stalenessBounds[i],
+               stalenessBounds[i] == 0 ? " (unbounded)" : "", format_seconds(asyncSeconds[i]).c_str(), skippedUpdates[i]);
+    }
+    return 0;
+}
+
+// 固定种子，在确定性模式下分别用1个线程和默认线程数训练，检查每个batch的loss和最终的验证loss逐位相同，
+// 并分别报告确定性模式与普通模式的训练吞吐
+int mnist_deterministic_main()
+{
+    const unsigned int threads = std::max(MiniCNN::get_default_thread_num(), 2u);
+    const unsigned int seed = MiniCNN::get_default_random_seed() != 0 ? MiniCNN::get_default_random_seed() : 2018;
+
+    const std::string mnist_train_images_file = "../res/MNIST_data/train-images-idx3-ubyte";
+    const std::string mnist_train_labels_file = "../res/MNIST_data/train-labels-idx1-ubyte";
+
+    MiniCNN::Dataset dataset;
+    const bool success = load_mnist_dataset(mnist_train_images_file, mnist_train_labels_file, dataset, dataset_cache_dir());
+    assert(success && dataset.size() > 0);
+
+    const float learningRate = 0.1f;
+    const unsigned int batch = 128;
+    const unsigned int batches = std::min(dataset.size() * 9 / 10 / batch, 100u);
+    const unsigned int channels = dataset.getSampleShape().Channels;
+    const unsigned int width = dataset.getSampleShape().Width;
+    const unsigned int height = dataset.getSampleShape().Height;
+    // 前batches个batch的样本用于训练，最后10%用于验证
+    std::vector<unsigned int> train_indices(batches * batch);
+    std::iota(train_indices.begin(), train_indices.end(), 0u);
+    std::vector<unsigned int> validate_indices(dataset.size() / 10);
+    std::iota(validate_indices.begin(), validate_indices.end(), dataset.size() - dataset.size() / 10);
+    const MiniCNN::SequentialSampler validate_sampler(std::move(validate_indices));
+
+    printf("seed:%u, batch:%d, batches:%d, threads:1/%d \n", seed, batch, batches, threads);
+
+    struct TrainRun
+    {
+        std::vector<float> losses;
+        float val_loss = 0.0f;
+        double seconds = 0.0;
+    };
+    auto trainRun = [&](const unsigned int threadNum, const bool deterministic)
+    {
+        MiniCNN::set_thread_num(threadNum);
+        MiniCNN::set_deterministic(deterministic);
+        MiniCNN::set_random_seed(seed);
+
+        MiniCNN::RandomSampler train_sampler(train_indices, SHUFFLE_STREAM);
+        train_sampler.nextEpoch();
+
+        MiniCNN::Network network(buildMLPNet(batch, channels, width, height));
+        network.setLossFunction(std::make_shared<MiniCNN::CrossEntropyFunction>());
+        network.setOptimizer(std::make_shared<MiniCNN::SGD>(learningRate));
+        network.fuseLayers();
+        std::shared_ptr<MiniCNN::Tensor> inputTensor = std::make_shared<MiniCNN::Tensor>(MiniCNN::Shape(batch, channels, width, height));
+        std::shared_ptr<MiniCNN::Tensor> labelTensor = std::make_shared<MiniCNN::Tensor>(MiniCNN::Shape(batch, CLASSES, 1, 1));
+
+        TrainRun run;
+        for (unsigned int batchIdx = 0; batchIdx < batches; batchIdx++)
+        {
+            fetch_batch(dataset, train_sampler, batchIdx, inputTensor, labelTensor);
+            const auto begin = std::chrono::steady_clock::now();
+            run.losses.push_back(network.trainBatch(inputTensor, labelTensor));
+            run.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        }
+        MiniCNN::Evaluator validator(network, batch, threadNum);
+        run.val_loss = evaluate(validator, dataset, validate_sampler).loss;
+        return run;
+    };
+
+    const TrainRun single = trainRun(1, true);
+    const TrainRun multi = trainRun(threads, true);
+    const TrainRun fast = trainRun(threads, false);
+    MiniCNN::set_deterministic(false);
+    MiniCNN::set_thread_num(MiniCNN::get_default_thread_num());
+
+    // 逐位比较，不允许任何舍入差异
+    const bool identical = std::memcmp(&single.losses[0], &multi.losses[0], batches * sizeof(float)) == 0 &&
+                           std::memcmp(&single.val_loss, &multi.val_loss, sizeof(float)) == 0;
+    printf("deterministic, 1 thread : final train_loss %.9g, val_loss %.9g \n", single.losses.back(), single.val_loss);
+    printf("deterministic, %d threads: final train_loss %.9g, val_loss %.9g \n", threads, multi.losses.back(), multi.val_loss);
+    printf("non-deterministic, %d threads: final train_loss %.9g, val_loss %.9g \n", threads, fast.losses.back(), fast.val_loss);
+    printf("bit-identical across thread counts: %s \n", identical ? "yes" : "NO");
+
+    const double samples = (double)batches * batch;
+    const double deterministicThroughput = samples / multi.seconds;
+    const double fastThroughput = samples / fast.seconds;
+    printf("train_throughput (%d threads): deterministic %.0f samples/s, non-deterministic %.0f samples/s, cost %.1f%% \n",
+           threads, deterministicThroughput, fastThroughput, (1.0 - deterministicThroughput / fastThroughput) * 100.0);
+    return identical ? 0 : 1;
+}
+
+// 把dataset按顺序切成shards个分片，每片写成一对IDX文件，并生成manifest
+static bool write_idx_shards(const MiniCNN::Dataset& dataset, const unsigned int shards, const std::string& dir,
+                             const std::string& manifest_file)
+{
+    auto writeBigEndian = [](std::ofstream& ofs, const uint32_t value)
+    {
+        const unsigned char bytes[4] = { (unsigned char)(value >> 24), (unsigned char)(value >> 16),
+                                         (unsigned char)(value >> 8), (unsigned char)value };
+        ofs.write((const char*)bytes, sizeof(bytes));
+    };
+    const MiniCNN::Shape shape = dataset.getSampleShape();
+    assert(shape.Channels == 1);
+    std::ofstream manifest(manifest_file);
+    for (unsigned int shard = 0; shard < shards; shard++)
+    {
+        const unsigned int begin = dataset.size() * shard / shards;
+        const unsigned int end = dataset.size() * (shard + 1) / shards;
+        const std::string prefix = "mnist-train-shard" + std::to_string(shard);
+        std::ofstream images(dir + "/" + prefix + "-images-idx3-ubyte", std::ios::binary);
+        std::ofstream labels(dir + "/" + prefix + "-labels-idx1-ubyte", std::ios::binary);
+        writeBigEndian(images, 0x00000803);
+        writeBigEndian(images, end - begin);
+        writeBigEndian(images, shape.Height);
+        writeBigEndian(images, shape.Width);
+        writeBigEndian(labels, 0x00000801);
+        writeBigEndian(labels, end - begin);
+        for (unsigned int i = begin; i < end; i++)
+        {
+            const uint8_t* sample = dataset.getSample(i);
+            if (sample == nullptr)
+            {
+                return false;
+            }
+            const char label = (char)dataset.getLabel(i);
+            images.write((const char*)sample, dataset.getSampleSize());
+            labels.write(&label, 1);
+        }
+        if (!images || !labels)
+        {
+            return false;
+        }
+        manifest << prefix << "-images-idx3-ubyte " << prefix << "-labels-idx1-ubyte" << std::endl;
+    }
+    return manifest.good();
+}
+
+// 用ShardedReader流式读取分片的训练集（不存在时先把训练集切成分片，写入scratch_dir()），训练几个epoch并在测试集上验证，
+// 报告reader占用的内存、每个epoch读到的样本数和读取吞吐
+int mnist_stream_main()
+{
+    const std::string data_dir = "../res/MNIST_data";
+    const std::string shard_dir = scratch_dir();
+    const std::string manifest_file = shard_dir + "/mnist_train_shards.manifest";
+    const std::string mnist_test_images_file = data_dir + "/t10k-images-idx3-ubyte";
+    const std::string mnist_test_labels_file = data_dir + "/t10k-labels-idx1-ubyte";
+
+    MiniCNN::set_random_seed(MiniCNN::get_default_random_seed());
+
+    // 为了体现内存与数据集大小无关，chunk和buffer取得比单个分片小
+    const unsigned int chunkSamples = 256;
+    const unsigned int bufferSamples = 1024;
+    MiniCNN::ShardedReader reader;
+    bool success = reader.open(manifest_file, CLASSES, chunkSamples, bufferSamples, READER_STREAM);
+    if (!success)
+    {
+        MiniCNN::Dataset train_dataset;
+        success = load_mnist_dataset(data_dir + "/train-images-idx3-ubyte", data_dir + "/train-labels-idx1-ubyte",
+                                     train_dataset);
+        success = success && write_idx_shards(train_dataset, 4, shard_dir, manifest_file);
+        success = success && reader.open(manifest_file, CLASSES, chunkSamples, bufferSamples, READER_STREAM);
+    }
+    assert(success);
+
+    MiniCNN::Dataset test_dataset;
+    success = load_mnist_dataset(mnist_test_images_file, mnist_test_labels_file, test_dataset, dataset_cache_dir());
+    assert(success && test_dataset.size() > 0);
+
+    const float learningRate = 0.1f;
+    const unsigned int batch = 64;
+    const unsigned int epochs = 3;
+    const MiniCNN::Shape sampleShape = reader.getSampleShape();
+    printf("shards:%d, samples:%lu, chunk:%d, buffer:%d, reader memory:%lu bytes \n", reader.getShards(),
+           (unsigned long)reader.size(), chunkSamples, bufferSamples, (unsigned long)reader.getMemoryBytes());
+
+    MiniCNN::Network network(buildMLPNet(batch, sampleShape.Channels, sampleShape.Width, sampleShape.Height));
+    network.setLossFunction(std::make_shared<MiniCNN::CrossEntropyFunction>());
+    network.setOptimizer(std::make_shared<MiniCNN::SGD>(learningRate));
+    network.fuseLayers();
+    std::shared_ptr<MiniCNN::Tensor> inputTensor = std::make_shared<MiniCNN::Tensor>(
+            MiniCNN::Shape(batch, sampleShape.Channels, sampleShape.Width, sampleShape.Height));
+    std::shared_ptr<MiniCNN::Tensor> labelTensor = std::make_shared<MiniCNN::Tensor>(MiniCNN::Shape(batch, CLASSES, 1, 1));
+
+    bool exact = true;
+    for (unsigned int epoch = 0; epoch < epochs; epoch++)
+    {
+        uint64_t samples = 0;
+        double readSeconds = 0.0;
+        float loss = 0.0f;
+        unsigned int batches = 0;
+        reader.startEpoch();
+        while (true)
+        {
+            const auto begin = std::chrono::steady_clock::now();
+            const unsigned int count = reader.nextBatch(*inputTensor, labelTensor.get());
+            readSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            if (count == 0)
+            {
+                break;
+            }
+            samples += count;
+            loss += network.trainBatch(head_view(inputTensor, count), head_view(labelTensor, count));
+            batches++;
+        }
+        if (reader.isFailed())
+        {
+            printf("epoch %d: failed to read the shards listed in %s \n", epoch, manifest_file.c_str());
+            return 1;
+        }
+        exact = exact && samples == reader.size();
+        const std::pair<float, float> result = test(network, batch, test_dataset);
+        printf("epoch %d: samples %lu, train_loss %.4f, test accuracy %.2f%%, reader_throughput %.0f samples/s \n",
+               epoch, (unsigned long)samples, batches > 0 ? loss / batches : 0.0f, result.first * 100.0f,
+               readSeconds > 0.0 ? samples / readSeconds : 0.0);
+    }
+    printf("every sample read exactly once per epoch: %s \n", exact ? "yes" : "NO");
+    return exact ? 0 : 1;
+}
+
+// 对已保存的模型做int8训练后量化，比较量化前后测试集上的精度和推理时间
+int mnist_quantize_main()
+{
+    MiniCNN::set_thread_num(MiniCNN::get_default_thread_num());
+    MiniCNN::set_random_seed(MiniCNN::get_default_random_seed());
+
+    const std::string model_file = "../model/mnist.modelx";
+    const std::string quantized_model_file = "../model/mnist_int8.modelx";
+    const std::string mnist_train_images_file = "../res/MNIST_data/train-images-idx3-ubyte";
+    const std::string mnist_train_labels_file = "../res/MNIST_data/train-labels-idx1-ubyte";
+    const std::string mnist_test_images_file = "../res/MNIST_data/t10k-images-idx3-ubyte";
+    const std::string mnist_test_labels_file = "../res/MNIST_data/t10k-labels-idx1-ubyte";
+
+    MiniCNN::Dataset train_dataset;
+    bool success = load_mnist_dataset(mnist_train_images_file, mnist_train_labels_file, train_dataset, dataset_cache_dir());
+    assert(success && train_dataset.size() > 0);
+    MiniCNN::Dataset test_dataset;
+    success = load_mnist_dataset(mnist_test_images_file, mnist_test_labels_file, test_dataset, dataset_cache_dir());
+    assert(success && test_dataset.size() > 0);
+
+    MiniCNN::Network network;
+    success = load_inference_model(model_file, network);
+    assert(success);
+    network.setLossFunction(std::make_shared<MiniCNN::CrossEntropyFunction>());
+
+    const size_t batch = 64;
+    float fp32Accuracy = 0.0f, fp32Loss = 0.0f;
+    const double fp32Seconds = timed_test(network, batch, test_dataset, 1, fp32Accuracy, &fp32Loss);
+
+    // 用训练集中的样本校准，不接触测试集
+    const MiniCNN::SequentialSampler calibration_sampler(std::min(train_dataset.size(), 1024u));
+    const size_t calibrationSize = calibration_sampler.size();
+    MiniCNN::Shape calibrationShape = train_dataset.getSampleShape();
+    calibrationShape.Batch = batch;
+    const std::shared_ptr<MiniCNN::Tensor> calibrationTensor = std::make_shared<MiniCNN::Tensor>(calibrationShape);
+    for (unsigned int batchIdx = 0; batchIdx < calibration_sampler.getBatches(batch); batchIdx++)
+    {
+        const unsigned int* indices = nullptr;
+        const unsigned int count = calibration_sampler.getBatch(batchIdx, batch, indices);
+        const size_t len = train_dataset.fillBatch(indices, count, *calibrationTensor, nullptr);
+        network.calibrate(head_view(calibrationTensor, len));
+    }
+    const unsigned int quantizedLayers = network.quantize();
+
+    float int8Accuracy = 0.0f, int8Loss = 0.0f;
+    const double int8Seconds = timed_test(network, batch, test_dataset, 1, int8Accuracy, &int8Loss);
+
+    success = network.saveModel(quantized_model_file);
+    assert(success);
+
+    printf("quantized %d layers with %lu calibration samples \n", quantizedLayers, calibrationSize);
+    printf("fp32 : accuracy %.4f%%, loss %f, time %.3fs \n", fp32Accuracy*100.0f, fp32Loss, fp32Seconds);
+    printf("int8 : accuracy %.4f%%, loss %f, time %.3fs \n", int8Accuracy*100.0f, int8Loss, int8Seconds);
+    printf("accuracy delta : %+.4f%%, speedup : %.2fx \n", (int8Accuracy - fp32Accuracy)*100.0f,
+           int8Seconds > 0.0 ? fp32Seconds / int8Seconds : 0.0);
+    return 0;
+}
+
+// 对已保存的模型按不同的稀疏度做全局的magnitude裁剪，比较稀疏格式（CSR、4x1、8x1块）与dense的推理时间，
+// 找出稀疏格式开始比dense快的稀疏度
+int mnist_prune_main()
+{
+    MiniCNN::set_thread_num(MiniCNN::get_default_thread_num());
+    MiniCNN::set_random_seed(MiniCNN::get_default_random_seed());
+
+    const std::string model_file = "../model/mnist.modelx";
+    const std::string sparse_model_file = "../model/mnist_sparse.modelx";
+    const std::string mnist_test_images_file = "../res/MNIST_data/t10k-images-idx3-ubyte";
+    const std::string mnist_test_labels_file = "../res/MNIST_data/t10k-labels-idx1-ubyte";
+
+    MiniCNN::Dataset test_dataset;
+    bool success = load_mnist_dataset(mnist_test_images_file, mnist_test_labels_file, test_dataset, dataset_cache_dir());
+    assert(success && test_dataset.size() > 0);
+
+    const size_t batch = 64;
+    // 重复几次取最短的时间
+    const unsigned int repeats = 3;
+    const float sparsities[] = { 0.1f, 0.25f, 0.5f, 0.7f, 0.8f, 0.9f, 0.95f, 0.98f };
+    const unsigned int blockRowsList[] = { 1, 4, 8 };
+    // 保存这个稀疏度下CSR格式的模型
+    const float savedSparsity = 0.9f;
+
+    MiniCNN::Network baseline;
+    success = load_inference_model(model_file, baseline);
+    assert(success);
+    float baselineAccuracy = 0.0f;
+    const double baselineSeconds = timed_test(baseline, batch, test_dataset, repeats, baselineAccuracy);
+    printf("dense : accuracy %.4f%%, time %.3fs \n", baselineAccuracy*100.0f, baselineSeconds);
+
+    for (const unsigned int blockRows : blockRowsList)
+    {
+        float breakEvenSparsity = -1.0f;
+        for (const float sparsity : sparsities)
+        {
+            MiniCNN::Network network;
+            success = load_inference_model(model_file, network);
+            assert(success);
+            const float actualSparsity = network.prune(sparsity, true, blockRows);
+
+            float denseAccuracy = 0.0f, sparseAccuracy = 0.0f;
+            const double denseSeconds = timed_test(network, batch, test_dataset, repeats, denseAccuracy);
+            network.sparsify(blockRows);
+            const double sparseSeconds = timed_test(network, batch, test_dataset, repeats, sparseAccuracy);
+
+            printf("block %dx1, sparsity %.2f%% : accuracy %.4f%% (%+.4f%%), dense %.3fs, sparse %.3fs, speedup %.2fx \n",
+                   blockRows, actualSparsity*100.0f, sparseAccuracy*100.0f, (sparseAccuracy - baselineAccuracy)*100.0f,
+                   denseSeconds, sparseSeconds, sparseSeconds > 0.0 ? denseSeconds / sparseSeconds : 0.0);
+            if (breakEvenSparsity < 0.0f && sparseSeconds < denseSeconds)
+            {
+                breakEvenSparsity = actualSparsity;
+            }
+            if (blockRows == 1 && sparsity == savedSparsity)
+            {
+                success = network.saveModel(sparse_model_file);
+                assert(success);
+            }
+        }
+
+        if (breakEvenSparsity >= 0.0f)
+        {
+            printf("block %dx1 : sparse beats dense from sparsity %.2f%% \n", blockRows, breakEvenSparsity*100.0f);
+        }
+        else
+        {
+            printf("block %dx1 : sparse never beats dense in the tested range \n", blockRows);
+        }
+    }
+    return 0;
+}
+
+// 对已保存的模型按不同的rank做低秩分解，比较精度与推理时间，并验证分解后的模型可以直接加载
+int mnist_factorize_main()
+{
+    MiniCNN::set_thread_num(MiniCNN::get_default_thread_num());
+    MiniCNN::set_random_seed(MiniCNN::get_default_random_seed());
+
+    const std::string model_file = "../model/mnist.modelx";
+    const std::string lowrank_model_file = "../model/mnist_lowrank.modelx";
+    const std::string mnist_test_images_file = "../res/MNIST_data/t10k-images-idx3-ubyte";
+    const std::string mnist_test_labels_file = "../res/MNIST_data/t10k-labels-idx1-ubyte";
+
+    MiniCNN::Dataset test_dataset;
+    bool success = load_mnist_dataset(mnist_test_images_file, mnist_test_labels_file, test_dataset, dataset_cache_dir());
+    assert(success && test_dataset.size() > 0);
+
+    const size_t batch = 64;
+    // 重复几次取最短的时间
+    const unsigned int repeats = 3;
+    const unsigned int ranks[] = { 16, 32, 64, 128 };
+    // 保存这个rank分解后的模型
+    const unsigned int savedRank = 64;
+
+    MiniCNN::Network baseline;
+    success = load_inference_model(model_file, baseline);
+    assert(success);
+    float baselineAccuracy = 0.0f;
+    const double baselineSeconds = timed_test(baseline, batch, test_dataset, repeats, baselineAccuracy);
+    printf("dense : accuracy %.4f%%, time %.3fs \n", baselineAccuracy*100.0f, baselineSeconds);
+
+    for (const unsigned int rank : ranks)
+    {
+        MiniCNN::Network network;
+        success = load_inference_model(model_file, network);
+        assert(success);
+
+        const auto begin = std::chrono::steady_clock::now();
+        const unsigned int factorizedLayers = network.factorize(rank);
+        const auto end = std::chrono::steady_clock::now();
+
+        float accuracy = 0.0f;
+        const double seconds = timed_test(network, batch, test_dataset, repeats, accuracy);
+        printf("rank %d : factorized %d layers in %.2fs, accuracy %.4f%% (%+.4f%%), time %.3fs, speedup %.2fx \n",
+               rank, factorizedLayers, std::chrono::duration<double>(end - begin).count(), accuracy*100.0f,
+               (accuracy - baselineAccuracy)*100.0f, seconds, seconds > 0.0 ? baselineSeconds / seconds : 0.0);
+
+        if (rank == savedRank)
+        {
+            success = network.saveModel(lowrank_model_file);
+            assert(success);
+        }
+    }
+
+    // 分解后的两层就是普通的全连接层，直接加载推理
+    MiniCNN::Network lowrank;
+    success = load_inference_model(lowrank_model_file, lowrank);
+    assert(success);
+    float lowrankAccuracy = 0.0f;
+    const double lowrankSeconds = timed_test(lowrank, batch, test_dataset, repeats, lowrankAccuracy);
+    printf("reloaded rank %d model : accuracy %.4f%%, time %.3fs \n", savedRank, lowrankAccuracy*100.0f, lowrankSeconds);
+    return 0;
+}
+
+// 读完整个文件（按CompressedInput解压后的内容），返回用时，内容写入data
+static double read_whole_file(const std::string& path, std::vector<uint8_t>& data)
+{
+    const auto begin = std::chrono::steady_clock::now();
+    MiniCNN::CompressedInput input;
+    bool success = input.open(path);
+    assert(success);
+    data.clear();
+    std::vector<uint8_t> chunk(1 << 20);
+    size_t count = 0;
+    while ((count = input.readSome(chunk.data(), chunk.size())) > 0)
+    {
+        data.insert(data.end(), chunk.begin(), chunk.begin() + count);
+    }
+    assert(!input.isFailed());
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+// 比较原始文件、普通gzip和分块gzip（单线程/多线程）的读取吞吐，并检查解压结果与原始文件相同
+int mnist_compress_main()
+{
+    const std::string mnist_train_images_file = "../res/MNIST_data/train-images-idx3-ubyte";
+    const std::string mnist_train_labels_file = "../res/MNIST_data/train-labels-idx1-ubyte";
+    // 压缩后的文件是中间结果，写入scratch_dir()
+    const std::string gzip_file = scratch_dir() + "/mnist-train-images-idx3-ubyte.plain.gz";
+    const std::string blocked_file = scratch_dir() + "/mnist-train-images-idx3-ubyte.bgz";
+    const unsigned int threads = MiniCNN::get_default_thread_num();
+
+    std::vector<uint8_t> raw;
+    read_whole_file(mnist_train_images_file, raw);
+    assert(!raw.empty());
+    if (!std::ifstream(gzip_file).is_open())
+    {
+        gzFile gz = gzopen(gzip_file.c_str(), "wb6");
+        assert(gz != nullptr);
+        gzwrite(gz, raw.data(), (unsigned int)raw.size());
+        gzclose(gz);
+    }
+    bool success = MiniCNN::compress_file_blocked(mnist_train_images_file, blocked_file);
+    assert(success);
+
+    auto fileSize = [](const std::string& path)
+    {
+        std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+        return (double)ifs.tellg();
+    };
+    printf("raw %.1f MB, gzip %.1f MB, blocked gzip %.1f MB \n", raw.size() / 1e6, fileSize(gzip_file) / 1e6,
+           fileSize(blocked_file) / 1e6);
+
+    bool identical = true;
+    auto benchmark = [&](const char* name, const std::string& path, const unsigned int threadNum)
+    {
+        MiniCNN::set_thread_num(threadNum);
+        std::vector<uint8_t> data;
+        double seconds = std::numeric_limits<double>::max();
+        for (int i = 0; i < 3; i++)
+        {
+            seconds = std::min(seconds, read_whole_file(path, data));
+        }
+        identical = identical && data == raw;
+        printf("%-28s %d thread(s): %8.1f MB/s \n", name, threadNum, raw.size() / seconds / 1e6);
+    };
+    benchmark("raw", mnist_train_images_file, 1);
+    benchmark("gzip (streaming)", gzip_file, 1);
+    benchmark("blocked gzip", blocked_file, 1);
+    benchmark("blocked gzip", blocked_file, threads);
+    MiniCNN::set_thread_num(threads);
+
+    // 直接从压缩文件加载数据集
+    MiniCNN::Dataset raw_dataset;
+    MiniCNN::Dataset compressed_dataset;
+    success = load_mnist_dataset(mnist_train_images_file, mnist_train_labels_file, raw_dataset)
+              && load_mnist_dataset(blocked_file, mnist_train_labels_file, compressed_dataset);
+    identical = identical && success && raw_dataset.size() == compressed_dataset.size()
+                && std::memcmp(raw_dataset.getSample(0), compressed_dataset.getSample(0),
+                               (size_t)raw_dataset.size() * raw_dataset.getSampleSize()) == 0;
+    printf("decompressed data identical to raw: %s \n", identical ? "yes" : "NO");
+    return identical ? 0 : 1;
+}
+
+// 用CIFAR-10二进制格式的数据训练MLP，训练数据由AugmentedLoader在后台随机裁剪，与MNIST使用相同的batch和预取路径，
+// 报告数据加载的速度、训练吞吐和测试集精度
+int cifar_main()
+{
+    MiniCNN::set_random_seed(MiniCNN::get_default_random_seed());
+
+    const std::string data_dir = "../res/cifar-10-batches-bin";
+    std::vector<std::string> train_files;
+    for (int i = 1; i <= 5; i++)
+    {
+        train_files.push_back(data_dir + "/data_batch_" + std::to_string(i) + ".bin");
+    }
+    const std::vector<std::string> test_files = { data_dir + "/test_batch.bin" };
+
+    // 训练数据需要uint8样本做增强，不使用预处理缓存
+    MiniCNN::Dataset train_dataset;
+    MiniCNN::Dataset test_dataset;
+    const auto loadBegin = std::chrono::steady_clock::now();
+    const bool success = load_cifar10_dataset(train_files, train_dataset)
+                         && load_cifar10_dataset(test_files, test_dataset, dataset_cache_dir());
+    const double loadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - loadBegin).count();
+    if (!success)
+    {
+        printf("can't load CIFAR-10 binary files from %s \n", data_dir.c_str());
+        return 1;
+    }
+    const MiniCNN::Shape sampleShape = train_dataset.getSampleShape();
+    const double bytes = (double)(train_dataset.size() + test_dataset.size()) * (train_dataset.getSampleSize() + 1);
+    printf("train:%d, test:%d, channels:%d, width:%d, height:%d, loaded %.1f MB in %.3fs (%.0f MB/s) \n",
+           train_dataset.size(), test_dataset.size(), sampleShape.Channels, sampleShape.Width, sampleShape.Height,
+           bytes / 1e6, loadSeconds, bytes / 1e6 / loadSeconds);
+
+    const float learningRate = 0.01f;
+    const unsigned int batch = 128;
+    const unsigned int epochs = 2;
+    MiniCNN::AugmentationConfig augmentationConfig;
+    augmentationConfig.cropPadding = 4;
+    const unsigned int augmentationWorkers = 2;
+
+    MiniCNN::Network network(buildMLPNet(batch, sampleShape.Channels, sampleShape.Width, sampleShape.Height));
+    network.setLossFunction(std::make_shared<MiniCNN::CrossEntropyFunction>());
+    network.setOptimizer(std::make_shared<MiniCNN::SGD>(learningRate));
+    network.fuseLayers();
+
+    MiniCNN::RandomSampler train_sampler(train_dataset.size(), SHUFFLE_STREAM);
+    MiniCNN::AugmentedLoader loader(train_dataset, train_sampler, batch, augmentationConfig, AUGMENT_STREAM,
+                                    augmentationWorkers);
+    if (!loader.isValid())
+    {
+        printf("augmentation needs uint8 samples, the training set has none \n");
+        return 1;
+    }
+    for (unsigned int epoch = 0; epoch < epochs; epoch++)
+    {
+        loader.startEpoch();
+        float loss = 0.0f;
+        unsigned int batches = 0;
+        size_t samples = 0;
+        double seconds = 0.0;
+        std::shared_ptr<MiniCNN::Tensor> inputTensor, labelTensor;
+        unsigned int count = 0;
+        while ((count = loader.nextBatch(inputTensor, labelTensor)) > 0)
+        {
+            const auto begin = std::chrono::steady_clock::now();
+            loss += network.trainBatch(inputTensor, labelTensor);
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            samples += count;
+            batches++;
+        }
+        const std::pair<float, float> result = test(network, batch, test_dataset);
+        const MiniCNN::AugmentationStats stats = loader.getStats();
+        printf("epoch %d: train_loss %.4f, test_accuracy %.2f%%, train_throughput %.0f samples/s, "
+               "augmentation %.0f samples/s, trainer waited %.3fs \n", epoch, batches > 0 ? loss / batches : 0.0f,
+               result.first * 100.0f, seconds > 0.0 ? samples / seconds : 0.0, stats.samplesPerSecond(), stats.waitSeconds);
+        loader.resetStats();
+    }
+    return 0;
+}
+
+// 固定种子和确定性模式，分别不中断地训练和在中途“被终止”后从最近的checkpoint继续训练（新建网络和sampler），
+// 检查每个batch的loss和最终的验证loss逐位相同，并报告checkpoint占用训练线程的时间和后台写入的时间
+int mnist_checkpoint_main()
+{
+    const unsigned int seed = MiniCNN::get_default_random_seed() != 0 ? MiniCNN::get_default_random_seed() : 2018;
+    MiniCNN::set_thread_num(MiniCNN::get_default_thread_num());
+    MiniCNN::set_deterministic(true);
+    MiniCNN::set_random_seed(seed);
+
+    const std::string mnist_train_images_file = "../res/MNIST_data/train-images-idx3-ubyte";
+    const std::string mnist_train_labels_file = "../res/MNIST_data/train-labels-idx1-ubyte";
+    const std::string checkpoint_file = "../model/mnist.checkpoint";
+
+    MiniCNN::Dataset dataset;
+    const bool success = load_mnist_dataset(mnist_train_images_file, mnist_train_labels_file, dataset, dataset_cache_dir());
+    assert(success && dataset.size() > 0);
+
+    const float initLearningRate = 0.05f;
+    const float decayRate = 0.8f;
+    const float momentum = 0.9f;
+    const unsigned int batch = 64;
+    const unsigned int max_epoch = 3;
+    const unsigned int saveAfterBatches = 10;
+    const unsigned int channels = dataset.getSampleShape().Channels;
+    const unsigned int width = dataset.getSampleShape().Width;
+    const unsigned int height = dataset.getSampleShape().Height;
+    std::vector<unsigned int> train_indices(dataset.size() - dataset.size() / 10);
+    std::iota(train_indices.begin(), train_indices.end(), 0u);
+    std::vector<unsigned int> validate_indices(dataset.size() / 10);
+    std::iota(validate_indices.begin(), validate_indices.end(), (unsigned int)train_indices.size());
+    const MiniCNN::SequentialSampler validate_sampler(std::move(validate_indices));
+    const unsigned int batches = (unsigned int)(train_indices.size() + batch - 1) / batch;
+    // 在第二个epoch中间、两个checkpoint之间被终止，最近一个checkpoint之后的batch需要重新训练
+    const uint64_t interruptStep = batches + batches / 2 + saveAfterBatches / 2;
+
+    printf("seed:%u, batch:%d, batches per epoch:%d, epochs:%d, checkpoint every %d batches, interrupted at batch %llu \n",
+           seed, batch, batches, max_epoch, saveAfterBatches, (unsigned long long)interruptStep);
+
+    struct TrainRun
+    {
+        std::vector<float> losses;
+        float val_loss = 0.0f;
+        double seconds = 0.0;
+        uint64_t resumedStep = 0;
+        MiniCNN::CheckpointWriterStats stats;
+    };
+    auto createNetwork = [&]()
+    {
+        std::unique_ptr<MiniCNN::Network> network(new MiniCNN::Network(buildMLPNet(batch, channels, width, height)));
+        network->setLossFunction(std::make_shared<MiniCNN::CrossEntropyFunction>());
+        network->setOptimizer(std::make_shared<MiniCNN::SGDWithMomentum>(initLearningRate, momentum));
+        network->fuseLayers();
+        return network;
+    };
+    auto trainRun = [&](const bool interrupt)
+    {
+        std::remove(checkpoint_file.c_str());
+        MiniCNN::set_random_seed(seed);
+        std::unique_ptr<MiniCNN::Network> network = createNetwork();
+        std::unique_ptr<MiniCNN::RandomSampler> train_sampler(new MiniCNN::RandomSampler(train_indices, SHUFFLE_STREAM));
+        std::shared_ptr<MiniCNN::Tensor> inputTensor = std::make_shared<MiniCNN::Tensor>(MiniCNN::Shape(batch, channels, width, height));
+        std::shared_ptr<MiniCNN::Tensor> labelTensor = std::make_shared<MiniCNN::Tensor>(MiniCNN::Shape(batch, CLASSES, 1, 1));
+
+        TrainRun run;
+        MiniCNN::CheckpointWriter writer;
+        float learningRate = initLearningRate;
+        unsigned int epoch = 0;
+        unsigned int batchIdx = 0;
+        uint64_t step = 0;
+        bool pendingInterrupt = interrupt;
+        auto save = [&]()
+        {
+            MiniCNN::TrainingState state;
+            state.epoch = epoch;
+            state.batch = batchIdx;
+            state.step = step;
+            state.learningRate = learningRate;
+            state.seed = seed;
+            state.samplerState = train_sampler->saveState();
+            writer.save(*network, state, checkpoint_file);
+        };
+        while (epoch < max_epoch)
+        {
+            if (batchIdx == 0)
+            {
+                train_sampler->nextEpoch();
+            }
+            bool interrupted = false;
+            while (batchIdx < batches)
+            {
+                const size_t len = fetch_batch(dataset, *train_sampler, batchIdx, inputTensor, labelTensor);
+                const auto begin = std::chrono::steady_clock::now();
+                run.losses.push_back(network->trainBatch(head_view(inputTensor, len), head_view(labelTensor, len)));
+                run.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+                batchIdx++;
+                step++;
+                if (step % saveAfterBatches == 0)
+                {
+                    const auto saveBegin = std::chrono::steady_clock::now();
+                    save();
+                    run.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - saveBegin).count();
+                }
+                if (pendingInterrupt && step == interruptStep)
+                {
+                    pendingInterrupt = false;
+                    interrupted = true;
+                    break;
+                }
+            }
+            if (interrupted)
+            {
+                // 模拟进程被终止后重新启动：丢弃网络和sampler，从已经写完的checkpoint恢复
+                writer.wait();
+                run.stats = writer.getStats();
+                network = createNetwork();
+                train_sampler.reset(new MiniCNN::RandomSampler(train_indices, SHUFFLE_STREAM));
+                MiniCNN::TrainingState state;
+                if (!MiniCNN::load_checkpoint(checkpoint_file, *network, state) || !train_sampler->loadState(state.samplerState))
+                {
+                    printf("failed to resume from %s \n", checkpoint_file.c_str());
+                    return run;
+                }
+                MiniCNN::set_random_seed(state.seed);
+                learningRate = state.learningRate;
+                network->setLearningRate(learningRate);
+                epoch = state.epoch;
+                batchIdx = state.batch;
+                step = state.step;
+                run.resumedStep = step;
+                run.losses.resize((size_t)step);
+                continue;
+            }
+            epoch++;
+            batchIdx = 0;
+            learningRate *= decayRate;
+            network->setLearningRate(learningRate);
+            save();
+        }
+        writer.wait();
+        const MiniCNN::CheckpointWriterStats stats = writer.getStats();
+        run.stats.checkpoints += stats.checkpoints;
+        run.stats.failures += stats.failures;
+        run.stats.saveSeconds += stats.saveSeconds;
+        run.stats.copyOnWriteSeconds += stats.copyOnWriteSeconds;
+        run.stats.copyOnWriteBytes += stats.copyOnWriteBytes;
+        run.stats.writeSeconds += stats.writeSeconds;
+        run.stats.bytes += stats.bytes;
+        MiniCNN::Evaluator validator(*network, batch, MiniCNN::get_thread_num());
+        run.val_loss = evaluate(validator, dataset, validate_sampler).loss;
+        return run;
+    };
+
+    const TrainRun full = trainRun(false);
+    const TrainRun resumed = trainRun(true);
+    MiniCNN::set_deterministic(false);
+
+    // 逐位比较，不允许任何舍入差异
+    const bool identical = full.losses.size() == resumed.losses.size() &&
+                           std::memcmp(&full.losses[0], &resumed.losses[0], full.losses.size() * sizeof(float)) == 0 &&
+                           std::memcmp(&full.val_loss, &resumed.val_loss, sizeof(float)) == 0;
+    printf("uninterrupted: final train_loss %.9g, val_loss %.9g \n", full.losses.back(), full.val_loss);
+    printf("resumed from batch %llu: final train_loss %.9g, val_loss %.9g \n", (unsigned long long)resumed.resumedStep,
+           resumed.losses.empty() ? 0.0f : resumed.losses.back(), resumed.val_loss);
+    printf("bit-identical after resuming: %s \n", identical ? "yes" : "NO");
+
+    const MiniCNN::CheckpointWriterStats& stats = full.stats;
+    const double trainerSeconds = stats.saveSeconds + stats.copyOnWriteSeconds;
+    printf("%lu checkpoints (%.2f MB each, %lu failed): trainer spent %.3fs (%.1f%% of training, copy-on-write %.2f MB), "
+           "background writing %.3fs \n", stats.checkpoints,
+           stats.checkpoints > 0 ? stats.bytes / 1024.0 / 1024.0 / stats.checkpoints : 0.0, stats.failures,
+           trainerSeconds, full.seconds > 0.0 ? trainerSeconds / full.seconds * 100.0 : 0.0,
+           stats.copyOnWriteBytes / 1024.0 / 1024.0, stats.writeSeconds);
+    return identical ? 0 : 1;
+}
+
+int mnist_codegen_main()
+{
+    const std::string model_file = "../model/mnist.modelx";
+    const std::string source_file = "../model/mnist_model.cpp";
+
+    MiniCNN::Network network;
+    bool success = network.loadModel(model_file);
+    assert(success);
+    // 融合后activation直接在dense模板中计算
+    const unsigned int fusedLayers = network.fuseLayers();
+
+    success = network.generateSource(source_file, "mnist_model");
+    assert(success);
+    std::ifstream ifs(source_file, std::ios::binary | std::ios::ate);
+    printf("generated %s (%ld bytes, %d fused layers), compile with: c++ -O3 -march=native -c %s \n",
+           source_file.c_str(), (long)ifs.tellg(), fusedLayers, source_file.c_str());
+    return 0;
+}
+
 int mnist_main()
 {
-    MiniCNN::set_thread_num(4);
+    MiniCNN::set_thread_num(MiniCNN::get_default_thread_num());
+    MiniCNN::set_random_seed(MiniCNN::get_default_random_seed());
 
     const std::string model_file = "../model/mnist.modelx";
 
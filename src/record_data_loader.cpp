@@ -0,0 +1,200 @@
+//
+// Created by yang chen on 2018/4/30.
+//
+
+#include "../include/record_data_loader.h"
+#include "../include/CompressedInput.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+bool parse_record_format(const std::string& spec, record_format_t& format)
+{
+    record_format_t parsed;
+    std::istringstream iss(spec);
+    std::string item;
+    while (std::getline(iss, item, ','))
+    {
+        const size_t pos = item.find('=');
+        if (pos == std::string::npos)
+        {
+            return false;
+        }
+        const std::string key = item.substr(0, pos);
+        const std::string value = item.substr(pos + 1);
+        // 只接受数字（shape还有分隔的x），strtoul和sscanf会跳过空白并接受负号
+        if (value.empty() || value.find_first_not_of(key == "shape" ? "0123456789x" : "0123456789") != std::string::npos)
+        {
+            return false;
+        }
+        char* end = nullptr;
+        const unsigned long number = std::strtoul(value.c_str(), &end, 10);
+        if (key == "shape")
+        {
+            int consumed = 0;
+            if (sscanf(value.c_str(), "%ux%ux%u%n", &parsed.channels, &parsed.height, &parsed.width, &consumed) != 3
+                || consumed != (int)value.size())
+            {
+                return false;
+            }
+        }
+        else if (end == value.c_str() || *end != '\0' || number > UINT_MAX)
+        {
+            return false;
+        }
+        else if (key == "header")
+        {
+            parsed.header_bytes = (unsigned int)number;
+        }
+        else if (key == "labels")
+        {
+            parsed.label_bytes = (unsigned int)number;
+        }
+        else if (key == "label_index")
+        {
+            parsed.label_index = (unsigned int)number;
+        }
+        else if (key == "classes")
+        {
+            parsed.classes = (unsigned int)number;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    if (parsed.label_bytes == 0 || parsed.label_index >= parsed.label_bytes || parsed.channels == 0
+        || parsed.width == 0 || parsed.height == 0 || parsed.classes == 0 || parsed.classes > 256)
+    {
+        return false;
+    }
+    format = parsed;
+    return true;
+}
+
+std::string record_format_to_string(const record_format_t& format)
+{
+    char spec[128];
+    snprintf(spec, sizeof(spec), "header=%u,labels=%u,label_index=%u,shape=%ux%ux%u,classes=%u", format.header_bytes,
+             format.label_bytes, format.label_index, format.channels, format.height, format.width, format.classes);
+    return spec;
+}
+
+static bool decode_record_files(const std::vector<std::string>& file_paths, const record_format_t& format,
+                                MiniCNN::Dataset& dataset)
+{
+    const size_t sample_size = (size_t)format.channels * format.height * format.width;
+    const size_t record_size = format.label_bytes + sample_size;
+    std::vector<uint8_t> samples;
+    std::vector<uint8_t> labels;
+    // 每次读入整数条记录，约1MB
+    std::vector<uint8_t> chunk(std::max<size_t>(1, (1 << 20) / record_size) * record_size);
+    for (const auto& file_path : file_paths)
+    {
+        MiniCNN::CompressedInput input;
+        if (!input.open(file_path))
+        {
+            return false;
+        }
+        if (input.getFormat() == MiniCNN::CompressedInput::Format::RAW)
+        {
+            // 未压缩的文件可以按长度预先分配
+            std::ifstream ifs(file_path, std::ios::binary | std::ios::ate);
+            const size_t records = ((size_t)ifs.tellg() - std::min<size_t>((size_t)ifs.tellg(), format.header_bytes))
+                                   / record_size;
+            labels.reserve(labels.size() + records);
+            samples.reserve(samples.size() + records * sample_size);
+        }
+        std::vector<uint8_t> header(format.header_bytes);
+        if (!header.empty() && !input.read(header.data(), header.size()))
+        {
+            return false;
+        }
+        while (true)
+        {
+            size_t filled = 0;
+            size_t count = 0;
+            while (filled < chunk.size() && (count = input.readSome(&chunk[filled], chunk.size() - filled)) > 0)
+            {
+                filled += count;
+            }
+            if (input.isFailed() || filled % record_size != 0)
+            {
+                return false;
+            }
+            if (filled == 0)
+            {
+                break;
+            }
+            const size_t records = filled / record_size;
+            const size_t sample_offset = samples.size();
+            samples.resize(sample_offset + records * sample_size);
+            for (size_t i = 0; i < records; i++)
+            {
+                const uint8_t* record = &chunk[i * record_size];
+                labels.push_back(record[format.label_index]);
+                std::memcpy(&samples[sample_offset + i * sample_size], record + format.label_bytes, sample_size);
+            }
+        }
+    }
+    return dataset.create(MiniCNN::Shape(1, format.channels, format.width, format.height), format.classes,
+                          std::move(samples), std::move(labels));
+}
+
+static bool load_records(const std::vector<std::string>& source_file_paths, const record_format_t& format,
+                         const std::string& name, MiniCNN::Dataset& dataset, const std::string& cache_dir)
+{
+    std::vector<std::string> file_paths;
+    for (const auto& path : source_file_paths)
+    {
+        file_paths.push_back(MiniCNN::resolve_compressed_path(path));
+    }
+    if (file_paths.empty())
+    {
+        return false;
+    }
+    return MiniCNN::load_dataset_with_cache(file_paths, "records " + record_format_to_string(format), name, cache_dir,
+                                            [&](MiniCNN::Dataset& decoded)
+    {
+        return decode_record_files(file_paths, format, decoded);
+    }, dataset);
+}
+
+bool load_record_dataset(const std::vector<std::string>& file_paths, const record_format_t& format,
+                         MiniCNN::Dataset& dataset, const std::string& cache_dir)
+{
+    if (format.label_bytes == 0 || format.label_index >= format.label_bytes || format.classes == 0
+        || format.channels * format.width * format.height == 0)
+    {
+        return false;
+    }
+    return load_records(file_paths, format, "records", dataset, cache_dir);
+}
+
+bool load_cifar10_dataset(const std::vector<std::string>& file_paths, MiniCNN::Dataset& dataset,
+                          const std::string& cache_dir)
+{
+    record_format_t format;
+    format.label_bytes = 1;
+    format.channels = 3;
+    format.width = format.height = 32;
+    format.classes = 10;
+    return load_records(file_paths, format, "cifar10", dataset, cache_dir);
+}
+
+bool load_cifar100_dataset(const std::vector<std::string>& file_paths, const bool fine_labels,
+                           MiniCNN::Dataset& dataset, const std::string& cache_dir)
+{
+    record_format_t format;
+    format.label_bytes = 2;
+    format.label_index = fine_labels ? 1 : 0;
+    format.channels = 3;
+    format.width = format.height = 32;
+    format.classes = fine_labels ? 100 : 20;
+    return load_records(file_paths, format, "cifar100", dataset, cache_dir);
+}